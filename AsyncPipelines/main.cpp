@@ -0,0 +1,128 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "AsyncPipelineBuilder.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Startup latency for 1, 10 and 100 compute pipelines (each with its own
+// library, as separate shaders would be in a real app) built one after another
+// on the main thread and built concurrently with AsyncPipelineBuilder. In the
+// async case a "render loop" starts straight away and each frame dispatches
+// whichever pipelines are ready.
+
+using clock_type = std::chrono::steady_clock;
+
+double msSince(clock_type::time_point _start)
+{
+  return std::chrono::duration<double, std::milli>(clock_type::now() - _start).count();
+}
+
+// a unique salt per run stops Metal's in memory cache hiding the compile cost
+std::string kernelSource(int _index, int _salt)
+{
+  return "// " + std::to_string(_salt) + "\n"
+         "#include <metal_stdlib>\n"
+         "using namespace metal;\n"
+         "kernel void work(device float *v [[ buffer(0) ]], uint id [[ thread_position_in_grid ]])\n"
+         "{\n"
+         "    float x = v[id];\n"
+         "    for (int j = 0; j < " + std::to_string(4 + _index % 8) + "; ++j)\n"
+         "        x = fma(x, 0.5f, sin(x * " + std::to_string(_index) + ".0f));\n"
+         "    v[id] = x;\n"
+         "}\n";
+}
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  auto *commandQueue = device->newCommandQueue();
+  assert(commandQueue);
+  auto *dataBuffer = device->newBuffer(sizeof(float) * 1024, MTL::ResourceStorageModeShared);
+  assert(dataBuffer);
+  int salt = 0;
+
+  printf("%-10s %12s %12s %12s %16s\n", "pipelines", "sync all ms", "async first", "async all ms", "frames before all");
+  for (int count : {1, 10, 100})
+  {
+    // synchronous, sequential on this thread
+    auto start = clock_type::now();
+    {
+      auto *compileOptions = MTL::CompileOptions::alloc()->init();
+      NS::Error *errorMessages = nullptr;
+      ++salt;
+      for (int i = 0; i < count; ++i)
+      {
+        auto src = kernelSource(i, salt);
+        auto *library = device->newLibrary(NS::String::string(src.c_str(), NS::UTF8StringEncoding), compileOptions, &errorMessages);
+        auto *func = library->newFunction(NS::String::string("work", NS::ASCIIStringEncoding));
+        auto *pipeline = device->newComputePipelineState(func, &errorMessages);
+        assert(pipeline);
+        pipeline->release();
+        func->release();
+        library->release();
+      }
+      compileOptions->release();
+    }
+    double syncTime = msSince(start);
+
+    // asynchronous, everything requested up front
+    ++salt;
+    start = clock_type::now();
+    AsyncPipelineBuilder builder(device);
+    std::vector<AsyncResult<MTL::ComputePipelineState>> pipelines;
+    for (int i = 0; i < count; ++i)
+    {
+      auto library = builder.newLibrary(kernelSource(i, salt), ShaderOptions());
+      pipelines.push_back(builder.newComputePipelineState(library, "work"));
+    }
+
+    double firstReady = -1.0;
+    int frames = 0;
+    size_t readyCount = 0;
+    while (readyCount < pipelines.size())
+    {
+      // one frame, draw with what we have
+      auto *commandBuffer = commandQueue->commandBuffer();
+      auto *commandEncoder = commandBuffer->computeCommandEncoder();
+      commandEncoder->setBuffer(dataBuffer, 0, 0);
+      readyCount = 0;
+      for (auto &p : pipelines)
+      {
+        if (!p.ready())
+          continue;
+        ++readyCount;
+        // a failed build is ready too, with no pipeline, it is reported
+        // once everything has finished
+        if (!p.get())
+          continue;
+        commandEncoder->setComputePipelineState(p.get());
+        commandEncoder->dispatchThreadgroups(MTL::Size(4, 1, 1), MTL::Size(256, 1, 1));
+      }
+      commandEncoder->endEncoding();
+      commandBuffer->commit();
+      commandBuffer->waitUntilCompleted();
+      if (readyCount > 0 && firstReady < 0.0)
+        firstReady = msSince(start);
+      if (readyCount < pipelines.size())
+        ++frames;
+    }
+    double asyncTime = msSince(start);
+    for (auto &p : pipelines)
+      if (!p.get())
+      {
+        std::cerr << "pipeline failed " << p.error() << '\n';
+        return EXIT_FAILURE;
+      }
+    printf("%-10d %12.2f %12.2f %12.2f %16d\n", count, syncTime, firstReady, asyncTime, frames);
+  }
+
+  dataBuffer->release();
+  commandQueue->release();
+  return EXIT_SUCCESS;
+}
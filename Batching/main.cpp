@@ -0,0 +1,233 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "BatchRenderer.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Scenes of 1k, 10k and 50k small objects, each one of three meshes with one
+// of eight materials, in scene order. Drawn one draw call per object, setting
+// its state and passing its data with setVertexBytes, and through a
+// BatchRenderer that sorts them and draws each mesh and material pair once
+// with an instance count. Reports draw calls and CPU ms per frame, which for
+// the batched path includes submitting, sorting and packing.
+
+const char *shaderSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  struct Instance
+  {
+    float4 offsetScale;
+    float4 colour;
+  };
+
+  struct RasteriserData
+  {
+    float4 position [[position]];
+    float2 uv;
+    float4 colour;
+  };
+
+  vertex RasteriserData vertFunc(uint vertexID [[vertex_id]],
+                                 uint instanceID [[instance_id]],
+                                 const device float2 *positions [[buffer(0)]],
+                                 const device Instance *instances [[buffer(1)]])
+  {
+    RasteriserData out;
+    float2 p = positions[vertexID];
+    Instance instance = instances[instanceID];
+    out.position = float4(instance.offsetScale.xy + p * instance.offsetScale.zw, 0.0f, 1.0f);
+    out.uv = p * 0.5f + 0.5f;
+    out.colour = instance.colour;
+    return out;
+  }
+
+  fragment float4 fragFunc(RasteriserData in [[stage_in]],
+                           texture2d<float> tex [[texture(0)]],
+                           sampler s [[sampler(0)]])
+  {
+    return tex.sample(s, in.uv) * in.colour;
+  }
+)""";
+
+struct Instance
+{
+  float offsetScale[4];
+  float colour[4];
+};
+
+struct Object
+{
+  int material;
+  int mesh;
+  Instance instance;
+};
+
+constexpr int frames = 50;
+constexpr int size = 512;
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = device->newLibrary(NS::String::string(shaderSource, NS::UTF8StringEncoding), nullptr, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to compile shaders " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+
+  // opaque and blended pipelines
+  std::vector<MTL::RenderPipelineState *> pipelines;
+  for (bool blend : {false, true})
+  {
+    auto *desc = MTL::RenderPipelineDescriptor::alloc()->init();
+    desc->setVertexFunction(vertFunc);
+    desc->setFragmentFunction(fragFunc);
+    auto *colour = desc->colorAttachments()->object(0);
+    colour->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+    colour->setBlendingEnabled(blend);
+    colour->setSourceRGBBlendFactor(MTL::BlendFactorSourceAlpha);
+    colour->setDestinationRGBBlendFactor(MTL::BlendFactorOneMinusSourceAlpha);
+    auto *pipeline = device->newRenderPipelineState(desc, &errorMessages);
+    assert(pipeline);
+    pipelines.push_back(pipeline);
+    desc->release();
+  }
+  std::vector<MTL::Texture *> textures;
+  for (int t = 0; t < 4; ++t)
+  {
+    auto *textureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, 64, 64, false);
+    auto *texture = device->newTexture(textureDesc);
+    std::vector<uint32_t> texels(64 * 64);
+    for (size_t p = 0; p < texels.size(); ++p)
+      texels[p] = ((p / (4 << t) + p / (256 << t)) & 1) ? 0xffffffffu : 0xff808080u;
+    texture->replaceRegion(MTL::Region(0, 0, 64, 64), 0, texels.data(), 64 * 4);
+    textures.push_back(texture);
+  }
+  auto *samplerDesc = MTL::SamplerDescriptor::alloc()->init();
+  samplerDesc->setMinFilter(MTL::SamplerMinMagFilterLinear);
+  samplerDesc->setMagFilter(MTL::SamplerMinMagFilterLinear);
+  auto *sampler = device->newSamplerState(samplerDesc);
+  samplerDesc->release();
+  std::vector<BatchMaterial> materials(8);
+  for (size_t m = 0; m < materials.size(); ++m)
+  {
+    materials[m].pipeline = pipelines[m % 2];
+    materials[m].textures[0] = textures[m / 2];
+    materials[m].sampler = sampler;
+  }
+
+  // a triangle, an indexed quad and an indexed hexagon sharing one buffer
+  const float positions[] = {0.0f, 1.0f, -1.0f, -1.0f, 1.0f, -1.0f,
+                             -1.0f, -1.0f, 1.0f, -1.0f, 1.0f, 1.0f, -1.0f, 1.0f,
+                             0.0f, 0.0f, 1.0f, 0.0f, 0.5f, 0.87f, -0.5f, 0.87f, -1.0f, 0.0f, -0.5f, -0.87f, 0.5f, -0.87f};
+  const uint16_t indices[] = {3, 4, 5, 3, 5, 6,
+                              7, 8, 9, 7, 9, 10, 7, 10, 11, 7, 11, 12, 7, 12, 13, 7, 13, 8};
+  auto *positionBuffer = device->newBuffer(positions, sizeof(positions), MTL::ResourceStorageModeShared);
+  auto *indexBuffer = device->newBuffer(indices, sizeof(indices), MTL::ResourceStorageModeShared);
+  std::vector<BatchMesh> meshes(3);
+  for (auto &m : meshes)
+    m.vertices = positionBuffer;
+  meshes[0].vertexCount = 3;
+  meshes[1].indices = indexBuffer;
+  meshes[1].indexCount = 6;
+  meshes[2].indices = indexBuffer;
+  meshes[2].indexOffset = 6 * sizeof(uint16_t);
+  meshes[2].indexCount = 18;
+
+  auto *colourDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, size, size, false);
+  colourDesc->setUsage(MTL::TextureUsageRenderTarget);
+  auto *colourTexture = device->newTexture(colourDesc);
+  auto *commandQueue = device->newCommandQueue();
+  BatchRenderer<Instance> batcher(device);
+
+  printf("%8s %-8s %12s %12s %12s\n", "objects", "path", "draw calls", "cpu ms", "gpu ms");
+  for (int count : {1000, 10000, 50000})
+  {
+    std::mt19937 rng(count);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Object> scene(count);
+    for (auto &o : scene)
+    {
+      o.material = int(rng() % materials.size());
+      o.mesh = int(rng() % meshes.size());
+      o.instance = {{unit(rng) * 2.0f - 1.0f, unit(rng) * 2.0f - 1.0f, 0.01f, 0.01f}, {unit(rng), unit(rng), unit(rng), 0.8f}};
+    }
+
+    for (bool batched : {false, true})
+    {
+      double cpuMs = 0.0;
+      double gpuMs = 0.0;
+      size_t drawCalls = 0;
+      for (int frame = 0; frame < frames; ++frame)
+      {
+        auto *pool = NS::AutoreleasePool::alloc()->init();
+        auto *commandBuffer = commandQueue->commandBuffer();
+        auto *passDesc = MTL::RenderPassDescriptor::alloc()->init();
+        auto *colour = passDesc->colorAttachments()->object(0);
+        colour->setTexture(colourTexture);
+        colour->setLoadAction(MTL::LoadActionClear);
+        colour->setStoreAction(MTL::StoreActionStore);
+        auto *encoder = commandBuffer->renderCommandEncoder(passDesc);
+        auto start = std::chrono::steady_clock::now();
+        if (batched)
+        {
+          batcher.begin();
+          for (auto &o : scene)
+            batcher.submit(&materials[o.material], &meshes[o.mesh], o.instance);
+          FilteredRenderEncoder filter(encoder);
+          drawCalls = batcher.flush(filter).drawCalls;
+        }
+        else
+        {
+          for (auto &o : scene)
+          {
+            const auto &material = materials[o.material];
+            const auto &mesh = meshes[o.mesh];
+            encoder->setRenderPipelineState(material.pipeline);
+            encoder->setFragmentTexture(material.textures[0], 0);
+            encoder->setFragmentSamplerState(material.sampler, 0);
+            encoder->setVertexBuffer(mesh.vertices, 0, 0);
+            encoder->setVertexBytes(&o.instance, sizeof(Instance), 1);
+            if (mesh.indices)
+              encoder->drawIndexedPrimitives(mesh.primitive, mesh.indexCount, mesh.indexType, mesh.indices, mesh.indexOffset);
+            else
+              encoder->drawPrimitives(mesh.primitive, mesh.vertexStart, mesh.vertexCount);
+          }
+          drawCalls = scene.size();
+        }
+        encoder->endEncoding();
+        cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        commandBuffer->commit();
+        commandBuffer->waitUntilCompleted();
+        gpuMs += (commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime()) * 1000.0;
+        passDesc->release();
+        pool->release();
+      }
+      printf("%8d %-8s %12zu %12.3f %12.3f\n", count, batched ? "batched" : "per draw", drawCalls, cpuMs / frames, gpuMs / frames);
+    }
+  }
+
+  commandQueue->release();
+  colourTexture->release();
+  indexBuffer->release();
+  positionBuffer->release();
+  sampler->release();
+  for (auto *t : textures)
+    t->release();
+  for (auto *p : pipelines)
+    p->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
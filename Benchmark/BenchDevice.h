@@ -0,0 +1,66 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// The small slice of the Metal compute API the benchmarks need. MetalDevice.h
+// maps it straight onto MTL::Device / MTL::CommandQueue /
+// MTL::ComputeCommandEncoder as used in Compute/main.cpp, CPUDevice.h is a
+// stand in using threads so the same benchmarks run on machines without Metal.
+namespace bench
+{
+
+// the kernels every device provides, all take x at buffer 0, y at buffer 1 and
+// write out at buffer 2 (the STREAM copy / scale / add / triad operations)
+enum class Kernel
+{
+  Empty, // does nothing, used for dispatch latency
+  Copy,  // out = x
+  Scale, // out = s * x
+  Add,   // out = x + y
+  Triad  // out = x + s * y
+};
+
+class Buffer
+{
+public:
+  virtual ~Buffer() = default;
+  virtual void *contents() = 0;
+  virtual size_t length() const = 0;
+};
+
+class ComputeEncoder
+{
+public:
+  virtual ~ComputeEncoder() = default;
+  virtual void setKernel(Kernel _kernel) = 0;
+  virtual void setBuffer(Buffer *_buffer, size_t _index) = 0;
+  virtual void setScalar(float _s) = 0;
+  // one thread per element
+  virtual void dispatch(size_t _threads) = 0;
+  virtual void endEncoding() = 0;
+};
+
+class CommandBuffer
+{
+public:
+  virtual ~CommandBuffer() = default;
+  // owned by the command buffer and only valid until endEncoding
+  virtual ComputeEncoder *computeCommandEncoder() = 0;
+  virtual void commit() = 0;
+  virtual void waitUntilCompleted() = 0;
+  // time the device spent executing, only valid once completed
+  virtual double gpuSeconds() const = 0;
+};
+
+class Device
+{
+public:
+  virtual ~Device() = default;
+  virtual std::string name() const = 0;
+  virtual std::string backend() const = 0;
+  virtual std::unique_ptr<Buffer> newBuffer(size_t _bytes) = 0;
+  virtual std::unique_ptr<CommandBuffer> commandBuffer() = 0;
+};
+
+} // end namespace bench
@@ -0,0 +1,277 @@
+#pragma once
+#include "BenchDevice.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A CPU stand in for a Metal device. Command buffers are recorded on the
+// calling thread, committed to a queue serviced by a "device" thread and each
+// dispatch is split across a pool of worker threads, which mirrors the
+// submission model closely enough to exercise and sanity check the benchmarks.
+namespace bench
+{
+
+class ThreadPool
+{
+public:
+  explicit ThreadPool(unsigned _threads)
+  {
+    for (unsigned i = 0; i < _threads; ++i)
+      m_workers.emplace_back([this, i, _threads] { workerLoop(i, _threads); });
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+      ++m_generation;
+    }
+    m_start.notify_all();
+    for (auto &t : m_workers)
+      t.join();
+  }
+
+  // run _fn(begin, end) over [0, _count) split evenly across the workers and
+  // wait for them all to finish
+  void parallelFor(size_t _count, const std::function<void(size_t, size_t)> &_fn)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_fn = &_fn;
+    m_count = _count;
+    m_remaining = m_workers.size();
+    ++m_generation;
+    m_start.notify_all();
+    m_done.wait(lock, [this] { return m_remaining == 0; });
+    m_fn = nullptr;
+  }
+
+private:
+  void workerLoop(unsigned _index, unsigned _threads)
+  {
+    uint64_t seen = 0;
+    for (;;)
+    {
+      const std::function<void(size_t, size_t)> *fn;
+      size_t count;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_start.wait(lock, [this, seen] { return m_generation != seen; });
+        seen = m_generation;
+        if (m_quit)
+          return;
+        fn = m_fn;
+        count = m_count;
+      }
+      size_t per = (count + _threads - 1) / _threads;
+      size_t begin = std::min(count, per * _index);
+      size_t end = std::min(count, begin + per);
+      if (begin < end)
+        (*fn)(begin, end);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_remaining == 0)
+          m_done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_start;
+  std::condition_variable m_done;
+  const std::function<void(size_t, size_t)> *m_fn = nullptr;
+  size_t m_count = 0;
+  size_t m_remaining = 0;
+  uint64_t m_generation = 0;
+  bool m_quit = false;
+};
+
+class CPUBuffer : public Buffer
+{
+public:
+  explicit CPUBuffer(size_t _bytes) : m_data((_bytes + sizeof(float) - 1) / sizeof(float)), m_length(_bytes) {}
+  void *contents() override { return m_data.data(); }
+  size_t length() const override { return m_length; }
+
+private:
+  std::vector<float> m_data;
+  size_t m_length;
+};
+
+struct CPUCommand
+{
+  Kernel kernel = Kernel::Empty;
+  Buffer *buffers[3] = {nullptr, nullptr, nullptr};
+  float scalar = 0.0f;
+  size_t threads = 0;
+};
+
+class CPUDevice;
+
+class CPUComputeEncoder : public ComputeEncoder
+{
+public:
+  explicit CPUComputeEncoder(std::vector<CPUCommand> &_commands) : m_commands(_commands) {}
+  void setKernel(Kernel _kernel) override { m_state.kernel = _kernel; }
+  void setBuffer(Buffer *_buffer, size_t _index) override { m_state.buffers[_index] = _buffer; }
+  void setScalar(float _s) override { m_state.scalar = _s; }
+  void dispatch(size_t _threads) override
+  {
+    m_state.threads = _threads;
+    m_commands.push_back(m_state);
+  }
+  void endEncoding() override {}
+
+private:
+  std::vector<CPUCommand> &m_commands;
+  CPUCommand m_state;
+};
+
+class CPUCommandBuffer : public CommandBuffer
+{
+public:
+  explicit CPUCommandBuffer(CPUDevice &_device) : m_device(_device) {}
+  ~CPUCommandBuffer() override
+  {
+    if (m_committed)
+      waitUntilCompleted();
+  }
+  ComputeEncoder *computeCommandEncoder() override
+  {
+    m_encoder = std::make_unique<CPUComputeEncoder>(m_commands);
+    return m_encoder.get();
+  }
+  void commit() override;
+  void waitUntilCompleted() override
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this] { return m_completed; });
+  }
+  double gpuSeconds() const override { return m_gpuSeconds; }
+
+private:
+  friend class CPUDevice;
+  void complete(double _seconds)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_gpuSeconds = _seconds;
+    m_completed = true;
+    m_cv.notify_all();
+  }
+
+  CPUDevice &m_device;
+  std::vector<CPUCommand> m_commands;
+  std::unique_ptr<CPUComputeEncoder> m_encoder;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_committed = false;
+  bool m_completed = false;
+  double m_gpuSeconds = 0.0;
+};
+
+class CPUDevice : public Device
+{
+public:
+  explicit CPUDevice(unsigned _threads = std::max(1u, std::thread::hardware_concurrency()))
+      : m_pool(_threads), m_threads(_threads)
+  {
+    m_deviceThread = std::thread([this] { deviceLoop(); });
+  }
+
+  ~CPUDevice() override
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_cv.notify_all();
+    m_deviceThread.join();
+  }
+
+  std::string name() const override { return "CPU stand-in (" + std::to_string(m_threads) + " threads)"; }
+  std::string backend() const override { return "cpu"; }
+  std::unique_ptr<Buffer> newBuffer(size_t _bytes) override { return std::make_unique<CPUBuffer>(_bytes); }
+  std::unique_ptr<CommandBuffer> commandBuffer() override { return std::make_unique<CPUCommandBuffer>(*this); }
+
+  void submit(CPUCommandBuffer *_commandBuffer)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(_commandBuffer);
+    }
+    m_cv.notify_one();
+  }
+
+private:
+  void deviceLoop()
+  {
+    for (;;)
+    {
+      CPUCommandBuffer *commandBuffer;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+        if (m_queue.empty())
+          return;
+        commandBuffer = m_queue.front();
+        m_queue.pop_front();
+      }
+      auto start = std::chrono::steady_clock::now();
+      for (const auto &command : commandBuffer->m_commands)
+        execute(command);
+      commandBuffer->complete(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+  }
+
+  void execute(const CPUCommand &_c)
+  {
+    if (_c.kernel == Kernel::Empty)
+    {
+      m_pool.parallelFor(_c.threads, [](size_t, size_t) {});
+      return;
+    }
+    const float *x = _c.buffers[0] ? static_cast<const float *>(_c.buffers[0]->contents()) : nullptr;
+    const float *y = _c.buffers[1] ? static_cast<const float *>(_c.buffers[1]->contents()) : nullptr;
+    float *out = static_cast<float *>(_c.buffers[2]->contents());
+    const float s = _c.scalar;
+    switch (_c.kernel)
+    {
+    case Kernel::Copy:
+      m_pool.parallelFor(_c.threads, [=](size_t b, size_t e) { for (size_t i = b; i < e; ++i) out[i] = x[i]; });
+      break;
+    case Kernel::Scale:
+      m_pool.parallelFor(_c.threads, [=](size_t b, size_t e) { for (size_t i = b; i < e; ++i) out[i] = s * x[i]; });
+      break;
+    case Kernel::Add:
+      m_pool.parallelFor(_c.threads, [=](size_t b, size_t e) { for (size_t i = b; i < e; ++i) out[i] = x[i] + y[i]; });
+      break;
+    case Kernel::Triad:
+      m_pool.parallelFor(_c.threads, [=](size_t b, size_t e) { for (size_t i = b; i < e; ++i) out[i] = x[i] + s * y[i]; });
+      break;
+    case Kernel::Empty:
+      break;
+    }
+  }
+
+  ThreadPool m_pool;
+  unsigned m_threads;
+  std::thread m_deviceThread;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<CPUCommandBuffer *> m_queue;
+  bool m_quit = false;
+};
+
+inline void CPUCommandBuffer::commit()
+{
+  m_committed = true;
+  m_device.submit(this);
+}
+
+} // end namespace bench
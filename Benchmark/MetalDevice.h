@@ -0,0 +1,164 @@
+#pragma once
+#include "BenchDevice.h"
+#include "Metal.hpp"
+#include <cassert>
+#include <iostream>
+
+// The benchmark device interface on top of metal-cpp, each call maps onto the
+// same MTL::CommandQueue / MTL::ComputeCommandEncoder calls as Compute/main.cpp
+// so the numbers include the real API overhead.
+namespace bench
+{
+
+class MetalBuffer : public Buffer
+{
+public:
+  MetalBuffer(MTL::Device *_device, size_t _bytes)
+  {
+    m_buffer = _device->newBuffer(_bytes, MTL::ResourceStorageModeShared);
+    assert(m_buffer);
+  }
+  ~MetalBuffer() override { m_buffer->release(); }
+  void *contents() override { return m_buffer->contents(); }
+  size_t length() const override { return m_buffer->length(); }
+  MTL::Buffer *buffer() const { return m_buffer; }
+
+private:
+  MTL::Buffer *m_buffer;
+};
+
+class MetalComputeEncoder : public ComputeEncoder
+{
+public:
+  MetalComputeEncoder(MTL::ComputeCommandEncoder *_encoder, MTL::ComputePipelineState *const *_pipelines)
+      : m_encoder(_encoder), m_pipelines(_pipelines) {}
+  void setKernel(Kernel _kernel) override
+  {
+    m_pipeline = m_pipelines[static_cast<int>(_kernel)];
+    m_encoder->setComputePipelineState(m_pipeline);
+  }
+  void setBuffer(Buffer *_buffer, size_t _index) override
+  {
+    m_encoder->setBuffer(static_cast<MetalBuffer *>(_buffer)->buffer(), 0, _index);
+  }
+  void setScalar(float _s) override { m_encoder->setBytes(&_s, sizeof(float), 3); }
+  void dispatch(size_t _threads) override
+  {
+    uint32_t count = static_cast<uint32_t>(_threads);
+    m_encoder->setBytes(&count, sizeof(uint32_t), 4);
+    NS::UInteger width = m_pipeline->maxTotalThreadsPerThreadgroup();
+    m_encoder->dispatchThreadgroups(MTL::Size((count + width - 1) / width, 1, 1), MTL::Size(width, 1, 1));
+  }
+  void endEncoding() override { m_encoder->endEncoding(); }
+
+private:
+  MTL::ComputeCommandEncoder *m_encoder;
+  MTL::ComputePipelineState *const *m_pipelines;
+  MTL::ComputePipelineState *m_pipeline = nullptr;
+};
+
+class MetalCommandBuffer : public CommandBuffer
+{
+public:
+  MetalCommandBuffer(MTL::CommandQueue *_queue, MTL::ComputePipelineState *const *_pipelines) : m_pipelines(_pipelines)
+  {
+    // command buffers and encoders are autoreleased, the pool drains them when
+    // this object goes away so long benchmark loops don't grow memory
+    m_pool = NS::AutoreleasePool::alloc()->init();
+    m_commandBuffer = _queue->commandBuffer();
+  }
+  ~MetalCommandBuffer() override
+  {
+    m_encoder.reset();
+    m_pool->release();
+  }
+  ComputeEncoder *computeCommandEncoder() override
+  {
+    m_encoder = std::make_unique<MetalComputeEncoder>(m_commandBuffer->computeCommandEncoder(), m_pipelines);
+    return m_encoder.get();
+  }
+  void commit() override { m_commandBuffer->commit(); }
+  void waitUntilCompleted() override { m_commandBuffer->waitUntilCompleted(); }
+  double gpuSeconds() const override { return m_commandBuffer->GPUEndTime() - m_commandBuffer->GPUStartTime(); }
+
+private:
+  NS::AutoreleasePool *m_pool;
+  MTL::CommandBuffer *m_commandBuffer;
+  MTL::ComputePipelineState *const *m_pipelines;
+  std::unique_ptr<MetalComputeEncoder> m_encoder;
+};
+
+class MetalDevice : public Device
+{
+public:
+  MetalDevice()
+  {
+    m_device = MTL::CreateSystemDefaultDevice();
+    assert(m_device);
+    auto *shaderSrc = NS::String::string(
+        R"""(
+          #include <metal_stdlib>
+          using namespace metal;
+
+          #define STREAM_KERNEL(NAME, EXPR)                          \
+          kernel void NAME(                                          \
+              const device float *x [[ buffer(0) ]],                 \
+              const device float *y [[ buffer(1) ]],                 \
+              device float *out [[ buffer(2) ]],                     \
+              constant float &s [[ buffer(3) ]],                     \
+              constant uint &count [[ buffer(4) ]],                  \
+              uint id [[ thread_position_in_grid ]])                 \
+          {                                                          \
+              if (id < count)                                        \
+                  out[id] = EXPR;                                    \
+          }
+
+          kernel void empty() {}
+          STREAM_KERNEL(copy, x[id])
+          STREAM_KERNEL(scale, s * x[id])
+          STREAM_KERNEL(add, x[id] + y[id])
+          STREAM_KERNEL(triad, x[id] + s * y[id])
+      )""",
+        NS::ASCIIStringEncoding);
+    auto *compileOptions = MTL::CompileOptions::alloc()->init();
+    NS::Error *errorMessages = nullptr;
+    auto *library = m_device->newLibrary(shaderSrc, compileOptions, &errorMessages);
+    if (!library)
+    {
+      std::cerr << "Unable to compile benchmark kernels " << errorMessages->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    const char *names[] = {"empty", "copy", "scale", "add", "triad"};
+    for (int i = 0; i < 5; ++i)
+    {
+      auto *func = library->newFunction(NS::String::string(names[i], NS::ASCIIStringEncoding));
+      m_pipelines[i] = m_device->newComputePipelineState(func, &errorMessages);
+      assert(m_pipelines[i]);
+      func->release();
+    }
+    library->release();
+    compileOptions->release();
+    m_commandQueue = m_device->newCommandQueue();
+    assert(m_commandQueue);
+  }
+
+  ~MetalDevice() override
+  {
+    for (auto *p : m_pipelines)
+      p->release();
+    m_commandQueue->release();
+    m_device->release();
+  }
+
+  std::string name() const override { return m_device->name()->utf8String(); }
+  std::string backend() const override { return "metal"; }
+  std::unique_ptr<Buffer> newBuffer(size_t _bytes) override { return std::make_unique<MetalBuffer>(m_device, _bytes); }
+  std::unique_ptr<CommandBuffer> commandBuffer() override { return std::make_unique<MetalCommandBuffer>(m_commandQueue, m_pipelines); }
+
+private:
+  MTL::Device *m_device;
+  MTL::CommandQueue *m_commandQueue;
+  MTL::ComputePipelineState *m_pipelines[5];
+};
+
+} // end namespace bench
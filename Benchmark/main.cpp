@@ -0,0 +1,263 @@
+#if defined(__APPLE__)
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "MetalDevice.h"
+#endif
+#include "CPUDevice.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compute micro benchmarks, STREAM style bandwidth, empty dispatch latency,
+// command buffer overhead and encoder creation cost. Results are written as
+// JSON so runs can be compared to track regressions.
+// usage : Benchmark [--device metal|cpu] [--size elements] [--samples n] [--output file.json]
+
+using namespace bench;
+using clock_type = std::chrono::steady_clock;
+
+struct Result
+{
+  std::string name;
+  std::string unit;
+  std::vector<double> samples;
+  // for bandwidth results bigger is better
+  bool higherIsBetter = false;
+};
+
+double seconds(clock_type::time_point _start)
+{
+  return std::chrono::duration<double>(clock_type::now() - _start).count();
+}
+
+std::string escape(const std::string &_s)
+{
+  std::string out;
+  for (char c : _s)
+  {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    out += c;
+  }
+  return out;
+}
+
+void writeJson(std::ostream &_out, Device &_device, size_t _elements, const std::vector<Result> &_results)
+{
+  _out << "{\n";
+  _out << "  \"device\": \"" << escape(_device.name()) << "\",\n";
+  _out << "  \"backend\": \"" << _device.backend() << "\",\n";
+  _out << "  \"timestamp\": " << std::time(nullptr) << ",\n";
+  _out << "  \"elements\": " << _elements << ",\n";
+  _out << "  \"results\": [\n";
+  for (size_t r = 0; r < _results.size(); ++r)
+  {
+    auto sorted = _results[r].samples;
+    std::sort(sorted.begin(), sorted.end());
+    double mean = 0.0;
+    for (auto v : sorted)
+      mean += v;
+    mean /= sorted.size();
+    double best = _results[r].higherIsBetter ? sorted.back() : sorted.front();
+    _out << "    {\"name\": \"" << _results[r].name << "\", \"unit\": \"" << _results[r].unit << "\""
+         << ", \"median\": " << sorted[sorted.size() / 2]
+         << ", \"best\": " << best
+         << ", \"min\": " << sorted.front()
+         << ", \"max\": " << sorted.back()
+         << ", \"mean\": " << mean
+         << ", \"samples\": " << sorted.size() << "}"
+         << (r + 1 < _results.size() ? "," : "") << '\n';
+  }
+  _out << "  ]\n}\n";
+}
+
+// GB/s for one STREAM kernel measured with the device's own execution time
+Result streamBandwidth(Device &_device, const char *_name, Kernel _kernel, int _arrays, Buffer *_x, Buffer *_y, Buffer *_out, size_t _elements, int _samples)
+{
+  Result result{_name, "GB/s", {}, true};
+  const double bytes = static_cast<double>(_arrays) * _elements * sizeof(float);
+  for (int i = 0; i < _samples + 1; ++i)
+  {
+    auto commandBuffer = _device.commandBuffer();
+    auto *encoder = commandBuffer->computeCommandEncoder();
+    encoder->setKernel(_kernel);
+    encoder->setBuffer(_x, 0);
+    encoder->setBuffer(_y, 1);
+    encoder->setBuffer(_out, 2);
+    encoder->setScalar(3.0f);
+    encoder->dispatch(_elements);
+    encoder->endEncoding();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+    // first run is a warm up
+    if (i > 0)
+      result.samples.push_back(bytes / commandBuffer->gpuSeconds() / 1e9);
+  }
+  return result;
+}
+
+// commit a single one thread dispatch of an empty kernel and wait for it
+Result emptyDispatchLatency(Device &_device, int _samples)
+{
+  Result result{"empty_dispatch_latency", "us", {}, false};
+  for (int i = 0; i < _samples + 1; ++i)
+  {
+    auto start = clock_type::now();
+    auto commandBuffer = _device.commandBuffer();
+    auto *encoder = commandBuffer->computeCommandEncoder();
+    encoder->setKernel(Kernel::Empty);
+    encoder->dispatch(1);
+    encoder->endEncoding();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+    if (i > 0)
+      result.samples.push_back(seconds(start) * 1e6);
+  }
+  return result;
+}
+
+// an empty command buffer, split into creation and commit -> completed
+std::vector<Result> commandBufferOverhead(Device &_device, int _samples)
+{
+  Result create{"command_buffer_create", "us", {}, false};
+  Result complete{"command_buffer_commit_complete", "us", {}, false};
+  for (int i = 0; i < _samples + 1; ++i)
+  {
+    auto start = clock_type::now();
+    auto commandBuffer = _device.commandBuffer();
+    double created = seconds(start);
+    start = clock_type::now();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+    double completed = seconds(start);
+    if (i > 0)
+    {
+      create.samples.push_back(created * 1e6);
+      complete.samples.push_back(completed * 1e6);
+    }
+  }
+  return {create, complete};
+}
+
+// CPU cost of creating and ending a compute encoder
+Result encoderCreation(Device &_device, int _samples)
+{
+  Result result{"compute_encoder_create_end", "us", {}, false};
+  const int encodersPerBuffer = 64;
+  for (int i = 0; i < _samples + 1; ++i)
+  {
+    auto commandBuffer = _device.commandBuffer();
+    auto start = clock_type::now();
+    for (int e = 0; e < encodersPerBuffer; ++e)
+      commandBuffer->computeCommandEncoder()->endEncoding();
+    double elapsed = seconds(start);
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+    if (i > 0)
+      result.samples.push_back(elapsed / encodersPerBuffer * 1e6);
+  }
+  return result;
+}
+
+bool verify(Buffer *_x, Buffer *_y, Buffer *_out, size_t _elements)
+{
+  // last kernel run is the triad out = x + 3 * y
+  const float *x = static_cast<const float *>(_x->contents());
+  const float *y = static_cast<const float *>(_y->contents());
+  const float *out = static_cast<const float *>(_out->contents());
+  for (size_t i = 0; i < _elements; ++i)
+    if (out[i] != x[i] + 3.0f * y[i])
+      return false;
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+#if defined(__APPLE__)
+  std::string deviceName = "metal";
+#else
+  std::string deviceName = "cpu";
+#endif
+  size_t elements = 1 << 25;
+  int samples = 10;
+  std::string outputFile;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "--device" && i + 1 < argc)
+      deviceName = argv[++i];
+    else if (arg == "--size" && i + 1 < argc)
+      elements = std::strtoull(argv[++i], nullptr, 10);
+    else if (arg == "--samples" && i + 1 < argc)
+      samples = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--output" && i + 1 < argc)
+      outputFile = argv[++i];
+    else
+    {
+      std::cerr << "usage : " << argv[0] << " [--device metal|cpu] [--size elements] [--samples n] [--output file.json]\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::unique_ptr<Device> device;
+  if (deviceName == "cpu")
+    device = std::make_unique<CPUDevice>();
+#if defined(__APPLE__)
+  else if (deviceName == "metal")
+    device = std::make_unique<MetalDevice>();
+#endif
+  else
+  {
+    std::cerr << "Unknown or unsupported device " << deviceName << '\n';
+    return EXIT_FAILURE;
+  }
+
+  auto x = device->newBuffer(elements * sizeof(float));
+  auto y = device->newBuffer(elements * sizeof(float));
+  auto out = device->newBuffer(elements * sizeof(float));
+  {
+    float *xd = static_cast<float *>(x->contents());
+    float *yd = static_cast<float *>(y->contents());
+    for (size_t i = 0; i < elements; ++i)
+    {
+      xd[i] = static_cast<float>(i % 100);
+      yd[i] = static_cast<float>(i % 37) * 0.5f;
+    }
+  }
+
+  std::vector<Result> results;
+  results.push_back(streamBandwidth(*device, "stream_copy", Kernel::Copy, 2, x.get(), y.get(), out.get(), elements, samples));
+  results.push_back(streamBandwidth(*device, "stream_scale", Kernel::Scale, 2, x.get(), y.get(), out.get(), elements, samples));
+  results.push_back(streamBandwidth(*device, "stream_add", Kernel::Add, 3, x.get(), y.get(), out.get(), elements, samples));
+  results.push_back(streamBandwidth(*device, "stream_triad", Kernel::Triad, 3, x.get(), y.get(), out.get(), elements, samples));
+  if (!verify(x.get(), y.get(), out.get(), elements))
+  {
+    std::cerr << "Triad produced the wrong result\n";
+    return EXIT_FAILURE;
+  }
+  // latency style tests want many more samples to get a stable median
+  results.push_back(emptyDispatchLatency(*device, samples * 10));
+  for (auto &r : commandBufferOverhead(*device, samples * 10))
+    results.push_back(r);
+  results.push_back(encoderCreation(*device, samples * 10));
+
+  if (outputFile.empty())
+    writeJson(std::cout, *device, elements, results);
+  else
+  {
+    std::ofstream file(outputFile);
+    if (!file.is_open())
+    {
+      std::cerr << "Unable to open output file " << outputFile << '\n';
+      return EXIT_FAILURE;
+    }
+    writeJson(file, *device, elements, results);
+  }
+  return EXIT_SUCCESS;
+}
@@ -2,6 +2,8 @@
 #define CA_PRIVATE_IMPLEMENTATION
 #define MTL_PRIVATE_IMPLEMENTATION
 #include "Metal.hpp"  
+#include "ShaderCache.h"
+#include "BindingTable.h"
 #include <iostream>
 #include <cstdlib>
 // based on https://github.com/naleksiev/mtlpp/blob/master/examples/03_compute.cpp
@@ -25,15 +27,21 @@ int main()
         }
     )""",NS::ASCIIStringEncoding);
 
-    auto *compileOptions = MTL::CompileOptions::alloc()->init();
+    // compiled shaders are cached on disk so only the first run pays for the compile
+    ShaderCache shaderCache(device);
     auto *errorDictionary = NS::Dictionary::dictionary();
     auto *errorMessages=NS::Error::alloc()->init(NS::CocoaErrorDomain,99,errorDictionary);
-    auto library = device->newLibrary(shaderSrc,compileOptions,&errorMessages); 
+    auto library = shaderCache.newLibrary(shaderSrc,ShaderOptions(),&errorMessages); 
     assert(library);
     auto sqrFunc = library->newFunction(NS::String::string("sqr",NS::ASCIIStringEncoding));
     assert(sqrFunc);
-    auto *computePipelineState = device->newComputePipelineState(sqrFunc,&errorMessages);
+    // the pipeline is built with reflection so the buffers can be bound by
+    // name rather than repeating the [[ buffer(n) ]] indices here
+    ComputeBindings sqrBindings(device, sqrFunc, &errorMessages);
+    auto *computePipelineState = sqrBindings.pipeline();
     assert(computePipelineState);
+    const auto vInSlot = sqrBindings.slot("vIn");
+    const auto vOutSlot = sqrBindings.slot("vOut");
     auto *commandQueue = device->newCommandQueue();
     assert(commandQueue);
 
@@ -59,8 +67,8 @@ int main()
         assert(commandBuffer);
 
         auto *commandEncoder = commandBuffer->computeCommandEncoder();
-        commandEncoder->setBuffer(inBuffer, 0, 0);
-        commandEncoder->setBuffer(outBuffer, 0, 1);
+        ComputeBindings::setBuffer(commandEncoder, vInSlot, inBuffer);
+        ComputeBindings::setBuffer(commandEncoder, vOutSlot, outBuffer);
         commandEncoder->setComputePipelineState(computePipelineState);
         commandEncoder->dispatchThreadgroups(
             MTL::Size(1, 1, 1),
@@ -0,0 +1,290 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "SharedShaderLibrary.h"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A set of compute pipelines that all use the same noise helpers. Built the
+// usual way every kernel's library carries its own copy of the helpers, built
+// against a SharedShaderLibrary the helpers are compiled once into a dynamic
+// library that each kernel links to. On devices with function pointers the
+// helpers are also compiled once as [[ visible ]] functions of an ordinary
+// library and handed to each pipeline through MTL::LinkedFunctions. Compile
+// time covers the libraries and pipelines, binary size is the pipelines'
+// functions serialized into a binary archive plus the dynamic library for the
+// shared build.
+// usage : DynamicLibrary [--clear]
+
+const char *helperSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  float hash(float2 p)
+  {
+    p = fract(p * float2(123.34f, 456.21f));
+    p += dot(p, p + 45.32f);
+    return fract(p.x * p.y);
+  }
+
+  float valueNoise(float2 p)
+  {
+    float2 i = floor(p);
+    float2 f = fract(p);
+    float2 u = f * f * (3.0f - 2.0f * f);
+    return mix(mix(hash(i), hash(i + float2(1, 0)), u.x),
+               mix(hash(i + float2(0, 1)), hash(i + float2(1, 1)), u.x), u.y);
+  }
+
+  float fbm(float2 p, int octaves)
+  {
+    float sum = 0.0f;
+    float amplitude = 0.5f;
+    for (int i = 0; i < octaves; ++i)
+    {
+      sum += amplitude * valueNoise(p);
+      p = float2x2(1.6f, 1.2f, -1.2f, 1.6f) * p;
+      amplitude *= 0.5f;
+    }
+    return sum;
+  }
+
+  float ridged(float2 p, int octaves)
+  {
+    float sum = 0.0f;
+    float amplitude = 0.5f;
+    for (int i = 0; i < octaves; ++i)
+    {
+      float n = 1.0f - abs(valueNoise(p) * 2.0f - 1.0f);
+      sum += amplitude * n * n;
+      p *= 2.03f;
+      amplitude *= 0.5f;
+    }
+    return sum;
+  }
+
+  float warp(float2 p, int octaves)
+  {
+    float2 q = float2(fbm(p, octaves), fbm(p + float2(5.2f, 1.3f), octaves));
+    float2 r = float2(fbm(p + 4.0f * q + float2(1.7f, 9.2f), octaves), fbm(p + 4.0f * q + float2(8.3f, 2.8f), octaves));
+    return fbm(p + 4.0f * r, octaves);
+  }
+)""";
+
+// the helpers as seen from a kernel linked against the dynamic library or
+// given them as linked functions
+const char *helperDeclarations = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+  extern float fbm(float2 p, int octaves);
+  extern float ridged(float2 p, int octaves);
+  extern float warp(float2 p, int octaves);
+)""";
+
+// the helpers as [[ visible ]] functions, so they can be taken out of their
+// library and linked into pipelines with MTL::LinkedFunctions
+std::string visibleHelperSource()
+{
+  std::string src = helperSource;
+  for (const char *definition : {"float fbm(", "float ridged(", "float warp("})
+    src.insert(src.find(definition), "[[ visible ]] ");
+  return src;
+}
+
+// each kernel mixes the helpers differently, _salt keeps Metal's in memory
+// cache from serving a kernel from a previous run
+std::string kernelSource(int _index, int _salt)
+{
+  auto n = std::to_string(_index);
+  return "// " + std::to_string(_salt) + "\n"
+         "kernel void k" + n + "(device float *out [[ buffer(0) ]], uint id [[ thread_position_in_grid ]])\n"
+         "{\n"
+         "    float2 p = float2(id % 256, id / 256) * " + std::to_string(0.01f * float(_index + 1)) + "f;\n"
+         "    out[id] = fbm(p, " + std::to_string(3 + _index % 5) + ") * " + std::to_string(_index % 3) + ".0f\n"
+         "            + ridged(p, " + std::to_string(2 + _index % 4) + ")\n"
+         "            + warp(p, " + std::to_string(1 + _index % 3) + ");\n"
+         "}\n";
+}
+
+size_t archiveSize(MTL::Device *_device, const std::vector<MTL::ComputePipelineDescriptor *> &_descs, const std::string &_path)
+{
+  auto *archiveDesc = MTL::BinaryArchiveDescriptor::alloc()->init();
+  NS::Error *error = nullptr;
+  auto *archive = _device->newBinaryArchive(archiveDesc, &error);
+  archiveDesc->release();
+  size_t size = 0;
+  bool ok = archive != nullptr;
+  for (auto *d : _descs)
+    ok = ok && archive->addComputePipelineFunctions(d, &error);
+  if (ok && archive->serializeToURL(NS::URL::fileURLWithPath(NS::String::string(_path.c_str(), NS::UTF8StringEncoding)), &error))
+    size = std::filesystem::file_size(_path);
+  if (!ok && error)
+    std::cerr << "archive " << error->localizedDescription()->utf8String() << '\n';
+  std::error_code ec;
+  std::filesystem::remove(_path, ec);
+  if (archive)
+    archive->release();
+  return size;
+}
+
+template <typename F>
+double timeMs(F &&_f)
+{
+  auto start = std::chrono::steady_clock::now();
+  _f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  if (!device->supportsDynamicLibraries())
+  {
+    std::cerr << device->name()->utf8String() << " doesn't support dynamic libraries\n";
+    return EXIT_FAILURE;
+  }
+  const int kernels = 16;
+  const int salt = int(std::chrono::steady_clock::now().time_since_epoch().count() & 0xffffff);
+  const auto directory = ShaderCache::defaultDirectory() + "/dylib";
+  if (argc > 1 && std::string(argv[1]) == "--clear")
+    std::filesystem::remove_all(directory);
+  NS::Error *errorMessages = nullptr;
+  const auto scratch = directory + "/scratch.binarchive";
+
+  // everything in one library per kernel
+  std::vector<MTL::ComputePipelineDescriptor *> monolithic;
+  double monolithicMs = timeMs([&] {
+    auto *options = ShaderOptions().newCompileOptions();
+    for (int i = 0; i < kernels; ++i)
+    {
+      auto src = std::string(helperSource) + kernelSource(i, salt);
+      auto *library = device->newLibrary(NS::String::string(src.c_str(), NS::UTF8StringEncoding), options, &errorMessages);
+      assert(library);
+      auto name = "k" + std::to_string(i);
+      auto *func = library->newFunction(NS::String::string(name.c_str(), NS::ASCIIStringEncoding));
+      auto *desc = MTL::ComputePipelineDescriptor::alloc()->init();
+      desc->setComputeFunction(func);
+      auto *pipeline = device->newComputePipelineState(desc, MTL::PipelineOptionNone, nullptr, &errorMessages);
+      assert(pipeline);
+      monolithic.push_back(desc);
+      pipeline->release();
+      func->release();
+      library->release();
+    }
+    options->release();
+  });
+
+  // helpers once, kernels linked to them
+  std::vector<MTL::ComputePipelineDescriptor *> linked;
+  bool dylibFromDisk = false;
+  double dylibMs = 0.0;
+  size_t dylibSize = 0;
+  double linkedMs = timeMs([&] {
+    SharedShaderLibrary *shared = nullptr;
+    dylibMs = timeMs([&] { shared = new SharedShaderLibrary(device, helperSource, "noise", ShaderOptions(), directory); });
+    if (!shared->valid())
+    {
+      std::cerr << "Failed to build the shared library " << shared->error() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    dylibFromDisk = shared->loadedFromDisk();
+    dylibSize = shared->binarySize();
+    for (int i = 0; i < kernels; ++i)
+    {
+      auto src = std::string(helperDeclarations) + kernelSource(i, salt);
+      auto *library = shared->newLinkedLibrary(src, &errorMessages);
+      if (!library)
+      {
+        std::cerr << "Failed to link k" << i << ' ' << errorMessages->localizedDescription()->utf8String() << '\n';
+        exit(EXIT_FAILURE);
+      }
+      auto name = "k" + std::to_string(i);
+      auto *func = library->newFunction(NS::String::string(name.c_str(), NS::ASCIIStringEncoding));
+      auto *desc = MTL::ComputePipelineDescriptor::alloc()->init();
+      desc->setComputeFunction(func);
+      shared->configure(desc);
+      auto *pipeline = device->newComputePipelineState(desc, MTL::PipelineOptionNone, nullptr, &errorMessages);
+      assert(pipeline);
+      linked.push_back(desc);
+      pipeline->release();
+      func->release();
+      library->release();
+    }
+    // the descriptors keep the dynamic library alive through their preloaded
+    // libraries array
+    delete shared;
+  });
+
+  // helpers once as visible functions, linked into each pipeline
+  std::vector<MTL::ComputePipelineDescriptor *> functions;
+  double functionsMs = 0.0;
+  if (device->supportsFunctionPointers())
+  {
+    functionsMs = timeMs([&] {
+      auto *options = ShaderOptions().newCompileOptions();
+      auto src = visibleHelperSource();
+      auto *helpers = device->newLibrary(NS::String::string(src.c_str(), NS::UTF8StringEncoding), options, &errorMessages);
+      if (!helpers)
+      {
+        std::cerr << "Failed to build the visible helpers " << errorMessages->localizedDescription()->utf8String() << '\n';
+        exit(EXIT_FAILURE);
+      }
+      auto *linkedFunctions = SharedShaderLibrary::newLinkedFunctions(helpers, {"fbm", "ridged", "warp"});
+      for (int i = 0; i < kernels; ++i)
+      {
+        src = std::string(helperDeclarations) + kernelSource(i, salt);
+        auto *library = device->newLibrary(NS::String::string(src.c_str(), NS::UTF8StringEncoding), options, &errorMessages);
+        assert(library);
+        auto name = "k" + std::to_string(i);
+        auto *func = library->newFunction(NS::String::string(name.c_str(), NS::ASCIIStringEncoding));
+        auto *desc = MTL::ComputePipelineDescriptor::alloc()->init();
+        desc->setComputeFunction(func);
+        desc->setLinkedFunctions(linkedFunctions);
+        auto *pipeline = device->newComputePipelineState(desc, MTL::PipelineOptionNone, nullptr, &errorMessages);
+        if (!pipeline)
+        {
+          std::cerr << "Failed to link functions into k" << i << ' ' << errorMessages->localizedDescription()->utf8String() << '\n';
+          exit(EXIT_FAILURE);
+        }
+        functions.push_back(desc);
+        pipeline->release();
+        func->release();
+        library->release();
+      }
+      // the descriptors retain the linked functions
+      linkedFunctions->release();
+      helpers->release();
+      options->release();
+    });
+  }
+
+  size_t monolithicSize = archiveSize(device, monolithic, scratch);
+  size_t linkedSize = archiveSize(device, linked, scratch);
+  size_t functionsSize = functions.empty() ? 0 : archiveSize(device, functions, scratch);
+
+  printf("%d kernels sharing the noise helpers\n", kernels);
+  printf("%-12s %12s %14s\n", "", "compile ms", "binary bytes");
+  printf("%-12s %12.2f %14zu\n", "monolithic", monolithicMs, monolithicSize);
+  printf("%-12s %12.2f %14zu (pipelines %zu + dynamic library %zu)\n", "shared", linkedMs, linkedSize + dylibSize, linkedSize, dylibSize);
+  if (!functions.empty())
+    printf("%-12s %12.2f %14zu\n", "linked", functionsMs, functionsSize);
+  else
+    printf("%-12s no function pointers on %s\n", "linked", device->name()->utf8String());
+  printf("dynamic library %s in %.2f ms\n", dylibFromDisk ? "loaded" : "compiled", dylibMs);
+  if (!dylibFromDisk)
+    printf("run again to load the serialized dynamic library\n");
+
+  for (auto *d : monolithic)
+    d->release();
+  for (auto *d : linked)
+    d->release();
+  for (auto *d : functions)
+    d->release();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+#pragma once
+#include "Metal.hpp"
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A set of function constant values, used both to build an
+// MTL::FunctionConstantValues and as a cache key. The hash is updated as values
+// are set so looking a variant up never rehashes the constants.
+class ConstantSet
+{
+public:
+  ConstantSet &set(NS::UInteger _index, uint32_t _value) { return add(_index, MTL::DataTypeUInt, &_value, sizeof(_value)); }
+  ConstantSet &set(NS::UInteger _index, int32_t _value) { return add(_index, MTL::DataTypeInt, &_value, sizeof(_value)); }
+  ConstantSet &set(NS::UInteger _index, float _value) { return add(_index, MTL::DataTypeFloat, &_value, sizeof(_value)); }
+  ConstantSet &set(NS::UInteger _index, bool _value) { return add(_index, MTL::DataTypeBool, &_value, sizeof(_value)); }
+
+  bool empty() const { return m_entries.empty(); }
+  size_t hash() const { return m_hash; }
+
+  bool operator==(const ConstantSet &_rhs) const
+  {
+    if (m_hash != _rhs.m_hash || m_entries.size() != _rhs.m_entries.size())
+      return false;
+    for (size_t i = 0; i < m_entries.size(); ++i)
+    {
+      const auto &a = m_entries[i];
+      const auto &b = _rhs.m_entries[i];
+      if (a.index != b.index || a.type != b.type || a.bits != b.bits)
+        return false;
+    }
+    return true;
+  }
+
+  // caller owns the returned object
+  MTL::FunctionConstantValues *newFunctionConstantValues() const
+  {
+    auto *values = MTL::FunctionConstantValues::alloc()->init();
+    for (const auto &e : m_entries)
+      values->setConstantValue(&e.bits, e.type, e.index);
+    return values;
+  }
+
+  std::string description() const
+  {
+    std::string s;
+    for (const auto &e : m_entries)
+      s += "[" + std::to_string(e.index) + "]=" + std::to_string(e.bits) + " ";
+    return s.empty() ? "generic" : s;
+  }
+
+private:
+  struct Entry
+  {
+    NS::UInteger index;
+    MTL::DataType type;
+    uint32_t bits; // all supported types fit in 32 bits
+  };
+
+  ConstantSet &add(NS::UInteger _index, MTL::DataType _type, const void *_value, size_t _size)
+  {
+    Entry e{_index, _type, 0};
+    std::memcpy(&e.bits, _value, _size);
+    // keep entries sorted by index so the order of set calls does not matter
+    auto it = m_entries.begin();
+    while (it != m_entries.end() && it->index < _index)
+      ++it;
+    if (it != m_entries.end() && it->index == _index)
+      *it = e;
+    else
+      m_entries.insert(it, e);
+    rehash();
+    return *this;
+  }
+
+  // FNV-1a over the entries
+  void rehash()
+  {
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&h](uint64_t _v)
+    {
+      for (int i = 0; i < 8; ++i)
+      {
+        h ^= (_v >> (i * 8)) & 0xff;
+        h *= 1099511628211ull;
+      }
+    };
+    for (const auto &e : m_entries)
+    {
+      mix(e.index);
+      mix(static_cast<uint64_t>(e.type));
+      mix(e.bits);
+    }
+    m_hash = static_cast<size_t>(h);
+  }
+
+  std::vector<Entry> m_entries;
+  size_t m_hash = 0;
+};
+
+// Builds specialised functions from a library on demand and caches the
+// resulting pipeline states keyed by function name(s) and constant set. An
+// empty ConstantSet gives the generic function: every constant is left
+// undefined, so a constant the generic variant can run without needs an
+// is_function_constant_defined fallback in the shader. A lookup hashes the
+// function names in place and compares against the variants with the same
+// hash, so nothing is copied or allocated on a hit.
+class SpecializationCache
+{
+public:
+  SpecializationCache(MTL::Device *_device, MTL::Library *_library) : m_device(_device), m_library(_library) {}
+  ~SpecializationCache()
+  {
+    for (auto *variants : {&m_compute, &m_render})
+      for (auto &bucket : *variants)
+        for (auto &v : bucket.second)
+          v.pipeline->release();
+  }
+
+  MTL::ComputePipelineState *computePipeline(const std::string &_name, const ConstantSet &_constants)
+  {
+    static const std::string none;
+    auto h = hash(_name, none, _constants, nullptr);
+    if (auto *pipeline = find(m_compute, h, _name, none, _constants, nullptr))
+    {
+      ++m_hits;
+      return static_cast<MTL::ComputePipelineState *>(pipeline);
+    }
+    ++m_misses;
+    auto *function = newFunction(_name, _constants);
+    NS::Error *error = nullptr;
+    auto *pipeline = m_device->newComputePipelineState(function, &error);
+    function->release();
+    if (!pipeline)
+    {
+      std::cerr << "Unable to build compute pipeline " << _name << ' ' << error->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    m_compute[h].push_back({_name, none, _constants, nullptr, pipeline});
+    return pipeline;
+  }
+
+  // _base supplies everything except the functions (attachments, blending etc)
+  // and is part of the key, so keep one descriptor per render configuration.
+  MTL::RenderPipelineState *renderPipeline(const MTL::RenderPipelineDescriptor *_base, const std::string &_vertexName, const std::string &_fragmentName, const ConstantSet &_constants)
+  {
+    auto h = hash(_vertexName, _fragmentName, _constants, _base);
+    if (auto *pipeline = find(m_render, h, _vertexName, _fragmentName, _constants, _base))
+    {
+      ++m_hits;
+      return static_cast<MTL::RenderPipelineState *>(pipeline);
+    }
+    ++m_misses;
+    auto *desc = _base->copy();
+    auto *vertFunc = newFunction(_vertexName, _constants);
+    auto *fragFunc = newFunction(_fragmentName, _constants);
+    desc->setVertexFunction(vertFunc);
+    desc->setFragmentFunction(fragFunc);
+    NS::Error *error = nullptr;
+    auto *pipeline = m_device->newRenderPipelineState(desc, &error);
+    vertFunc->release();
+    fragFunc->release();
+    desc->release();
+    if (!pipeline)
+    {
+      std::cerr << "Unable to build render pipeline " << _vertexName << '/' << _fragmentName << ' ' << error->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    m_render[h].push_back({_vertexName, _fragmentName, _constants, _base, pipeline});
+    return pipeline;
+  }
+
+  size_t hits() const { return m_hits; }
+  size_t misses() const { return m_misses; }
+
+private:
+  MTL::Function *newFunction(const std::string &_name, const ConstantSet &_constants)
+  {
+    // a function that declares function constants can only be made with
+    // values, even when none of them are set
+    auto *name = NS::String::string(_name.c_str(), NS::ASCIIStringEncoding);
+    auto *values = _constants.newFunctionConstantValues();
+    NS::Error *error = nullptr;
+    auto *function = m_library->newFunction(name, values, &error);
+    values->release();
+    if (!function)
+    {
+      std::cerr << "Unable to specialise " << _name << ' ' << error->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    return function;
+  }
+
+  // a compute variant has one function name and no base descriptor
+  struct Variant
+  {
+    std::string first;
+    std::string second;
+    ConstantSet constants;
+    const void *base;
+    NS::Object *pipeline;
+  };
+  // keyed by hash(), a bucket only holds more than one variant if their
+  // hashes collide
+  using Variants = std::unordered_map<size_t, std::vector<Variant>>;
+
+  static size_t hash(const std::string &_first, const std::string &_second, const ConstantSet &_constants, const void *_base)
+  {
+    std::hash<std::string> name;
+    return _constants.hash() ^ (name(_first) * 31) ^ (name(_second) * 131) ^ std::hash<const void *>()(_base);
+  }
+
+  static NS::Object *find(const Variants &_variants, size_t _hash, const std::string &_first, const std::string &_second, const ConstantSet &_constants, const void *_base)
+  {
+    auto it = _variants.find(_hash);
+    if (it == _variants.end())
+      return nullptr;
+    for (const auto &v : it->second)
+      if (v.base == _base && v.constants == _constants && v.first == _first && v.second == _second)
+        return v.pipeline;
+    return nullptr;
+  }
+
+  MTL::Device *m_device;
+  MTL::Library *m_library;
+  Variants m_compute;
+  Variants m_render;
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+};
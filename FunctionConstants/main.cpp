@@ -0,0 +1,261 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "SpecializationCache.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+// The same kernels are built generic (values read from a buffer at run time) and
+// specialised (values baked in with function constants, so loops unroll and the
+// bounds checks are compiled out) and the two are timed against each other.
+
+struct Params
+{
+  uint32_t count;
+  uint32_t elementsPerThread;
+  uint32_t tileSize;
+  uint32_t checkBounds;
+};
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+
+  auto *shaderSrc = NS::String::string(
+      R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        struct Params
+        {
+          uint count;
+          uint elementsPerThread;
+          uint tileSize;
+          uint checkBounds;
+        };
+
+        constant uint elementsPerThread [[ function_constant(0) ]];
+        constant uint tileSize [[ function_constant(1) ]];
+        constant bool checkBounds [[ function_constant(2) ]];
+        constant bool colourFromVertexValue [[ function_constant(3) ]];
+        constant bool hasElementsPerThread = is_function_constant_defined(elementsPerThread);
+        constant bool hasTileSize = is_function_constant_defined(tileSize);
+        constant bool hasCheckBounds = is_function_constant_defined(checkBounds);
+        constant bool colourFromVertex = is_function_constant_defined(colourFromVertexValue) ? colourFromVertexValue : false;
+
+        kernel void sqr(
+            const device float *vIn [[ buffer(0) ]],
+            device float *vOut [[ buffer(1) ]],
+            constant Params &params [[ buffer(2) ]],
+            uint id [[ thread_position_in_grid ]],
+            uint gridSize [[ threads_per_grid ]])
+        {
+            const uint ept = hasElementsPerThread ? elementsPerThread : params.elementsPerThread;
+            const bool check = hasCheckBounds ? checkBounds : params.checkBounds != 0;
+            for (uint i = 0; i < ept; ++i)
+            {
+                uint idx = id + i * gridSize;
+                if (!check || idx < params.count)
+                    vOut[idx] = vIn[idx] * vIn[idx];
+            }
+        }
+
+        // each threadgroup sums tileSize * elementsPerThread values into partial[group]
+        kernel void reduceSum(
+            const device float *vIn [[ buffer(0) ]],
+            device float *partial [[ buffer(1) ]],
+            constant Params &params [[ buffer(2) ]],
+            threadgroup float *scratch [[ threadgroup(0) ]],
+            uint tid [[ thread_index_in_threadgroup ]],
+            uint group [[ threadgroup_position_in_grid ]])
+        {
+            const uint ept = hasElementsPerThread ? elementsPerThread : params.elementsPerThread;
+            const uint tile = hasTileSize ? tileSize : params.tileSize;
+            const bool check = hasCheckBounds ? checkBounds : params.checkBounds != 0;
+            float sum = 0.0f;
+            uint base = group * tile * ept + tid;
+            for (uint i = 0; i < ept; ++i)
+            {
+                uint idx = base + i * tile;
+                if (!check || idx < params.count)
+                    sum += vIn[idx];
+            }
+            scratch[tid] = sum;
+            threadgroup_barrier(mem_flags::mem_threadgroup);
+            for (uint s = tile / 2; s > 0; s >>= 1)
+            {
+                if (tid < s)
+                    scratch[tid] += scratch[tid + s];
+                threadgroup_barrier(mem_flags::mem_threadgroup);
+            }
+            if (tid == 0)
+                partial[group] = scratch[0];
+        }
+
+        struct RasteriserData
+        {
+            float4 position [[position]];
+            float4 colour;
+        };
+
+        vertex RasteriserData vertFunc(const device packed_float3* vertexArray [[ buffer(0) ]], uint vID [[ vertex_id ]])
+        {
+            RasteriserData out;
+            out.position = float4(vertexArray[vID], 1.0);
+            out.colour = colourFromVertex ? float4(vertexArray[vID] * 0.5 + 0.5, 1.0) : float4(1.0);
+            return out;
+        }
+
+        fragment float4 fragFunc(RasteriserData in [[ stage_in ]])
+        {
+            return in.colour;
+        }
+    )""",
+      NS::ASCIIStringEncoding);
+
+  auto *compileOptions = MTL::CompileOptions::alloc()->init();
+  NS::Error *errorMessages = nullptr;
+  auto library = device->newLibrary(shaderSrc, compileOptions, &errorMessages);
+  if (!library)
+  {
+    std::cerr << errorMessages->localizedDescription()->utf8String() << '\n';
+    return EXIT_FAILURE;
+  }
+  auto *commandQueue = device->newCommandQueue();
+  assert(commandQueue);
+
+  SpecializationCache cache(device, library);
+
+  const uint32_t elementsPerThread = 8;
+  const uint32_t tileSize = 256;
+  const uint32_t dataCount = 1 << 24; // a multiple of tileSize * elementsPerThread so no tail
+  const int iterations = 20;
+
+  auto *inBuffer = device->newBuffer(sizeof(float) * dataCount, MTL::ResourceStorageModeShared);
+  auto *outBuffer = device->newBuffer(sizeof(float) * dataCount, MTL::ResourceStorageModeShared);
+  const uint32_t groups = dataCount / (tileSize * elementsPerThread);
+  auto *partialBuffer = device->newBuffer(sizeof(float) * groups, MTL::ResourceStorageModeShared);
+  assert(inBuffer && outBuffer && partialBuffer);
+
+  float *inData = static_cast<float *>(inBuffer->contents());
+  double expectedSum = 0.0;
+  for (uint32_t i = 0; i < dataCount; ++i)
+  {
+    inData[i] = static_cast<float>(i % 7) * 0.25f;
+    expectedSum += inData[i];
+  }
+
+  Params params{dataCount, elementsPerThread, tileSize, 1};
+
+  auto timeKernel = [&](MTL::ComputePipelineState *_pipeline, bool _reduce)
+  {
+    double total = 0.0;
+    for (int i = 0; i < iterations; ++i)
+    {
+      auto *commandBuffer = commandQueue->commandBuffer();
+      auto *commandEncoder = commandBuffer->computeCommandEncoder();
+      commandEncoder->setComputePipelineState(_pipeline);
+      commandEncoder->setBuffer(inBuffer, 0, 0);
+      commandEncoder->setBuffer(_reduce ? partialBuffer : outBuffer, 0, 1);
+      commandEncoder->setBytes(&params, sizeof(Params), 2);
+      if (_reduce)
+      {
+        commandEncoder->setThreadgroupMemoryLength(sizeof(float) * tileSize, 0);
+        commandEncoder->dispatchThreadgroups(MTL::Size(groups, 1, 1), MTL::Size(tileSize, 1, 1));
+      }
+      else
+      {
+        const uint32_t threads = dataCount / elementsPerThread;
+        commandEncoder->dispatchThreadgroups(MTL::Size(threads / tileSize, 1, 1), MTL::Size(tileSize, 1, 1));
+      }
+      commandEncoder->endEncoding();
+      commandBuffer->commit();
+      commandBuffer->waitUntilCompleted();
+      total += commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime();
+    }
+    return total / iterations * 1000.0;
+  };
+
+  auto checkResults = [&](bool _reduce)
+  {
+    if (_reduce)
+    {
+      double sum = 0.0;
+      float *partial = static_cast<float *>(partialBuffer->contents());
+      for (uint32_t i = 0; i < groups; ++i)
+        sum += partial[i];
+      if (std::abs(sum - expectedSum) > expectedSum * 1e-5)
+      {
+        std::cerr << "reduceSum mismatch " << sum << " expected " << expectedSum << '\n';
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      float *outData = static_cast<float *>(outBuffer->contents());
+      for (uint32_t i = 0; i < dataCount; ++i)
+        if (outData[i] != inData[i] * inData[i])
+        {
+          std::cerr << "sqr mismatch at " << i << '\n';
+          exit(EXIT_FAILURE);
+        }
+    }
+  };
+
+  ConstantSet generic;
+  ConstantSet specialised;
+  specialised.set(0, elementsPerThread).set(1, tileSize).set(2, false);
+
+  printf("%-10s %-12s %10s %10s\n", "kernel", "variant", "build ms", "gpu ms");
+  for (auto name : {"sqr", "reduceSum"})
+  {
+    bool reduce = std::string(name) == "reduceSum";
+    for (auto *constants : {&generic, &specialised})
+    {
+      auto start = std::chrono::steady_clock::now();
+      auto *pipeline = cache.computePipeline(name, *constants);
+      auto end = std::chrono::steady_clock::now();
+      double build = std::chrono::duration<double, std::milli>(end - start).count();
+      double gpu = timeKernel(pipeline, reduce);
+      checkResults(reduce);
+      printf("%-10s %-12s %10.3f %10.3f\n", name, constants == &generic ? "generic" : "specialised", build, gpu);
+    }
+  }
+
+  // the hot path: asking for a variant which already exists is just a lookup
+  {
+    const int lookups = 100000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < lookups; ++i)
+    {
+      ConstantSet constants;
+      constants.set(0, elementsPerThread).set(1, tileSize).set(2, false);
+      cache.computePipeline("sqr", constants);
+    }
+    auto end = std::chrono::steady_clock::now();
+    printf("variant lookup %.1f ns\n", std::chrono::duration<double, std::nano>(end - start).count() / lookups);
+  }
+
+  // render pipelines are specialised the same way
+  auto *renderPipelineDesc = MTL::RenderPipelineDescriptor::alloc()->init();
+  renderPipelineDesc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  auto *white = cache.renderPipeline(renderPipelineDesc, "vertFunc", "fragFunc", ConstantSet().set(3, false));
+  auto *coloured = cache.renderPipeline(renderPipelineDesc, "vertFunc", "fragFunc", ConstantSet().set(3, true));
+  assert(white && coloured && white != coloured);
+  assert(cache.renderPipeline(renderPipelineDesc, "vertFunc", "fragFunc", ConstantSet().set(3, true)) == coloured);
+
+  printf("cache hits %zu misses %zu\n", cache.hits(), cache.misses());
+
+  renderPipelineDesc->release();
+  inBuffer->release();
+  outBuffer->release();
+  partialBuffer->release();
+  commandQueue->release();
+  library->release();
+  compileOptions->release();
+  return EXIT_SUCCESS;
+}
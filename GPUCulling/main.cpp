@@ -0,0 +1,348 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Objects scattered around a turning camera, drawn with the CPU testing each
+// against the view frustum and encoding a draw for each one that survives,
+// and GPU driven, where a kernel does the test and encodes the survivors into
+// an MTL::IndirectCommandBuffer that the render pass runs with
+// executeCommandsInBuffer. The kernel packs the draws it writes to the front
+// of the indirect command buffer and counts them into the execution range the
+// render pass reads, so culled objects cost nothing to execute. CPU frame time
+// is from starting to encode the frame to committing it.
+
+const char *shaderSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  struct Object
+  {
+    float4 centreRadius;
+    float4 colour;
+  };
+
+  struct Uniforms
+  {
+    float4x4 viewProjection;
+    float4 planes[6];
+    uint count;
+  };
+
+  struct RasteriserData
+  {
+    float4 position [[position]];
+    float4 colour;
+  };
+
+  // holds the indirect command buffer for the kernel, set by an argument encoder
+  struct ICBContainer
+  {
+    command_buffer commands [[id(0)]];
+  };
+
+  bool visible(float4 sphere, const device float4 *planes)
+  {
+    for (int p = 0; p < 6; ++p)
+      if (dot(planes[p].xyz, sphere.xyz) + planes[p].w < -sphere.w)
+        return false;
+    return true;
+  }
+
+  kernel void cullAndEncode(uint id [[thread_position_in_grid]],
+                            device Uniforms &uniforms [[buffer(0)]],
+                            device Object *objects [[buffer(1)]],
+                            device float4 *mesh [[buffer(2)]],
+                            constant uint &meshVertices [[buffer(3)]],
+                            device ICBContainer &icb [[buffer(4)]],
+                            device atomic_uint *executionRange [[buffer(5)]])
+  {
+    if (id >= uniforms.count || !visible(objects[id].centreRadius, uniforms.planes))
+      return;
+    // executionRange is {location, length}, the survivors are packed from 0
+    uint slot = atomic_fetch_add_explicit(&executionRange[1], 1, memory_order_relaxed);
+    render_command cmd(icb.commands, slot);
+    cmd.set_vertex_buffer(mesh, 0);
+    cmd.set_vertex_buffer(objects, 1);
+    cmd.set_vertex_buffer(&uniforms, 2);
+    cmd.draw_primitives(primitive_type::triangle, 0, meshVertices, 1, id);
+  }
+
+  vertex RasteriserData vertFunc(uint vertexID [[vertex_id]],
+                                 uint instanceID [[instance_id]],
+                                 const device float4 *mesh [[buffer(0)]],
+                                 const device Object *objects [[buffer(1)]],
+                                 const device Uniforms &uniforms [[buffer(2)]])
+  {
+    RasteriserData out;
+    Object object = objects[instanceID];
+    float3 p = object.centreRadius.xyz + mesh[vertexID].xyz * object.centreRadius.w;
+    out.position = uniforms.viewProjection * float4(p, 1.0f);
+    out.colour = object.colour;
+    return out;
+  }
+
+  fragment float4 fragFunc(RasteriserData in [[stage_in]])
+  {
+    return in.colour;
+  }
+)""";
+
+struct Object
+{
+  float centreRadius[4];
+  float colour[4];
+};
+
+// matches the shader's layout, padded to float4x4 alignment
+struct Uniforms
+{
+  float viewProjection[16];
+  float planes[6][4];
+  uint32_t count;
+  uint32_t pad[3];
+};
+
+constexpr int frames = 60;
+constexpr int size = 512;
+constexpr float fieldSize = 100.0f;
+
+// column major like float4x4, _a * _b
+void multiply(const float *_a, const float *_b, float *o_m)
+{
+  for (int c = 0; c < 4; ++c)
+    for (int r = 0; r < 4; ++r)
+    {
+      float sum = 0.0f;
+      for (int k = 0; k < 4; ++k)
+        sum += _a[k * 4 + r] * _b[c * 4 + k];
+      o_m[c * 4 + r] = sum;
+    }
+}
+
+// a camera at the origin turned _angle about y, with Metal's 0 to 1 depth range,
+// and the frustum planes pulled out of the combined matrix
+void setCamera(float _angle, Uniforms *o_uniforms)
+{
+  const float nearZ = 0.1f;
+  const float farZ = fieldSize * 2.0f;
+  const float ys = 1.0f / std::tan(0.5f * 60.0f * float(M_PI) / 180.0f);
+  const float zs = farZ / (nearZ - farZ);
+  const float projection[16] = {ys, 0, 0, 0, 0, ys, 0, 0, 0, 0, zs, -1, 0, 0, zs * nearZ, 0};
+  const float c = std::cos(_angle);
+  const float s = std::sin(_angle);
+  const float view[16] = {c, 0, -s, 0, 0, 1, 0, 0, s, 0, c, 0, 0, 0, 0, 1};
+  float *m = o_uniforms->viewProjection;
+  multiply(projection, view, m);
+  auto row = [m](int _r, int _i) { return m[_i * 4 + _r]; };
+  for (int i = 0; i < 4; ++i)
+  {
+    o_uniforms->planes[0][i] = row(3, i) + row(0, i);
+    o_uniforms->planes[1][i] = row(3, i) - row(0, i);
+    o_uniforms->planes[2][i] = row(3, i) + row(1, i);
+    o_uniforms->planes[3][i] = row(3, i) - row(1, i);
+    o_uniforms->planes[4][i] = row(2, i);
+    o_uniforms->planes[5][i] = row(3, i) - row(2, i);
+  }
+  for (auto &p : o_uniforms->planes)
+  {
+    float length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    for (auto &v : p)
+      v /= length;
+  }
+}
+
+bool visible(const Object &_object, const Uniforms &_uniforms)
+{
+  const float *s = _object.centreRadius;
+  for (auto &p : _uniforms.planes)
+    if (p[0] * s[0] + p[1] * s[1] + p[2] * s[2] + p[3] < -s[3])
+      return false;
+  return true;
+}
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = device->newLibrary(NS::String::string(shaderSource, NS::UTF8StringEncoding), nullptr, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to compile shaders " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+  auto cullFunc = library->newFunction(NS::String::string("cullAndEncode", NS::ASCIIStringEncoding));
+
+  auto *renderPipelineDesc = MTL::RenderPipelineDescriptor::alloc()->init();
+  renderPipelineDesc->setVertexFunction(vertFunc);
+  renderPipelineDesc->setFragmentFunction(fragFunc);
+  renderPipelineDesc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  renderPipelineDesc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+  // the pipeline is inherited by the indirect commands
+  renderPipelineDesc->setSupportIndirectCommandBuffers(true);
+  auto *renderPipeline = device->newRenderPipelineState(renderPipelineDesc, &errorMessages);
+  assert(renderPipeline);
+  auto *cullPipeline = device->newComputePipelineState(cullFunc, &errorMessages);
+  assert(cullPipeline);
+  auto *depthDesc = MTL::DepthStencilDescriptor::alloc()->init();
+  depthDesc->setDepthCompareFunction(MTL::CompareFunctionLess);
+  depthDesc->setDepthWriteEnabled(true);
+  auto *depthState = device->newDepthStencilState(depthDesc);
+  depthDesc->release();
+
+  // an octahedron
+  const float meshData[][4] = {{1, 0, 0, 1}, {0, 1, 0, 1}, {0, 0, 1, 1},   {0, 1, 0, 1}, {-1, 0, 0, 1}, {0, 0, 1, 1},
+                               {-1, 0, 0, 1}, {0, -1, 0, 1}, {0, 0, 1, 1}, {0, -1, 0, 1}, {1, 0, 0, 1}, {0, 0, 1, 1},
+                               {0, 1, 0, 1}, {1, 0, 0, 1}, {0, 0, -1, 1},  {-1, 0, 0, 1}, {0, 1, 0, 1}, {0, 0, -1, 1},
+                               {0, -1, 0, 1}, {-1, 0, 0, 1}, {0, 0, -1, 1}, {1, 0, 0, 1}, {0, -1, 0, 1}, {0, 0, -1, 1}};
+  const uint32_t meshVertices = sizeof(meshData) / sizeof(meshData[0]);
+  auto *meshBuffer = device->newBuffer(meshData, sizeof(meshData), MTL::ResourceStorageModeShared);
+  auto *uniformBuffer = device->newBuffer(sizeof(Uniforms), MTL::ResourceStorageModeShared);
+  auto *rangeBuffer = device->newBuffer(sizeof(MTL::IndirectCommandBufferExecutionRange), MTL::ResourceStorageModeShared);
+
+  auto *colourDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, size, size, false);
+  colourDesc->setUsage(MTL::TextureUsageRenderTarget);
+  auto *colourTexture = device->newTexture(colourDesc);
+  auto *depthTextureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatDepth32Float, size, size, false);
+  depthTextureDesc->setUsage(MTL::TextureUsageRenderTarget);
+  depthTextureDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *depthTexture = device->newTexture(depthTextureDesc);
+  auto *commandQueue = device->newCommandQueue();
+
+  auto *argumentEncoder = cullFunc->newArgumentEncoder(4);
+  auto *argumentBuffer = device->newBuffer(argumentEncoder->encodedLength(), MTL::ResourceStorageModeShared);
+
+  printf("%8s %-6s %10s %12s %12s\n", "objects", "path", "visible", "cpu ms", "gpu ms");
+  for (uint32_t count : {1000u, 10000u, 100000u})
+  {
+    std::mt19937 rng(count);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Object> objects(count);
+    for (auto &o : objects)
+      o = {{(unit(rng) * 2.0f - 1.0f) * fieldSize, (unit(rng) * 2.0f - 1.0f) * fieldSize * 0.25f, (unit(rng) * 2.0f - 1.0f) * fieldSize, 0.5f},
+           {unit(rng), unit(rng), unit(rng), 1.0f}};
+    auto *objectBuffer = device->newBuffer(objects.data(), sizeof(Object) * count, MTL::ResourceStorageModeShared);
+
+    // one draw per object at most, each binding its own buffers
+    auto *icbDesc = MTL::IndirectCommandBufferDescriptor::alloc()->init();
+    icbDesc->setCommandTypes(MTL::IndirectCommandTypeDraw);
+    icbDesc->setInheritPipelineState(true);
+    icbDesc->setInheritBuffers(false);
+    icbDesc->setMaxVertexBufferBindCount(3);
+    icbDesc->setMaxFragmentBufferBindCount(0);
+    auto *icb = device->newIndirectCommandBuffer(icbDesc, count, MTL::ResourceStorageModePrivate);
+    icbDesc->release();
+    assert(icb);
+    argumentEncoder->setArgumentBuffer(argumentBuffer, 0);
+    argumentEncoder->setIndirectCommandBuffer(icb, 0);
+
+    for (bool gpuDriven : {false, true})
+    {
+      double cpuMs = 0.0;
+      double gpuMs = 0.0;
+      uint32_t visibleCount = 0;
+      for (int frame = 0; frame < frames; ++frame)
+      {
+        auto *pool = NS::AutoreleasePool::alloc()->init();
+        auto start = std::chrono::steady_clock::now();
+        auto *uniforms = static_cast<Uniforms *>(uniformBuffer->contents());
+        setCamera(float(frame) * 0.05f, uniforms);
+        uniforms->count = count;
+        auto *commandBuffer = commandQueue->commandBuffer();
+
+        if (gpuDriven)
+        {
+          auto *blit = commandBuffer->blitCommandEncoder();
+          blit->fillBuffer(rangeBuffer, NS::Range(0, sizeof(MTL::IndirectCommandBufferExecutionRange)), 0);
+          blit->endEncoding();
+          auto *compute = commandBuffer->computeCommandEncoder();
+          compute->setComputePipelineState(cullPipeline);
+          compute->setBuffer(uniformBuffer, 0, 0);
+          compute->setBuffer(objectBuffer, 0, 1);
+          compute->setBuffer(meshBuffer, 0, 2);
+          compute->setBytes(&meshVertices, sizeof(uint32_t), 3);
+          compute->setBuffer(argumentBuffer, 0, 4);
+          compute->setBuffer(rangeBuffer, 0, 5);
+          // the indirect command buffer is only reached through the argument buffer
+          compute->useResource(icb, MTL::ResourceUsageWrite);
+          compute->dispatchThreads(MTL::Size(count, 1, 1), MTL::Size(cullPipeline->maxTotalThreadsPerThreadgroup(), 1, 1));
+          compute->endEncoding();
+        }
+
+        auto *passDesc = MTL::RenderPassDescriptor::alloc()->init();
+        auto *colour = passDesc->colorAttachments()->object(0);
+        colour->setTexture(colourTexture);
+        colour->setLoadAction(MTL::LoadActionClear);
+        colour->setStoreAction(MTL::StoreActionStore);
+        auto *depth = passDesc->depthAttachment();
+        depth->setTexture(depthTexture);
+        depth->setLoadAction(MTL::LoadActionClear);
+        depth->setStoreAction(MTL::StoreActionDontCare);
+        auto *encoder = commandBuffer->renderCommandEncoder(passDesc);
+        encoder->setRenderPipelineState(renderPipeline);
+        encoder->setDepthStencilState(depthState);
+        if (gpuDriven)
+        {
+          // buffers bound by the indirect commands have to be made resident
+          encoder->useResource(meshBuffer, MTL::ResourceUsageRead);
+          encoder->useResource(objectBuffer, MTL::ResourceUsageRead);
+          encoder->useResource(uniformBuffer, MTL::ResourceUsageRead);
+          encoder->executeCommandsInBuffer(icb, rangeBuffer, 0);
+        }
+        else
+        {
+          encoder->setVertexBuffer(meshBuffer, 0, 0);
+          encoder->setVertexBuffer(objectBuffer, 0, 1);
+          encoder->setVertexBuffer(uniformBuffer, 0, 2);
+          visibleCount = 0;
+          for (uint32_t i = 0; i < count; ++i)
+          {
+            if (!visible(objects[i], *uniforms))
+              continue;
+            encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, 0, meshVertices, 1, i);
+            ++visibleCount;
+          }
+        }
+        encoder->endEncoding();
+        commandBuffer->commit();
+        cpuMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        commandBuffer->waitUntilCompleted();
+        gpuMs += (commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime()) * 1000.0;
+        if (gpuDriven)
+          visibleCount = static_cast<MTL::IndirectCommandBufferExecutionRange *>(rangeBuffer->contents())->length;
+        passDesc->release();
+        pool->release();
+      }
+      printf("%8u %-6s %10u %12.3f %12.3f\n", count, gpuDriven ? "gpu" : "cpu", visibleCount, cpuMs / frames, gpuMs / frames);
+    }
+    icb->release();
+    objectBuffer->release();
+  }
+
+  argumentBuffer->release();
+  argumentEncoder->release();
+  commandQueue->release();
+  depthTexture->release();
+  colourTexture->release();
+  rangeBuffer->release();
+  uniformBuffer->release();
+  meshBuffer->release();
+  depthState->release();
+  cullPipeline->release();
+  renderPipeline->release();
+  renderPipelineDesc->release();
+  cullFunc->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
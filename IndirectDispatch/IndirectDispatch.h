@@ -0,0 +1,76 @@
+#pragma once
+#include "Metal.hpp"
+#include <cassert>
+#include <iostream>
+
+// Lets a kernel size the next dispatch on the GPU. An earlier stage writes an
+// element count into a buffer, a one thread kernel turns that count into
+// MTL::DispatchThreadgroupsIndirectArguments and the next stage is launched with
+// the indirect form of dispatchThreadgroups, so no CPU round trip is needed.
+class IndirectDispatch
+{
+public:
+  explicit IndirectDispatch(MTL::Device *_device)
+  {
+    auto *shaderSrc = NS::String::string(
+        R"""(
+          #include <metal_stdlib>
+          using namespace metal;
+
+          struct DispatchArgs
+          {
+              uint threadgroupsPerGrid[3];
+          };
+
+          kernel void writeDispatchArgs(
+              const device uint *count [[ buffer(0) ]],
+              device DispatchArgs *args [[ buffer(1) ]],
+              constant uint &threadsPerThreadgroup [[ buffer(2) ]])
+          {
+              args->threadgroupsPerGrid[0] = (*count + threadsPerThreadgroup - 1) / threadsPerThreadgroup;
+              args->threadgroupsPerGrid[1] = 1;
+              args->threadgroupsPerGrid[2] = 1;
+          }
+      )""",
+        NS::ASCIIStringEncoding);
+    auto *compileOptions = MTL::CompileOptions::alloc()->init();
+    NS::Error *errorMessages = nullptr;
+    auto *library = _device->newLibrary(shaderSrc, compileOptions, &errorMessages);
+    assert(library);
+    auto *func = library->newFunction(NS::String::string("writeDispatchArgs", NS::ASCIIStringEncoding));
+    m_pipeline = _device->newComputePipelineState(func, &errorMessages);
+    assert(m_pipeline);
+    func->release();
+    library->release();
+    compileOptions->release();
+  }
+
+  ~IndirectDispatch() { m_pipeline->release(); }
+
+  // a buffer large enough for one set of arguments, GPU only is fine
+  static MTL::Buffer *newArgumentBuffer(MTL::Device *_device)
+  {
+    return _device->newBuffer(sizeof(MTL::DispatchThreadgroupsIndirectArguments), MTL::ResourceStorageModePrivate);
+  }
+
+  // encode the kernel which converts the uint at _countBuffer/_countOffset into
+  // threadgroup counts for _threadsPerThreadgroup sized groups
+  void encodeArguments(MTL::ComputeCommandEncoder *_encoder, const MTL::Buffer *_countBuffer, NS::UInteger _countOffset, const MTL::Buffer *_argumentBuffer, uint32_t _threadsPerThreadgroup) const
+  {
+    _encoder->setComputePipelineState(m_pipeline);
+    _encoder->setBuffer(_countBuffer, _countOffset, 0);
+    _encoder->setBuffer(_argumentBuffer, 0, 1);
+    _encoder->setBytes(&_threadsPerThreadgroup, sizeof(uint32_t), 2);
+    _encoder->dispatchThreadgroups(MTL::Size(1, 1, 1), MTL::Size(1, 1, 1));
+  }
+
+  // dispatch whatever pipeline is bound using the arguments written above, the
+  // caller's kernel still needs to bounds check against the count
+  static void dispatch(MTL::ComputeCommandEncoder *_encoder, const MTL::Buffer *_argumentBuffer, uint32_t _threadsPerThreadgroup)
+  {
+    _encoder->dispatchThreadgroups(_argumentBuffer, 0, MTL::Size(_threadsPerThreadgroup, 1, 1));
+  }
+
+private:
+  MTL::ComputePipelineState *m_pipeline = nullptr;
+};
@@ -0,0 +1,180 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "IndirectDispatch.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+// A filter -> process chain. The filter keeps the values above a threshold and
+// counts them, the process stage squares the survivors. First the count is read
+// back on the CPU to size the second dispatch, then the same chain is run in one
+// command buffer with the second dispatch sized on the GPU.
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+
+  auto *shaderSrc = NS::String::string(
+      R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void filter(
+            const device float *vIn [[ buffer(0) ]],
+            device float *vKept [[ buffer(1) ]],
+            device atomic_uint *keptCount [[ buffer(2) ]],
+            constant float &threshold [[ buffer(3) ]],
+            constant uint &count [[ buffer(4) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            if (id >= count || vIn[id] <= threshold)
+                return;
+            uint slot = atomic_fetch_add_explicit(keptCount, 1, memory_order_relaxed);
+            vKept[slot] = vIn[id];
+        }
+
+        kernel void process(
+            device float *vData [[ buffer(0) ]],
+            const device uint *count [[ buffer(1) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            if (id < *count)
+                vData[id] = vData[id] * vData[id];
+        }
+    )""",
+      NS::ASCIIStringEncoding);
+
+  auto *compileOptions = MTL::CompileOptions::alloc()->init();
+  NS::Error *errorMessages = nullptr;
+  auto library = device->newLibrary(shaderSrc, compileOptions, &errorMessages);
+  assert(library);
+  auto filterFunc = library->newFunction(NS::String::string("filter", NS::ASCIIStringEncoding));
+  auto processFunc = library->newFunction(NS::String::string("process", NS::ASCIIStringEncoding));
+  auto *filterPipeline = device->newComputePipelineState(filterFunc, &errorMessages);
+  auto *processPipeline = device->newComputePipelineState(processFunc, &errorMessages);
+  assert(filterPipeline && processPipeline);
+  auto *commandQueue = device->newCommandQueue();
+  assert(commandQueue);
+
+  IndirectDispatch indirect(device);
+
+  const uint32_t dataCount = 1 << 20;
+  const uint32_t threadsPerGroup = 256;
+  const float threshold = 0.75f;
+  const int iterations = 100;
+
+  auto *inBuffer = device->newBuffer(sizeof(float) * dataCount, MTL::ResourceStorageModeShared);
+  auto *keptBuffer = device->newBuffer(sizeof(float) * dataCount, MTL::ResourceStorageModeShared);
+  auto *countBuffer = device->newBuffer(sizeof(uint32_t), MTL::ResourceStorageModeShared);
+  auto *argumentBuffer = IndirectDispatch::newArgumentBuffer(device);
+  assert(inBuffer && keptBuffer && countBuffer && argumentBuffer);
+
+  float *inData = static_cast<float *>(inBuffer->contents());
+  uint32_t expectedCount = 0;
+  double expectedSum = 0.0;
+  for (uint32_t i = 0; i < dataCount; ++i)
+  {
+    inData[i] = static_cast<float>((i * 7919) % 1000) / 1000.0f;
+    if (inData[i] > threshold)
+    {
+      ++expectedCount;
+      expectedSum += inData[i] * inData[i];
+    }
+  }
+
+  auto encodeFilter = [&](MTL::CommandBuffer *_commandBuffer)
+  {
+    auto blitCommandEncoder = _commandBuffer->blitCommandEncoder();
+    blitCommandEncoder->fillBuffer(countBuffer, NS::Range(0, sizeof(uint32_t)), 0);
+    blitCommandEncoder->endEncoding();
+    auto *commandEncoder = _commandBuffer->computeCommandEncoder();
+    commandEncoder->setComputePipelineState(filterPipeline);
+    commandEncoder->setBuffer(inBuffer, 0, 0);
+    commandEncoder->setBuffer(keptBuffer, 0, 1);
+    commandEncoder->setBuffer(countBuffer, 0, 2);
+    commandEncoder->setBytes(&threshold, sizeof(float), 3);
+    commandEncoder->setBytes(&dataCount, sizeof(uint32_t), 4);
+    commandEncoder->dispatchThreadgroups(MTL::Size((dataCount + threadsPerGroup - 1) / threadsPerGroup, 1, 1), MTL::Size(threadsPerGroup, 1, 1));
+    return commandEncoder;
+  };
+
+  auto check = [&](const char *_name)
+  {
+    uint32_t kept = *static_cast<uint32_t *>(countBuffer->contents());
+    double sum = 0.0;
+    float *keptData = static_cast<float *>(keptBuffer->contents());
+    for (uint32_t i = 0; i < kept; ++i)
+      sum += keptData[i];
+    if (kept != expectedCount || std::abs(sum - expectedSum) > expectedSum * 1e-5)
+    {
+      std::cerr << _name << " wrong result, kept " << kept << " expected " << expectedCount << '\n';
+      exit(EXIT_FAILURE);
+    }
+  };
+
+  using clock = std::chrono::steady_clock;
+
+  // CPU reads the count back between the two stages
+  auto start = clock::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    auto *commandBuffer = commandQueue->commandBuffer();
+    auto *commandEncoder = encodeFilter(commandBuffer);
+    commandEncoder->endEncoding();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+
+    uint32_t kept = *static_cast<uint32_t *>(countBuffer->contents());
+    commandBuffer = commandQueue->commandBuffer();
+    commandEncoder = commandBuffer->computeCommandEncoder();
+    commandEncoder->setComputePipelineState(processPipeline);
+    commandEncoder->setBuffer(keptBuffer, 0, 0);
+    commandEncoder->setBuffer(countBuffer, 0, 1);
+    commandEncoder->dispatchThreadgroups(MTL::Size((kept + threadsPerGroup - 1) / threadsPerGroup, 1, 1), MTL::Size(threadsPerGroup, 1, 1));
+    commandEncoder->endEncoding();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+  }
+  double readbackTime = std::chrono::duration<double, std::milli>(clock::now() - start).count() / iterations;
+  check("readback");
+
+  // both stages in one command buffer, the second sized by the GPU
+  start = clock::now();
+  for (int i = 0; i < iterations; ++i)
+  {
+    auto *commandBuffer = commandQueue->commandBuffer();
+    auto *commandEncoder = encodeFilter(commandBuffer);
+    indirect.encodeArguments(commandEncoder, countBuffer, 0, argumentBuffer, threadsPerGroup);
+    commandEncoder->setComputePipelineState(processPipeline);
+    commandEncoder->setBuffer(keptBuffer, 0, 0);
+    commandEncoder->setBuffer(countBuffer, 0, 1);
+    IndirectDispatch::dispatch(commandEncoder, argumentBuffer, threadsPerGroup);
+    commandEncoder->endEncoding();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+  }
+  double indirectTime = std::chrono::duration<double, std::milli>(clock::now() - start).count() / iterations;
+  check("indirect");
+
+  printf("elements %u kept %u\n", dataCount, expectedCount);
+  printf("with readback  %8.3f ms per chain\n", readbackTime);
+  printf("indirect       %8.3f ms per chain\n", indirectTime);
+  printf("speedup        %8.2fx\n", readbackTime / indirectTime);
+
+  filterFunc->release();
+  processFunc->release();
+  filterPipeline->release();
+  processPipeline->release();
+  inBuffer->release();
+  keptBuffer->release();
+  countBuffer->release();
+  argumentBuffer->release();
+  commandQueue->release();
+  library->release();
+  compileOptions->release();
+  return EXIT_SUCCESS;
+}
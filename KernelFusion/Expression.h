@@ -0,0 +1,237 @@
+#pragma once
+#include "Metal.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Small expression template library for element wise float operations.
+// Building an expression such as clamp(sqr(in(0)) + in(1) * 2.0f, 0.0f, 1.0f)
+// does no work, it just records the tree in the type. When evaluated the tree is
+// lowered to a single Metal kernel so the whole chain is one pass over memory
+// rather than one kernel (and one intermediate buffer) per operation.
+namespace fusion
+{
+
+// State gathered while lowering an expression to MSL. Constants are not baked
+// into the source but passed in a buffer so that expressions which only differ
+// by constant values share the same kernel.
+struct Lowering
+{
+  std::vector<float> constants;
+  uint32_t numInputs = 0;
+};
+
+template <typename Derived>
+struct Expr
+{
+  const Derived &self() const { return static_cast<const Derived &>(*this); }
+};
+
+// a read from input buffer _index at the current thread position
+struct Input : Expr<Input>
+{
+  explicit Input(uint32_t _index) : m_index(_index) {}
+  std::string lower(Lowering &_l) const
+  {
+    _l.numInputs = std::max(_l.numInputs, m_index + 1);
+    return "in" + std::to_string(m_index) + "[id]";
+  }
+  uint32_t m_index;
+};
+
+struct Constant : Expr<Constant>
+{
+  explicit Constant(float _value) : m_value(_value) {}
+  std::string lower(Lowering &_l) const
+  {
+    _l.constants.push_back(m_value);
+    return "k[" + std::to_string(_l.constants.size() - 1) + "]";
+  }
+  float m_value;
+};
+
+// a unary MSL function call such as sqrt(x) or abs(x), sqr is written as x*x
+template <typename A>
+struct UnaryExpr : Expr<UnaryExpr<A>>
+{
+  UnaryExpr(const char *_fn, const A &_a) : m_fn(_fn), m_a(_a) {}
+  std::string lower(Lowering &_l) const
+  {
+    auto a = m_a.lower(_l);
+    if (std::string(m_fn) == "sqr")
+      return "(" + a + "*" + a + ")";
+    return std::string(m_fn) + "(" + a + ")";
+  }
+  const char *m_fn;
+  A m_a;
+};
+
+template <typename A, typename B>
+struct BinaryExpr : Expr<BinaryExpr<A, B>>
+{
+  BinaryExpr(char _op, const A &_a, const B &_b) : m_op(_op), m_a(_a), m_b(_b) {}
+  std::string lower(Lowering &_l) const
+  {
+    auto a = m_a.lower(_l);
+    auto b = m_b.lower(_l);
+    return "(" + a + " " + m_op + " " + b + ")";
+  }
+  char m_op;
+  A m_a;
+  B m_b;
+};
+
+template <typename A, typename Lo, typename Hi>
+struct ClampExpr : Expr<ClampExpr<A, Lo, Hi>>
+{
+  ClampExpr(const A &_a, const Lo &_lo, const Hi &_hi) : m_a(_a), m_lo(_lo), m_hi(_hi) {}
+  std::string lower(Lowering &_l) const
+  {
+    auto a = m_a.lower(_l);
+    auto lo = m_lo.lower(_l);
+    auto hi = m_hi.lower(_l);
+    return "clamp(" + a + ", " + lo + ", " + hi + ")";
+  }
+  A m_a;
+  Lo m_lo;
+  Hi m_hi;
+};
+
+inline Input in(uint32_t _index) { return Input(_index); }
+
+// floats used in an expression are promoted to Constant nodes
+template <typename T>
+const T &promote(const Expr<T> &_e) { return _e.self(); }
+inline Constant promote(float _v) { return Constant(_v); }
+
+#define FUSION_BINARY_OP(OP)                                                                  \
+  template <typename A, typename B>                                                           \
+  BinaryExpr<A, B> operator OP(const Expr<A> &_a, const Expr<B> &_b)                          \
+  {                                                                                           \
+    return BinaryExpr<A, B>(#OP[0], _a.self(), _b.self());                                    \
+  }                                                                                           \
+  template <typename A>                                                                       \
+  BinaryExpr<A, Constant> operator OP(const Expr<A> &_a, float _b)                            \
+  {                                                                                           \
+    return BinaryExpr<A, Constant>(#OP[0], _a.self(), Constant(_b));                          \
+  }                                                                                           \
+  template <typename B>                                                                       \
+  BinaryExpr<Constant, B> operator OP(float _a, const Expr<B> &_b)                            \
+  {                                                                                           \
+    return BinaryExpr<Constant, B>(#OP[0], Constant(_a), _b.self());                          \
+  }
+
+FUSION_BINARY_OP(+)
+FUSION_BINARY_OP(-)
+FUSION_BINARY_OP(*)
+FUSION_BINARY_OP(/)
+#undef FUSION_BINARY_OP
+
+template <typename A>
+UnaryExpr<A> sqr(const Expr<A> &_a) { return UnaryExpr<A>("sqr", _a.self()); }
+template <typename A>
+UnaryExpr<A> sqrt(const Expr<A> &_a) { return UnaryExpr<A>("sqrt", _a.self()); }
+template <typename A>
+UnaryExpr<A> abs(const Expr<A> &_a) { return UnaryExpr<A>("abs", _a.self()); }
+
+template <typename A, typename Lo, typename Hi>
+auto clamp(const Expr<A> &_a, const Lo &_lo, const Hi &_hi)
+{
+  auto lo = promote(_lo);
+  auto hi = promote(_hi);
+  return ClampExpr<A, decltype(lo), decltype(hi)>(_a.self(), lo, hi);
+}
+
+// Generates, compiles and caches one kernel per distinct expression. The cache
+// key is the generated source, which only depends on the shape of the tree and
+// the input indices so changing constants never triggers a recompile.
+class Evaluator
+{
+public:
+  explicit Evaluator(MTL::Device *_device) : m_device(_device) {}
+  ~Evaluator()
+  {
+    for (auto &p : m_cache)
+      p.second->release();
+  }
+
+  // encode the expression into _commandBuffer writing _count elements to _out
+  template <typename E>
+  void encode(MTL::CommandBuffer *_commandBuffer, const Expr<E> &_expr, const std::vector<MTL::Buffer *> &_inputs, MTL::Buffer *_out, uint32_t _count)
+  {
+    Lowering lowering;
+    auto body = _expr.self().lower(lowering);
+    assert(_inputs.size() >= lowering.numInputs);
+    auto *pipeline = pipelineFor(generateSource(body, lowering.numInputs));
+
+    auto *commandEncoder = _commandBuffer->computeCommandEncoder();
+    commandEncoder->setComputePipelineState(pipeline);
+    for (uint32_t i = 0; i < lowering.numInputs; ++i)
+      commandEncoder->setBuffer(_inputs[i], 0, i);
+    commandEncoder->setBuffer(_out, 0, lowering.numInputs);
+    // setBytes needs at least one value even if there are no constants
+    if (lowering.constants.empty())
+      lowering.constants.push_back(0.0f);
+    commandEncoder->setBytes(lowering.constants.data(), sizeof(float) * lowering.constants.size(), lowering.numInputs + 1);
+    commandEncoder->setBytes(&_count, sizeof(uint32_t), lowering.numInputs + 2);
+    NS::UInteger threads = pipeline->maxTotalThreadsPerThreadgroup();
+    commandEncoder->dispatchThreadgroups(
+        MTL::Size((_count + threads - 1) / threads, 1, 1),
+        MTL::Size(threads, 1, 1));
+    commandEncoder->endEncoding();
+  }
+
+  size_t cacheSize() const { return m_cache.size(); }
+  size_t compiles() const { return m_compiles; }
+
+  static std::string generateSource(const std::string &_body, uint32_t _numInputs)
+  {
+    std::string src = "#include <metal_stdlib>\nusing namespace metal;\n\nkernel void fused(\n";
+    for (uint32_t i = 0; i < _numInputs; ++i)
+      src += "    const device float *in" + std::to_string(i) + " [[ buffer(" + std::to_string(i) + ") ]],\n";
+    src += "    device float *vOut [[ buffer(" + std::to_string(_numInputs) + ") ]],\n";
+    src += "    constant float *k [[ buffer(" + std::to_string(_numInputs + 1) + ") ]],\n";
+    src += "    constant uint &count [[ buffer(" + std::to_string(_numInputs + 2) + ") ]],\n";
+    src += "    uint id [[ thread_position_in_grid ]])\n{\n";
+    src += "    if (id >= count) return;\n";
+    src += "    vOut[id] = " + _body + ";\n}\n";
+    return src;
+  }
+
+private:
+  MTL::ComputePipelineState *pipelineFor(const std::string &_source)
+  {
+    auto it = m_cache.find(_source);
+    if (it != m_cache.end())
+      return it->second;
+
+    auto *compileOptions = MTL::CompileOptions::alloc()->init();
+    compileOptions->setFastMathEnabled(true);
+    NS::Error *errorMessages = nullptr;
+    auto *library = m_device->newLibrary(NS::String::string(_source.c_str(), NS::ASCIIStringEncoding), compileOptions, &errorMessages);
+    if (!library)
+    {
+      std::cerr << "Unable to compile fused kernel\n" << _source << '\n' << errorMessages->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    auto *fn = library->newFunction(NS::String::string("fused", NS::ASCIIStringEncoding));
+    auto *pipeline = m_device->newComputePipelineState(fn, &errorMessages);
+    assert(pipeline);
+    fn->release();
+    library->release();
+    compileOptions->release();
+    ++m_compiles;
+    m_cache[_source] = pipeline;
+    return pipeline;
+  }
+
+  MTL::Device *m_device;
+  std::unordered_map<std::string, MTL::ComputePipelineState *> m_cache;
+  size_t m_compiles = 0;
+};
+
+} // end namespace fusion
@@ -0,0 +1,309 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "MeshLoader.h"
+#include "VertexLayout.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// usage : MeshLoader [mesh.obj | mesh.ply]
+// Loads a mesh, welding it into indexed vertices, and draws it at each step of
+// optimising it: as a non indexed triangle soup (how Triangle and SDL draw),
+// indexed in file order, with the triangles reordered for the vertex cache,
+// then for overdraw, then the vertices reordered for fetch. Reports the ACMR
+// and ATVR (vertices transformed per triangle, and per vertex in the mesh)
+// for a 16 entry FIFO cache and the GPU time to draw it.
+//
+// Without a file a torus knot is written out as a binary PLY triangle soup
+// in shuffled order, the worst case for all of these, and loaded back.
+
+const char *shaderSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  struct VertexIn
+  {
+    float3 position [[attribute(0)]];
+    float3 normal [[attribute(1)]];
+  };
+
+  struct RasteriserData
+  {
+    float4 position [[position]];
+    float3 normal;
+  };
+
+  // packed so it is the same 20 bytes as the C++ struct
+  struct Uniforms
+  {
+    packed_float3 centre;
+    float scale;
+    float angle;
+  };
+
+  vertex RasteriserData vertFunc(VertexIn in [[stage_in]], constant Uniforms &u [[buffer(1)]])
+  {
+    float c = cos(u.angle);
+    float s = sin(u.angle);
+    float3 p = (in.position - u.centre) * u.scale;
+    RasteriserData out;
+    out.position = float4(p.x * c - p.z * s, p.y, (p.x * s + p.z * c) * 0.5f + 0.5f, 1.0f);
+    out.normal = float3(in.normal.x * c - in.normal.z * s, in.normal.y, in.normal.x * s + in.normal.z * c);
+    return out;
+  }
+
+  // a little more than nothing per fragment so overdraw costs something
+  fragment float4 fragFunc(RasteriserData in [[stage_in]])
+  {
+    float3 n = normalize(in.normal);
+    float3 l = normalize(float3(0.4f, 0.7f, -1.0f));
+    float3 h = normalize(l + float3(0.0f, 0.0f, -1.0f));
+    float light = 0.1f + max(dot(n, l), 0.0f) + pow(max(dot(n, h), 0.0f), 32.0f);
+    return float4(float3(0.8f, 0.5f, 0.3f) * light, 1.0f);
+  }
+)""";
+
+struct Uniforms
+{
+  float centre[3];
+  float scale;
+  float angle;
+};
+static_assert(sizeof(Uniforms) == 20, "Uniforms must match the shader's packed layout");
+
+constexpr int views = 4;
+constexpr int frames = 30;
+constexpr int size = 1024;
+
+// a (3, 7) torus knot tube as a triangle soup, three vertices a triangle and
+// nothing shared, in random order
+void writeKnot(const std::string &_path)
+{
+  constexpr int rings = 2048;
+  constexpr int sides = 64;
+  auto centre = [](float _t, float *o_p) {
+    float r = 2.0f + std::cos(7.0f * _t);
+    o_p[0] = r * std::cos(3.0f * _t);
+    o_p[1] = r * std::sin(3.0f * _t);
+    o_p[2] = std::sin(7.0f * _t);
+  };
+  std::vector<float> grid(size_t(rings) * sides * 3);
+  for (int i = 0; i < rings; ++i)
+  {
+    float t = 6.2831853f * float(i) / rings;
+    float p[3], q[3];
+    centre(t, p);
+    centre(t + 0.001f, q);
+    // a frame around the tangent to sweep the tube with
+    float tangent[3] = {q[0] - p[0], q[1] - p[1], q[2] - p[2]};
+    float length = std::sqrt(tangent[0] * tangent[0] + tangent[1] * tangent[1] + tangent[2] * tangent[2]);
+    for (float &c : tangent)
+      c /= length;
+    float side[3] = {tangent[1], -tangent[0], 0.0f};
+    length = std::sqrt(side[0] * side[0] + side[1] * side[1]);
+    for (float &c : side)
+      c /= length;
+    float up[3] = {tangent[1] * side[2] - tangent[2] * side[1], tangent[2] * side[0] - tangent[0] * side[2], tangent[0] * side[1] - tangent[1] * side[0]};
+    for (int j = 0; j < sides; ++j)
+    {
+      float a = 6.2831853f * float(j) / sides;
+      for (int c = 0; c < 3; ++c)
+        grid[(size_t(i) * sides + j) * 3 + c] = p[c] + 0.35f * (std::cos(a) * side[c] + std::sin(a) * up[c]);
+    }
+  }
+  std::vector<std::array<uint32_t, 3>> triangles;
+  for (uint32_t i = 0; i < rings; ++i)
+    for (uint32_t j = 0; j < sides; ++j)
+    {
+      uint32_t a = i * sides + j;
+      uint32_t b = i * sides + (j + 1) % sides;
+      uint32_t c = (i + 1) % rings * sides + j;
+      uint32_t d = (i + 1) % rings * sides + (j + 1) % sides;
+      triangles.push_back({a, c, b});
+      triangles.push_back({b, c, d});
+    }
+  std::mt19937 rng(3);
+  std::shuffle(triangles.begin(), triangles.end(), rng);
+
+  std::ofstream file(_path, std::ios::binary);
+  file << "ply\nformat binary_little_endian 1.0\n"
+       << "element vertex " << triangles.size() * 3 << "\nproperty float x\nproperty float y\nproperty float z\n"
+       << "element face " << triangles.size() << "\nproperty list uchar uint vertex_indices\nend_header\n";
+  for (const auto &t : triangles)
+    for (uint32_t v : t)
+      file.write(reinterpret_cast<const char *>(&grid[v * 3]), 3 * sizeof(float));
+  for (uint32_t t = 0; t < triangles.size(); ++t)
+  {
+    uint8_t count = 3;
+    uint32_t face[3] = {t * 3, t * 3 + 1, t * 3 + 2};
+    file.write(reinterpret_cast<const char *>(&count), 1);
+    file.write(reinterpret_cast<const char *>(face), sizeof(face));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  std::string path;
+  if (argc > 1)
+    path = argv[1];
+  else
+  {
+    path = (std::filesystem::temp_directory_path() / "knot.ply").string();
+    writeKnot(path);
+  }
+  MeshData mesh;
+  auto start = std::chrono::steady_clock::now();
+  if (!meshtools::load(path, &mesh))
+    exit(EXIT_FAILURE);
+  double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  if (argc == 1)
+    std::filesystem::remove(path);
+  printf("%s: %zu triangles, welded to %zu vertices in %.1f ms\n", path.c_str(), mesh.triangleCount(), mesh.vertexCount(), loadMs);
+
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = device->newLibrary(NS::String::string(shaderSource, NS::UTF8StringEncoding), nullptr, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to compile shaders " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+  VertexLayout layout;
+  layout.add(MTL::VertexFormatFloat3).add(MTL::VertexFormatInt1010102Normalized);
+  auto *desc = MTL::RenderPipelineDescriptor::alloc()->init();
+  desc->setVertexFunction(vertFunc);
+  desc->setFragmentFunction(fragFunc);
+  desc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  desc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+  auto *vertexDesc = layout.newDescriptor(0);
+  desc->setVertexDescriptor(vertexDesc);
+  vertexDesc->release();
+  auto *pipeline = device->newRenderPipelineState(desc, &errorMessages);
+  assert(pipeline);
+  desc->release();
+  auto *depthDesc = MTL::DepthStencilDescriptor::alloc()->init();
+  depthDesc->setDepthCompareFunction(MTL::CompareFunctionLess);
+  depthDesc->setDepthWriteEnabled(true);
+  auto *depthState = device->newDepthStencilState(depthDesc);
+  depthDesc->release();
+  auto *colourDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, size, size, false);
+  colourDesc->setUsage(MTL::TextureUsageRenderTarget);
+  colourDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *colourTexture = device->newTexture(colourDesc);
+  auto *depthTextureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatDepth32Float, size, size, false);
+  depthTextureDesc->setUsage(MTL::TextureUsageRenderTarget);
+  depthTextureDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *depthTexture = device->newTexture(depthTextureDesc);
+  auto *commandQueue = device->newCommandQueue();
+
+  // fit the mesh to the view
+  Uniforms uniforms = {{0.0f, 0.0f, 0.0f}, 1.0f, 0.0f};
+  float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+  for (size_t v = 0; v < mesh.vertexCount(); ++v)
+    for (int c = 0; c < 3; ++c)
+    {
+      lo[c] = std::min(lo[c], mesh.positions[v * 3 + c]);
+      hi[c] = std::max(hi[c], mesh.positions[v * 3 + c]);
+    }
+  float extent = 0.0f;
+  for (int c = 0; c < 3; ++c)
+  {
+    uniforms.centre[c] = (lo[c] + hi[c]) * 0.5f;
+    extent = std::max(extent, hi[c] - lo[c]);
+  }
+  uniforms.scale = extent > 0.0f ? 1.6f / extent : 1.0f;
+
+  // GPU ms a frame, drawing from a few angles, _draw encodes one draw
+  auto timeFrames = [&](const std::function<void(MTL::RenderCommandEncoder *)> &_draw) {
+    double gpuMs = 0.0;
+    for (int frame = 0; frame < frames; ++frame)
+    {
+      auto *pool = NS::AutoreleasePool::alloc()->init();
+      auto *commandBuffer = commandQueue->commandBuffer();
+      auto *passDesc = MTL::RenderPassDescriptor::alloc()->init();
+      auto *colour = passDesc->colorAttachments()->object(0);
+      colour->setTexture(colourTexture);
+      colour->setLoadAction(MTL::LoadActionClear);
+      colour->setStoreAction(MTL::StoreActionStore);
+      auto *depth = passDesc->depthAttachment();
+      depth->setTexture(depthTexture);
+      depth->setLoadAction(MTL::LoadActionClear);
+      depth->setStoreAction(MTL::StoreActionDontCare);
+      auto *encoder = commandBuffer->renderCommandEncoder(passDesc);
+      encoder->setRenderPipelineState(pipeline);
+      encoder->setDepthStencilState(depthState);
+      encoder->setCullMode(MTL::CullModeNone);
+      for (int view = 0; view < views; ++view)
+      {
+        uniforms.angle = 6.2831853f * float(view) / views;
+        encoder->setVertexBytes(&uniforms, sizeof(Uniforms), 1);
+        _draw(encoder);
+      }
+      encoder->endEncoding();
+      commandBuffer->commit();
+      commandBuffer->waitUntilCompleted();
+      gpuMs += (commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime()) * 1000.0;
+      passDesc->release();
+      pool->release();
+    }
+    return gpuMs / frames;
+  };
+
+  printf("%-16s %10s %8s %8s %8s %12s %10s\n", "", "vertices", "index", "ACMR", "ATVR", "optimise ms", "gpu ms");
+  // the soup, every triangle's vertices written out in full
+  {
+    MeshData soup;
+    for (uint32_t i : mesh.indices)
+    {
+      soup.positions.insert(soup.positions.end(), &mesh.positions[i * 3], &mesh.positions[i * 3 + 3]);
+      soup.normals.insert(soup.normals.end(), &mesh.normals[i * 3], &mesh.normals[i * 3 + 3]);
+    }
+    auto *buffer = device->newBuffer(layout.stride() * soup.vertexCount(), MTL::ResourceStorageModeShared);
+    layout.pack({soup.positions.data(), soup.normals.data()}, soup.vertexCount(), buffer->contents());
+    double gpuMs = timeFrames([&](MTL::RenderCommandEncoder *_encoder) {
+      _encoder->setVertexBuffer(buffer, 0, 0);
+      _encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, NS::UInteger(0), NS::UInteger(soup.vertexCount()));
+    });
+    printf("%-16s %10zu %8s %8.3f %8.3f %12s %10.3f\n", "soup", soup.vertexCount(), "none", 3.0, 1.0, "", gpuMs);
+    buffer->release();
+  }
+
+  auto report = [&](const char *_name, double _optimiseMs) {
+    IndexedMesh gpuMesh(device, mesh, layout);
+    double gpuMs = timeFrames([&gpuMesh](MTL::RenderCommandEncoder *_encoder) { gpuMesh.draw(_encoder); });
+    double acmr = meshtools::acmr(mesh.indices, mesh.vertexCount());
+    printf("%-16s %10zu %8s %8.3f %8.3f %12.1f %10.3f\n", _name, mesh.vertexCount(), gpuMesh.indexType() == MTL::IndexTypeUInt16 ? "16 bit" : "32 bit",
+           acmr, acmr * double(mesh.triangleCount()) / double(mesh.vertexCount()), _optimiseMs, gpuMs);
+  };
+  auto timed = [](const std::function<void()> &_f) {
+    auto start = std::chrono::steady_clock::now();
+    _f();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  };
+  report("indexed", 0.0);
+  report("+ vertex cache", timed([&mesh] { meshtools::optimiseVertexCache(mesh.indices, mesh.vertexCount()); }));
+  report("+ overdraw", timed([&mesh] { meshtools::optimiseOverdraw(mesh.indices, mesh.positions); }));
+  report("+ vertex fetch", timed([&mesh] { meshtools::optimiseVertexFetch(mesh); }));
+
+  commandQueue->release();
+  depthTexture->release();
+  colourTexture->release();
+  depthState->release();
+  pipeline->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
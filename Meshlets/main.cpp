@@ -0,0 +1,288 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "MeshLoader.h"
+#include "Meshlets.h"
+#include "VertexLayout.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// usage : Meshlets [mesh.obj | mesh.ply]
+// A dense mesh split into meshlets of up to 64 vertices and 124 triangles,
+// drawn by a camera orbiting close enough that part of it is always out of
+// view. Each frame is drawn three ways: every triangle, with a compute pass
+// that drops the meshlets outside the frustum before an indirect draw of the
+// rest, and with the normal cone test as well, which also drops the meshlets
+// that face away from the camera. Reports the meshlets and triangles drawn
+// and culled per frame and the GPU time, cull pass included.
+//
+// Without a file a million triangle torus knot is used.
+
+const char *shaderSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  struct VertexIn
+  {
+    float3 position [[attribute(0)]];
+    float3 normal [[attribute(1)]];
+  };
+
+  struct RasteriserData
+  {
+    float4 position [[position]];
+    float3 normal;
+  };
+
+  vertex RasteriserData vertFunc(VertexIn in [[stage_in]], constant float4x4 &viewProjection [[buffer(1)]])
+  {
+    RasteriserData out;
+    out.position = viewProjection * float4(in.position, 1.0f);
+    out.normal = in.normal;
+    return out;
+  }
+
+  fragment float4 fragFunc(RasteriserData in [[stage_in]])
+  {
+    float light = 0.15f + max(dot(normalize(in.normal), normalize(float3(0.4f, 0.7f, 0.6f))), 0.0f);
+    return float4(float3(0.8f, 0.5f, 0.3f) * light, 1.0f);
+  }
+)""";
+
+constexpr int frames = 60;
+constexpr int size = 1024;
+
+// a (3, 7) torus knot tube, wound counter clockwise seen from outside
+void makeKnot(MeshData *o_mesh)
+{
+  constexpr int rings = 4096;
+  constexpr int sides = 128;
+  auto centre = [](float _t, float *o_p) {
+    float r = 2.0f + std::cos(7.0f * _t);
+    o_p[0] = r * std::cos(3.0f * _t);
+    o_p[1] = r * std::sin(3.0f * _t);
+    o_p[2] = std::sin(7.0f * _t);
+  };
+  for (int i = 0; i < rings; ++i)
+  {
+    float t = 6.2831853f * float(i) / rings;
+    float p[3], q[3];
+    centre(t, p);
+    centre(t + 0.001f, q);
+    float tangent[3] = {q[0] - p[0], q[1] - p[1], q[2] - p[2]};
+    float length = std::sqrt(tangent[0] * tangent[0] + tangent[1] * tangent[1] + tangent[2] * tangent[2]);
+    for (float &c : tangent)
+      c /= length;
+    float side[3] = {tangent[1], -tangent[0], 0.0f};
+    length = std::sqrt(side[0] * side[0] + side[1] * side[1]);
+    for (float &c : side)
+      c /= length;
+    float up[3] = {tangent[1] * side[2] - tangent[2] * side[1], tangent[2] * side[0] - tangent[0] * side[2], tangent[0] * side[1] - tangent[1] * side[0]};
+    for (int j = 0; j < sides; ++j)
+    {
+      float a = 6.2831853f * float(j) / sides;
+      for (int c = 0; c < 3; ++c)
+        o_mesh->positions.push_back(p[c] + 0.35f * (std::cos(a) * side[c] + std::sin(a) * up[c]));
+    }
+  }
+  for (uint32_t i = 0; i < rings; ++i)
+    for (uint32_t j = 0; j < sides; ++j)
+    {
+      uint32_t a = i * sides + j;
+      uint32_t b = i * sides + (j + 1) % sides;
+      uint32_t c = (i + 1) % rings * sides + j;
+      uint32_t d = (i + 1) % rings * sides + (j + 1) % sides;
+      o_mesh->indices.insert(o_mesh->indices.end(), {a, b, c, b, d, c});
+    }
+}
+
+// column major like float4x4, _a * _b
+void multiply(const float *_a, const float *_b, float *o_m)
+{
+  for (int c = 0; c < 4; ++c)
+    for (int r = 0; r < 4; ++r)
+    {
+      float sum = 0.0f;
+      for (int k = 0; k < 4; ++k)
+        sum += _a[k * 4 + r] * _b[c * 4 + k];
+      o_m[c * 4 + r] = sum;
+    }
+}
+
+// looking from _eye at _target with y up, with Metal's 0 to 1 depth range
+void setCamera(const float *_eye, const float *_target, float _far, float *o_viewProjection)
+{
+  const float nearZ = 0.01f * _far;
+  const float ys = 1.0f / std::tan(0.5f * 60.0f * float(M_PI) / 180.0f);
+  const float zs = _far / (nearZ - _far);
+  const float projection[16] = {ys, 0, 0, 0, 0, ys, 0, 0, 0, 0, zs, -1, 0, 0, zs * nearZ, 0};
+  float f[3] = {_target[0] - _eye[0], _target[1] - _eye[1], _target[2] - _eye[2]};
+  float length = std::sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+  for (float &c : f)
+    c /= length;
+  float s[3] = {-f[2], 0.0f, f[0]};
+  length = std::sqrt(s[0] * s[0] + s[2] * s[2]);
+  for (float &c : s)
+    c /= length;
+  float u[3] = {s[1] * f[2] - s[2] * f[1], s[2] * f[0] - s[0] * f[2], s[0] * f[1] - s[1] * f[0]};
+  auto dot = [_eye](const float *_v) { return _v[0] * _eye[0] + _v[1] * _eye[1] + _v[2] * _eye[2]; };
+  const float view[16] = {s[0], u[0], -f[0], 0, s[1], u[1], -f[1], 0, s[2], u[2], -f[2], 0, -dot(s), -dot(u), dot(f), 1};
+  multiply(projection, view, o_viewProjection);
+}
+
+int main(int argc, char *argv[])
+{
+  MeshData mesh;
+  if (argc > 1)
+  {
+    if (!meshtools::load(argv[1], &mesh))
+      exit(EXIT_FAILURE);
+  }
+  else
+  {
+    makeKnot(&mesh);
+    meshtools::computeNormals(mesh);
+  }
+  // the cull pass writes indices meshlet by meshlet, built from a cache
+  // optimised mesh they keep most of its order
+  auto start = std::chrono::steady_clock::now();
+  meshtools::optimise(mesh);
+  auto meshlets = meshtools::buildMeshlets(mesh);
+  double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  size_t coneless = std::count_if(meshlets.meshlets.begin(), meshlets.meshlets.end(), [](const Meshlet &_m) { return _m.coneAxisCutoff[3] >= 1.0f; });
+  printf("%zu triangles, %zu vertices in %zu meshlets (%.1f vertices, %.1f triangles each, %zu too curved to cone cull), built in %.1f ms\n",
+         mesh.triangleCount(), mesh.vertexCount(), meshlets.meshlets.size(), double(meshlets.vertices.size()) / meshlets.meshlets.size(),
+         double(meshlets.triangleCount()) / meshlets.meshlets.size(), coneless, buildMs);
+
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = device->newLibrary(NS::String::string(shaderSource, NS::UTF8StringEncoding), nullptr, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to compile shaders " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+  VertexLayout layout;
+  layout.add(MTL::VertexFormatFloat3).add(MTL::VertexFormatInt1010102Normalized);
+  auto *desc = MTL::RenderPipelineDescriptor::alloc()->init();
+  desc->setVertexFunction(vertFunc);
+  desc->setFragmentFunction(fragFunc);
+  desc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  desc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+  auto *vertexDesc = layout.newDescriptor(0);
+  desc->setVertexDescriptor(vertexDesc);
+  vertexDesc->release();
+  auto *pipeline = device->newRenderPipelineState(desc, &errorMessages);
+  assert(pipeline);
+  desc->release();
+  auto *depthDesc = MTL::DepthStencilDescriptor::alloc()->init();
+  depthDesc->setDepthCompareFunction(MTL::CompareFunctionLess);
+  depthDesc->setDepthWriteEnabled(true);
+  auto *depthState = device->newDepthStencilState(depthDesc);
+  depthDesc->release();
+  auto *colourDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, size, size, false);
+  colourDesc->setUsage(MTL::TextureUsageRenderTarget);
+  colourDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *colourTexture = device->newTexture(colourDesc);
+  auto *depthTextureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatDepth32Float, size, size, false);
+  depthTextureDesc->setUsage(MTL::TextureUsageRenderTarget);
+  depthTextureDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *depthTexture = device->newTexture(depthTextureDesc);
+  auto *commandQueue = device->newCommandQueue();
+  MeshletMesh gpuMesh(device, mesh, meshlets, layout);
+
+  // orbit inside the bounding box's reach so some of the mesh is behind or
+  // beside the camera
+  float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+  for (size_t v = 0; v < mesh.vertexCount(); ++v)
+    for (int c = 0; c < 3; ++c)
+    {
+      lo[c] = std::min(lo[c], mesh.positions[v * 3 + c]);
+      hi[c] = std::max(hi[c], mesh.positions[v * 3 + c]);
+    }
+  float centre[3];
+  float extent = 0.0f;
+  for (int c = 0; c < 3; ++c)
+  {
+    centre[c] = (lo[c] + hi[c]) * 0.5f;
+    extent = std::max(extent, hi[c] - lo[c]);
+  }
+
+  enum class Mode
+  {
+    All,
+    Frustum,
+    FrustumCone
+  };
+  printf("%-16s %10s %12s %12s %8s %10s\n", "", "meshlets", "triangles", "culled", "culled", "gpu ms");
+  for (auto mode : {Mode::All, Mode::Frustum, Mode::FrustumCone})
+  {
+    double gpuMs = 0.0;
+    double drawnMeshlets = 0.0;
+    double drawnTriangles = 0.0;
+    for (int frame = 0; frame < frames; ++frame)
+    {
+      auto *pool = NS::AutoreleasePool::alloc()->init();
+      float angle = 6.2831853f * float(frame) / frames;
+      float eye[3] = {centre[0] + 0.6f * extent * std::cos(angle), centre[1] + 0.2f * extent, centre[2] + 0.6f * extent * std::sin(angle)};
+      float viewProjection[16];
+      setCamera(eye, centre, extent * 2.0f, viewProjection);
+      auto *commandBuffer = commandQueue->commandBuffer();
+      if (mode != Mode::All)
+        gpuMesh.cull(commandBuffer, 0, viewProjection, eye, mode == Mode::FrustumCone);
+      auto *passDesc = MTL::RenderPassDescriptor::alloc()->init();
+      auto *colour = passDesc->colorAttachments()->object(0);
+      colour->setTexture(colourTexture);
+      colour->setLoadAction(MTL::LoadActionClear);
+      colour->setStoreAction(MTL::StoreActionStore);
+      auto *depth = passDesc->depthAttachment();
+      depth->setTexture(depthTexture);
+      depth->setLoadAction(MTL::LoadActionClear);
+      depth->setStoreAction(MTL::StoreActionDontCare);
+      auto *encoder = commandBuffer->renderCommandEncoder(passDesc);
+      encoder->setRenderPipelineState(pipeline);
+      encoder->setDepthStencilState(depthState);
+      encoder->setFrontFacingWinding(MTL::WindingCounterClockwise);
+      encoder->setCullMode(MTL::CullModeBack);
+      encoder->setVertexBytes(viewProjection, sizeof(viewProjection), 1);
+      if (mode == Mode::All)
+        gpuMesh.drawAll(encoder);
+      else
+        gpuMesh.draw(encoder, 0);
+      encoder->endEncoding();
+      commandBuffer->commit();
+      commandBuffer->waitUntilCompleted();
+      gpuMs += (commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime()) * 1000.0;
+      auto stats = gpuMesh.stats(0);
+      drawnMeshlets += mode == Mode::All ? stats.meshlets : stats.visibleMeshlets;
+      drawnTriangles += mode == Mode::All ? stats.triangles : stats.visibleTriangles;
+      passDesc->release();
+      pool->release();
+    }
+    drawnMeshlets /= frames;
+    drawnTriangles /= frames;
+    double culled = double(gpuMesh.triangleCount()) - drawnTriangles;
+    const char *names[] = {"all", "frustum", "frustum + cone"};
+    printf("%-16s %10.0f %12.0f %12.0f %7.1f%% %10.3f\n", names[int(mode)], drawnMeshlets, drawnTriangles, culled,
+           100.0 * culled / double(gpuMesh.triangleCount()), gpuMs / frames);
+  }
+
+  commandQueue->release();
+  depthTexture->release();
+  colourTexture->release();
+  depthState->release();
+  pipeline->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+#define CA_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+
+// Checks the CA::MetalLayer and CA::MetalDrawable wrappers in Metal.hpp
+// without a Mac. The Objective-C runtime is replaced by a stub: selectors are
+// interned strings, classes are dummy objects looked up by name, and
+// objc_msgSend records the receiver, selector and argument registers of each
+// message and returns whatever the test set up. Each wrapper is then called
+// and checked for sending the right selector to the right object with the
+// right arguments, and for handing back the return value unchanged.
+//
+// Metal.hpp passes arguments and takes results the way the real
+// objc_msgSend is called, so the stub is x86-64 System V only: self and _cmd
+// in rdi and rsi, integer arguments after them, CGSize in xmm0 and xmm1, and
+// the result in rax or xmm0 and xmm1.
+
+#if !defined(__x86_64__) || defined(__APPLE__)
+#error "the stub runtime is for x86-64 Linux"
+#endif
+
+struct objc_class
+{
+  const char *name;
+};
+
+// the last message sent
+struct Message
+{
+  const void *receiver = nullptr;
+  const char *selector = "";
+  uint64_t integers[4] = {};
+  double floats[2] = {};
+};
+
+Message lastMessage;
+
+extern "C"
+{
+  // loaded into rax, xmm0 and xmm1 by objc_msgSend before it returns
+  uint64_t stubIntegerResult = 0;
+  double stubFloatResults[2] = {};
+
+  // objc_msgSend calls this with its registers untouched, so the parameters
+  // line up with the ones the message was sent with
+  void stubRecord(const void *_receiver, SEL _selector, uint64_t _a, uint64_t _b, uint64_t _c, uint64_t _d, double _x, double _y)
+  {
+    lastMessage.receiver = _receiver;
+    lastMessage.selector = sel_getName(_selector);
+    lastMessage.integers[0] = _a;
+    lastMessage.integers[1] = _b;
+    lastMessage.integers[2] = _c;
+    lastMessage.integers[3] = _d;
+    lastMessage.floats[0] = _x;
+    lastMessage.floats[1] = _y;
+  }
+
+  SEL sel_registerName(const char *_name)
+  {
+    // function static so it exists for the selectors Metal.hpp registers
+    // while initialising its globals
+    static std::set<std::string> names;
+    return reinterpret_cast<SEL>(const_cast<char *>(names.insert(_name).first->c_str()));
+  }
+
+  const char *sel_getName(SEL _selector) { return reinterpret_cast<const char *>(_selector); }
+
+  id objc_lookUpClass(const char *_name)
+  {
+    static objc_class metalLayer{"CAMetalLayer"};
+    return std::strcmp(_name, metalLayer.name) == 0 ? reinterpret_cast<id>(&metalLayer) : nullptr;
+  }
+
+  Protocol *objc_getProtocol(const char *) { return nullptr; }
+  bool class_respondsToSelector(Class, SEL) { return true; }
+  Class object_getClass(id) { return nullptr; }
+}
+
+asm(R"(
+  .text
+  .globl objc_msgSend
+  .type objc_msgSend, @function
+objc_msgSend:
+  sub $8, %rsp
+  call stubRecord
+  mov stubIntegerResult(%rip), %rax
+  movsd stubFloatResults(%rip), %xmm0
+  movsd stubFloatResults+8(%rip), %xmm1
+  add $8, %rsp
+  ret
+  .globl objc_msgSend_fpret
+  .set objc_msgSend_fpret, objc_msgSend
+  .globl objc_msgSend_stret
+  .set objc_msgSend_stret, objc_msgSend
+)");
+
+int failures = 0;
+
+void check(const char *_wrapper, const void *_receiver, const char *_selector, bool _ok)
+{
+  bool sent = lastMessage.receiver == _receiver && std::strcmp(lastMessage.selector, _selector) == 0;
+  printf("%-50s %-32s %s\n", _wrapper, lastMessage.selector, sent && _ok ? "ok" : "FAILED");
+  if (!sent || !_ok)
+    ++failures;
+  lastMessage = Message();
+}
+
+// the pointer the next message returns
+template <typename T>
+T *returning(uintptr_t _address)
+{
+  stubIntegerResult = _address;
+  return reinterpret_cast<T *>(_address);
+}
+
+int main()
+{
+  auto *layerClass = objc_lookUpClass("CAMetalLayer");
+  auto *layer = returning<CA::MetalLayer>(0x1000);
+  check("CA::MetalLayer::layer()", layerClass, "layer", CA::MetalLayer::layer() == layer);
+
+  auto *device = returning<MTL::Device>(0x2000);
+  check("CA::MetalLayer::device()", layer, "device", layer->device() == device);
+  layer->setDevice(device);
+  check("CA::MetalLayer::setDevice()", layer, "setDevice:", lastMessage.integers[0] == 0x2000);
+
+  stubIntegerResult = MTL::PixelFormatBGRA8Unorm_sRGB;
+  check("CA::MetalLayer::pixelFormat()", layer, "pixelFormat", layer->pixelFormat() == MTL::PixelFormatBGRA8Unorm_sRGB);
+  layer->setPixelFormat(MTL::PixelFormatRGBA16Float);
+  check("CA::MetalLayer::setPixelFormat()", layer, "setPixelFormat:", lastMessage.integers[0] == MTL::PixelFormatRGBA16Float);
+
+  stubIntegerResult = 1;
+  check("CA::MetalLayer::framebufferOnly()", layer, "framebufferOnly", layer->framebufferOnly());
+  layer->setFramebufferOnly(true);
+  // a bool only fills the bottom byte of its register
+  check("CA::MetalLayer::setFramebufferOnly()", layer, "setFramebufferOnly:", (lastMessage.integers[0] & 0xff) == 1);
+
+  stubFloatResults[0] = 1280.0;
+  stubFloatResults[1] = 720.0;
+  auto size = layer->drawableSize();
+  check("CA::MetalLayer::drawableSize()", layer, "drawableSize", size.width == 1280.0 && size.height == 720.0);
+  layer->setDrawableSize(CGSize{1920.0, 1080.0});
+  check("CA::MetalLayer::setDrawableSize()", layer, "setDrawableSize:", lastMessage.floats[0] == 1920.0 && lastMessage.floats[1] == 1080.0);
+
+  stubIntegerResult = 3;
+  check("CA::MetalLayer::maximumDrawableCount()", layer, "maximumDrawableCount", layer->maximumDrawableCount() == 3);
+  layer->setMaximumDrawableCount(2);
+  check("CA::MetalLayer::setMaximumDrawableCount()", layer, "setMaximumDrawableCount:", lastMessage.integers[0] == 2);
+
+  stubIntegerResult = 0;
+  check("CA::MetalLayer::displaySyncEnabled()", layer, "displaySyncEnabled", !layer->displaySyncEnabled());
+  layer->setDisplaySyncEnabled(false);
+  check("CA::MetalLayer::setDisplaySyncEnabled()", layer, "setDisplaySyncEnabled:", (lastMessage.integers[0] & 0xff) == 0);
+
+  stubIntegerResult = 1;
+  check("CA::MetalLayer::allowsNextDrawableTimeout()", layer, "allowsNextDrawableTimeout", layer->allowsNextDrawableTimeout());
+  layer->setAllowsNextDrawableTimeout(true);
+  check("CA::MetalLayer::setAllowsNextDrawableTimeout()", layer, "setAllowsNextDrawableTimeout:", (lastMessage.integers[0] & 0xff) == 1);
+
+  auto *drawable = returning<CA::MetalDrawable>(0x3000);
+  check("CA::MetalLayer::nextDrawable()", layer, "nextDrawable", layer->nextDrawable() == drawable);
+  auto *texture = returning<MTL::Texture>(0x4000);
+  check("CA::MetalDrawable::texture()", drawable, "texture", drawable->texture() == texture);
+  returning<CA::MetalLayer>(0x1000);
+  check("CA::MetalDrawable::layer()", drawable, "layer", drawable->layer() == layer);
+
+  printf("%d failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,22 @@
+#pragma once
+// CoreFoundation.h brings in the C headers Metal.hpp relies on
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <dispatch/dispatch.h>
+
+typedef double CFTimeInterval;
+typedef long CFIndex;
+typedef unsigned long CFHashCode;
+typedef signed long CFComparisonResult;
+typedef const void *CFTypeRef;
+typedef const struct __CFString *CFStringRef;
+typedef struct __CFRunLoop *CFRunLoopRef;
+typedef struct
+{
+  CFIndex location;
+  CFIndex length;
+} CFRange;
+#define CF_ENUM(_type, _name) enum _name : _type
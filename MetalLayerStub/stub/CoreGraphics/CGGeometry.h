@@ -0,0 +1,8 @@
+#pragma once
+
+typedef double CGFloat;
+struct CGSize
+{
+  CGFloat width;
+  CGFloat height;
+};
@@ -0,0 +1,6 @@
+#pragma once
+#include <cstddef>
+
+typedef struct dispatch_data_s *dispatch_data_t;
+typedef struct dispatch_queue_s *dispatch_queue_t;
+typedef void (*dispatch_block_t)(void);
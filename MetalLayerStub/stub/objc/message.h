@@ -0,0 +1,10 @@
+#pragma once
+#include "runtime.h"
+
+// Metal.hpp casts these to the signature of each message before calling them
+extern "C"
+{
+  void objc_msgSend();
+  void objc_msgSend_stret();
+  void objc_msgSend_fpret();
+}
@@ -0,0 +1,27 @@
+#pragma once
+// the parts of the Objective-C runtime Metal.hpp uses, implemented by the test
+#include <cstddef>
+
+struct objc_object
+{
+};
+struct objc_class;
+struct objc_selector;
+typedef objc_object *id;
+typedef objc_selector *SEL;
+typedef objc_class *Class;
+typedef objc_object Protocol;
+typedef bool BOOL;
+#define nil nullptr
+#define YES true
+#define NO false
+
+extern "C"
+{
+  SEL sel_registerName(const char *_name);
+  const char *sel_getName(SEL _selector);
+  id objc_lookUpClass(const char *_name);
+  Protocol *objc_getProtocol(const char *_name);
+  bool class_respondsToSelector(Class _class, SEL _selector);
+  Class object_getClass(id _object);
+}
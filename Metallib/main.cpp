@@ -0,0 +1,151 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "MetallibLoader.h"
+#include "ShaderSource.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+// Time to first frame, from the program starting to the first frame being
+// finished on the GPU, with the library compiled from the built in source, loaded from
+// the packaged metallib through a URL and loaded by mapping the metallib.
+// Each is timed in a fresh process as a launch would be, by running this
+// program again with --path.
+// usage : Metallib [--path source|url|mapped] [--runs n]
+
+const auto processStart = std::chrono::steady_clock::now();
+
+// run _arguments as a child process, without a shell so the path of the
+// executable can be anything, and return what it wrote to stdout
+bool runChild(const std::vector<std::string> &_arguments, std::string *o_output)
+{
+  std::vector<char *> argv;
+  for (auto &a : _arguments)
+    argv.push_back(const_cast<char *>(a.c_str()));
+  argv.push_back(nullptr);
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addclose(&actions, fds[0]);
+  posix_spawn_file_actions_addclose(&actions, fds[1]);
+  pid_t pid;
+  bool spawned = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ) == 0;
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  char buffer[256];
+  ssize_t n;
+  while (spawned && (n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    o_output->append(buffer, size_t(n));
+  close(fds[0]);
+  int status = 0;
+  return spawned && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// render a frame and return the time since the program started
+double firstFrame(MetallibLoader::Path _prefer, MetallibLoader::Path *o_path)
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = MetallibLoader::newLibrary(device, "shader.metallib", shaderSource, ShaderOptions(), _prefer, o_path, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to load library " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+  auto *renderPipelineDesc = MTL::RenderPipelineDescriptor::alloc()->init();
+  renderPipelineDesc->setVertexFunction(vertFunc);
+  renderPipelineDesc->setFragmentFunction(fragFunc);
+  renderPipelineDesc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  auto *renderPipelineState = device->newRenderPipelineState(renderPipelineDesc, &errorMessages);
+  assert(renderPipelineState);
+
+  auto *textureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, 256, 256, false);
+  textureDesc->setUsage(MTL::TextureUsageRenderTarget);
+  auto *texture = device->newTexture(textureDesc);
+  const float vertexData[] = {0.0f, 1.0f, 0.0f, -1.0f, -1.0f, 0.0f, 1.0f, -1.0f, 0.0f};
+  auto *vertexBuffer = device->newBuffer(vertexData, sizeof(vertexData), MTL::ResourceStorageModeShared);
+  auto *commandQueue = device->newCommandQueue();
+  auto *commandBuffer = commandQueue->commandBuffer();
+  auto renderPassDesc = MTL::RenderPassDescriptor::alloc()->init();
+  auto colorAttachmentDesc = renderPassDesc->colorAttachments()->object(0);
+  colorAttachmentDesc->setTexture(texture);
+  colorAttachmentDesc->setLoadAction(MTL::LoadActionClear);
+  colorAttachmentDesc->setStoreAction(MTL::StoreActionStore);
+  auto renderCommandEncoder = commandBuffer->renderCommandEncoder(renderPassDesc);
+  renderCommandEncoder->setRenderPipelineState(renderPipelineState);
+  renderCommandEncoder->setVertexBuffer(vertexBuffer, 0, 0);
+  renderCommandEncoder->drawPrimitives(MTL::PrimitiveTypeTriangle, NS::UInteger(0), NS::UInteger(3));
+  renderCommandEncoder->endEncoding();
+  commandBuffer->commit();
+  commandBuffer->waitUntilCompleted();
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - processStart).count();
+
+  renderPassDesc->release();
+  commandQueue->release();
+  vertexBuffer->release();
+  texture->release();
+  renderPipelineState->release();
+  renderPipelineDesc->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return ms;
+}
+
+int main(int argc, char *argv[])
+{
+  int runs = 5;
+  for (int i = 1; i < argc - 1; ++i)
+  {
+    if (std::strcmp(argv[i], "--path") == 0)
+    {
+      std::string p = argv[i + 1];
+      auto prefer = p == "mapped" ? MetallibLoader::Path::Mapped : p == "url" ? MetallibLoader::Path::URL : MetallibLoader::Path::Compiled;
+      MetallibLoader::Path taken;
+      double ms = firstFrame(prefer, &taken);
+      printf("%f %d\n", ms, static_cast<int>(taken));
+      return EXIT_SUCCESS;
+    }
+    if (std::strcmp(argv[i], "--runs") == 0)
+      runs = std::atoi(argv[i + 1]);
+  }
+
+  if (!MetallibLoader::upToDate("shader.metallib", shaderSource))
+    printf("shader.metallib is missing or stale, every path will compile (build with -DPACKAGE_METALLIB=ON)\n");
+  printf("%-16s %12s %12s %12s\n", "path", "best ms", "median ms", "loaded by");
+  for (auto *path : {"source", "url", "mapped"})
+  {
+    std::vector<double> times;
+    int taken = 0;
+    for (int r = 0; r < runs; ++r)
+    {
+      std::string output;
+      double ms = 0.0;
+      if (runChild({argv[0], "--path", path}, &output) && std::sscanf(output.c_str(), "%lf %d", &ms, &taken) == 2)
+        times.push_back(ms);
+    }
+    if (times.empty())
+      continue;
+    std::sort(times.begin(), times.end());
+    printf("%-16s %12.2f %12.2f %12s\n", path, times.front(), times[times.size() / 2], MetallibLoader::name(static_cast<MetallibLoader::Path>(taken)));
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#include <metal_stdlib>
+using namespace metal;
+
+struct VertexOut
+{
+    float4 position [[ position ]];
+    float4 colour;
+};
+
+vertex VertexOut vertFunc(const device packed_float3* vertexArray [[ buffer(0) ]], unsigned int vID [[ vertex_id ]])
+{
+    VertexOut out;
+    out.position = float4(vertexArray[vID], 1.0);
+    out.colour = float4(float(vID == 0), float(vID == 1), float(vID == 2), 1.0);
+    return out;
+}
+
+fragment half4 fragFunc(VertexOut in [[ stage_in ]])
+{
+    return half4(in.colour);
+}
@@ -0,0 +1,119 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include "PipelineArchive.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Builds a set of compute pipelines and a render pipeline through a
+// PipelineArchive. Run it twice, the first run records every pipeline into the
+// archive and the second builds them from the archived binaries.
+// usage : PipelineArchive [--clear]
+
+std::string generateSource(int _kernels)
+{
+  std::string src = R"""(
+    #include <metal_stdlib>
+    using namespace metal;
+
+    vertex float4 vertFunc(const device packed_float3* vertexArray [[ buffer(0) ]], unsigned int vID [[ vertex_id ]])
+    {
+        return float4(vertexArray[vID], 1.0);
+    }
+
+    fragment half4 fragFunc()
+    {
+        return half4(1.0);
+    }
+  )""";
+  for (int i = 0; i < _kernels; ++i)
+  {
+    auto n = std::to_string(i);
+    src += "kernel void k" + n + "(device float *v [[ buffer(0) ]], uint id [[ thread_position_in_grid ]])\n"
+           "{\n"
+           "    float x = v[id];\n"
+           "    for (int j = 0; j < " + std::to_string(4 + i % 8) + "; ++j)\n"
+           "        x = fma(x, x, sin(x * " + n + ".0f));\n"
+           "    v[id] = x;\n"
+           "}\n";
+  }
+  return src;
+}
+
+int main(int argc, char *argv[])
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  const int kernels = 32;
+  const auto source = generateSource(kernels);
+  char version[32];
+  std::snprintf(version, sizeof(version), "%016llx", static_cast<unsigned long long>(fnv1a(source)));
+
+  auto archivePath = ShaderCache::defaultDirectory() + "/PipelineArchive.binarchive";
+  if (argc > 1 && std::string(argv[1]) == "--clear")
+  {
+    std::filesystem::remove(archivePath);
+    std::filesystem::remove(archivePath + ".stamp");
+  }
+
+  // the library comes from the shader cache so the timing below is pipelines only
+  ShaderCache shaderCache(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = shaderCache.newLibrary(source, ShaderOptions(), &errorMessages);
+  assert(library);
+
+  auto start = std::chrono::steady_clock::now();
+  PipelineArchive archive(device, archivePath, version);
+  double openTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<MTL::ComputePipelineState *> computePipelines;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kernels; ++i)
+  {
+    auto name = "k" + std::to_string(i);
+    auto *func = library->newFunction(NS::String::string(name.c_str(), NS::ASCIIStringEncoding));
+    auto *desc = MTL::ComputePipelineDescriptor::alloc()->init();
+    desc->setComputeFunction(func);
+    auto *pipeline = archive.newComputePipelineState(desc, &errorMessages);
+    assert(pipeline);
+    computePipelines.push_back(pipeline);
+    desc->release();
+    func->release();
+  }
+
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+  auto *renderPipelineDesc = MTL::RenderPipelineDescriptor::alloc()->init();
+  renderPipelineDesc->setVertexFunction(vertFunc);
+  renderPipelineDesc->setFragmentFunction(fragFunc);
+  renderPipelineDesc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  auto *renderPipelineState = archive.newRenderPipelineState(renderPipelineDesc, &errorMessages);
+  assert(renderPipelineState);
+  double buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  start = std::chrono::steady_clock::now();
+  archive.save();
+  double saveTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  printf("archive %s (%s)\n", archivePath.c_str(), archive.loadedFromDisk() ? "loaded" : "new");
+  printf("open     %8.2f ms\n", openTime);
+  printf("build    %8.2f ms for %d pipelines\n", buildTime, kernels + 1);
+  printf("save     %8.2f ms\n", saveTime);
+  printf("archive hits %zu misses %zu\n", archive.hits(), archive.misses());
+  if (!archive.loadedFromDisk())
+    printf("run again to build from the archive\n");
+
+  for (auto *p : computePipelines)
+    p->release();
+  renderPipelineState->release();
+  renderPipelineDesc->release();
+  vertFunc->release();
+  fragFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
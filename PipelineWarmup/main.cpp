@@ -0,0 +1,182 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "PipelineWarmup.h"
+#include "ShaderCache.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A simulated render loop with a 60Hz frame budget that starts using more
+// compute pipelines as it goes. The manifest's guess at when each is first
+// used is mostly wrong. Run without warm-up every pipeline is compiled on the
+// frame that needs it; with warm-up they are compiled on two background
+// threads, first in the manifest's order and then in the order learned from
+// the previous pass, which is saved to the shader cache directory and also
+// used by the next launch. A hitch is a frame over budget that had to wait for
+// a pipeline.
+// usage : PipelineWarmup [--clear]
+
+using clock_type = std::chrono::steady_clock;
+
+double msSince(clock_type::time_point _start)
+{
+  return std::chrono::duration<double, std::milli>(clock_type::now() - _start).count();
+}
+
+// a unique salt per pass stops Metal's in memory cache hiding the compile cost
+std::string kernelSource(int _index, int _salt)
+{
+  return "// " + std::to_string(_salt) + "\n"
+         "#include <metal_stdlib>\n"
+         "using namespace metal;\n"
+         "kernel void work(device float *v [[ buffer(0) ]], uint id [[ thread_position_in_grid ]])\n"
+         "{\n"
+         "    float x = v[id];\n"
+         "    for (int j = 0; j < " + std::to_string(4 + _index % 8) + "; ++j)\n"
+         "        x = fma(x, 0.5f, sin(x * " + std::to_string(_index) + ".0f));\n"
+         "    v[id] = x;\n"
+         "}\n";
+}
+
+std::string pipelineName(int _index) { return "work" + std::to_string(_index); }
+
+struct Result
+{
+  int hitches = 0;
+  int overBudget = 0;
+  size_t syncBuilds = 0;
+  double stallMs = 0.0;
+  double worstMs = 0.0;
+  bool usedHistory = false;
+  std::vector<std::string> order;
+};
+
+constexpr int pipelines = 48;
+constexpr int frames = 180;
+constexpr double budgetMs = 1000.0 / 60.0;
+
+// the frame pipeline _index is really first used on, the manifest guesses
+// _index * 3
+int firstUse(int _index) { return ((_index * 29) % pipelines) * 3; }
+
+Result run(MTL::Device *_device, MTL::CommandQueue *_queue, MTL::Buffer *_data, unsigned _threads, const std::string &_history, int _salt)
+{
+  std::vector<WarmupEntry> manifest;
+  for (int i = 0; i < pipelines; ++i)
+  {
+    WarmupEntry e;
+    e.name = pipelineName(i);
+    e.priority = (pipelines - i) % 4;
+    e.expectedFrame = i * 3;
+    e.build = [_device, i, _salt]() -> NS::Object * {
+      NS::Error *errorMessages = nullptr;
+      auto *options = MTL::CompileOptions::alloc()->init();
+      auto src = kernelSource(i, _salt);
+      auto *library = _device->newLibrary(NS::String::string(src.c_str(), NS::UTF8StringEncoding), options, &errorMessages);
+      options->release();
+      if (!library)
+      {
+        std::cerr << "Failed to compile " << pipelineName(i) << ' ' << errorMessages->localizedDescription()->utf8String() << '\n';
+        exit(EXIT_FAILURE);
+      }
+      auto *func = library->newFunction(NS::String::string("work", NS::ASCIIStringEncoding));
+      auto *pipeline = _device->newComputePipelineState(func, &errorMessages);
+      assert(pipeline);
+      func->release();
+      library->release();
+      return pipeline;
+    };
+    manifest.push_back(std::move(e));
+  }
+
+  Result result;
+  PipelineWarmup warmup(std::move(manifest), _history, _threads);
+  result.usedHistory = warmup.hadHistory();
+  result.order = warmup.order();
+  for (int frame = 0; frame < frames; ++frame)
+  {
+    auto start = clock_type::now();
+    auto stalls = warmup.stalls();
+    auto *commandBuffer = _queue->commandBuffer();
+    auto *encoder = commandBuffer->computeCommandEncoder();
+    encoder->setBuffer(_data, 0, 0);
+    for (int i = 0; i < pipelines; ++i)
+    {
+      if (firstUse(i) > frame)
+        continue;
+      encoder->setComputePipelineState(warmup.acquire<MTL::ComputePipelineState>(pipelineName(i), frame));
+      encoder->dispatchThreads(MTL::Size(1024, 1, 1), MTL::Size(64, 1, 1));
+    }
+    encoder->endEncoding();
+    commandBuffer->commit();
+    commandBuffer->waitUntilCompleted();
+    double ms = msSince(start);
+    result.worstMs = std::max(result.worstMs, ms);
+    if (ms > budgetMs)
+    {
+      ++result.overBudget;
+      if (warmup.stalls() != stalls)
+        ++result.hitches;
+    }
+    // wait for the next vsync as a presenting app would
+    if (ms < budgetMs)
+      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(budgetMs - ms));
+  }
+  result.syncBuilds = warmup.stalls();
+  result.stallMs = warmup.stallMs();
+  if (_threads > 0 && !warmup.saveHistory())
+    std::cerr << "Unable to save " << _history << '\n';
+  return result;
+}
+
+int main(int argc, char *argv[])
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  auto *commandQueue = device->newCommandQueue();
+  assert(commandQueue);
+  auto *dataBuffer = device->newBuffer(sizeof(float) * 1024, MTL::ResourceStorageModeShared);
+  assert(dataBuffer);
+
+  const auto directory = ShaderCache::defaultDirectory();
+  const auto history = directory + "/warmup.history";
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+  if (argc > 1 && std::string(argv[1]) == "--clear")
+    std::filesystem::remove(history, ec);
+  const int salt = int(clock_type::now().time_since_epoch().count() & 0xffffff);
+
+  printf("%d pipelines over %d frames, %.2f ms budget\n", pipelines, frames, budgetMs);
+  printf("%-16s %8s %12s %12s %10s %10s\n", "warm-up", "hitches", "over budget", "sync builds", "stall ms", "worst ms");
+  auto report = [](const char *_name, const Result &_r) {
+    printf("%-16s %8d %12d %12zu %10.2f %10.2f\n", _name, _r.hitches, _r.overBudget, _r.syncBuilds, _r.stallMs, _r.worstMs);
+  };
+  report("none", run(device, commandQueue, dataBuffer, 0, "", salt));
+  auto first = run(device, commandQueue, dataBuffer, 2, history, salt + 1);
+  report(first.usedHistory ? "saved history" : "manifest order", first);
+  auto learned = run(device, commandQueue, dataBuffer, 2, history, salt + 2);
+  report("learned order", learned);
+
+  printf("first pipelines warmed :");
+  for (size_t i = 0; i < 8; ++i)
+    printf(" %s", learned.order[i].c_str());
+  printf("\nfirst pipelines used   :");
+  std::vector<int> byUse(pipelines);
+  for (int i = 0; i < pipelines; ++i)
+    byUse[i] = i;
+  std::sort(byUse.begin(), byUse.end(), [](int _a, int _b) { return firstUse(_a) < firstUse(_b); });
+  for (size_t i = 0; i < 8; ++i)
+    printf(" %s", pipelineName(byUse[i]).c_str());
+  printf("\n");
+
+  dataBuffer->release();
+  commandQueue->release();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include "RenderPipelineCache.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A scene of objects that each build their own render pipeline descriptor by
+// hand, as Triangle and SDL do, from a small set of materials. Creating a
+// pipeline per object is timed against going through a RenderPipelineCache,
+// which only builds one pipeline per distinct state.
+
+struct Material
+{
+  const char *fragment;
+  MTL::PixelFormat format;
+  bool blend;
+  bool instanced;
+};
+
+MTL::RenderPipelineDescriptor *newDescriptor(const Material &_material, MTL::Function *_vert, MTL::Function *_frag)
+{
+  auto *desc = MTL::RenderPipelineDescriptor::alloc()->init();
+  desc->setVertexFunction(_vert);
+  desc->setFragmentFunction(_frag);
+  auto *colour = desc->colorAttachments()->object(0);
+  colour->setPixelFormat(_material.format);
+  if (_material.blend)
+  {
+    colour->setBlendingEnabled(true);
+    colour->setSourceRGBBlendFactor(MTL::BlendFactorSourceAlpha);
+    colour->setDestinationRGBBlendFactor(MTL::BlendFactorOneMinusSourceAlpha);
+    colour->setSourceAlphaBlendFactor(MTL::BlendFactorOne);
+    colour->setDestinationAlphaBlendFactor(MTL::BlendFactorOneMinusSourceAlpha);
+  }
+  desc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+
+  auto *vertex = MTL::VertexDescriptor::alloc()->init();
+  vertex->attributes()->object(0)->setFormat(MTL::VertexFormatFloat3);
+  vertex->attributes()->object(0)->setOffset(0);
+  vertex->attributes()->object(0)->setBufferIndex(0);
+  vertex->layouts()->object(0)->setStride(sizeof(float) * 3);
+  vertex->attributes()->object(1)->setFormat(MTL::VertexFormatFloat4);
+  vertex->attributes()->object(1)->setOffset(0);
+  vertex->attributes()->object(1)->setBufferIndex(1);
+  vertex->layouts()->object(1)->setStride(sizeof(float) * 4);
+  vertex->layouts()->object(1)->setStepFunction(_material.instanced ? MTL::VertexStepFunctionPerInstance : MTL::VertexStepFunctionPerVertex);
+  desc->setVertexDescriptor(vertex);
+  vertex->release();
+  return desc;
+}
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+
+  const char *shaderSrc = R"""(
+    #include <metal_stdlib>
+    using namespace metal;
+
+    struct VertexIn
+    {
+      float3 position [[ attribute(0) ]];
+      float4 colour [[ attribute(1) ]];
+    };
+
+    struct VertexOut
+    {
+      float4 position [[ position ]];
+      float4 colour;
+    };
+
+    vertex VertexOut vertFunc(VertexIn in [[ stage_in ]])
+    {
+      return VertexOut{float4(in.position, 1.0), in.colour};
+    }
+
+    fragment half4 flatFrag(VertexOut in [[ stage_in ]])
+    {
+      return half4(in.colour);
+    }
+
+    fragment half4 fadeFrag(VertexOut in [[ stage_in ]])
+    {
+      return half4(half3(in.colour.rgb), 0.5h);
+    }
+
+    fragment half4 greyFrag(VertexOut in [[ stage_in ]])
+    {
+      return half4(half3(dot(in.colour.rgb, float3(0.299, 0.587, 0.114))), 1.0h);
+    }
+  )""";
+
+  ShaderCache shaderCache(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = shaderCache.newLibrary(shaderSrc, ShaderOptions(), &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to create library " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+
+  // 12 distinct pipelines shared out over the scene
+  std::vector<Material> materials;
+  for (auto *frag : {"flatFrag", "fadeFrag", "greyFrag"})
+    for (bool blend : {false, true})
+      for (bool instanced : {false, true})
+        materials.push_back({frag, MTL::PixelFormatBGRA8Unorm, blend, instanced});
+  const int objects = 1000;
+
+  // what each object would do on its own
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < objects; ++i)
+  {
+    auto &m = materials[i % materials.size()];
+    auto *vert = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+    auto *frag = library->newFunction(NS::String::string(m.fragment, NS::ASCIIStringEncoding));
+    auto *desc = newDescriptor(m, vert, frag);
+    auto *pipeline = device->newRenderPipelineState(desc, &errorMessages);
+    assert(pipeline);
+    pipeline->release();
+    desc->release();
+    frag->release();
+    vert->release();
+  }
+  double uncachedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  RenderPipelineCache cache(device);
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < objects; ++i)
+  {
+    auto &m = materials[i % materials.size()];
+    auto *desc = newDescriptor(m, cache.function(library, "vertFunc"), cache.function(library, m.fragment));
+    auto *pipeline = cache.renderPipelineState(desc, &errorMessages);
+    assert(pipeline);
+    desc->release();
+  }
+  double cachedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  // a state that differs only in blending must not share a pipeline
+  auto *a = newDescriptor(materials[0], cache.function(library, "vertFunc"), cache.function(library, "flatFrag"));
+  auto *b = newDescriptor(materials[2], cache.function(library, "vertFunc"), cache.function(library, "flatFrag"));
+  assert(cache.hash(a) != cache.hash(b));
+  a->release();
+  b->release();
+
+  printf("%d objects, %zu materials\n", objects, materials.size());
+  printf("pipeline per object %10.2f ms\n", uncachedMs);
+  printf("pipeline cache      %10.2f ms\n", cachedMs);
+  printf("unique pipelines %zu hits %zu misses %zu hit rate %.1f%%\n", cache.size(), cache.hits(), cache.misses(), cache.hitRate() * 100.0);
+  printf("creation %.2f ms, creation time saved %.2f ms\n", cache.createMs(), cache.savedMs());
+
+  library->release();
+  return EXIT_SUCCESS;
+}
@@ -4,30 +4,84 @@
 #define CA_PRIVATE_IMPLEMENTATION
 #define MTL_PRIVATE_IMPLEMENTATION
 #include "Metal.hpp"
-#include <fstream>
+#include "ShaderCache.h"
+#include "ShaderHotReload.h"
+#include "FramePacer.h"
+#include "VertexLayout.h"
+#include "MeshLoader.h"
+#include "Meshlets.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 
 
-// Simple function to load shader from file
-// converts to NSString in ASCII encoding
-NS::String *loadShader(const std::string &_fname)
+// column major like float4x4, _a * _b
+void multiply(const float *_a, const float *_b, float *o_m)
 {
-  std::ifstream shaderSource(_fname.data());
-  if (!shaderSource.is_open())
-  {
-   std::cerr<<"Unable to open shader file "<<_fname<<'\n';
-   exit(EXIT_FAILURE);
-  }
-  // now read in the data
-  auto source =  std::string((std::istreambuf_iterator<char>(shaderSource)), std::istreambuf_iterator<char>());
-  shaderSource.close();
-  source+='\0';
+  for (int c = 0; c < 4; ++c)
+    for (int r = 0; r < 4; ++r)
+    {
+      float sum = 0.0f;
+      for (int k = 0; k < 4; ++k)
+        sum += _a[k * 4 + r] * _b[c * 4 + k];
+      o_m[c * 4 + r] = sum;
+    }
+}
 
-  return NS::String::string(source.data(),NS::ASCIIStringEncoding);
+// looking from _eye at _target with y up, with Metal's 0 to 1 depth range
+void setCamera(const float *_eye, const float *_target, float _far, float _aspect, float *o_viewProjection)
+{
+  const float nearZ = 0.01f * _far;
+  const float ys = 1.0f / std::tan(0.5f * 60.0f * float(M_PI) / 180.0f);
+  const float zs = _far / (nearZ - _far);
+  const float projection[16] = {ys / _aspect, 0, 0, 0, 0, ys, 0, 0, 0, 0, zs, -1, 0, 0, zs * nearZ, 0};
+  float f[3] = {_target[0] - _eye[0], _target[1] - _eye[1], _target[2] - _eye[2]};
+  float length = std::sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+  for (float &c : f)
+    c /= length;
+  float s[3] = {-f[2], 0.0f, f[0]};
+  length = std::sqrt(s[0] * s[0] + s[2] * s[2]);
+  for (float &c : s)
+    c /= length;
+  float u[3] = {s[1] * f[2] - s[2] * f[1], s[2] * f[0] - s[0] * f[2], s[0] * f[1] - s[1] * f[0]};
+  auto dot = [_eye](const float *_v) { return _v[0] * _eye[0] + _v[1] * _eye[1] + _v[2] * _eye[2]; };
+  const float view[16] = {s[0], u[0], -f[0], 0, s[1], u[1], -f[1], 0, s[2], u[2], -f[2], 0, -dot(s), -dot(u), dot(f), 1};
+  multiply(projection, view, o_viewProjection);
+}
+
+MTL::Texture *newDepthTexture(MTL::Device *_device, int _width, int _height)
+{
+  auto *desc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatDepth32Float, NS::UInteger(_width), NS::UInteger(_height), false);
+  desc->setUsage(MTL::TextureUsageRenderTarget);
+  desc->setStorageMode(MTL::StorageModePrivate);
+  return _device->newTexture(desc);
 }
 
+// usage : SDLMetal [shader.metal] [--frames-in-flight n] [--no-vsync] [--mesh mesh.obj|mesh.ply]
+// one frame in flight is the old synchronous loop, compare it with the
+// default of three with --no-vsync so the frame rate isn't capped
+// --mesh draws a mesh orbited by the camera in place of the triangle, split
+// into meshlets that are culled on the GPU every frame
 int main (int argc, char *args[])
 {
+  std::string shaderPath = "shader.metal";
+  std::string meshPath;
+  unsigned framesInFlight = 3;
+  bool vsync = true;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (std::strcmp(args[i], "--frames-in-flight") == 0 && i + 1 < argc)
+      framesInFlight = unsigned(std::atoi(args[++i]));
+    else if (std::strcmp(args[i], "--no-vsync") == 0)
+      vsync = false;
+    else if (std::strcmp(args[i], "--mesh") == 0 && i + 1 < argc)
+      meshPath = args[++i];
+    else
+      shaderPath = args[i];
+  }
   // Basic SDL setup
   SDL_InitSubSystem(SDL_INIT_EVERYTHING);
   // create Window ensure it is a metal one
@@ -45,60 +99,126 @@ int main (int argc, char *args[])
     exit(EXIT_FAILURE);
   }
 
-  // now we need to get the Render Layer we need to cast the void * from SDL to an MTL::Resource
-  // from this we can get the actual device we are using.
-  MTL::Resource *layer= static_cast<MTL::Resource *>( SDL_RenderGetMetalLayer(renderer));
+  // SDL's renderer owns a CAMetalLayer, we render straight into its drawables
+  // and present them from the command buffer so nothing is copied back to the CPU
+  auto *layer = static_cast<CA::MetalLayer *>(SDL_RenderGetMetalLayer(renderer));
   auto device = layer->device();
-  // get window size to generate our textures
+  layer->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
+  layer->setFramebufferOnly(true);
+  layer->setDisplaySyncEnabled(vsync);
   int width,height;
   SDL_Metal_GetDrawableSize(window, &width,&height);
-  // Build Metal texture (this is where we are going to render to with metal)
-  auto *textureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, width, height, false);
-  textureDesc->setUsage(MTL::TextureUsageRenderTarget);
-  auto texture = device->newTexture(textureDesc);
-  // Generate SDL texture, this will copy the metal render texture then blit to the renderere
-  // Must be the same size and format, at presetn whilst saying RGBA everything seems to be in BGRA!
-  SDL_Texture* sdltexture = SDL_CreateTexture( renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+  layer->setDrawableSize(CGSize{double(width), double(height)});
+  std::cout<<"presenting "<<width<<'x'<<height<<" with up to "<<layer->maximumDrawableCount()<<" drawables\n";
 
   // Load in the shaders we need to set some default options and error handlers.
-  // note these must be released when finished with as they are owned by us as calling alloc
-  auto *shader=loadShader("shader.metal");
-  auto *compileOptions = MTL::CompileOptions::alloc()->init();
+  // the compiled library is cached on disk so later runs skip the compile.
+  // shader.metal is watched while running, saving an edit rebuilds the
+  // pipeline in the background and it is swapped in between frames
+  // pass the path of the source shader.metal to edit it in place rather than
+  // the copy next to the executable
+  ShaderCache shaderCache(device);
 
   auto *errorDictionary = NS::Dictionary::dictionary();
   auto *errorMessages=NS::Error::alloc()->init(NS::CocoaErrorDomain,99,errorDictionary);
-  auto library = device->newLibrary(shader,compileOptions,&errorMessages); 
-  // get the shader functions from the compiled shaders 
-  auto vertFunc = library->newFunction(NS::String::string("vertFunc",NS::ASCIIStringEncoding));
-  auto fragFunc = library->newFunction(NS::String::string("fragFunc",NS::ASCIIStringEncoding));
-  std::cout<<"Error Description "<<errorMessages->localizedDescription()<<'\n';
-  std::cout<<"localizedRecoverySuggestion "<<errorMessages->localizedRecoverySuggestion()<<'\n';
-  std::cout<<"localizedFailureReason "<<errorMessages->localizedFailureReason()<<'\n';
-  // Now build a render pipline
+  // Now build a render pipline, the functions are filled in from the shader
   auto *renderPipelineDesc = MTL::RenderPipelineDescriptor::alloc()->init();
-  renderPipelineDesc->setVertexFunction(vertFunc);
-  renderPipelineDesc->setFragmentFunction(fragFunc);
-  renderPipelineDesc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
-  auto * renderPipelineState = device->newRenderPipelineState(renderPipelineDesc,&errorMessages);
-
-  std::cout<<"Error Description "<<errorMessages->localizedDescription()<<'\n';
-  std::cout<<"localizedRecoverySuggestion "<<errorMessages->localizedRecoverySuggestion()<<'\n';
-  std::cout<<"localizedFailureReason "<<errorMessages->localizedFailureReason()<<'\n';
-  // Vertex data, [Vertex x,y,z,w] [Colour B,G,R,A]
+  renderPipelineDesc->colorAttachments()->object(0)->setPixelFormat(layer->pixelFormat());
+  // the vertices are half float positions and normalized byte colours, 12
+  // bytes a vertex rather than the 32 of the float data below, the shader
+  // reads them with [[stage_in]] so the GPU converts them back to float
+  VertexLayout vertexLayout;
+  vertexLayout.add(MTL::VertexFormatHalf4).add(MTL::VertexFormatUChar4Normalized);
+  auto *vertexDesc = vertexLayout.newDescriptor(0);
+  renderPipelineDesc->setVertexDescriptor(vertexDesc);
+  vertexDesc->release();
+  // only the pipeline that is drawn is built and watched, the triangle's or
+  // with --mesh the mesh's below
+  std::unique_ptr<HotReloadPipeline> trianglePipeline;
+  if (meshPath.empty())
+    trianglePipeline = std::make_unique<HotReloadPipeline>(device, shaderCache, shaderPath, renderPipelineDesc, "vertFunc", "fragFunc");
+
+  // Vertex data, [Vertex x,y,z,w] [Colour R,G,B,A]
   const float vertexData[] =
   {
       0.0f,  1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 0.0f, 1.0,
     -1.0f, -1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f, 0.0f,
       1.0f, -1.0f, 0.0f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f,
   };
-  // create a buffer for the vertex data
-  auto *vertexBuffer = device->newBuffer(vertexData, sizeof(vertexData), MTL::CPUCacheModeDefaultCache);
+  // the triangle spins, its vertices are written by the CPU every frame so
+  // there is one buffer per frame in flight, the CPU never writes one the GPU
+  // may still be reading
+  FramePacer pacer(framesInFlight);
+  std::vector<MTL::Buffer *> vertexBuffers;
+  for (unsigned i = 0; i < pacer.framesInFlight(); ++i)
+    vertexBuffers.push_back(device->newBuffer(vertexLayout.stride() * 3, MTL::ResourceStorageModeShared));
+  std::cout<<pacer.framesInFlight()<<" frames in flight, vsync "<<(vsync ? "on" : "off")<<'\n';
+
+  // the mesh, its meshlets are culled by a compute pass that writes the
+  // indices of the visible ones for an indirect draw, with an index and
+  // arguments buffer per frame in flight like the vertices above
+  std::unique_ptr<MeshletMesh> meshletMesh;
+  std::unique_ptr<HotReloadPipeline> meshPipeline;
+  MTL::DepthStencilState *depthState = nullptr;
+  MTL::Texture *depthTexture = nullptr;
+  float meshCentre[3] = {0.0f, 0.0f, 0.0f};
+  float meshExtent = 1.0f;
+  if (!meshPath.empty())
+  {
+    MeshData mesh;
+    if (!meshtools::load(meshPath, &mesh))
+      exit(EXIT_FAILURE);
+    meshtools::optimise(mesh);
+    auto meshlets = meshtools::buildMeshlets(mesh);
+    std::cout<<meshPath<<' '<<mesh.triangleCount()<<" triangles in "<<meshlets.meshlets.size()<<" meshlets\n";
+    float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+    for (size_t v = 0; v < mesh.vertexCount(); ++v)
+      for (int c = 0; c < 3; ++c)
+      {
+        lo[c] = std::min(lo[c], mesh.positions[v * 3 + c]);
+        hi[c] = std::max(hi[c], mesh.positions[v * 3 + c]);
+      }
+    for (int c = 0; c < 3; ++c)
+    {
+      meshCentre[c] = (lo[c] + hi[c]) * 0.5f;
+      meshExtent = std::max(meshExtent, hi[c] - lo[c]);
+    }
+    VertexLayout meshLayout;
+    meshLayout.add(MTL::VertexFormatFloat3).add(MTL::VertexFormatInt1010102Normalized);
+    meshletMesh = std::make_unique<MeshletMesh>(device, mesh, meshlets, meshLayout, pacer.framesInFlight());
+    auto *meshPipelineDesc = MTL::RenderPipelineDescriptor::alloc()->init();
+    meshPipelineDesc->colorAttachments()->object(0)->setPixelFormat(layer->pixelFormat());
+    meshPipelineDesc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+    auto *meshVertexDesc = meshLayout.newDescriptor(0);
+    meshPipelineDesc->setVertexDescriptor(meshVertexDesc);
+    meshVertexDesc->release();
+    meshPipeline = std::make_unique<HotReloadPipeline>(device, shaderCache, shaderPath, meshPipelineDesc, "meshVertFunc", "meshFragFunc");
+    meshPipelineDesc->release();
+    auto *depthDesc = MTL::DepthStencilDescriptor::alloc()->init();
+    depthDesc->setDepthCompareFunction(MTL::CompareFunctionLess);
+    depthDesc->setDepthWriteEnabled(true);
+    depthState = device->newDepthStencilState(depthDesc);
+    depthDesc->release();
+    depthTexture = newDepthTexture(device, width, height);
+  }
+  HotReloadPipeline &renderPipeline = meshPipeline ? *meshPipeline : *trianglePipeline;
+  std::cout<<"watching "<<shaderPath<<' '<<(renderPipeline.watchingWithInotify() ? "with inotify" : "by polling")<<'\n';
+  MeshletMesh::Stats meshletTotals;
+  int meshletFrames = 0;
+  unsigned long frameNumber = 0;
   // create a new command queue to register our commands
   auto *commandQueue = device->newCommandQueue();
 
 
   bool quit = false;
   SDL_Event e;
+  // frame times to see how much a pipeline swap disturbs the frame rate
+  const double tickMs = 1000.0 / double(SDL_GetPerformanceFrequency());
+  auto lastTick = SDL_GetPerformanceCounter();
+  double averageMs = 0.0;
+  int framesSinceSwap = -1;
+  float angle = 0.0f;
+  FramePacer::Stats stats;
 
   while (!quit) 
   {
@@ -112,47 +232,159 @@ int main (int argc, char *args[])
           {
             case SDLK_ESCAPE : quit=true; break;
           }
+      break;
+        case SDL_WINDOWEVENT :
+          if (e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+          {
+            SDL_Metal_GetDrawableSize(window, &width,&height);
+            layer->setDrawableSize(CGSize{double(width), double(height)});
+            if (depthTexture)
+            {
+              // frames still in flight hold their own reference to the old one
+              depthTexture->release();
+              depthTexture = newDepthTexture(device, width, height);
+            }
+          }
       break;
       } // event
     } // end poll
+    // drawables are autoreleased so each frame needs its own pool or the
+    // layer runs out of them
+    auto *pool = NS::AutoreleasePool::alloc()->init();
+    // wait for a frame slot, this blocks while the GPU is frames behind
+    unsigned slot = pacer.beginFrame();
+    // the slot's last frame is done, so what it culled can be read back
+    if (meshletMesh && ++frameNumber > pacer.framesInFlight())
+    {
+      auto culled = meshletMesh->stats(slot);
+      meshletTotals.visibleMeshlets += culled.visibleMeshlets;
+      meshletTotals.visibleTriangles += culled.visibleTriangles;
+      ++meshletFrames;
+    }
+    // wait for a drawable to render into, this blocks if they are all in use
+    auto *drawable = pacer.waitFor([layer] { return layer->nextDrawable(); });
+    // update this slot's vertices, spun as floats then packed
+    angle += 0.01f;
+    float vertices[24];
+    std::memcpy(vertices, vertexData, sizeof(vertexData));
+    for (int v = 0; v < 3; ++v)
+    {
+      float x = vertexData[v * 8];
+      float y = vertexData[v * 8 + 1];
+      vertices[v * 8] = x * std::cos(angle) - y * std::sin(angle);
+      vertices[v * 8 + 1] = x * std::sin(angle) + y * std::cos(angle);
+    }
+    vertexLayout.pack(0, vertices, 8, 3, vertexBuffers[slot]->contents());
+    vertexLayout.pack(1, vertices + 4, 8, 3, vertexBuffers[slot]->contents());
+    // pick up a rebuilt pipeline if there is one
+    bool swapped = false;
+    auto *renderPipelineState = renderPipeline.acquire(&swapped);
+    if (swapped)
+      framesSinceSwap = 0;
     // generate a command buffer
     auto *commandBuffer = commandQueue->commandBuffer();
+    if (!drawable)
+    {
+      // nothing to draw into, still hand the slot back through the GPU
+      pacer.endFrame(commandBuffer);
+      commandBuffer->commit();
+      pool->release();
+      continue;
+    }
     // get the render pass info an set the details
     auto renderPassDesc = MTL::RenderPassDescriptor::alloc()->init();
     auto colorAttachmentDesc = renderPassDesc->colorAttachments()->object(0);
-    colorAttachmentDesc->setTexture(texture);
+    colorAttachmentDesc->setTexture(drawable->texture());
     colorAttachmentDesc->setLoadAction(MTL::LoadActionClear);
     colorAttachmentDesc->setStoreAction(MTL::StoreActionStore);
-    colorAttachmentDesc->setClearColor(MTL::ClearColor(0.0f, 0.8f, 0.8f, 0.8f)); // BGRA?
+    colorAttachmentDesc->setClearColor(MTL::ClearColor(0.0f, 0.8f, 0.8f, 0.8f));
     renderPassDesc->setRenderTargetArrayLength(1);
+    float viewProjection[16];
+    if (meshletMesh)
+    {
+      // cull before the render pass so the indirect draw sees the result
+      float eye[3] = {meshCentre[0] + 0.6f * meshExtent * std::cos(angle), meshCentre[1] + 0.2f * meshExtent,
+                      meshCentre[2] + 0.6f * meshExtent * std::sin(angle)};
+      setCamera(eye, meshCentre, meshExtent * 2.0f, float(width) / float(height), viewProjection);
+      meshletMesh->cull(commandBuffer, slot, viewProjection, eye);
+      auto depthAttachmentDesc = renderPassDesc->depthAttachment();
+      depthAttachmentDesc->setTexture(depthTexture);
+      depthAttachmentDesc->setLoadAction(MTL::LoadActionClear);
+      depthAttachmentDesc->setStoreAction(MTL::StoreActionDontCare);
+    }
     // encode our render command and draw 
     auto renderCommandEncoder = commandBuffer->renderCommandEncoder(renderPassDesc);
-    renderCommandEncoder->setRenderPipelineState(renderPipelineState);
-    renderCommandEncoder->setVertexBuffer(vertexBuffer, 0, 0);
-    renderCommandEncoder->drawPrimitives(MTL::PrimitiveTypeTriangle,  NS::UInteger(0),  NS::UInteger(3));
+    if (meshletMesh)
+    {
+      renderCommandEncoder->setRenderPipelineState(renderPipelineState);
+      renderCommandEncoder->setDepthStencilState(depthState);
+      renderCommandEncoder->setFrontFacingWinding(MTL::WindingCounterClockwise);
+      renderCommandEncoder->setCullMode(MTL::CullModeBack);
+      renderCommandEncoder->setVertexBytes(viewProjection, sizeof(viewProjection), 1);
+      meshletMesh->draw(renderCommandEncoder, slot);
+    }
+    else
+    {
+      renderCommandEncoder->setRenderPipelineState(renderPipelineState);
+      renderCommandEncoder->setVertexBuffer(vertexBuffers[slot], 0, 0);
+      renderCommandEncoder->drawPrimitives(MTL::PrimitiveTypeTriangle,  NS::UInteger(0),  NS::UInteger(3));
+    }
     renderCommandEncoder->endEncoding();
-    // finally blit the result to our texture
-    auto blitCommandEncoder = commandBuffer->blitCommandEncoder();
-    blitCommandEncoder->synchronizeTexture(texture, 0, 0);
-    blitCommandEncoder->endEncoding();
+    // present once the GPU has finished rendering, the slot is freed when
+    // the command buffer completes rather than waiting for it here
+    commandBuffer->presentDrawable(drawable);
+    pacer.endFrame(commandBuffer);
     commandBuffer->commit();
-    commandBuffer->waitUntilCompleted();
-    // now copy to the SDL texture and present to the renderer
-    uint32_t* pixels;
-    int pitch;
-
-    SDL_LockTexture( sdltexture, NULL, (void**)&pixels, &pitch );
-    texture->getBytes(pixels, width *4, MTL::Region(0, 0, width, height), 0);
-    SDL_UnlockTexture( sdltexture );
-    SDL_RenderCopy(renderer, sdltexture, NULL, NULL);
-    SDL_RenderPresent(renderer);
     // this is the only per frame allocation so release.
     renderPassDesc->release();
+    pool->release();
+
+    auto tick = SDL_GetPerformanceCounter();
+    double frameMs = double(tick - lastTick) * tickMs;
+    lastTick = tick;
+    if (framesSinceSwap >= 0)
+    {
+      // the swap frame and the one after, against the running average
+      std::cout<<"reload "<<renderPipeline.reloads()<<" built in "<<renderPipeline.lastBuildMs()<<" ms off thread, frame "
+               <<framesSinceSwap<<" after swap "<<frameMs<<" ms (average "<<averageMs<<" ms)\n";
+      if (++framesSinceSwap > 1)
+        framesSinceSwap = -1;
+    }
+    averageMs = averageMs == 0.0 ? frameMs : averageMs * 0.95 + frameMs * 0.05;
+    if (pacer.sample(&stats, std::chrono::milliseconds(2000)))
+    {
+      std::cout<<stats.fps<<" fps, cpu "<<stats.cpuMs<<" ms gpu "<<stats.gpuMs<<" ms waiting "<<stats.waitMs
+               <<" ms per frame, "<<int(stats.overlap * 100.0)<<"% cpu/gpu overlap\n";
+      if (meshletMesh && meshletFrames)
+      {
+        double triangles = double(meshletTotals.visibleTriangles) / meshletFrames;
+        double culled = double(meshletMesh->triangleCount()) - triangles;
+        std::cout<<"meshlets "<<meshletTotals.visibleMeshlets / meshletFrames<<" of "<<meshletMesh->meshletCount()<<" drawn, "
+                 <<size_t(culled)<<" of "<<meshletMesh->triangleCount()<<" triangles culled per frame ("
+                 <<int(100.0 * culled / double(meshletMesh->triangleCount()))<<"%)\n";
+        meshletTotals = MeshletMesh::Stats();
+        meshletFrames = 0;
+      }
+    }
   }// end loop
 
+  // the frames still in flight use the mesh, the queue runs its command
+  // buffers in order so once an empty one completes they all have
+  if (meshletMesh)
+  {
+    auto *pool = NS::AutoreleasePool::alloc()->init();
+    auto *last = commandQueue->commandBuffer();
+    last->commit();
+    last->waitUntilCompleted();
+    pool->release();
+    meshletMesh.reset();
+    meshPipeline.reset();
+    depthTexture->release();
+    depthState->release();
+  }
+  // the pacer's destructor waits for the frames still in flight
   renderPipelineDesc->release();
   errorMessages->release();
-  compileOptions->release();
 
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
@@ -3,11 +3,12 @@
 
 using namespace metal;
 
-// The structure that is fed into the vertex shader. We use packed data types to alleviate memory alignment
-// issues caused by the float2
+// The structure that is fed into the vertex shader. The attributes are fetched by the
+// vertex descriptor built from the VertexLayout in main.cpp, the position is stored as
+// half floats and the colour as normalized bytes, both arrive here as floats
 typedef struct {
-    packed_float4 position;
-    packed_float4 colour;
+    float4 position [[attribute(0)]];
+    float4 colour [[attribute(1)]];
 } Vertex;
 
 // The output of the vertex shader, which will be fed into the fragment shader
@@ -16,13 +17,11 @@ typedef struct {
     float4 colour;
 } RasteriserData;
 
-vertex RasteriserData vertFunc(uint vertexID [[vertex_id]],
-                                        constant Vertex *vertices [[buffer(0)]]) {
+vertex RasteriserData vertFunc(Vertex in [[stage_in]]) {
     
     RasteriserData out;
-    //out.position = float4(0.0, 0.0, 0.0, 1.0);
-    out.position = vertices[vertexID].position;
-    out.colour = vertices[vertexID].colour;
+    out.position = in.position;
+    out.colour = in.colour;
 
     // Both the colour and the clip space position will be interpolated in this data structure
     return out;
@@ -31,3 +30,27 @@ vertex RasteriserData vertFunc(uint vertexID [[vertex_id]],
 fragment float4 fragFunc(RasteriserData in [[stage_in]]) {
     return in.colour;
 }
+
+// The mesh drawn with --mesh, float positions and 10:10:10:2 normals, already
+// in world space so only the camera transforms it
+typedef struct {
+    float3 position [[attribute(0)]];
+    float3 normal [[attribute(1)]];
+} MeshVertex;
+
+typedef struct {
+    float4 position [[position]];
+    float3 normal;
+} MeshRasteriserData;
+
+vertex MeshRasteriserData meshVertFunc(MeshVertex in [[stage_in]], constant float4x4 &viewProjection [[buffer(1)]]) {
+    MeshRasteriserData out;
+    out.position = viewProjection * float4(in.position, 1.0f);
+    out.normal = in.normal;
+    return out;
+}
+
+fragment float4 meshFragFunc(MeshRasteriserData in [[stage_in]]) {
+    float light = 0.15f + max(dot(normalize(in.normal), normalize(float3(0.4f, 0.7f, 0.6f))), 0.0f);
+    return float4(float3(0.8f, 0.5f, 0.3f) * light, 1.0f);
+}
@@ -0,0 +1,106 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Startup cost of getting a library from MSL source, compiled in process every
+// time (what the other examples used to do) against a cold and a warm
+// ShaderCache. The source is a few dozen generated kernels so the compile time
+// is big enough to measure.
+
+std::string generateSource(int _kernels)
+{
+  std::string src = "#include <metal_stdlib>\nusing namespace metal;\n";
+  for (int i = 0; i < _kernels; ++i)
+  {
+    auto n = std::to_string(i);
+    src += "kernel void k" + n + "(device float *v [[ buffer(0) ]], constant float &s [[ buffer(1) ]], uint id [[ thread_position_in_grid ]])\n"
+           "{\n"
+           "    float x = v[id];\n"
+           "    for (int j = 0; j < " + std::to_string(4 + i % 8) + "; ++j)\n"
+           "        x = fma(x, s, sin(x * " + n + ".0f) + SCALE);\n"
+           "    v[id] = x;\n"
+           "}\n";
+  }
+  return src;
+}
+
+template <typename F>
+double timeMs(F &&_f)
+{
+  auto start = std::chrono::steady_clock::now();
+  _f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+
+  ShaderOptions options;
+  options.languageVersion = MTL::LanguageVersion2_3;
+  options.macros["SCALE"] = "0.5f";
+  const auto source = generateSource(64);
+  const int runs = 5;
+
+  // keep the timing runs away from the cache the other examples use
+  ShaderCache cache(device, ShaderCache::defaultDirectory() + "/timing");
+  cache.clear();
+
+  NS::Error *errorMessages = nullptr;
+  std::vector<double> uncached;
+  for (int i = 0; i < runs; ++i)
+  {
+    // Metal keeps its own in memory cache of source it has already seen, a
+    // unique comment makes every run a genuine compile like a fresh launch
+    auto unique = "// run " + std::to_string(i) + "\n" + source;
+    auto *compileOptions = options.newCompileOptions();
+    uncached.push_back(timeMs([&] {
+      auto *library = device->newLibrary(NS::String::string(unique.c_str(), NS::UTF8StringEncoding), compileOptions, &errorMessages);
+      assert(library);
+      library->release();
+    }));
+    compileOptions->release();
+  }
+
+  double cold = timeMs([&] {
+    auto *library = cache.newLibrary(source, options, &errorMessages);
+    assert(library);
+    library->release();
+  });
+  bool cachedOnDisk = std::filesystem::exists(cache.entryPath(source, options));
+
+  std::vector<double> warm;
+  for (int i = 0; i < runs; ++i)
+  {
+    warm.push_back(timeMs([&] {
+      auto *library = cache.newLibrary(source, options, &errorMessages);
+      assert(library);
+      library->release();
+    }));
+  }
+
+  // changing any option must give a different entry
+  ShaderOptions other = options;
+  other.fastMath = false;
+  assert(cache.entryPath(source, other) != cache.entryPath(source, options));
+
+  std::sort(uncached.begin(), uncached.end());
+  std::sort(warm.begin(), warm.end());
+  printf("cache entry   %s\n", cache.entryPath(source, options).c_str());
+  if (!cachedOnDisk)
+    printf("offline metal compiler not found, the cache falls back to compiling in process\n");
+  printf("no cache      %8.2f ms (median of %d)\n", uncached[runs / 2], runs);
+  printf("cold cache    %8.2f ms\n", cold);
+  printf("warm cache    %8.2f ms (median of %d)\n", warm[runs / 2], runs);
+  printf("hits %zu misses %zu\n", cache.hits(), cache.misses());
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include "ShaderPreprocessor.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// shaders/shade.metal includes lighting.h and common.h and has four
+// permutation macros. Every permutation is compiled the usual way, the same
+// source with different macros, and then through ShaderVariants which strips
+// the dead branches and compiles each distinct source once. Both go through a
+// ShaderCache that is cleared first so both pay for real compiles.
+
+template <typename F>
+double timeMs(F &&_f)
+{
+  auto start = std::chrono::steady_clock::now();
+  _f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  const std::string shaderPath = "shaders/shade.metal";
+
+  ShaderPreprocessor preprocessor({"shaders"});
+  preprocessor.addPermutation("LIGHTS", {"1", "2", "4"});
+  preprocessor.addPermutation("SHADOWS", {"0", "1"});
+  preprocessor.addPermutation("QUALITY", {"0", "1", "2"});
+  preprocessor.addPermutation("FOG", {"0", "1"});
+
+  // the includes still have to be inlined as Metal can't be given an include
+  // path, so the baseline uses a preprocessor with no permutations
+  std::string flat;
+  std::string error;
+  if (!ShaderPreprocessor({"shaders"}).preprocess(shaderPath, Permutation(), flat, error))
+  {
+    std::cerr << error << '\n';
+    exit(EXIT_FAILURE);
+  }
+
+  ShaderCache cache(device, ShaderCache::defaultDirectory() + "/variants");
+  NS::Error *errorMessages = nullptr;
+
+  cache.clear();
+  size_t baselineBytes = 0;
+  double baselineMs = timeMs([&] {
+    for (auto &p : preprocessor.permutations())
+    {
+      ShaderOptions options;
+      options.macros = p.values;
+      auto *library = cache.newLibrary(flat, options, &errorMessages);
+      if (!library)
+      {
+        std::cerr << p.name() << ' ' << errorMessages->localizedDescription()->utf8String() << '\n';
+        exit(EXIT_FAILURE);
+      }
+      baselineBytes += flat.size();
+      library->release();
+    }
+  });
+
+  cache.clear();
+  ShaderVariants variants;
+  double expandMs = timeMs([&] {
+    if (!variants.expand(preprocessor, shaderPath, error))
+    {
+      std::cerr << error << '\n';
+      exit(EXIT_FAILURE);
+    }
+  });
+  double compileMs = timeMs([&] {
+    if (!variants.compile(cache, ShaderOptions(), &errorMessages))
+    {
+      std::cerr << errorMessages->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+  });
+
+  // every permutation must have a library with the kernel in it
+  for (auto &p : variants.permutations())
+  {
+    auto *func = variants.library(p)->newFunction(NS::String::string("shadeSurfaces", NS::ASCIIStringEncoding));
+    assert(func);
+    func->release();
+  }
+
+  size_t permutations = variants.permutations().size();
+  printf("%zu permutations, %zu distinct sources\n", permutations, variants.uniqueSources());
+  printf("macros only     %8.2f ms %3zu libraries %8zu source bytes\n", baselineMs, permutations, baselineBytes);
+  printf("preprocessed    %8.2f ms %3zu libraries %8zu source bytes (expand %.2f ms)\n", expandMs + compileMs, variants.uniqueSources(),
+         variants.sourceBytes(), expandMs);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <metal_stdlib>
+using namespace metal;
+
+struct Surface
+{
+  float3 position;
+  float3 normal;
+  float3 albedo;
+};
+
+inline Surface makeSurface(uint id)
+{
+  float t = float(id) * 0.001f;
+  Surface s;
+  s.position = float3(sin(t), cos(t), t);
+  s.normal = normalize(float3(cos(t), 1.0f, sin(t)));
+  s.albedo = float3(0.8f, 0.6f, 0.4f);
+  return s;
+}
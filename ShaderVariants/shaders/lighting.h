@@ -0,0 +1,37 @@
+#pragma once
+#include "common.h"
+
+inline float3 lightDirection(int i)
+{
+  return normalize(float3(cos(float(i)), 1.0f, sin(float(i))));
+}
+
+#if SHADOWS
+// soft shadows take more samples at higher quality
+inline float shadow(float3 p, float3 l)
+{
+#if QUALITY == 0
+  return step(0.0f, dot(p, l));
+#else
+  float s = 0.0f;
+  for (int i = 0; i < QUALITY * 4; ++i)
+    s += step(0.0f, dot(p + float(i) * 0.01f, l));
+  return s / float(QUALITY * 4);
+#endif
+}
+#endif
+
+inline float3 shade(Surface s)
+{
+  float3 c = float3(0.0f);
+  for (int i = 0; i < LIGHTS; ++i)
+  {
+    float3 l = lightDirection(i);
+    float d = max(dot(s.normal, l), 0.0f);
+#if SHADOWS
+    d *= shadow(s.position, l);
+#endif
+    c += s.albedo * d;
+  }
+  return c;
+}
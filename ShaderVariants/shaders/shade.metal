@@ -0,0 +1,14 @@
+#include "lighting.h"
+
+// LIGHTS, SHADOWS, QUALITY and FOG are permutation macros, QUALITY only
+// changes anything when SHADOWS is on so most of its permutations are
+// duplicates
+kernel void shadeSurfaces(device float4 *out [[ buffer(0) ]], uint id [[ thread_position_in_grid ]])
+{
+  Surface s = makeSurface(id);
+  float3 c = shade(s);
+#if FOG
+  c = mix(c, float3(0.5f), saturate(s.position.z * 0.1f));
+#endif
+  out[id] = float4(c, 1.0f);
+}
@@ -0,0 +1,250 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "StateFilter.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// A scene of small quads drawn the simple way, every draw sets everything it
+// needs, encoded straight to the render command encoder and through a
+// FilteredRenderEncoder. Objects are drawn in material order, where most of
+// the state repeats from draw to draw, and in a shuffled order, where less of
+// it does. The per object data lives in one buffer so consecutive draws only
+// change its offset.
+
+const char *shaderSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  struct ObjectData
+  {
+    float4 offsetScale;
+    float4 colour;
+  };
+
+  struct RasteriserData
+  {
+    float4 position [[position]];
+    float2 uv;
+    float4 colour;
+  };
+
+  vertex RasteriserData vertFunc(uint vertexID [[vertex_id]],
+                                 const device float2 *quad [[buffer(0)]],
+                                 const device ObjectData &object [[buffer(1)]])
+  {
+    RasteriserData out;
+    float2 p = quad[vertexID];
+    out.position = float4(object.offsetScale.xy + p * object.offsetScale.zw, 0.0f, 1.0f);
+    out.uv = p * 0.5f + 0.5f;
+    out.colour = object.colour;
+    return out;
+  }
+
+  fragment float4 fragFunc(RasteriserData in [[stage_in]],
+                           texture2d<float> tex [[texture(0)]],
+                           sampler s [[sampler(0)]])
+  {
+    return tex.sample(s, in.uv) * in.colour;
+  }
+)""";
+
+struct ObjectData
+{
+  float offsetScale[4];
+  float colour[4];
+};
+
+struct Material
+{
+  MTL::RenderPipelineState *pipeline;
+  MTL::Texture *texture;
+  MTL::SamplerState *sampler;
+};
+
+constexpr int objects = 4000;
+constexpr int materials = 16;
+constexpr int frames = 50;
+constexpr int size = 512;
+// state calls encodeScene makes for every draw
+constexpr int callsPerDraw = 8;
+
+// everything a draw needs, set on every draw, works with the plain encoder
+// and the filtered one as they share the method names
+template <typename Encoder>
+void encodeScene(Encoder *_encoder, const std::vector<int> &_order, const std::vector<int> &_materialOf, const std::vector<Material> &_materials,
+                 MTL::DepthStencilState *_depth, MTL::Buffer *_quad, MTL::Buffer *_objectData)
+{
+  MTL::Viewport viewport = {0.0, 0.0, double(size), double(size), 0.0, 1.0};
+  for (int i : _order)
+  {
+    const auto &m = _materials[_materialOf[i]];
+    _encoder->setRenderPipelineState(m.pipeline);
+    _encoder->setDepthStencilState(_depth);
+    _encoder->setViewport(viewport);
+    _encoder->setCullMode(MTL::CullModeNone);
+    _encoder->setVertexBuffer(_quad, 0, 0);
+    _encoder->setVertexBuffer(_objectData, NS::UInteger(i) * sizeof(ObjectData), 1);
+    _encoder->setFragmentTexture(m.texture, 0);
+    _encoder->setFragmentSamplerState(m.sampler, 0);
+    _encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, NS::UInteger(0), NS::UInteger(6));
+  }
+}
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = device->newLibrary(NS::String::string(shaderSource, NS::UTF8StringEncoding), nullptr, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to compile shaders " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+
+  // two pipelines, opaque and blended, four textures and two samplers make
+  // up the materials
+  std::vector<MTL::RenderPipelineState *> pipelines;
+  for (bool blend : {false, true})
+  {
+    auto *desc = MTL::RenderPipelineDescriptor::alloc()->init();
+    desc->setVertexFunction(vertFunc);
+    desc->setFragmentFunction(fragFunc);
+    auto *colour = desc->colorAttachments()->object(0);
+    colour->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+    colour->setBlendingEnabled(blend);
+    colour->setSourceRGBBlendFactor(MTL::BlendFactorSourceAlpha);
+    colour->setDestinationRGBBlendFactor(MTL::BlendFactorOneMinusSourceAlpha);
+    desc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+    auto *pipeline = device->newRenderPipelineState(desc, &errorMessages);
+    assert(pipeline);
+    pipelines.push_back(pipeline);
+    desc->release();
+  }
+  std::vector<MTL::Texture *> textures;
+  for (int t = 0; t < 4; ++t)
+  {
+    auto *textureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, 64, 64, false);
+    auto *texture = device->newTexture(textureDesc);
+    std::vector<uint32_t> texels(64 * 64);
+    for (size_t p = 0; p < texels.size(); ++p)
+      texels[p] = ((p / 8 + p / 512 + t) & 1) ? 0xffffffffu : 0xff808080u;
+    texture->replaceRegion(MTL::Region(0, 0, 64, 64), 0, texels.data(), 64 * 4);
+    textures.push_back(texture);
+  }
+  std::vector<MTL::SamplerState *> samplers;
+  for (auto filter : {MTL::SamplerMinMagFilterNearest, MTL::SamplerMinMagFilterLinear})
+  {
+    auto *samplerDesc = MTL::SamplerDescriptor::alloc()->init();
+    samplerDesc->setMinFilter(filter);
+    samplerDesc->setMagFilter(filter);
+    samplers.push_back(device->newSamplerState(samplerDesc));
+    samplerDesc->release();
+  }
+  std::vector<Material> materialList;
+  for (int m = 0; m < materials; ++m)
+    materialList.push_back({pipelines[m % 2], textures[(m / 2) % 4], samplers[m / 8]});
+
+  auto *depthDesc = MTL::DepthStencilDescriptor::alloc()->init();
+  depthDesc->setDepthCompareFunction(MTL::CompareFunctionLessEqual);
+  depthDesc->setDepthWriteEnabled(true);
+  auto *depthState = device->newDepthStencilState(depthDesc);
+  depthDesc->release();
+
+  const float quadData[] = {-1, -1, 1, -1, 1, 1, -1, -1, 1, 1, -1, 1};
+  auto *quadBuffer = device->newBuffer(quadData, sizeof(quadData), MTL::ResourceStorageModeShared);
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  std::vector<ObjectData> objectData(objects);
+  std::vector<int> materialOf(objects);
+  for (int i = 0; i < objects; ++i)
+  {
+    objectData[i] = {{unit(rng) * 2.0f - 1.0f, unit(rng) * 2.0f - 1.0f, 0.02f, 0.02f}, {unit(rng), unit(rng), unit(rng), 0.8f}};
+    materialOf[i] = i * materials / objects;
+  }
+  auto *objectBuffer = device->newBuffer(objectData.data(), sizeof(ObjectData) * objects, MTL::ResourceStorageModeShared);
+
+  auto *colourDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, size, size, false);
+  colourDesc->setUsage(MTL::TextureUsageRenderTarget);
+  auto *colourTexture = device->newTexture(colourDesc);
+  auto *depthTextureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatDepth32Float, size, size, false);
+  depthTextureDesc->setUsage(MTL::TextureUsageRenderTarget);
+  depthTextureDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *depthTexture = device->newTexture(depthTextureDesc);
+  auto *commandQueue = device->newCommandQueue();
+
+  std::vector<int> sorted(objects);
+  for (int i = 0; i < objects; ++i)
+    sorted[i] = i;
+  auto shuffled = sorted;
+  std::shuffle(shuffled.begin(), shuffled.end(), rng);
+
+  printf("%d objects, %d materials, %d state calls a draw\n", objects, materials, callsPerDraw);
+  printf("%-10s %-10s %10s %10s %12s %14s\n", "order", "encoder", "issued", "filtered", "offset only", "encode ms");
+  for (auto *order : {&sorted, &shuffled})
+  {
+    for (bool filtered : {false, true})
+    {
+      double encodeMs = 0.0;
+      StateFilterCounters counters;
+      for (int frame = 0; frame < frames; ++frame)
+      {
+        auto *pool = NS::AutoreleasePool::alloc()->init();
+        auto *commandBuffer = commandQueue->commandBuffer();
+        auto *passDesc = MTL::RenderPassDescriptor::alloc()->init();
+        auto *colour = passDesc->colorAttachments()->object(0);
+        colour->setTexture(colourTexture);
+        colour->setLoadAction(MTL::LoadActionClear);
+        colour->setStoreAction(MTL::StoreActionStore);
+        auto *depth = passDesc->depthAttachment();
+        depth->setTexture(depthTexture);
+        depth->setLoadAction(MTL::LoadActionClear);
+        depth->setStoreAction(MTL::StoreActionDontCare);
+        auto *encoder = commandBuffer->renderCommandEncoder(passDesc);
+        auto start = std::chrono::steady_clock::now();
+        if (filtered)
+        {
+          FilteredRenderEncoder filter(encoder);
+          encodeScene(&filter, *order, materialOf, materialList, depthState, quadBuffer, objectBuffer);
+          counters = filter.counters();
+        }
+        else
+          encodeScene(encoder, *order, materialOf, materialList, depthState, quadBuffer, objectBuffer);
+        encodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        encoder->endEncoding();
+        commandBuffer->commit();
+        commandBuffer->waitUntilCompleted();
+        passDesc->release();
+        pool->release();
+      }
+      size_t calls = size_t(objects) * callsPerDraw;
+      printf("%-10s %-10s %10zu %10zu %12zu %14.3f\n", order == &sorted ? "material" : "shuffled", filtered ? "filtered" : "plain",
+             filtered ? counters.issued : calls, counters.filtered, counters.offsetOnly, encodeMs / frames);
+    }
+  }
+
+  commandQueue->release();
+  depthTexture->release();
+  colourTexture->release();
+  objectBuffer->release();
+  quadBuffer->release();
+  depthState->release();
+  for (auto *s : samplers)
+    s->release();
+  for (auto *t : textures)
+    t->release();
+  for (auto *p : pipelines)
+    p->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
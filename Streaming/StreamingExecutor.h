@@ -0,0 +1,210 @@
+#pragma once
+#include "Metal.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Where processed chunks end up. Chunks are always written in order.
+class OutputSink
+{
+public:
+  virtual ~OutputSink() = default;
+  virtual void write(const void *_data, size_t _offset, size_t _bytes) = 0;
+};
+
+// copies into caller owned memory which must be large enough for the whole stream
+class MemorySink : public OutputSink
+{
+public:
+  explicit MemorySink(void *_dst) : m_dst(static_cast<char *>(_dst)) {}
+  void write(const void *_data, size_t _offset, size_t _bytes) override
+  {
+    std::memcpy(m_dst + _offset, _data, _bytes);
+  }
+
+private:
+  char *m_dst;
+};
+
+class FileSink : public OutputSink
+{
+public:
+  explicit FileSink(const std::string &_fname)
+  {
+    m_file = std::fopen(_fname.c_str(), "wb");
+    if (!m_file)
+    {
+      std::cerr << "Unable to open output file " << _fname << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+  ~FileSink() override { std::fclose(m_file); }
+  void write(const void *_data, size_t, size_t _bytes) override
+  {
+    if (std::fwrite(_data, 1, _bytes, m_file) != _bytes)
+    {
+      std::cerr << "Short write to output file\n";
+      exit(EXIT_FAILURE);
+    }
+  }
+
+private:
+  std::FILE *m_file;
+};
+
+struct StreamStats
+{
+  size_t bytes = 0;
+  size_t chunks = 0;
+  double wallSeconds = 0.0;
+  double uploadSeconds = 0.0;
+  double gpuSeconds = 0.0;
+  double readbackSeconds = 0.0;
+
+  double gbPerSecond() const { return bytes / wallSeconds / 1e9; }
+  // 1.0 when the wall time is the best overlap allows, 0.0 when it is the sum
+  // of all stages (fully serial). Upload and readback both run on the calling
+  // thread so only the GPU can overlap them, the best case is whichever of
+  // the GPU and the CPU work together takes longer.
+  double overlapEfficiency() const
+  {
+    double serial = uploadSeconds + gpuSeconds + readbackSeconds;
+    double ideal = std::max(uploadSeconds + readbackSeconds, gpuSeconds);
+    if (serial <= ideal)
+      return 1.0;
+    return std::clamp((serial - wallSeconds) / (serial - ideal), 0.0, 1.0);
+  }
+};
+
+// Runs a float -> float kernel over a stream which need not fit in device
+// memory. The stream is cut into chunks and a ring of _inFlight chunk slots
+// (each with its own input and output buffer) is cycled so that while the GPU
+// works on one chunk the CPU fills the next and drains a finished one. With
+// _inFlight == 1 every stage runs back to back, which is the baseline.
+//
+// The kernel must take the input at buffer(0), the output at buffer(1) and the
+// element count of the chunk as a uint at buffer(2).
+class StreamingExecutor
+{
+public:
+  // fill _dst with _bytes of the stream starting at _offset
+  using Source = std::function<void(void *_dst, size_t _offset, size_t _bytes)>;
+
+  StreamingExecutor(MTL::Device *_device, MTL::CommandQueue *_queue, MTL::ComputePipelineState *_pipeline, size_t _chunkBytes, uint32_t _inFlight)
+      : m_queue(_queue), m_pipeline(_pipeline), m_chunkBytes(_chunkBytes)
+  {
+    assert(_inFlight > 0 && _chunkBytes % sizeof(float) == 0);
+    m_slots.resize(_inFlight);
+    for (auto &slot : m_slots)
+    {
+      slot.in = _device->newBuffer(_chunkBytes, MTL::ResourceStorageModeShared);
+      slot.out = _device->newBuffer(_chunkBytes, MTL::ResourceStorageModeShared);
+      assert(slot.in && slot.out);
+    }
+  }
+
+  ~StreamingExecutor()
+  {
+    for (auto &slot : m_slots)
+    {
+      slot.in->release();
+      slot.out->release();
+    }
+  }
+
+  StreamStats run(const Source &_source, size_t _totalBytes, OutputSink &_sink)
+  {
+    using clock = std::chrono::steady_clock;
+    StreamStats stats;
+    stats.bytes = _totalBytes;
+    auto start = clock::now();
+    size_t chunk = 0;
+    for (size_t offset = 0; offset < _totalBytes; offset += m_chunkBytes, ++chunk)
+    {
+      auto &slot = m_slots[chunk % m_slots.size()];
+      // the slot may still hold an earlier chunk, wait for it and write it out
+      drain(slot, _sink, stats);
+
+      slot.offset = offset;
+      slot.bytes = std::min(m_chunkBytes, _totalBytes - offset);
+      auto uploadStart = clock::now();
+      _source(slot.in->contents(), slot.offset, slot.bytes);
+      stats.uploadSeconds += std::chrono::duration<double>(clock::now() - uploadStart).count();
+
+      uint32_t count = static_cast<uint32_t>(slot.bytes / sizeof(float));
+      auto *commandBuffer = m_queue->commandBuffer();
+      auto *commandEncoder = commandBuffer->computeCommandEncoder();
+      commandEncoder->setComputePipelineState(m_pipeline);
+      commandEncoder->setBuffer(slot.in, 0, 0);
+      commandEncoder->setBuffer(slot.out, 0, 1);
+      commandEncoder->setBytes(&count, sizeof(uint32_t), 2);
+      NS::UInteger threads = m_pipeline->maxTotalThreadsPerThreadgroup();
+      commandEncoder->dispatchThreadgroups(MTL::Size((count + threads - 1) / threads, 1, 1), MTL::Size(threads, 1, 1));
+      commandEncoder->endEncoding();
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        slot.busy = true;
+        slot.pending = true;
+      }
+      commandBuffer->addCompletedHandler([this, &slot](MTL::CommandBuffer *_cb)
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        slot.gpuSeconds = _cb->GPUEndTime() - _cb->GPUStartTime();
+        slot.busy = false;
+        m_cv.notify_all();
+      });
+      commandBuffer->commit();
+      // the baseline waits here so nothing overlaps
+      if (m_slots.size() == 1)
+        drain(slot, _sink, stats);
+    }
+    // flush the remaining chunks in stream order
+    for (size_t i = 0; i < m_slots.size(); ++i)
+      drain(m_slots[(chunk + i) % m_slots.size()], _sink, stats);
+    stats.chunks = chunk;
+    stats.wallSeconds = std::chrono::duration<double>(clock::now() - start).count();
+    return stats;
+  }
+
+private:
+  struct Slot
+  {
+    MTL::Buffer *in = nullptr;
+    MTL::Buffer *out = nullptr;
+    size_t offset = 0;
+    size_t bytes = 0;
+    bool busy = false;    // GPU still working on it
+    bool pending = false; // output not yet written to the sink
+    double gpuSeconds = 0.0;
+  };
+
+  void drain(Slot &_slot, OutputSink &_sink, StreamStats &_stats)
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [&_slot] { return !_slot.busy; });
+      if (!_slot.pending)
+        return;
+      _slot.pending = false;
+      _stats.gpuSeconds += _slot.gpuSeconds;
+    }
+    auto start = std::chrono::steady_clock::now();
+    _sink.write(_slot.out->contents(), _slot.offset, _slot.bytes);
+    _stats.readbackSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  MTL::CommandQueue *m_queue;
+  MTL::ComputePipelineState *m_pipeline;
+  size_t m_chunkBytes;
+  std::vector<Slot> m_slots;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+};
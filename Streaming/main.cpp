@@ -0,0 +1,148 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "StreamingExecutor.h"
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Streams a generated array, which can be much larger than device memory,
+// through the sqr kernel from Compute/main.cpp one chunk at a time.
+// usage : Streaming [size GB] [chunk MB] [chunks in flight] [output file]
+
+// checks every element as it arrives rather than storing the stream
+class CheckingSink : public OutputSink
+{
+public:
+  void write(const void *_data, size_t _offset, size_t _bytes) override
+  {
+    const float *out = static_cast<const float *>(_data);
+    size_t first = _offset / sizeof(float);
+    for (size_t i = 0; i < _bytes / sizeof(float); ++i)
+    {
+      float v = valueAt(first + i);
+      if (out[i] != v * v)
+        ++m_errors;
+    }
+  }
+  static float valueAt(size_t _index) { return static_cast<float>(_index % 1024) * 0.5f; }
+  size_t errors() const { return m_errors; }
+
+private:
+  size_t m_errors = 0;
+};
+
+void generate(void *_dst, size_t _offset, size_t _bytes)
+{
+  float *data = static_cast<float *>(_dst);
+  size_t first = _offset / sizeof(float);
+  for (size_t i = 0; i < _bytes / sizeof(float); ++i)
+    data[i] = CheckingSink::valueAt(first + i);
+}
+
+void report(const char *_name, const StreamStats &_stats)
+{
+  printf("%-12s %6zu chunks %8.3f s %7.2f GB/s  upload %7.3f s gpu %7.3f s readback %7.3f s  overlap %5.1f%%\n",
+         _name, _stats.chunks, _stats.wallSeconds, _stats.gbPerSecond(),
+         _stats.uploadSeconds, _stats.gpuSeconds, _stats.readbackSeconds, _stats.overlapEfficiency() * 100.0);
+}
+
+int main(int argc, char *argv[])
+{
+  double sizeGB = argc > 1 ? std::atof(argv[1]) : 4.0;
+  size_t chunkMB = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 64;
+  uint32_t inFlight = argc > 3 ? static_cast<uint32_t>(std::strtoul(argv[3], nullptr, 10)) : 3;
+  std::string outputFile = argc > 4 ? argv[4] : "";
+
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+
+  auto *shaderSrc = NS::String::string(
+      R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void sqr(
+            const device float *vIn [[ buffer(0) ]],
+            device float *vOut [[ buffer(1) ]],
+            constant uint &count [[ buffer(2) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            if (id < count)
+                vOut[id] = vIn[id] * vIn[id];
+        }
+    )""",
+      NS::ASCIIStringEncoding);
+
+  auto *compileOptions = MTL::CompileOptions::alloc()->init();
+  NS::Error *errorMessages = nullptr;
+  auto library = device->newLibrary(shaderSrc, compileOptions, &errorMessages);
+  assert(library);
+  auto sqrFunc = library->newFunction(NS::String::string("sqr", NS::ASCIIStringEncoding));
+  assert(sqrFunc);
+  auto *computePipelineState = device->newComputePipelineState(sqrFunc, &errorMessages);
+  assert(computePipelineState);
+  auto *commandQueue = device->newCommandQueue();
+  assert(commandQueue);
+
+  const size_t chunkBytes = chunkMB * 1024 * 1024;
+  const size_t totalBytes = static_cast<size_t>(sizeGB * 1024.0 * 1024.0 * 1024.0) / sizeof(float) * sizeof(float);
+  printf("streaming %.2f GB in %zu MB chunks, device working set %.2f GB\n",
+         totalBytes / 1e9, chunkMB, device->recommendedMaxWorkingSetSize() / 1e9);
+
+  // small run into memory first to check the result end to end
+  {
+    const size_t smallBytes = 3 * chunkBytes + 4 * sizeof(float); // forces a partial final chunk
+    std::vector<float> result(smallBytes / sizeof(float));
+    MemorySink sink(result.data());
+    StreamingExecutor executor(device, commandQueue, computePipelineState, chunkBytes, inFlight);
+    executor.run(generate, smallBytes, sink);
+    for (size_t i = 0; i < result.size(); ++i)
+    {
+      float v = CheckingSink::valueAt(i);
+      if (result[i] != v * v)
+      {
+        std::cerr << "Mismatch at " << i << '\n';
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  StreamStats baseline;
+  {
+    CheckingSink sink;
+    StreamingExecutor executor(device, commandQueue, computePipelineState, chunkBytes, 1);
+    baseline = executor.run(generate, totalBytes, sink);
+    report("serial", baseline);
+    if (sink.errors())
+      std::cerr << sink.errors() << " errors in serial run\n";
+  }
+
+  StreamStats overlapped;
+  {
+    StreamingExecutor executor(device, commandQueue, computePipelineState, chunkBytes, inFlight);
+    if (outputFile.empty())
+    {
+      CheckingSink sink;
+      overlapped = executor.run(generate, totalBytes, sink);
+      if (sink.errors())
+        std::cerr << sink.errors() << " errors in overlapped run\n";
+    }
+    else
+    {
+      FileSink sink(outputFile);
+      overlapped = executor.run(generate, totalBytes, sink);
+    }
+    std::string name = std::to_string(inFlight) + " in flight";
+    report(name.c_str(), overlapped);
+  }
+  printf("speedup over serial %.2fx\n", baseline.wallSeconds / overlapped.wallSeconds);
+
+  sqrFunc->release();
+  library->release();
+  compileOptions->release();
+  computePipelineState->release();
+  commandQueue->release();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,612 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "FrameGraph.h"
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Deferred lighting of a field of boxes lit by hundreds of point lights,
+// two ways, both built as a FrameGraph:
+//
+// tile      one render pass. The G-buffer (albedo, normal and linear depth)
+//           is rendered into colour attachments that are memoryless, they
+//           only ever exist in the imageblock in tile memory. A tile function
+//           then runs over each tile in the same pass, finds the depth range
+//           of the tile, culls the lights against the tile's frustum into
+//           threadgroup memory and shades every pixel from the imageblock,
+//           writing the result to attachment 0, the only one stored.
+// multipass the fallback for GPUs without tile shading. The G-buffer is stored
+//           to textures in a G-buffer pass and a compute pass reads them back
+//           to do the same culling and shading a 16x16 tile per threadgroup.
+//
+// Reports the memory the G-buffer takes, an estimate of the memory traffic a
+// frame (attachment loads and stores and textures read and written by
+// shaders, once each) and the GPU time. Tile shading needs an Apple4 family
+// GPU (A11 or later, Apple silicon Macs), elsewhere only the multipass path
+// runs.
+
+const char *shaderSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  constant uint MaxTileLights = 256;
+
+  struct Instance
+  {
+    float4 centre;
+    float4 halfSize;
+    float4 colour;
+  };
+
+  struct Light
+  {
+    float4 viewPositionRadius;
+    float4 colour;
+  };
+
+  struct Uniforms
+  {
+    float4x4 viewProjection;
+    float4x4 view;
+    // tan of half the field of view, x scaled by the aspect ratio
+    float2 tanHalfFov;
+    float2 screenSize;
+    float farZ;
+    uint lightCount;
+  };
+
+  struct RasteriserData
+  {
+    float4 position [[position]];
+    float3 viewNormal;
+    float viewDepth;
+    half4 albedo;
+  };
+
+  vertex RasteriserData gbufferVert(uint vertexID [[vertex_id]], uint instanceID [[instance_id]],
+                                    const device float4 *cube [[buffer(0)]],
+                                    const device Instance *instances [[buffer(1)]],
+                                    constant Uniforms &u [[buffer(2)]])
+  {
+    Instance instance = instances[instanceID];
+    float4 p = float4(instance.centre.xyz + cube[vertexID * 2].xyz * instance.halfSize.xyz, 1.0f);
+    RasteriserData out;
+    out.position = u.viewProjection * p;
+    out.viewNormal = (u.view * float4(cube[vertexID * 2 + 1].xyz, 0.0f)).xyz;
+    out.viewDepth = -(u.view * p).z;
+    out.albedo = half4(instance.colour);
+    return out;
+  }
+
+  // attachment 0 is the lit colour, only the lighting writes it
+  struct GBuffer
+  {
+    half4 albedo [[color(1)]];
+    half4 normal [[color(2)]];
+    float depth [[color(3)]];
+  };
+
+  fragment GBuffer gbufferFrag(RasteriserData in [[stage_in]])
+  {
+    GBuffer out;
+    out.albedo = in.albedo;
+    out.normal = half4(half3(normalize(in.viewNormal)), 0.0h);
+    out.depth = in.viewDepth;
+    return out;
+  }
+
+  // a tile's depth range, as the bits of positive floats which order the
+  // same as the floats, and the lights that reach it
+  struct TileData
+  {
+    atomic_uint minDepth;
+    atomic_uint maxDepth;
+    atomic_uint count;
+    uint lights[MaxTileLights];
+  };
+
+  void beginTile(threadgroup TileData &tile, uint lane)
+  {
+    if (lane == 0)
+    {
+      atomic_store_explicit(&tile.minDepth, as_type<uint>(FLT_MAX), memory_order_relaxed);
+      atomic_store_explicit(&tile.maxDepth, 0u, memory_order_relaxed);
+      atomic_store_explicit(&tile.count, 0u, memory_order_relaxed);
+    }
+  }
+
+  void addDepth(threadgroup TileData &tile, float depth, bool covered)
+  {
+    if (!covered)
+      return;
+    atomic_fetch_min_explicit(&tile.minDepth, as_type<uint>(depth), memory_order_relaxed);
+    atomic_fetch_max_explicit(&tile.maxDepth, as_type<uint>(depth), memory_order_relaxed);
+  }
+
+  // the lanes of the tile share the lights between them, each light is
+  // tested against the tile's depth range and its four side planes, which
+  // pass through the eye so are just the slopes of the tile's edges
+  void cullLights(threadgroup TileData &tile, constant Uniforms &u, const device Light *lights, uint2 tileIndex, uint2 tileSize,
+                  uint lane, uint lanes)
+  {
+    float minZ = as_type<float>(atomic_load_explicit(&tile.minDepth, memory_order_relaxed));
+    float maxZ = as_type<float>(atomic_load_explicit(&tile.maxDepth, memory_order_relaxed));
+    if (minZ > maxZ)
+      return;
+    float2 lo = float2(tileIndex * tileSize) / u.screenSize;
+    float2 hi = float2((tileIndex + 1) * tileSize) / u.screenSize;
+    float left = (lo.x * 2.0f - 1.0f) * u.tanHalfFov.x;
+    float right = (hi.x * 2.0f - 1.0f) * u.tanHalfFov.x;
+    float top = (1.0f - lo.y * 2.0f) * u.tanHalfFov.y;
+    float bottom = (1.0f - hi.y * 2.0f) * u.tanHalfFov.y;
+    float3 planes[4] = {normalize(float3(1.0f, 0.0f, left)), normalize(float3(-1.0f, 0.0f, -right)),
+                        normalize(float3(0.0f, 1.0f, bottom)), normalize(float3(0.0f, -1.0f, -top))};
+    for (uint i = lane; i < u.lightCount; i += lanes)
+    {
+      float4 light = lights[i].viewPositionRadius;
+      float z = -light.z;
+      if (z + light.w < minZ || z - light.w > maxZ)
+        continue;
+      bool inside = true;
+      for (int p = 0; p < 4; ++p)
+        inside = inside && dot(planes[p], light.xyz) >= -light.w;
+      if (!inside)
+        continue;
+      uint slot = atomic_fetch_add_explicit(&tile.count, 1u, memory_order_relaxed);
+      if (slot < MaxTileLights)
+        tile.lights[slot] = i;
+    }
+  }
+
+  half3 shade(threadgroup TileData &tile, constant Uniforms &u, const device Light *lights, float2 pixel, half4 albedo, half4 normal,
+              float depth)
+  {
+    if (depth >= u.farZ)
+      return half3(0.02h, 0.02h, 0.03h);
+    float2 ndc = float2(pixel.x / u.screenSize.x * 2.0f - 1.0f, 1.0f - pixel.y / u.screenSize.y * 2.0f);
+    float3 p = float3(ndc * u.tanHalfFov * depth, -depth);
+    float3 n = float3(normal.xyz);
+    float3 v = normalize(-p);
+    float3 colour = 0.03f * float3(albedo.rgb);
+    uint count = min(atomic_load_explicit(&tile.count, memory_order_relaxed), MaxTileLights);
+    for (uint i = 0; i < count; ++i)
+    {
+      Light light = lights[tile.lights[i]];
+      float3 toLight = light.viewPositionRadius.xyz - p;
+      float distance = length(toLight);
+      if (distance >= light.viewPositionRadius.w)
+        continue;
+      float3 l = toLight / distance;
+      float falloff = 1.0f - distance / light.viewPositionRadius.w;
+      float diffuse = max(dot(n, l), 0.0f);
+      float specular = 0.3f * pow(max(dot(n, normalize(l + v)), 0.0f), 32.0f);
+      colour += light.colour.rgb * falloff * falloff * (float3(albedo.rgb) * diffuse + specular);
+    }
+    return half3(colour);
+  }
+
+  // the whole G-buffer as the tile function sees it in the imageblock
+  struct TileGBuffer
+  {
+    half4 lit [[color(0)]];
+    half4 albedo [[color(1)]];
+    half4 normal [[color(2)]];
+    float depth [[color(3)]];
+  };
+
+  kernel void lightTile(imageblock<TileGBuffer, imageblock_layout_implicit> gbuffer,
+                        constant Uniforms &u [[buffer(0)]],
+                        const device Light *lights [[buffer(1)]],
+                        threadgroup TileData &tile [[threadgroup(0)]],
+                        ushort2 local [[thread_position_in_threadgroup]],
+                        ushort2 tileSize [[threads_per_threadgroup]],
+                        ushort2 tileIndex [[threadgroup_position_in_grid]])
+  {
+    uint lane = local.y * tileSize.x + local.x;
+    uint2 pixel = uint2(tileIndex) * uint2(tileSize) + uint2(local);
+    bool onScreen = all(float2(pixel) < u.screenSize);
+    beginTile(tile, lane);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    TileGBuffer g = gbuffer.read(local);
+    addDepth(tile, g.depth, onScreen && g.depth < u.farZ);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    cullLights(tile, u, lights, uint2(tileIndex), uint2(tileSize), lane, tileSize.x * tileSize.y);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    g.lit = half4(shade(tile, u, lights, float2(pixel) + 0.5f, g.albedo, g.normal, g.depth), 1.0h);
+    gbuffer.write(g, local);
+  }
+
+  kernel void lightCompute(texture2d<half> albedo [[texture(0)]],
+                           texture2d<half> normal [[texture(1)]],
+                           texture2d<float> depth [[texture(2)]],
+                           texture2d<half, access::write> lit [[texture(3)]],
+                           constant Uniforms &u [[buffer(0)]],
+                           const device Light *lights [[buffer(1)]],
+                           threadgroup TileData &tile [[threadgroup(0)]],
+                           ushort2 local [[thread_position_in_threadgroup]],
+                           ushort2 tileSize [[threads_per_threadgroup]],
+                           ushort2 tileIndex [[threadgroup_position_in_grid]])
+  {
+    uint lane = local.y * tileSize.x + local.x;
+    uint2 pixel = uint2(tileIndex) * uint2(tileSize) + uint2(local);
+    bool onScreen = all(float2(pixel) < u.screenSize);
+    beginTile(tile, lane);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    float d = onScreen ? depth.read(pixel).r : u.farZ;
+    addDepth(tile, d, d < u.farZ);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    cullLights(tile, u, lights, uint2(tileIndex), uint2(tileSize), lane, tileSize.x * tileSize.y);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (!onScreen)
+      return;
+    lit.write(half4(shade(tile, u, lights, float2(pixel) + 0.5f, albedo.read(pixel), normal.read(pixel), d), 1.0h), pixel);
+  }
+)""";
+
+struct Instance
+{
+  float centre[4];
+  float halfSize[4];
+  float colour[4];
+};
+
+struct Light
+{
+  float viewPositionRadius[4];
+  float colour[4];
+};
+
+// matches the shader's layout, padded to float4x4 alignment
+struct Uniforms
+{
+  float viewProjection[16];
+  float view[16];
+  float tanHalfFov[2];
+  float screenSize[2];
+  float farZ;
+  uint32_t lightCount;
+  uint32_t pad[2];
+};
+
+// the shader's TileData, rounded up to the 16 bytes threadgroup memory comes in
+constexpr NS::UInteger maxTileLights = 256;
+constexpr NS::UInteger tileMemory = (3 * 4 + maxTileLights * 4 + 15) / 16 * 16;
+constexpr NS::UInteger tileSize = 16;
+constexpr NS::UInteger width = 1920;
+constexpr NS::UInteger height = 1080;
+constexpr int frames = 60;
+constexpr int grid = 24;
+constexpr float spacing = 4.0f;
+constexpr uint32_t lightCount = 512;
+constexpr float farZ = 200.0f;
+
+// column major like float4x4, _a * _b
+void multiply(const float *_a, const float *_b, float *o_m)
+{
+  for (int c = 0; c < 4; ++c)
+    for (int r = 0; r < 4; ++r)
+    {
+      float sum = 0.0f;
+      for (int k = 0; k < 4; ++k)
+        sum += _a[k * 4 + r] * _b[c * 4 + k];
+      o_m[c * 4 + r] = sum;
+    }
+}
+
+// looking from _eye at _target with y up, with Metal's 0 to 1 depth range
+void setCamera(const float *_eye, const float *_target, Uniforms *o_uniforms)
+{
+  const float nearZ = 0.5f;
+  const float tanHalfFov = std::tan(0.5f * 60.0f * float(M_PI) / 180.0f);
+  const float aspect = float(width) / float(height);
+  const float zs = farZ / (nearZ - farZ);
+  const float projection[16] = {1.0f / (tanHalfFov * aspect), 0, 0, 0, 0, 1.0f / tanHalfFov, 0, 0, 0, 0, zs, -1, 0, 0, zs * nearZ, 0};
+  float f[3] = {_target[0] - _eye[0], _target[1] - _eye[1], _target[2] - _eye[2]};
+  float length = std::sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+  for (float &c : f)
+    c /= length;
+  float s[3] = {-f[2], 0.0f, f[0]};
+  length = std::sqrt(s[0] * s[0] + s[2] * s[2]);
+  for (float &c : s)
+    c /= length;
+  float u[3] = {s[1] * f[2] - s[2] * f[1], s[2] * f[0] - s[0] * f[2], s[0] * f[1] - s[1] * f[0]};
+  auto dot = [_eye](const float *_v) { return _v[0] * _eye[0] + _v[1] * _eye[1] + _v[2] * _eye[2]; };
+  const float view[16] = {s[0], u[0], -f[0], 0, s[1], u[1], -f[1], 0, s[2], u[2], -f[2], 0, -dot(s), -dot(u), dot(f), 1};
+  std::copy(view, view + 16, o_uniforms->view);
+  multiply(projection, view, o_uniforms->viewProjection);
+  o_uniforms->tanHalfFov[0] = tanHalfFov * aspect;
+  o_uniforms->tanHalfFov[1] = tanHalfFov;
+  o_uniforms->screenSize[0] = float(width);
+  o_uniforms->screenSize[1] = float(height);
+  o_uniforms->farZ = farZ;
+}
+
+// position then normal, two float4s a vertex, 36 vertices
+std::vector<float> makeCube()
+{
+  std::vector<float> vertices;
+  for (int axis = 0; axis < 3; ++axis)
+    for (float sign : {-1.0f, 1.0f})
+    {
+      // the two axes across the face, ordered so it winds counter clockwise
+      // seen from outside
+      int u = (axis + 1) % 3;
+      int v = (axis + 2) % 3;
+      if (sign < 0.0f)
+        std::swap(u, v);
+      float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+      for (int i : {0, 1, 2, 0, 2, 3})
+      {
+        float p[4] = {0, 0, 0, 1};
+        p[axis] = sign;
+        p[u] = corners[i][0];
+        p[v] = corners[i][1];
+        float n[4] = {0, 0, 0, 0};
+        n[axis] = sign;
+        vertices.insert(vertices.end(), p, p + 4);
+        vertices.insert(vertices.end(), n, n + 4);
+      }
+    }
+  return vertices;
+}
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  bool tileShading = device->supportsFamily(MTL::GPUFamilyApple4);
+  NS::Error *errorMessages = nullptr;
+  auto *library = device->newLibrary(NS::String::string(shaderSource, NS::UTF8StringEncoding), nullptr, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to compile shaders " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto *vertFunc = library->newFunction(NS::String::string("gbufferVert", NS::ASCIIStringEncoding));
+  auto *fragFunc = library->newFunction(NS::String::string("gbufferFrag", NS::ASCIIStringEncoding));
+  auto *tileFunc = library->newFunction(NS::String::string("lightTile", NS::ASCIIStringEncoding));
+  auto *computeFunc = library->newFunction(NS::String::string("lightCompute", NS::ASCIIStringEncoding));
+
+  const MTL::PixelFormat formats[] = {MTL::PixelFormatRGBA8Unorm, MTL::PixelFormatRGBA8Unorm, MTL::PixelFormatRGBA16Float, MTL::PixelFormatR32Float};
+  // the G-buffer pipelines only differ in whether the lit colour is attached
+  auto newGBufferPipeline = [&](bool _withLit) {
+    auto *desc = MTL::RenderPipelineDescriptor::alloc()->init();
+    desc->setVertexFunction(vertFunc);
+    desc->setFragmentFunction(fragFunc);
+    for (NS::UInteger i = _withLit ? 0 : 1; i < 4; ++i)
+      desc->colorAttachments()->object(i)->setPixelFormat(formats[i]);
+    desc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+    auto *pipeline = device->newRenderPipelineState(desc, &errorMessages);
+    desc->release();
+    if (!pipeline)
+    {
+      std::cerr << "Failed to create the G-buffer pipeline " << errorMessages->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    return pipeline;
+  };
+  auto *gbufferPipeline = newGBufferPipeline(false);
+  MTL::RenderPipelineState *tileGBufferPipeline = nullptr;
+  MTL::RenderPipelineState *tilePipeline = nullptr;
+  if (tileShading)
+  {
+    tileGBufferPipeline = newGBufferPipeline(true);
+    auto *tileDesc = MTL::TileRenderPipelineDescriptor::alloc()->init();
+    tileDesc->setTileFunction(tileFunc);
+    for (NS::UInteger i = 0; i < 4; ++i)
+      tileDesc->colorAttachments()->object(i)->setPixelFormat(formats[i]);
+    tileDesc->setThreadgroupSizeMatchesTileSize(true);
+    tilePipeline = device->newRenderPipelineState(tileDesc, MTL::PipelineOptionNone, nullptr, &errorMessages);
+    tileDesc->release();
+    if (!tilePipeline)
+    {
+      std::cerr << "Failed to create the tile pipeline " << errorMessages->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+  auto *computePipeline = device->newComputePipelineState(computeFunc, &errorMessages);
+  assert(computePipeline);
+  auto *depthDesc = MTL::DepthStencilDescriptor::alloc()->init();
+  depthDesc->setDepthCompareFunction(MTL::CompareFunctionLess);
+  depthDesc->setDepthWriteEnabled(true);
+  auto *depthState = device->newDepthStencilState(depthDesc);
+  depthDesc->release();
+
+  // a floor and a grid of boxes of random heights
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  std::vector<Instance> instances;
+  const float half = grid * spacing * 0.5f;
+  instances.push_back({{0.0f, -0.5f, 0.0f, 1.0f}, {half + spacing, 0.5f, half + spacing, 0.0f}, {0.6f, 0.6f, 0.6f, 1.0f}});
+  for (int z = 0; z < grid; ++z)
+    for (int x = 0; x < grid; ++x)
+    {
+      float h = 0.5f + 2.5f * unit(rng);
+      instances.push_back({{(float(x) + 0.5f) * spacing - half, h, (float(z) + 0.5f) * spacing - half, 1.0f},
+                           {0.8f + 0.6f * unit(rng), h, 0.8f + 0.6f * unit(rng), 0.0f},
+                           {0.4f + 0.6f * unit(rng), 0.4f + 0.6f * unit(rng), 0.4f + 0.6f * unit(rng), 1.0f}});
+    }
+  auto cube = makeCube();
+  const NS::UInteger cubeVertices = cube.size() / 8;
+  auto *cubeBuffer = device->newBuffer(cube.data(), cube.size() * sizeof(float), MTL::ResourceStorageModeShared);
+  auto *instanceBuffer = device->newBuffer(instances.data(), instances.size() * sizeof(Instance), MTL::ResourceStorageModeShared);
+
+  // lights circle the field at their own radius, speed and height
+  struct Orbit
+  {
+    float radius, speed, phase, height, reach;
+    float colour[3];
+  };
+  std::vector<Orbit> orbits(lightCount);
+  for (auto &o : orbits)
+    o = {half * unit(rng), 0.2f + unit(rng), 6.2831853f * unit(rng), 0.5f + 3.0f * unit(rng), 4.0f + 4.0f * unit(rng), {unit(rng), unit(rng), unit(rng)}};
+  auto *uniformBuffer = device->newBuffer(sizeof(Uniforms), MTL::ResourceStorageModeShared);
+  auto *lightBuffer = device->newBuffer(sizeof(Light) * lightCount, MTL::ResourceStorageModeShared);
+  const float eye[3] = {0.0f, 30.0f, half + 20.0f};
+  const float target[3] = {0.0f, 0.0f, 0.0f};
+  auto *uniforms = static_cast<Uniforms *>(uniformBuffer->contents());
+  setCamera(eye, target, uniforms);
+  uniforms->lightCount = lightCount;
+  auto updateLights = [&](float _time) {
+    auto *lights = static_cast<Light *>(lightBuffer->contents());
+    for (uint32_t i = 0; i < lightCount; ++i)
+    {
+      const auto &o = orbits[i];
+      float angle = o.phase + o.speed * _time;
+      float world[4] = {o.radius * std::cos(angle), o.height, o.radius * std::sin(angle), 1.0f};
+      for (int r = 0; r < 3; ++r)
+      {
+        float sum = 0.0f;
+        for (int k = 0; k < 4; ++k)
+          sum += uniforms->view[k * 4 + r] * world[k];
+        lights[i].viewPositionRadius[r] = sum;
+      }
+      lights[i].viewPositionRadius[3] = o.reach;
+      for (int c = 0; c < 3; ++c)
+        lights[i].colour[c] = o.colour[c];
+      lights[i].colour[3] = 1.0f;
+    }
+  };
+
+  auto *litDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, width, height, false);
+  litDesc->setUsage(MTL::TextureUsageRenderTarget | MTL::TextureUsageShaderWrite);
+  litDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *litTexture = device->newTexture(litDesc);
+  auto *commandQueue = device->newCommandQueue();
+
+  auto drawScene = [&](MTL::RenderCommandEncoder *_encoder, MTL::RenderPipelineState *_pipeline) {
+    _encoder->setRenderPipelineState(_pipeline);
+    _encoder->setDepthStencilState(depthState);
+    _encoder->setFrontFacingWinding(MTL::WindingCounterClockwise);
+    _encoder->setCullMode(MTL::CullModeBack);
+    _encoder->setVertexBuffer(cubeBuffer, 0, 0);
+    _encoder->setVertexBuffer(instanceBuffer, 0, 1);
+    _encoder->setVertexBuffer(uniformBuffer, 0, 2);
+    _encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, NS::UInteger(0), cubeVertices, instances.size());
+  };
+
+  auto buildGraph = [&](bool _tiled) {
+    auto graph = std::make_unique<FrameGraph>(device);
+    auto lit = graph->import("lit", litTexture);
+    auto albedo = graph->create("albedo", {formats[1], width, height});
+    auto normal = graph->create("normal", {formats[2], width, height});
+    auto linearDepth = graph->create("depth", {formats[3], width, height});
+    auto zbuffer = graph->create("zbuffer", {MTL::PixelFormatDepth32Float, width, height});
+    auto gbuffer = [=](FrameGraph::Builder &_b) {
+      _b.colour(albedo, 1, MTL::ClearColor(0.0, 0.0, 0.0, 0.0));
+      _b.colour(normal, 2, MTL::ClearColor(0.0, 0.0, 0.0, 0.0));
+      _b.colour(linearDepth, 3, MTL::ClearColor(farZ, 0.0, 0.0, 0.0));
+      _b.depth(zbuffer, 1.0);
+    };
+    if (_tiled)
+      graph->addRenderPass(
+          "gbuffer + lighting",
+          [=](FrameGraph::Builder &_b) {
+            _b.colour(lit, 0, MTL::ClearColor(0.0, 0.0, 0.0, 1.0));
+            gbuffer(_b);
+            _b.tiles(tileSize, tileSize, tileMemory);
+          },
+          [&](MTL::RenderCommandEncoder *_encoder, const FrameGraph &) {
+            drawScene(_encoder, tileGBufferPipeline);
+            // the tile function waits for every fragment in its tile, so it
+            // sees the finished G-buffer in the imageblock
+            _encoder->setRenderPipelineState(tilePipeline);
+            _encoder->setTileBuffer(uniformBuffer, 0, 0);
+            _encoder->setTileBuffer(lightBuffer, 0, 1);
+            _encoder->setThreadgroupMemoryLength(tileMemory, 0, 0);
+            _encoder->dispatchThreadsPerTile(MTL::Size(tileSize, tileSize, 1));
+          });
+    else
+    {
+      graph->addRenderPass("gbuffer", gbuffer, [&](MTL::RenderCommandEncoder *_encoder, const FrameGraph &) { drawScene(_encoder, gbufferPipeline); });
+      graph->addComputePass(
+          "lighting",
+          [=](FrameGraph::Builder &_b) {
+            _b.read(albedo);
+            _b.read(normal);
+            _b.read(linearDepth);
+            _b.write(lit);
+          },
+          [=](MTL::ComputeCommandEncoder *_encoder, const FrameGraph &_graph) {
+            _encoder->setComputePipelineState(computePipeline);
+            _encoder->setTexture(_graph.texture(albedo), 0);
+            _encoder->setTexture(_graph.texture(normal), 1);
+            _encoder->setTexture(_graph.texture(linearDepth), 2);
+            _encoder->setTexture(_graph.texture(lit), 3);
+            _encoder->setBuffer(uniformBuffer, 0, 0);
+            _encoder->setBuffer(lightBuffer, 0, 1);
+            _encoder->setThreadgroupMemoryLength(tileMemory, 0);
+            _encoder->dispatchThreadgroups(MTL::Size((width + tileSize - 1) / tileSize, (height + tileSize - 1) / tileSize, 1),
+                                           MTL::Size(tileSize, tileSize, 1));
+          });
+    }
+    if (!graph->compile())
+      exit(EXIT_FAILURE);
+    return graph;
+  };
+
+  printf("%dx%d boxes, %u lights at %lux%lu, %s\n", grid, grid, lightCount, width, height,
+         tileShading ? "tile shading supported" : "no tile shading on this GPU, multipass only");
+  printf("%-10s %12s %12s %16s %10s %14s\n", "path", "memory MB", "memoryless", "traffic MB/frame", "gpu ms", "GB/s at 60 fps");
+  auto mb = [](NS::UInteger _bytes) { return double(_bytes) / 1048576.0; };
+  double multipassMs = 0.0;
+  NS::UInteger multipassTraffic = 0;
+  for (bool tiled : {false, true})
+  {
+    if (tiled && !tileShading)
+      continue;
+    auto graph = buildGraph(tiled);
+    double gpuMs = 0.0;
+    for (int frame = 0; frame < frames; ++frame)
+    {
+      auto *pool = NS::AutoreleasePool::alloc()->init();
+      updateLights(float(frame) / 60.0f);
+      auto *commandBuffer = commandQueue->commandBuffer();
+      graph->execute(commandBuffer);
+      commandBuffer->commit();
+      commandBuffer->waitUntilCompleted();
+      gpuMs += (commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime()) * 1000.0;
+      pool->release();
+    }
+    gpuMs /= frames;
+    const auto &s = graph->stats();
+    NS::UInteger traffic = s.loadBytes + s.storeBytes + s.readBytes + s.writeBytes;
+    printf("%-10s %12.2f %12zu %16.2f %10.3f %14.2f", tiled ? "tile" : "multipass", mb(s.memoryBytes), s.memorylessTextures, mb(traffic), gpuMs,
+           double(traffic) * 60.0 / 1e9);
+    if (tiled)
+      printf("  %.1fx less traffic, %.2fx faster", double(multipassTraffic) / double(traffic), multipassMs / gpuMs);
+    else
+    {
+      multipassMs = gpuMs;
+      multipassTraffic = traffic;
+    }
+    printf("\n");
+    graph->print();
+  }
+
+  commandQueue->release();
+  litTexture->release();
+  lightBuffer->release();
+  uniformBuffer->release();
+  instanceBuffer->release();
+  cubeBuffer->release();
+  depthState->release();
+  computePipeline->release();
+  if (tilePipeline)
+  {
+    tilePipeline->release();
+    tileGBufferPipeline->release();
+  }
+  gbufferPipeline->release();
+  computeFunc->release();
+  tileFunc->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
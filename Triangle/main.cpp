@@ -2,6 +2,8 @@
 #define CA_PRIVATE_IMPLEMENTATION
 #define MTL_PRIVATE_IMPLEMENTATION
 #include "Metal.hpp"  
+#include "ShaderCache.h"
+#include "BindingTable.h"
 #include <iostream>
 #include <cstdlib>
 // based on https://github.com/naleksiev/mtlpp/blob/master/examples/02_triangle.cpp
@@ -30,11 +32,11 @@ fragment half4 fragFunc ()
     return half4(1.0);
 }
 )""",NS::ASCIIStringEncoding);
-    auto *compileOptions = MTL::CompileOptions::alloc()->init();
+    ShaderCache shaderCache(device);
 
     auto *errorDictionary = NS::Dictionary::dictionary();
     auto *errorMessages=NS::Error::alloc()->init(NS::CocoaErrorDomain,99,errorDictionary);
-    auto library = device->newLibrary(shader,compileOptions,&errorMessages); 
+    auto library = shaderCache.newLibrary(shader,ShaderOptions(),&errorMessages); 
     auto vertFunc = library->newFunction(NS::String::string("vertFunc",NS::ASCIIStringEncoding));
     auto fragFunc = library->newFunction(NS::String::string("fragFunc",NS::ASCIIStringEncoding));
     std::cout<<"Error Description "<<errorMessages->localizedDescription()<<'\n';
@@ -45,7 +47,10 @@ fragment half4 fragFunc ()
     renderPipelineDesc->setVertexFunction(vertFunc);
     renderPipelineDesc->setFragmentFunction(fragFunc);
     renderPipelineDesc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatR8Unorm);
-    auto * renderPipelineState = device->newRenderPipelineState(renderPipelineDesc,&errorMessages);
+    // reflection gives the vertex buffer index from the shader's argument name
+    RenderBindings bindings(device, renderPipelineDesc, &errorMessages);
+    auto * renderPipelineState = bindings.pipeline();
+    const auto vertexArraySlot = bindings.vertexSlot("vertexArray");
 
     std::cout<<"Error Description "<<errorMessages->localizedDescription()<<'\n';
     std::cout<<"localizedRecoverySuggestion "<<errorMessages->localizedRecoverySuggestion()<<'\n';
@@ -77,7 +82,7 @@ fragment half4 fragFunc ()
     auto renderCommandEncoder = commandBuffer->renderCommandEncoder(renderPassDesc);
     assert(renderCommandEncoder);
     renderCommandEncoder->setRenderPipelineState(renderPipelineState);
-    renderCommandEncoder->setVertexBuffer(vertexBuffer, 0, 0);
+    RenderBindings::setBuffer(renderCommandEncoder, vertexArraySlot, vertexBuffer);
     renderCommandEncoder->drawPrimitives(MTL::PrimitiveTypeTriangle,  NS::UInteger(0),  NS::UInteger(3));
     renderCommandEncoder->endEncoding();
 
@@ -0,0 +1,245 @@
+#define NS_PRIVATE_IMPLEMENTATION
+#define CA_PRIVATE_IMPLEMENTATION
+#define MTL_PRIVATE_IMPLEMENTATION
+#include "Metal.hpp"
+#include "VertexLayout.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// A million vertex mesh with a position, normal, colour and uv per vertex,
+// packed three ways and drawn with the same [[stage_in]] vertex shader, only
+// the pipeline's vertex descriptor changes:
+//
+// float   everything as float, 48 bytes a vertex
+// mixed   float positions, 10:10:10:2 snorm normals, unorm8 colours and half
+//         uvs, 24 bytes
+// compact as mixed with half positions, 20 bytes
+//
+// Reports the size of a vertex and of the vertex buffer, the time to pack it
+// on the CPU, the GPU time to draw it and the largest error the packing
+// introduced in each attribute.
+
+const char *shaderSource = R"""(
+  #include <metal_stdlib>
+  using namespace metal;
+
+  struct VertexIn
+  {
+    float3 position [[attribute(0)]];
+    float3 normal [[attribute(1)]];
+    float4 colour [[attribute(2)]];
+    float2 uv [[attribute(3)]];
+  };
+
+  struct RasteriserData
+  {
+    float4 position [[position]];
+    float4 colour;
+  };
+
+  vertex RasteriserData vertFunc(VertexIn in [[stage_in]], constant float &angle [[buffer(1)]])
+  {
+    float c = cos(angle);
+    float s = sin(angle);
+    float3 p = float3(in.position.x * c - in.position.z * s, in.position.y, in.position.x * s + in.position.z * c);
+    float3 n = float3(in.normal.x * c - in.normal.z * s, in.normal.y, in.normal.x * s + in.normal.z * c);
+    RasteriserData out;
+    out.position = float4(p.xy * 0.9f, p.z * 0.25f + 0.5f, 1.0f);
+    float light = 0.2f + 0.8f * max(dot(n, normalize(float3(0.3f, 0.6f, -1.0f))), 0.0f);
+    out.colour = float4(in.colour.rgb * light * (0.75f + 0.25f * fract(in.uv.x * 16.0f)), in.colour.a);
+    return out;
+  }
+
+  fragment float4 fragFunc(RasteriserData in [[stage_in]])
+  {
+    return in.colour;
+  }
+)""";
+
+constexpr int grid = 1024;
+constexpr int draws = 8;
+constexpr int frames = 20;
+constexpr int size = 512;
+
+struct Layout
+{
+  const char *name;
+  VertexLayout layout;
+};
+
+int main()
+{
+  auto device = MTL::CreateSystemDefaultDevice();
+  assert(device);
+  NS::Error *errorMessages = nullptr;
+  auto *library = device->newLibrary(NS::String::string(shaderSource, NS::UTF8StringEncoding), nullptr, &errorMessages);
+  if (!library)
+  {
+    std::cerr << "Failed to compile shaders " << errorMessages->localizedDescription()->utf8String() << '\n';
+    exit(EXIT_FAILURE);
+  }
+  auto vertFunc = library->newFunction(NS::String::string("vertFunc", NS::ASCIIStringEncoding));
+  auto fragFunc = library->newFunction(NS::String::string("fragFunc", NS::ASCIIStringEncoding));
+
+  // a rippled sheet in [-1, 1]
+  size_t vertexCount = size_t(grid) * grid;
+  std::vector<float> positions(vertexCount * 3);
+  std::vector<float> normals(vertexCount * 3);
+  std::vector<float> colours(vertexCount * 4);
+  std::vector<float> uvs(vertexCount * 2);
+  for (int y = 0; y < grid; ++y)
+    for (int x = 0; x < grid; ++x)
+    {
+      size_t v = size_t(y) * grid + x;
+      float u = float(x) / (grid - 1);
+      float w = float(y) / (grid - 1);
+      float px = u * 2.0f - 1.0f;
+      float py = w * 2.0f - 1.0f;
+      float height = 0.1f * std::sin(px * 12.0f) * std::cos(py * 9.0f);
+      positions[v * 3] = px;
+      positions[v * 3 + 1] = py;
+      positions[v * 3 + 2] = height;
+      float dx = 1.2f * std::cos(px * 12.0f) * std::cos(py * 9.0f);
+      float dy = -0.9f * std::sin(px * 12.0f) * std::sin(py * 9.0f);
+      float length = std::sqrt(dx * dx + dy * dy + 1.0f);
+      normals[v * 3] = -dx / length;
+      normals[v * 3 + 1] = -dy / length;
+      normals[v * 3 + 2] = 1.0f / length;
+      colours[v * 4] = u;
+      colours[v * 4 + 1] = w;
+      colours[v * 4 + 2] = 1.0f - u * w;
+      colours[v * 4 + 3] = 1.0f;
+      uvs[v * 2] = u;
+      uvs[v * 2 + 1] = w;
+    }
+  std::vector<uint32_t> indices;
+  indices.reserve(size_t(grid - 1) * (grid - 1) * 6);
+  for (uint32_t y = 0; y < grid - 1; ++y)
+    for (uint32_t x = 0; x < grid - 1; ++x)
+    {
+      uint32_t v = y * grid + x;
+      for (uint32_t i : {v, v + 1, v + grid, v + 1, v + grid + 1, v + grid})
+        indices.push_back(i);
+    }
+  auto *indexBuffer = device->newBuffer(indices.data(), indices.size() * sizeof(uint32_t), MTL::ResourceStorageModeShared);
+  const std::vector<const float *> streams = {positions.data(), normals.data(), colours.data(), uvs.data()};
+  const std::vector<const std::vector<float> *> sources = {&positions, &normals, &colours, &uvs};
+
+  std::vector<Layout> layouts(3);
+  layouts[0].name = "float";
+  layouts[0].layout.add(MTL::VertexFormatFloat3).add(MTL::VertexFormatFloat3).add(MTL::VertexFormatFloat4).add(MTL::VertexFormatFloat2);
+  layouts[1].name = "mixed";
+  layouts[1].layout.add(MTL::VertexFormatFloat3).add(MTL::VertexFormatInt1010102Normalized).add(MTL::VertexFormatUChar4Normalized).add(MTL::VertexFormatHalf2);
+  layouts[2].name = "compact";
+  layouts[2].layout.add(MTL::VertexFormatHalf3).add(MTL::VertexFormatInt1010102Normalized).add(MTL::VertexFormatUChar4Normalized).add(MTL::VertexFormatHalf2);
+
+  auto *colourDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatRGBA8Unorm, size, size, false);
+  colourDesc->setUsage(MTL::TextureUsageRenderTarget);
+  colourDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *colourTexture = device->newTexture(colourDesc);
+  auto *depthTextureDesc = MTL::TextureDescriptor::texture2DDescriptor(MTL::PixelFormatDepth32Float, size, size, false);
+  depthTextureDesc->setUsage(MTL::TextureUsageRenderTarget);
+  depthTextureDesc->setStorageMode(MTL::StorageModePrivate);
+  auto *depthTexture = device->newTexture(depthTextureDesc);
+  auto *depthDesc = MTL::DepthStencilDescriptor::alloc()->init();
+  depthDesc->setDepthCompareFunction(MTL::CompareFunctionLess);
+  depthDesc->setDepthWriteEnabled(true);
+  auto *depthState = device->newDepthStencilState(depthDesc);
+  depthDesc->release();
+  auto *commandQueue = device->newCommandQueue();
+
+  printf("%zu vertices, %zu triangles, drawn %d times a frame\n", vertexCount, indices.size() / 3, draws);
+  printf("%-8s %8s %10s %9s %9s %12s %12s %12s %12s\n", "layout", "bytes", "vertex MB", "pack ms", "gpu ms", "position err", "normal err",
+         "colour err", "uv err");
+  double floatMs = 0.0;
+  for (auto &l : layouts)
+  {
+    const auto &layout = l.layout;
+    auto *vertexBuffer = device->newBuffer(layout.stride() * vertexCount, MTL::ResourceStorageModeShared);
+    auto start = std::chrono::steady_clock::now();
+    layout.pack(streams, vertexCount, vertexBuffer->contents());
+    double packMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    float errors[4];
+    std::vector<float> unpacked;
+    for (size_t a = 0; a < layout.attributes(); ++a)
+    {
+      unpacked.resize(vertexCount * layout.components(a));
+      layout.unpack(a, vertexBuffer->contents(), vertexCount, unpacked.data());
+      errors[a] = 0.0f;
+      for (size_t i = 0; i < unpacked.size(); ++i)
+        errors[a] = std::max(errors[a], std::abs(unpacked[i] - (*sources[a])[i]));
+    }
+
+    auto *desc = MTL::RenderPipelineDescriptor::alloc()->init();
+    desc->setVertexFunction(vertFunc);
+    desc->setFragmentFunction(fragFunc);
+    desc->colorAttachments()->object(0)->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+    desc->setDepthAttachmentPixelFormat(MTL::PixelFormatDepth32Float);
+    auto *vertexDesc = layout.newDescriptor(0);
+    desc->setVertexDescriptor(vertexDesc);
+    vertexDesc->release();
+    auto *pipeline = device->newRenderPipelineState(desc, &errorMessages);
+    if (!pipeline)
+    {
+      std::cerr << "Failed to create the " << l.name << " pipeline " << errorMessages->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    desc->release();
+
+    double gpuMs = 0.0;
+    for (int frame = 0; frame < frames; ++frame)
+    {
+      auto *pool = NS::AutoreleasePool::alloc()->init();
+      auto *commandBuffer = commandQueue->commandBuffer();
+      auto *passDesc = MTL::RenderPassDescriptor::alloc()->init();
+      auto *colour = passDesc->colorAttachments()->object(0);
+      colour->setTexture(colourTexture);
+      colour->setLoadAction(MTL::LoadActionClear);
+      colour->setStoreAction(MTL::StoreActionStore);
+      auto *depth = passDesc->depthAttachment();
+      depth->setTexture(depthTexture);
+      depth->setLoadAction(MTL::LoadActionClear);
+      depth->setStoreAction(MTL::StoreActionDontCare);
+      auto *encoder = commandBuffer->renderCommandEncoder(passDesc);
+      encoder->setRenderPipelineState(pipeline);
+      encoder->setDepthStencilState(depthState);
+      encoder->setVertexBuffer(vertexBuffer, 0, 0);
+      for (int d = 0; d < draws; ++d)
+      {
+        float angle = 0.1f * float(frame * draws + d);
+        encoder->setVertexBytes(&angle, sizeof(float), 1);
+        encoder->drawIndexedPrimitives(MTL::PrimitiveTypeTriangle, indices.size(), MTL::IndexTypeUInt32, indexBuffer, 0);
+      }
+      encoder->endEncoding();
+      commandBuffer->commit();
+      commandBuffer->waitUntilCompleted();
+      gpuMs += (commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime()) * 1000.0;
+      passDesc->release();
+      pool->release();
+    }
+    gpuMs /= frames;
+    if (&l == &layouts[0])
+      floatMs = gpuMs;
+    printf("%-8s %8lu %10.2f %9.2f %9.3f %12.6f %12.6f %12.6f %12.6f", l.name, layout.stride(), layout.stride() * vertexCount / 1048576.0, packMs,
+           gpuMs, errors[0], errors[1], errors[2], errors[3]);
+    if (&l != &layouts[0])
+      printf("  %.2fx less memory, %.2fx faster", double(layouts[0].layout.stride()) / layout.stride(), floatMs / gpuMs);
+    printf("\n");
+    pipeline->release();
+    vertexBuffer->release();
+  }
+
+  commandQueue->release();
+  depthState->release();
+  depthTexture->release();
+  colourTexture->release();
+  indexBuffer->release();
+  fragFunc->release();
+  vertFunc->release();
+  library->release();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The result of an asynchronous Metal build. It can be polled from a render
+// loop with ready(), waited on with get() or chained with then(). The object is
+// retained while any copy of the result is alive so callers just borrow it.
+template <typename T>
+class AsyncResult
+{
+public:
+  AsyncResult() : m_state(std::make_shared<State>()) {}
+
+  bool ready() const { return m_state->done.load(std::memory_order_acquire); }
+
+  // blocks until the build has finished, nullptr if it failed
+  T *get() const
+  {
+    std::unique_lock<std::mutex> lock(m_state->mutex);
+    m_state->cv.wait(lock, [this] { return m_state->done.load(); });
+    return m_state->value;
+  }
+
+  std::string error() const
+  {
+    get();
+    return m_state->error;
+  }
+
+  // run _fn once the result is available, straight away if it already is.
+  // _fn may be called from a Metal completion thread.
+  void then(const std::function<void(T *)> &_fn) const
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_state->mutex);
+      if (!m_state->done)
+      {
+        m_state->continuations.push_back(_fn);
+        return;
+      }
+    }
+    _fn(m_state->value);
+  }
+
+  // called by the builder from the completion handler
+  void complete(T *_value, NS::Error *_error) const
+  {
+    std::vector<std::function<void(T *)>> continuations;
+    {
+      std::lock_guard<std::mutex> lock(m_state->mutex);
+      m_state->value = _value ? _value->retain() : nullptr;
+      if (_error)
+        m_state->error = _error->localizedDescription()->utf8String();
+      m_state->done.store(true, std::memory_order_release);
+      continuations.swap(m_state->continuations);
+    }
+    m_state->cv.notify_all();
+    for (auto &fn : continuations)
+      fn(m_state->value);
+  }
+
+private:
+  struct State
+  {
+    ~State()
+    {
+      if (value)
+        value->release();
+    }
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<bool> done{false};
+    T *value = nullptr;
+    std::string error;
+    std::vector<std::function<void(T *)>> continuations;
+  };
+  std::shared_ptr<State> m_state;
+};
+
+// Starts library and pipeline builds using the completion handler variants of
+// the MTL::Device calls so they all compile concurrently off the calling
+// thread. Every call returns straight away with an AsyncResult.
+class AsyncPipelineBuilder
+{
+public:
+  explicit AsyncPipelineBuilder(MTL::Device *_device) : m_device(_device) {}
+
+  // waits for anything still in flight, the handlers reference this object
+  ~AsyncPipelineBuilder() { waitAll(); }
+
+  AsyncResult<MTL::Library> newLibrary(const std::string &_source, const ShaderOptions &_options)
+  {
+    AsyncResult<MTL::Library> result;
+    auto *options = _options.newCompileOptions();
+    begin();
+    m_device->newLibrary(NS::String::string(_source.c_str(), NS::UTF8StringEncoding), options,
+                         [this, result](MTL::Library *_library, NS::Error *_error)
+                         {
+                           result.complete(_library, _error);
+                           end();
+                         });
+    options->release();
+    return result;
+  }
+
+  AsyncResult<MTL::ComputePipelineState> newComputePipelineState(const AsyncResult<MTL::Library> &_library, const std::string &_function)
+  {
+    AsyncResult<MTL::ComputePipelineState> result;
+    begin();
+    _library.then([this, result, _function](MTL::Library *_lib)
+    {
+      auto *func = _lib ? _lib->newFunction(NS::String::string(_function.c_str(), NS::UTF8StringEncoding)) : nullptr;
+      if (!func)
+      {
+        result.complete(nullptr, nullptr);
+        end();
+        return;
+      }
+      m_device->newComputePipelineState(func, [this, result](MTL::ComputePipelineState *_pipeline, NS::Error *_error)
+      {
+        result.complete(_pipeline, _error);
+        end();
+      });
+      func->release();
+    });
+    return result;
+  }
+
+  // _desc is copied so the caller can release or reuse it straight away
+  AsyncResult<MTL::RenderPipelineState> newRenderPipelineState(const MTL::RenderPipelineDescriptor *_desc)
+  {
+    AsyncResult<MTL::RenderPipelineState> result;
+    auto *desc = _desc->copy();
+    begin();
+    m_device->newRenderPipelineState(desc, [this, result](MTL::RenderPipelineState *_pipeline, NS::Error *_error)
+    {
+      result.complete(_pipeline, _error);
+      end();
+    });
+    desc->release();
+    return result;
+  }
+
+  size_t pending() const { return m_pending.load(); }
+
+  void waitAll()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this] { return m_pending.load() == 0; });
+  }
+
+private:
+  void begin() { ++m_pending; }
+  void end()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    --m_pending;
+    m_cv.notify_all();
+  }
+
+  MTL::Device *m_device;
+  std::atomic<size_t> m_pending{0};
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+};
@@ -0,0 +1,187 @@
+#pragma once
+#include "Metal.hpp"
+#include "StateFilter.h"
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+#include <vector>
+
+// What to draw, vertices are bound at buffer 0. Indexed if indices is set.
+struct BatchMesh
+{
+  MTL::Buffer *vertices = nullptr;
+  MTL::PrimitiveType primitive = MTL::PrimitiveTypeTriangle;
+  NS::UInteger vertexStart = 0;
+  NS::UInteger vertexCount = 0;
+  MTL::Buffer *indices = nullptr;
+  MTL::IndexType indexType = MTL::IndexTypeUInt16;
+  NS::UInteger indexOffset = 0;
+  NS::UInteger indexCount = 0;
+};
+
+// How to draw it, the fragment textures and sampler are bound from 0 up. Null
+// entries are bound as null, so a null depthStencil means the default state.
+struct BatchMaterial
+{
+  static constexpr int MaxTextures = 4;
+  MTL::RenderPipelineState *pipeline = nullptr;
+  MTL::DepthStencilState *depthStencil = nullptr;
+  std::array<const MTL::Texture *, MaxTextures> textures = {};
+  const MTL::SamplerState *sampler = nullptr;
+};
+
+// Collects draws for a frame and emits them as few instanced draws as it can.
+// Submissions are sorted by pipeline, then material, then mesh, every run with
+// the same material and mesh becomes one draw with an instance count, and the
+// per instance data (the Instance struct, read in the vertex shader with
+// [[instance_id]]) is packed into one buffer in that order. Each draw binds
+// the buffer at the offset of its first instance, which after the first draw
+// is only an offset change. State is set through a FilteredRenderEncoder so
+// nothing is sent twice.
+//
+// There is an instance buffer per frame in flight, begin() takes the slot
+// from a FramePacer or 0 when frames aren't overlapped.
+template <typename Instance>
+class BatchRenderer
+{
+public:
+  static_assert(sizeof(Instance) % 4 == 0, "instance data is bound at offsets that must be 4 byte aligned");
+
+  struct Stats
+  {
+    size_t submissions = 0;
+    size_t drawCalls = 0;
+    size_t pipelineChanges = 0;
+    size_t materialChanges = 0;
+  };
+
+  BatchRenderer(MTL::Device *_device, NS::UInteger _instanceBufferIndex = 1, unsigned _framesInFlight = 1)
+      : m_device(_device), m_instanceIndex(_instanceBufferIndex), m_buffers(std::max(1u, _framesInFlight), nullptr)
+  {
+  }
+
+  ~BatchRenderer()
+  {
+    for (auto *b : m_buffers)
+      if (b)
+        b->release();
+  }
+
+  BatchRenderer(const BatchRenderer &) = delete;
+  BatchRenderer &operator=(const BatchRenderer &) = delete;
+
+  void begin(unsigned _slot = 0)
+  {
+    m_slot = _slot % unsigned(m_buffers.size());
+    m_draws.clear();
+    m_instances.clear();
+    // ids are only used to sort this frame's draws, and a pointer seen in an
+    // earlier frame may since have been freed and reused for something else
+    m_pipelineIds.clear();
+    m_materialIds.clear();
+    m_meshIds.clear();
+  }
+
+  // _material and _mesh must live until flush()
+  void submit(const BatchMaterial *_material, const BatchMesh *_mesh, const Instance &_instance)
+  {
+    uint64_t key = uint64_t(idOf(m_pipelineIds, _material->pipeline)) << 48 | uint64_t(idOf(m_materialIds, _material)) << 24 |
+                   uint64_t(idOf(m_meshIds, _mesh));
+    m_draws.push_back({key, uint32_t(m_instances.size()), _material, _mesh});
+    m_instances.push_back(_instance);
+  }
+
+  // sort, pack and encode everything submitted since begin()
+  Stats flush(FilteredRenderEncoder &_encoder)
+  {
+    Stats stats;
+    stats.submissions = m_draws.size();
+    if (m_draws.empty())
+      return stats;
+    std::sort(m_draws.begin(), m_draws.end(), [](const Draw &_a, const Draw &_b) {
+      return _a.key != _b.key ? _a.key < _b.key : _a.instance < _b.instance;
+    });
+
+    auto *buffer = instanceBuffer(m_draws.size() * sizeof(Instance));
+    auto *packed = static_cast<Instance *>(buffer->contents());
+    for (size_t i = 0; i < m_draws.size(); ++i)
+      packed[i] = m_instances[m_draws[i].instance];
+
+    const MTL::RenderPipelineState *pipeline = nullptr;
+    const BatchMaterial *material = nullptr;
+    for (size_t first = 0; first < m_draws.size();)
+    {
+      size_t last = first + 1;
+      while (last < m_draws.size() && m_draws[last].key == m_draws[first].key)
+        ++last;
+      const auto &draw = m_draws[first];
+      if (draw.material->pipeline != pipeline)
+      {
+        pipeline = draw.material->pipeline;
+        ++stats.pipelineChanges;
+      }
+      if (draw.material != material)
+      {
+        material = draw.material;
+        ++stats.materialChanges;
+      }
+      // unset slots are bound as null too, otherwise they would keep what the
+      // previous material bound there; the filter drops the ones already null
+      _encoder.setRenderPipelineState(material->pipeline);
+      _encoder.setDepthStencilState(material->depthStencil);
+      for (NS::UInteger t = 0; t < BatchMaterial::MaxTextures; ++t)
+        _encoder.setFragmentTexture(material->textures[t], t);
+      _encoder.setFragmentSamplerState(material->sampler, 0);
+
+      const auto *mesh = draw.mesh;
+      auto instances = NS::UInteger(last - first);
+      _encoder.setVertexBuffer(mesh->vertices, 0, 0);
+      _encoder.setVertexBuffer(buffer, NS::UInteger(first * sizeof(Instance)), m_instanceIndex);
+      if (mesh->indices)
+        _encoder.drawIndexedPrimitives(mesh->primitive, mesh->indexCount, mesh->indexType, mesh->indices, mesh->indexOffset, instances);
+      else
+        _encoder.drawPrimitives(mesh->primitive, mesh->vertexStart, mesh->vertexCount, instances);
+      ++stats.drawCalls;
+      first = last;
+    }
+    return stats;
+  }
+
+private:
+  struct Draw
+  {
+    uint64_t key;
+    uint32_t instance;
+    const BatchMaterial *material;
+    const BatchMesh *mesh;
+  };
+
+  // a small id per pipeline, material and mesh, in the order they are first seen
+  static uint32_t idOf(std::unordered_map<const void *, uint32_t> &_ids, const void *_p)
+  {
+    return _ids.emplace(_p, uint32_t(_ids.size())).first->second;
+  }
+
+  MTL::Buffer *instanceBuffer(size_t _bytes)
+  {
+    auto *&buffer = m_buffers[m_slot];
+    if (!buffer || buffer->length() < _bytes)
+    {
+      if (buffer)
+        buffer->release();
+      // grow with some room so a growing scene doesn't reallocate every frame
+      buffer = m_device->newBuffer(_bytes + _bytes / 2, MTL::ResourceStorageModeShared | MTL::ResourceCPUCacheModeWriteCombined);
+    }
+    return buffer;
+  }
+
+  MTL::Device *m_device;
+  NS::UInteger m_instanceIndex;
+  std::vector<MTL::Buffer *> m_buffers;
+  unsigned m_slot = 0;
+  std::vector<Draw> m_draws;
+  std::vector<Instance> m_instances;
+  std::unordered_map<const void *, uint32_t> m_pipelineIds;
+  std::unordered_map<const void *, uint32_t> m_materialIds;
+  std::unordered_map<const void *, uint32_t> m_meshIds;
+};
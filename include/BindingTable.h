@@ -0,0 +1,302 @@
+#pragma once
+#include "Metal.hpp"
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Binding shader arguments by name instead of by a [[ buffer(n) ]] index that
+// has to be kept in step with the shader by hand. The pipeline is created once
+// with PipelineOptionArgumentInfo and the reflected arguments become a
+// BindingTable. Names are looked up when setting up, giving a BindSlot to keep
+// and bind through every frame, so there is no string work per draw. In debug
+// builds each bind checks the slot exists, is the right kind of argument and
+// that a buffer is big enough, release builds go straight to the encoder.
+
+enum class BindStage
+{
+  Vertex,
+  Fragment,
+  Compute
+};
+
+struct BindSlot
+{
+  static constexpr NS::UInteger Invalid = ~NS::UInteger(0);
+  NS::UInteger index = Invalid;
+  MTL::ArgumentType type = MTL::ArgumentTypeBuffer;
+  BindStage stage = BindStage::Compute;
+  // the size of what a buffer argument points to, 0 if not known
+  NS::UInteger dataSize = 0;
+  bool valid() const { return index != Invalid; }
+};
+
+class BindingTable
+{
+public:
+  struct Entry
+  {
+    std::string name;
+    BindSlot slot;
+    bool active;
+  };
+
+  BindingTable() = default;
+
+  BindingTable(const NS::Array *_arguments, BindStage _stage)
+  {
+    if (!_arguments)
+      return;
+    for (NS::UInteger i = 0; i < _arguments->count(); ++i)
+    {
+      auto *arg = _arguments->object<MTL::Argument>(i);
+      Entry e;
+      e.name = arg->name()->utf8String();
+      e.slot.index = arg->index();
+      e.slot.type = arg->type();
+      e.slot.stage = _stage;
+      e.slot.dataSize = arg->type() == MTL::ArgumentTypeBuffer ? arg->bufferDataSize() : 0;
+      e.active = arg->active();
+      m_entries.push_back(std::move(e));
+    }
+  }
+
+  // set up time only, an invalid slot if the shader has no such argument
+  BindSlot slot(const std::string &_name) const
+  {
+    for (auto &e : m_entries)
+      if (e.name == _name)
+        return e.slot;
+    return BindSlot{BindSlot::Invalid, MTL::ArgumentTypeBuffer, BindStage::Compute, 0};
+  }
+
+  const std::vector<Entry> &entries() const { return m_entries; }
+
+  void print(std::ostream &_out = std::cout) const
+  {
+    for (auto &e : m_entries)
+      _out << "  " << e.name << " -> " << e.slot.index << (e.active ? "" : " (unused)") << '\n';
+  }
+
+private:
+  std::vector<Entry> m_entries;
+};
+
+namespace binding
+{
+#ifdef NDEBUG
+inline void validate(const BindSlot &, MTL::ArgumentType, const MTL::Buffer * = nullptr, NS::UInteger = 0) {}
+#else
+inline void validate(const BindSlot &_slot, MTL::ArgumentType _type, const MTL::Buffer *_buffer = nullptr, NS::UInteger _offset = 0)
+{
+  assert(_slot.valid() && "binding to an argument the shader doesn't have");
+  assert(_slot.type == _type && "binding the wrong kind of resource to an argument");
+  if (_buffer && _slot.dataSize)
+    assert(_buffer->length() >= _offset + _slot.dataSize && "buffer too small for the argument");
+}
+#endif
+} // namespace binding
+
+// A compute pipeline and the binding table reflected from it.
+class ComputeBindings
+{
+public:
+  ComputeBindings(MTL::Device *_device, const MTL::Function *_function, NS::Error **_error)
+  {
+    MTL::ComputePipelineReflection *reflection = nullptr;
+    m_pipeline = _device->newComputePipelineState(_function, MTL::PipelineOptionArgumentInfo, &reflection, _error);
+    if (m_pipeline && reflection)
+      m_table = BindingTable(reflection->arguments(), BindStage::Compute);
+  }
+
+  ~ComputeBindings()
+  {
+    if (m_pipeline)
+      m_pipeline->release();
+  }
+
+  ComputeBindings(const ComputeBindings &) = delete;
+  ComputeBindings &operator=(const ComputeBindings &) = delete;
+
+  MTL::ComputePipelineState *pipeline() const { return m_pipeline; }
+  const BindingTable &table() const { return m_table; }
+  BindSlot slot(const std::string &_name) const { return m_table.slot(_name); }
+
+  static void setBuffer(MTL::ComputeCommandEncoder *_encoder, const BindSlot &_slot, const MTL::Buffer *_buffer, NS::UInteger _offset = 0)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeBuffer, _buffer, _offset);
+    assert(_slot.stage == BindStage::Compute);
+    _encoder->setBuffer(_buffer, _offset, _slot.index);
+  }
+
+  static void setBytes(MTL::ComputeCommandEncoder *_encoder, const BindSlot &_slot, const void *_bytes, NS::UInteger _length)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeBuffer);
+    assert(!_slot.dataSize || _length >= _slot.dataSize);
+    _encoder->setBytes(_bytes, _length, _slot.index);
+  }
+
+  static void setTexture(MTL::ComputeCommandEncoder *_encoder, const BindSlot &_slot, const MTL::Texture *_texture)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeTexture);
+    _encoder->setTexture(_texture, _slot.index);
+  }
+
+  static void setSamplerState(MTL::ComputeCommandEncoder *_encoder, const BindSlot &_slot, const MTL::SamplerState *_sampler)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeSampler);
+    _encoder->setSamplerState(_sampler, _slot.index);
+  }
+
+private:
+  MTL::ComputePipelineState *m_pipeline = nullptr;
+  BindingTable m_table;
+};
+
+// A render pipeline and a binding table for each of its stages. Slots carry
+// their stage so the same set calls work for vertex and fragment arguments.
+class RenderBindings
+{
+public:
+  RenderBindings(MTL::Device *_device, const MTL::RenderPipelineDescriptor *_desc, NS::Error **_error)
+  {
+    MTL::RenderPipelineReflection *reflection = nullptr;
+    m_pipeline = _device->newRenderPipelineState(_desc, MTL::PipelineOptionArgumentInfo, &reflection, _error);
+    if (m_pipeline && reflection)
+    {
+      m_vertex = BindingTable(reflection->vertexArguments(), BindStage::Vertex);
+      m_fragment = BindingTable(reflection->fragmentArguments(), BindStage::Fragment);
+    }
+  }
+
+  ~RenderBindings()
+  {
+    if (m_pipeline)
+      m_pipeline->release();
+  }
+
+  RenderBindings(const RenderBindings &) = delete;
+  RenderBindings &operator=(const RenderBindings &) = delete;
+
+  MTL::RenderPipelineState *pipeline() const { return m_pipeline; }
+  const BindingTable &vertexTable() const { return m_vertex; }
+  const BindingTable &fragmentTable() const { return m_fragment; }
+  BindSlot vertexSlot(const std::string &_name) const { return m_vertex.slot(_name); }
+  BindSlot fragmentSlot(const std::string &_name) const { return m_fragment.slot(_name); }
+
+  static void setBuffer(MTL::RenderCommandEncoder *_encoder, const BindSlot &_slot, const MTL::Buffer *_buffer, NS::UInteger _offset = 0)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeBuffer, _buffer, _offset);
+    if (_slot.stage == BindStage::Vertex)
+      _encoder->setVertexBuffer(_buffer, _offset, _slot.index);
+    else
+      _encoder->setFragmentBuffer(_buffer, _offset, _slot.index);
+  }
+
+  static void setBytes(MTL::RenderCommandEncoder *_encoder, const BindSlot &_slot, const void *_bytes, NS::UInteger _length)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeBuffer);
+    assert(!_slot.dataSize || _length >= _slot.dataSize);
+    if (_slot.stage == BindStage::Vertex)
+      _encoder->setVertexBytes(_bytes, _length, _slot.index);
+    else
+      _encoder->setFragmentBytes(_bytes, _length, _slot.index);
+  }
+
+  static void setTexture(MTL::RenderCommandEncoder *_encoder, const BindSlot &_slot, const MTL::Texture *_texture)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeTexture);
+    if (_slot.stage == BindStage::Vertex)
+      _encoder->setVertexTexture(_texture, _slot.index);
+    else
+      _encoder->setFragmentTexture(_texture, _slot.index);
+  }
+
+  static void setSamplerState(MTL::RenderCommandEncoder *_encoder, const BindSlot &_slot, const MTL::SamplerState *_sampler)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeSampler);
+    if (_slot.stage == BindStage::Vertex)
+      _encoder->setVertexSamplerState(_sampler, _slot.index);
+    else
+      _encoder->setFragmentSamplerState(_sampler, _slot.index);
+  }
+
+private:
+  MTL::RenderPipelineState *m_pipeline = nullptr;
+  BindingTable m_vertex;
+  BindingTable m_fragment;
+};
+
+// Buffer binds gathered up and applied together, consecutive indices of a
+// stage go to the encoder as one setBuffers call. Reuse one per draw with
+// clear() to avoid allocating.
+class BufferBatch
+{
+public:
+  // unlike binding straight to an encoder the slot indexes the batch's own
+  // arrays, so a slot the shader doesn't have or past the last binding point
+  // is dropped in release builds too, returning false
+  bool set(const BindSlot &_slot, MTL::Buffer *_buffer, NS::UInteger _offset = 0)
+  {
+    binding::validate(_slot, MTL::ArgumentTypeBuffer, _buffer, _offset);
+    if (!_slot.valid() || _slot.index >= MaxBuffers)
+      return false;
+    auto &stage = m_stages[static_cast<int>(_slot.stage)];
+    stage.buffers[_slot.index] = _buffer;
+    stage.offsets[_slot.index] = _offset;
+    stage.used |= uint32_t(1) << _slot.index;
+    return true;
+  }
+
+  void clear()
+  {
+    for (auto &s : m_stages)
+      s.used = 0;
+  }
+
+  void apply(MTL::ComputeCommandEncoder *_encoder)
+  {
+    forEachRun(m_stages[static_cast<int>(BindStage::Compute)],
+               [_encoder](MTL::Buffer **_buffers, const NS::UInteger *_offsets, NS::Range _range) { _encoder->setBuffers(_buffers, _offsets, _range); });
+  }
+
+  void apply(MTL::RenderCommandEncoder *_encoder)
+  {
+    forEachRun(m_stages[static_cast<int>(BindStage::Vertex)],
+               [_encoder](MTL::Buffer **_buffers, const NS::UInteger *_offsets, NS::Range _range) { _encoder->setVertexBuffers(_buffers, _offsets, _range); });
+    forEachRun(m_stages[static_cast<int>(BindStage::Fragment)],
+               [_encoder](MTL::Buffer **_buffers, const NS::UInteger *_offsets, NS::Range _range) { _encoder->setFragmentBuffers(_buffers, _offsets, _range); });
+  }
+
+private:
+  // Metal has 31 buffer binding points per stage
+  static constexpr int MaxBuffers = 31;
+
+  struct Stage
+  {
+    MTL::Buffer *buffers[MaxBuffers] = {};
+    NS::UInteger offsets[MaxBuffers] = {};
+    uint32_t used = 0;
+  };
+
+  template <typename F>
+  static void forEachRun(Stage &_stage, F &&_set)
+  {
+    int i = 0;
+    while (i < MaxBuffers)
+    {
+      if (!(_stage.used & (uint32_t(1) << i)))
+      {
+        ++i;
+        continue;
+      }
+      int start = i;
+      while (i < MaxBuffers && (_stage.used & (uint32_t(1) << i)))
+        ++i;
+      _set(_stage.buffers + start, _stage.offsets + start, NS::Range(start, i - start));
+    }
+  }
+
+  Stage m_stages[3];
+};
@@ -0,0 +1,128 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <system_error>
+#include <thread>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Calls a function on its own thread whenever a file changes. On Linux this
+// uses inotify on the containing directory, so editors that save by writing a
+// new file and renaming it over the old one are still seen. Everywhere else,
+// or if inotify can't be set up, the modification time is polled. Changes that
+// arrive close together are collapsed into one call so a half written file
+// isn't picked up.
+class FileWatcher
+{
+public:
+  using Callback = std::function<void(const std::string &)>;
+
+  FileWatcher(const std::string &_path, Callback _onChange, std::chrono::milliseconds _pollInterval = std::chrono::milliseconds(250))
+      : m_path(std::filesystem::absolute(_path)), m_onChange(std::move(_onChange)), m_pollInterval(_pollInterval)
+  {
+#if defined(__linux__)
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd >= 0 && inotify_add_watch(m_fd, m_path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+      close(m_fd);
+      m_fd = -1;
+    }
+#endif
+    m_thread = std::thread([this] { run(); });
+  }
+
+  ~FileWatcher()
+  {
+    m_quit = true;
+    m_thread.join();
+#if defined(__linux__)
+    if (m_fd >= 0)
+      close(m_fd);
+#endif
+  }
+
+  FileWatcher(const FileWatcher &) = delete;
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+  bool usingInotify() const { return m_fd >= 0; }
+
+private:
+  void run()
+  {
+#if defined(__linux__)
+    if (m_fd >= 0)
+    {
+      watchInotify();
+      return;
+    }
+#endif
+    watchPolling();
+  }
+
+#if defined(__linux__)
+  void watchInotify()
+  {
+    const auto name = m_path.filename().string();
+    alignas(inotify_event) char buffer[4096];
+    bool changed = false;
+    while (!m_quit)
+    {
+      pollfd pfd{m_fd, POLLIN, 0};
+      // once something has changed wait for things to settle before reporting
+      int ready = poll(&pfd, 1, changed ? SettleMs : int(m_pollInterval.count()));
+      if (ready > 0)
+      {
+        ssize_t len;
+        while ((len = read(m_fd, buffer, sizeof(buffer))) > 0)
+        {
+          for (char *p = buffer; p < buffer + len;)
+          {
+            auto *event = reinterpret_cast<inotify_event *>(p);
+            if (event->len && name == event->name)
+              changed = true;
+            p += sizeof(inotify_event) + event->len;
+          }
+        }
+      }
+      else if (ready == 0 && changed)
+      {
+        changed = false;
+        m_onChange(m_path.string());
+      }
+    }
+  }
+#endif
+
+  void watchPolling()
+  {
+    std::error_code ec;
+    auto last = std::filesystem::last_write_time(m_path, ec);
+    while (!m_quit)
+    {
+      std::this_thread::sleep_for(m_pollInterval);
+      auto now = std::filesystem::last_write_time(m_path, ec);
+      if (ec || now == last)
+        continue;
+      // wait for the writer to finish, the time moves on if it hasn't
+      std::this_thread::sleep_for(std::chrono::milliseconds(SettleMs));
+      last = std::filesystem::last_write_time(m_path, ec);
+      if (!ec)
+        m_onChange(m_path.string());
+    }
+  }
+
+  static constexpr int SettleMs = 50;
+
+  std::filesystem::path m_path;
+  Callback m_onChange;
+  std::chrono::milliseconds m_pollInterval;
+  std::atomic<bool> m_quit{false};
+  int m_fd = -1;
+  std::thread m_thread;
+};
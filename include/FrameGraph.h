@@ -0,0 +1,672 @@
+#pragma once
+#include "Metal.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+// Builds a frame out of passes that say which textures they use rather than
+// how. Each pass declares, in a setup callback, the textures it renders to,
+// samples and writes from a shader; compile() then works out everything the
+// examples otherwise wire by hand:
+//
+// - passes that don't lead to an imported texture (or to a pass marked as
+//   having side effects) are culled
+// - passes run in the order they were added. Each write makes a new version
+//   of a texture and a pass sees the version written by the last pass added
+//   before it, so a ping-pong between two textures needs no more than adding
+//   its passes in order. Reading a transient texture before any pass has
+//   written it is an error
+// - transient textures (created by the graph) whose lifetimes don't overlap
+//   share memory, placed in one heap
+// - attachments are cleared, loaded or left undefined, and stored only when a
+//   later pass reads them. A transient texture only ever used as an attachment
+//   of one pass is memoryless on GPUs that have tile memory
+// - the heap is untracked so fences are put between passes that touch the
+//   same memory, including textures aliasing each other. Nothing fences one
+//   execute() against the next though, so the transient textures (aliased or
+//   not) are only safe with one frame in flight: wait for a frame before
+//   executing the graph again, or build a graph per frame in flight
+//
+// With _optimise false the graph still orders the passes but runs all of them,
+// gives every texture its own tracked allocation and stores every attachment,
+// which is what the hand wired examples do, to compare against.
+class FrameGraph
+{
+  struct Pass;
+
+public:
+  using Handle = uint32_t;
+
+  struct TextureDesc
+  {
+    MTL::PixelFormat format;
+    NS::UInteger width;
+    NS::UInteger height;
+  };
+
+  // per frame
+  struct Stats
+  {
+    size_t passes = 0;
+    size_t culledPasses = 0;
+    size_t fences = 0;
+    size_t transientTextures = 0;
+    size_t aliasedTextures = 0;
+    size_t memorylessTextures = 0;
+    // what the transient textures would take allocated one by one
+    NS::UInteger unaliasedBytes = 0;
+    NS::UInteger memoryBytes = 0;
+    NS::UInteger loadBytes = 0;
+    NS::UInteger storeBytes = 0;
+    // textures read and written by shaders, counted once over the texture
+    NS::UInteger readBytes = 0;
+    NS::UInteger writeBytes = 0;
+  };
+
+  class Builder
+  {
+  public:
+    // render to a colour attachment, cleared first
+    void colour(Handle _texture, NS::UInteger _index, MTL::ClearColor _clear)
+    {
+      m_pass.attachments.push_back({_texture, _index, false, true, _clear, 0.0});
+    }
+
+    // render to a colour attachment on top of what earlier passes wrote
+    void colour(Handle _texture, NS::UInteger _index)
+    {
+      m_pass.attachments.push_back({_texture, _index, false, false, {}, 0.0});
+    }
+
+    void depth(Handle _texture, double _clear)
+    {
+      m_pass.attachments.push_back({_texture, 0, true, true, {}, _clear});
+    }
+
+    void depth(Handle _texture)
+    {
+      m_pass.attachments.push_back({_texture, 0, true, false, {}, 0.0});
+    }
+
+    // sampled or read in a shader
+    void read(Handle _texture)
+    {
+      m_pass.reads.push_back(_texture);
+    }
+
+    // written from a shader, all of it. A pass writing only part of the
+    // texture reads it too so the writes before it are kept
+    void write(Handle _texture)
+    {
+      m_pass.writes.push_back(_texture);
+    }
+
+    // for a render pass that dispatches tile functions, the tile size and the
+    // threadgroup memory each tile has for the length of the pass
+    void tiles(NS::UInteger _width, NS::UInteger _height, NS::UInteger _threadgroupMemory)
+    {
+      m_pass.tileWidth = _width;
+      m_pass.tileHeight = _height;
+      m_pass.threadgroupMemory = _threadgroupMemory;
+    }
+
+    // never cull the pass, for passes whose results leave the graph some other
+    // way than an imported texture
+    void sideEffect()
+    {
+      m_pass.sideEffect = true;
+    }
+
+  private:
+    friend class FrameGraph;
+    explicit Builder(Pass &_pass) : m_pass(_pass) {}
+    Pass &m_pass;
+  };
+
+  using RenderFunc = std::function<void(MTL::RenderCommandEncoder *, const FrameGraph &)>;
+  using ComputeFunc = std::function<void(MTL::ComputeCommandEncoder *, const FrameGraph &)>;
+
+  FrameGraph(MTL::Device *_device, bool _optimise = true) : m_device(_device), m_optimise(_optimise) {}
+
+  ~FrameGraph()
+  {
+    for (auto &t : m_textures)
+      if (!t.imported && t.texture)
+        t.texture->release();
+    for (auto *f : m_fences)
+      f->release();
+    if (m_heap)
+      m_heap->release();
+  }
+
+  FrameGraph(const FrameGraph &) = delete;
+  FrameGraph &operator=(const FrameGraph &) = delete;
+
+  // a texture the graph allocates, its contents only live for the frame
+  Handle create(const char *_name, const TextureDesc &_desc)
+  {
+    m_textures.push_back({_name, _desc, nullptr, false});
+    return Handle(m_textures.size() - 1);
+  }
+
+  // a texture from outside the graph, anything written to it is kept
+  Handle import(const char *_name, MTL::Texture *_texture)
+  {
+    m_textures.push_back({_name, {_texture->pixelFormat(), _texture->width(), _texture->height()}, _texture, true});
+    return Handle(m_textures.size() - 1);
+  }
+
+  void addRenderPass(const char *_name, const std::function<void(Builder &)> &_setup, RenderFunc _execute)
+  {
+    m_passes.emplace_back();
+    m_passes.back().name = _name;
+    m_passes.back().render = std::move(_execute);
+    Builder builder(m_passes.back());
+    _setup(builder);
+    assert(!m_passes.back().attachments.empty() && "a render pass needs an attachment");
+  }
+
+  void addComputePass(const char *_name, const std::function<void(Builder &)> &_setup, ComputeFunc _execute)
+  {
+    m_passes.emplace_back();
+    m_passes.back().name = _name;
+    m_passes.back().compute = std::move(_execute);
+    Builder builder(m_passes.back());
+    _setup(builder);
+  }
+
+  // the texture behind a handle, for the execute callbacks
+  MTL::Texture *texture(Handle _texture) const
+  {
+    return m_textures[_texture].texture;
+  }
+
+  // after every pass has been added, false if the passes depend on each other
+  // in a loop
+  bool compile()
+  {
+    assert(!m_compiled);
+    m_compiled = true;
+    if (!linkPasses())
+      return false;
+    cullPasses();
+    for (size_t p = 0; p < m_order.size(); ++p)
+      for (Handle t : touched(m_passes[m_order[p]]))
+      {
+        auto &texture = m_textures[t];
+        if (texture.first == NoPass)
+          texture.first = p;
+        texture.last = p;
+      }
+    inferActions();
+    allocate();
+    placeFences();
+    return true;
+  }
+
+  // encode every pass that survived culling, one encoder each
+  void execute(MTL::CommandBuffer *_commandBuffer) const
+  {
+    assert(m_compiled);
+    for (size_t p = 0; p < m_order.size(); ++p)
+    {
+      const auto &pass = m_passes[m_order[p]];
+      auto *label = NS::String::string(pass.name.c_str(), NS::UTF8StringEncoding);
+      if (pass.render)
+      {
+        auto *desc = MTL::RenderPassDescriptor::alloc()->init();
+        for (const auto &a : pass.attachments)
+        {
+          MTL::RenderPassAttachmentDescriptor *attachment;
+          if (a.isDepth)
+          {
+            desc->depthAttachment()->setClearDepth(a.clearDepth);
+            attachment = desc->depthAttachment();
+          }
+          else
+          {
+            desc->colorAttachments()->object(a.index)->setClearColor(a.clearColour);
+            attachment = desc->colorAttachments()->object(a.index);
+          }
+          attachment->setTexture(m_textures[a.texture].texture);
+          attachment->setLoadAction(a.load);
+          attachment->setStoreAction(a.store);
+        }
+        if (pass.tileWidth)
+        {
+          desc->setTileWidth(pass.tileWidth);
+          desc->setTileHeight(pass.tileHeight);
+          desc->setThreadgroupMemoryLength(pass.threadgroupMemory);
+        }
+        auto *encoder = _commandBuffer->renderCommandEncoder(desc);
+        desc->release();
+        encoder->setLabel(label);
+        for (size_t f : pass.waits)
+          encoder->waitForFence(m_fences[m_fenceOf[f]], MTL::RenderStageVertex);
+        pass.render(encoder, *this);
+        if (m_fenceOf[p] != NoPass)
+          encoder->updateFence(m_fences[m_fenceOf[p]], MTL::RenderStageFragment);
+        encoder->endEncoding();
+      }
+      else
+      {
+        auto *encoder = _commandBuffer->computeCommandEncoder();
+        encoder->setLabel(label);
+        for (size_t f : pass.waits)
+          encoder->waitForFence(m_fences[m_fenceOf[f]]);
+        pass.compute(encoder, *this);
+        if (m_fenceOf[p] != NoPass)
+          encoder->updateFence(m_fences[m_fenceOf[p]]);
+        encoder->endEncoding();
+      }
+    }
+  }
+
+  const Stats &stats() const
+  {
+    return m_stats;
+  }
+
+  // the compiled frame, pass by pass, then where each texture lives
+  void print() const
+  {
+    static const char *loads[] = {"dontcare", "load", "clear"};
+    static const char *stores[] = {"dontcare", "store"};
+    for (const auto &pass : m_passes)
+      if (pass.culled)
+        printf("  culled %s\n", pass.name.c_str());
+    for (size_t p = 0; p < m_order.size(); ++p)
+    {
+      const auto &pass = m_passes[m_order[p]];
+      printf("  %zu %s%s", p, pass.name.c_str(), pass.render ? "" : " (compute)");
+      for (size_t f : pass.waits)
+        printf(", waits for %s", m_passes[m_order[f]].name.c_str());
+      printf("\n");
+      for (const auto &a : pass.attachments)
+        printf("      %-10s %-8s %-8s\n", m_textures[a.texture].name.c_str(), loads[a.load], stores[a.store]);
+    }
+    for (const auto &t : m_textures)
+    {
+      if (t.first == NoPass)
+        printf("  %-10s unused\n", t.name.c_str());
+      else if (t.imported)
+        printf("  %-10s imported\n", t.name.c_str());
+      else if (t.memoryless)
+        printf("  %-10s passes %zu-%zu, memoryless\n", t.name.c_str(), t.first, t.last);
+      else if (t.inHeap)
+        printf("  %-10s passes %zu-%zu, %8.2f MB at %8.2f MB in the heap\n", t.name.c_str(), t.first, t.last, t.size / 1048576.0, t.offset / 1048576.0);
+      else
+        printf("  %-10s passes %zu-%zu, %8.2f MB\n", t.name.c_str(), t.first, t.last, t.size / 1048576.0);
+    }
+  }
+
+private:
+  static constexpr size_t NoPass = size_t(-1);
+
+  struct Attachment
+  {
+    Handle texture;
+    NS::UInteger index;
+    bool isDepth;
+    bool clear;
+    MTL::ClearColor clearColour;
+    double clearDepth;
+    MTL::LoadAction load = MTL::LoadActionDontCare;
+    MTL::StoreAction store = MTL::StoreActionStore;
+  };
+
+  struct Pass
+  {
+    std::string name;
+    RenderFunc render;
+    ComputeFunc compute;
+    std::vector<Attachment> attachments;
+    std::vector<Handle> reads;
+    std::vector<Handle> writes;
+    bool sideEffect = false;
+    NS::UInteger tileWidth = 0;
+    NS::UInteger tileHeight = 0;
+    NS::UInteger threadgroupMemory = 0;
+    bool culled = false;
+    // indices into m_passes of the passes that wrote the versions it reads
+    std::vector<size_t> producers;
+    // positions in m_order of the passes whose fences this one waits for
+    std::vector<size_t> waits;
+  };
+
+  struct Texture
+  {
+    std::string name;
+    TextureDesc desc;
+    MTL::Texture *texture;
+    bool imported;
+    MTL::TextureUsage usage = MTL::TextureUsageUnknown;
+    // index into m_passes of the pass writing its final version
+    size_t lastWriter = NoPass;
+    // positions in m_order of the first and last pass using it
+    size_t first = NoPass;
+    size_t last = NoPass;
+    bool memoryless = false;
+    bool inHeap = false;
+    NS::UInteger size = 0;
+    NS::UInteger align = 0;
+    NS::UInteger offset = 0;
+  };
+
+  // whether the pass needs what was in the texture before it ran
+  static bool readsFrom(const Pass &_pass, Handle _texture)
+  {
+    if (std::find(_pass.reads.begin(), _pass.reads.end(), _texture) != _pass.reads.end())
+      return true;
+    for (const auto &a : _pass.attachments)
+      if (a.texture == _texture && !a.clear)
+        return true;
+    return false;
+  }
+
+  static bool writesTo(const Pass &_pass, Handle _texture)
+  {
+    if (std::find(_pass.writes.begin(), _pass.writes.end(), _texture) != _pass.writes.end())
+      return true;
+    for (const auto &a : _pass.attachments)
+      if (a.texture == _texture)
+        return true;
+    return false;
+  }
+
+  static std::set<Handle> touched(const Pass &_pass)
+  {
+    std::set<Handle> textures(_pass.reads.begin(), _pass.reads.end());
+    textures.insert(_pass.writes.begin(), _pass.writes.end());
+    for (const auto &a : _pass.attachments)
+      textures.insert(a.texture);
+    return textures;
+  }
+
+  static NS::UInteger bytesPerPixel(MTL::PixelFormat _format)
+  {
+    switch (_format)
+    {
+    case MTL::PixelFormatR8Unorm:
+      return 1;
+    case MTL::PixelFormatR16Float:
+    case MTL::PixelFormatDepth16Unorm:
+      return 2;
+    case MTL::PixelFormatRGBA16Float:
+    case MTL::PixelFormatDepth32Float_Stencil8:
+      return 8;
+    case MTL::PixelFormatRGBA32Float:
+      return 16;
+    default:
+      // the 32 bit formats, RGBA8, BGRA8, RG16F, R32F, RGB10A2, RG11B10F,
+      // Depth32F
+      return 4;
+    }
+  }
+
+  NS::UInteger attachmentBytes(Handle _texture) const
+  {
+    const auto &desc = m_textures[_texture].desc;
+    return desc.width * desc.height * bytesPerPixel(desc.format);
+  }
+
+  // works out which pass wrote the version of each texture a pass reads.
+  // Running the passes in the order they were added puts every reader after
+  // the writer of the version it reads and every writer after the readers of
+  // the version it replaces, so that order is kept as it is.
+  bool linkPasses()
+  {
+    for (size_t p = 0; p < m_passes.size(); ++p)
+    {
+      auto &pass = m_passes[p];
+      auto textures = touched(pass);
+      for (Handle t : textures)
+      {
+        if (!readsFrom(pass, t))
+          continue;
+        auto &texture = m_textures[t];
+        if (texture.lastWriter != NoPass)
+          pass.producers.push_back(texture.lastWriter);
+        else if (!texture.imported)
+        {
+          std::cerr << "FrameGraph: " << pass.name << " reads " << texture.name << " before any pass writes it\n";
+          return false;
+        }
+      }
+      for (Handle t : textures)
+        if (writesTo(pass, t))
+          m_textures[t].lastWriter = p;
+      m_order.push_back(p);
+    }
+    return true;
+  }
+
+  // walk back from the passes whose results are kept, the final versions of
+  // imported textures and side effects, marking the passes they read from
+  void cullPasses()
+  {
+    std::vector<bool> needed(m_passes.size(), !m_optimise);
+    for (const auto &t : m_textures)
+      if (t.imported && t.lastWriter != NoPass)
+        needed[t.lastWriter] = true;
+    std::vector<size_t> kept;
+    for (size_t i = m_order.size(); i-- > 0;)
+    {
+      auto &pass = m_passes[m_order[i]];
+      if (!needed[m_order[i]] && !pass.sideEffect)
+      {
+        pass.culled = true;
+        ++m_stats.culledPasses;
+        continue;
+      }
+      for (size_t p : pass.producers)
+        needed[p] = true;
+      kept.push_back(m_order[i]);
+    }
+    m_order.assign(kept.rbegin(), kept.rend());
+    m_stats.passes = m_order.size();
+  }
+
+  void inferActions()
+  {
+    for (size_t p = 0; p < m_order.size(); ++p)
+    {
+      auto &pass = m_passes[m_order[p]];
+      for (Handle t : pass.reads)
+      {
+        m_textures[t].usage |= MTL::TextureUsageShaderRead;
+        m_stats.readBytes += attachmentBytes(t);
+      }
+      for (Handle t : pass.writes)
+      {
+        m_textures[t].usage |= MTL::TextureUsageShaderWrite;
+        m_stats.writeBytes += attachmentBytes(t);
+      }
+      for (auto &a : pass.attachments)
+      {
+        const auto &texture = m_textures[a.texture];
+        m_textures[a.texture].usage |= MTL::TextureUsageRenderTarget;
+        bool writtenBefore = texture.imported;
+        for (size_t q = 0; q < p && !writtenBefore; ++q)
+          writtenBefore = writesTo(m_passes[m_order[q]], a.texture);
+        // stored if the version this pass leaves is read before another
+        // pass replaces it
+        bool readAfter = texture.imported;
+        for (size_t q = p + 1; q < m_order.size() && !readAfter; ++q)
+        {
+          const auto &later = m_passes[m_order[q]];
+          readAfter = readsFrom(later, a.texture);
+          if (!readAfter && writesTo(later, a.texture))
+            break;
+        }
+
+        a.load = a.clear ? MTL::LoadActionClear : writtenBefore ? MTL::LoadActionLoad : MTL::LoadActionDontCare;
+        a.store = readAfter || !m_optimise ? MTL::StoreActionStore : MTL::StoreActionDontCare;
+        if (a.load == MTL::LoadActionLoad)
+          m_stats.loadBytes += attachmentBytes(a.texture);
+        if (a.store == MTL::StoreActionStore)
+          m_stats.storeBytes += attachmentBytes(a.texture);
+      }
+    }
+  }
+
+  void allocate()
+  {
+    bool tileMemory = m_optimise && m_device->supportsFamily(MTL::GPUFamilyApple1);
+    std::vector<Handle> placed;
+    for (Handle t = 0; t < m_textures.size(); ++t)
+    {
+      auto &texture = m_textures[t];
+      if (texture.imported || texture.first == NoPass)
+        continue;
+      ++m_stats.transientTextures;
+      auto *desc = MTL::TextureDescriptor::texture2DDescriptor(texture.desc.format, texture.desc.width, texture.desc.height, false);
+      desc->setUsage(texture.usage);
+      desc->setStorageMode(MTL::StorageModePrivate);
+      auto sizeAndAlign = m_device->heapTextureSizeAndAlign(desc);
+      texture.size = sizeAndAlign.size;
+      texture.align = sizeAndAlign.align;
+      m_stats.unaliasedBytes += texture.size;
+      if (tileMemory && texture.first == texture.last && texture.usage == MTL::TextureUsageRenderTarget)
+      {
+        // its contents never leave the tile so it needs no memory at all
+        desc->setStorageMode(MTL::StorageModeMemoryless);
+        texture.texture = m_device->newTexture(desc);
+        texture.memoryless = true;
+        ++m_stats.memorylessTextures;
+      }
+      else if (!m_optimise)
+      {
+        texture.texture = m_device->newTexture(desc);
+        m_stats.memoryBytes += texture.size;
+      }
+      else
+      {
+        texture.inHeap = true;
+        placed.push_back(t);
+      }
+    }
+    if (placed.empty())
+      return;
+
+    // largest first, each at the lowest offset clear of every placed texture
+    // it is alive at the same time as
+    std::stable_sort(placed.begin(), placed.end(), [this](Handle _a, Handle _b) { return m_textures[_a].size > m_textures[_b].size; });
+    NS::UInteger heapSize = 0;
+    for (size_t i = 0; i < placed.size(); ++i)
+    {
+      auto &texture = m_textures[placed[i]];
+      std::vector<const Texture *> alive;
+      for (size_t j = 0; j < i; ++j)
+      {
+        const auto &other = m_textures[placed[j]];
+        if (other.first <= texture.last && texture.first <= other.last)
+          alive.push_back(&other);
+      }
+      std::sort(alive.begin(), alive.end(), [](const Texture *_a, const Texture *_b) { return _a->offset < _b->offset; });
+      NS::UInteger offset = 0;
+      for (const auto *other : alive)
+      {
+        if (offset + texture.size <= other->offset)
+          break;
+        offset = std::max(offset, (other->offset + other->size + texture.align - 1) / texture.align * texture.align);
+      }
+      texture.offset = offset;
+      heapSize = std::max(heapSize, offset + texture.size);
+    }
+    for (Handle t : placed)
+    {
+      const auto &texture = m_textures[t];
+      for (Handle u : placed)
+        if (u != t && overlaps(texture, m_textures[u]))
+        {
+          ++m_stats.aliasedTextures;
+          break;
+        }
+    }
+
+    auto *heapDesc = MTL::HeapDescriptor::alloc()->init();
+    heapDesc->setType(MTL::HeapTypePlacement);
+    heapDesc->setStorageMode(MTL::StorageModePrivate);
+    heapDesc->setHazardTrackingMode(MTL::HazardTrackingModeUntracked);
+    heapDesc->setSize(heapSize);
+    m_heap = m_device->newHeap(heapDesc);
+    heapDesc->release();
+    assert(m_heap);
+    m_stats.memoryBytes += heapSize;
+    for (Handle t : placed)
+    {
+      auto &texture = m_textures[t];
+      auto *desc = MTL::TextureDescriptor::texture2DDescriptor(texture.desc.format, texture.desc.width, texture.desc.height, false);
+      desc->setUsage(texture.usage);
+      desc->setStorageMode(MTL::StorageModePrivate);
+      texture.texture = m_heap->newTexture(desc, texture.offset);
+      texture.texture->setLabel(NS::String::string(texture.name.c_str(), NS::UTF8StringEncoding));
+    }
+  }
+
+  static bool overlaps(const Texture &_a, const Texture &_b)
+  {
+    return _a.offset < _b.offset + _b.size && _b.offset < _a.offset + _a.size;
+  }
+
+  // heap textures aren't tracked, so a pass waits for the last pass to touch
+  // any memory it touches, whether the same texture or one aliasing it. That
+  // pass in turn waited for the one before it, so waiting for the last is
+  // enough, and a wait already covered by another one is dropped.
+  void placeFences()
+  {
+    m_fenceOf.assign(m_order.size(), NoPass);
+    std::vector<size_t> lastTouched(m_textures.size(), NoPass);
+    // the passes each pass has waited for, directly or not
+    std::vector<std::set<size_t>> covered(m_order.size());
+    for (size_t p = 0; p < m_order.size(); ++p)
+    {
+      auto &pass = m_passes[m_order[p]];
+      std::set<size_t> waits;
+      auto textures = touched(pass);
+      for (Handle t : textures)
+      {
+        if (!m_textures[t].inHeap)
+          continue;
+        for (Handle u = 0; u < m_textures.size(); ++u)
+          if (m_textures[u].inHeap && lastTouched[u] != NoPass && overlaps(m_textures[t], m_textures[u]))
+            waits.insert(lastTouched[u]);
+      }
+      for (size_t w : waits)
+        covered[p].insert(covered[w].begin(), covered[w].end());
+      for (size_t w : waits)
+        if (!covered[p].count(w))
+          pass.waits.push_back(w);
+      covered[p].insert(waits.begin(), waits.end());
+      for (size_t f : pass.waits)
+        if (m_fenceOf[f] == NoPass)
+        {
+          m_fenceOf[f] = m_fences.size();
+          m_fences.push_back(m_device->newFence());
+        }
+      for (Handle t : textures)
+        if (m_textures[t].inHeap)
+          lastTouched[t] = p;
+    }
+    m_stats.fences = m_fences.size();
+  }
+
+  MTL::Device *m_device;
+  bool m_optimise;
+  bool m_compiled = false;
+  std::vector<Pass> m_passes;
+  std::vector<Texture> m_textures;
+  // indices into m_passes of the passes to run, in order
+  std::vector<size_t> m_order;
+  MTL::Heap *m_heap = nullptr;
+  std::vector<MTL::Fence *> m_fences;
+  // index into m_fences of the fence each pass updates, by position in m_order
+  std::vector<size_t> m_fenceOf;
+  Stats m_stats;
+};
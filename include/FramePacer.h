@@ -0,0 +1,131 @@
+#pragma once
+#include "Metal.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Lets the CPU encode up to N frames ahead of the GPU. beginFrame() takes a
+// slot from a counting semaphore, blocking while N frames are in flight, and
+// returns its index so per frame resources (anything the CPU writes each
+// frame) can be kept one per slot. endFrame() hands the slot back from the
+// command buffer's completed handler. One frame in flight is the fully
+// synchronous loop.
+//
+// It also keeps the numbers to compare the two: frames per second, the time
+// the CPU spends on a frame outside of waiting, the time the GPU spends on it
+// and how much of the shorter of the two was hidden behind the other.
+class FramePacer
+{
+public:
+  struct Stats
+  {
+    double fps = 0.0;
+    double cpuMs = 0.0;
+    double gpuMs = 0.0;
+    double waitMs = 0.0;
+    // 0 when CPU and GPU take turns, 1 when the shorter is completely hidden
+    double overlap = 0.0;
+  };
+
+  explicit FramePacer(unsigned _framesInFlight = 3)
+      : m_framesInFlight(std::max(1u, _framesInFlight)), m_available(m_framesInFlight)
+  {
+  }
+
+  // wait for the GPU to finish with everything so resources can be released
+  ~FramePacer()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this] { return m_available == m_framesInFlight; });
+  }
+
+  FramePacer(const FramePacer &) = delete;
+  FramePacer &operator=(const FramePacer &) = delete;
+
+  unsigned framesInFlight() const { return m_framesInFlight; }
+
+  // blocks until a slot is free and returns it
+  unsigned beginFrame()
+  {
+    auto start = clock_type::now();
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this] { return m_available > 0; });
+      --m_available;
+    }
+    m_frameStart = clock_type::now();
+    m_wait += m_frameStart - start;
+    return m_slot = (m_slot + 1) % m_framesInFlight;
+  }
+
+  // run something that blocks inside a frame, such as getting the next
+  // drawable, and count the time as waiting rather than CPU work
+  template <typename F>
+  auto waitFor(F &&_f)
+  {
+    auto start = clock_type::now();
+    auto result = _f();
+    auto waited = clock_type::now() - start;
+    m_wait += waited;
+    m_frameStart += waited;
+    return result;
+  }
+
+  // call before _commandBuffer is committed, the slot is returned when it completes
+  void endFrame(MTL::CommandBuffer *_commandBuffer)
+  {
+    _commandBuffer->addCompletedHandler([this](MTL::CommandBuffer *_cb) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_gpu += std::max(0.0, _cb->GPUEndTime() - _cb->GPUStartTime());
+      ++m_available;
+      m_cv.notify_all();
+    });
+    m_cpu += clock_type::now() - m_frameStart;
+    ++m_frames;
+  }
+
+  // the numbers since the last reset, once at least _interval has passed
+  bool sample(Stats *o_stats, std::chrono::milliseconds _interval = std::chrono::milliseconds(1000))
+  {
+    auto now = clock_type::now();
+    auto elapsed = std::chrono::duration<double>(now - m_windowStart).count();
+    if (elapsed * 1000.0 < double(_interval.count()) || m_frames == 0)
+      return false;
+    double gpu;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      gpu = m_gpu;
+      m_gpu = 0.0;
+    }
+    double cpu = std::chrono::duration<double>(m_cpu).count();
+    o_stats->fps = double(m_frames) / elapsed;
+    o_stats->cpuMs = cpu * 1000.0 / double(m_frames);
+    o_stats->gpuMs = gpu * 1000.0 / double(m_frames);
+    o_stats->waitMs = std::chrono::duration<double, std::milli>(m_wait).count() / double(m_frames);
+    // run one after the other, CPU and GPU time add up to the elapsed time,
+    // whatever they add up to beyond it was spent side by side
+    double shorter = std::min(cpu, gpu);
+    o_stats->overlap = shorter > 0.0 ? std::clamp((cpu + gpu - elapsed) / shorter, 0.0, 1.0) : 0.0;
+    m_windowStart = now;
+    m_cpu = m_wait = clock_type::duration::zero();
+    m_frames = 0;
+    return true;
+  }
+
+private:
+  using clock_type = std::chrono::steady_clock;
+
+  const unsigned m_framesInFlight;
+  unsigned m_available;
+  unsigned m_slot = ~0u;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  clock_type::time_point m_frameStart;
+  clock_type::time_point m_windowStart = clock_type::now();
+  clock_type::duration m_cpu = clock_type::duration::zero();
+  clock_type::duration m_wait = clock_type::duration::zero();
+  // seconds, written from the completed handlers
+  double m_gpu = 0.0;
+  unsigned m_frames = 0;
+};
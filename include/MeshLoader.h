@@ -0,0 +1,866 @@
+#pragma once
+#include "Metal.hpp"
+#include "VertexLayout.h"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// An indexed triangle mesh on the CPU
+struct MeshData
+{
+  // three floats a vertex
+  std::vector<float> positions;
+  // three floats a vertex, or empty
+  std::vector<float> normals;
+  // two floats a vertex, or empty
+  std::vector<float> uvs;
+  std::vector<uint32_t> indices;
+
+  size_t vertexCount() const { return positions.size() / 3; }
+  size_t triangleCount() const { return indices.size() / 3; }
+};
+
+namespace meshtools
+{
+namespace detail
+{
+struct VertexKey
+{
+  std::array<float, 8> values;
+};
+
+// bytewise so -0 and 0 are different vertices and the hash agrees with ==
+struct VertexKeyHash
+{
+  size_t operator()(const VertexKey &_k) const
+  {
+    uint64_t h = 1469598103934665603ull;
+    const auto *bytes = reinterpret_cast<const uint8_t *>(_k.values.data());
+    for (size_t i = 0; i < sizeof(_k.values); ++i)
+      h = (h ^ bytes[i]) * 1099511628211ull;
+    return size_t(h);
+  }
+};
+
+struct VertexKeyEqual
+{
+  bool operator()(const VertexKey &_a, const VertexKey &_b) const
+  {
+    return std::memcmp(_a.values.data(), _b.values.data(), sizeof(_a.values)) == 0;
+  }
+};
+
+struct CornerHash
+{
+  size_t operator()(const std::array<int, 3> &_c) const
+  {
+    return size_t(uint64_t(uint32_t(_c[0])) * 0x9e3779b97f4a7c15ull ^ uint64_t(uint32_t(_c[1])) * 0xc2b2ae3d27d4eb4full ^ uint64_t(uint32_t(_c[2])));
+  }
+};
+
+enum class PlyType
+{
+  Int8,
+  UInt8,
+  Int16,
+  UInt16,
+  Int32,
+  UInt32,
+  Float32,
+  Float64,
+  None
+};
+
+inline PlyType plyType(const std::string &_name)
+{
+  if (_name == "char" || _name == "int8")
+    return PlyType::Int8;
+  if (_name == "uchar" || _name == "uint8")
+    return PlyType::UInt8;
+  if (_name == "short" || _name == "int16")
+    return PlyType::Int16;
+  if (_name == "ushort" || _name == "uint16")
+    return PlyType::UInt16;
+  if (_name == "int" || _name == "int32")
+    return PlyType::Int32;
+  if (_name == "uint" || _name == "uint32")
+    return PlyType::UInt32;
+  if (_name == "float" || _name == "float32")
+    return PlyType::Float32;
+  if (_name == "double" || _name == "float64")
+    return PlyType::Float64;
+  return PlyType::None;
+}
+
+// where a vertex property goes, x y z, nx ny nz, u v, anything else is read
+// and dropped
+inline int plySlot(const std::string &_name)
+{
+  static const char *names[][3] = {{"x", "", ""}, {"y", "", ""}, {"z", "", ""}, {"nx", "", ""}, {"ny", "", ""}, {"nz", "", ""},
+                                   {"u", "s", "texture_u"}, {"v", "t", "texture_v"}};
+  for (int slot = 0; slot < 8; ++slot)
+    for (const char *n : names[slot])
+      if (*n && _name == n)
+        return slot;
+  return -1;
+}
+
+// a list property has a count type as well
+struct PlyProperty
+{
+  std::string name;
+  PlyType type;
+  PlyType countType = PlyType::None;
+};
+
+struct PlyElement
+{
+  std::string name;
+  size_t count = 0;
+  std::vector<PlyProperty> properties;
+};
+
+// values from the body of the file, held in memory, as text or little endian
+// binary. ok goes false on running out or on something that isn't a number.
+struct PlyReader
+{
+  const char *cursor;
+  const char *end;
+  bool binary;
+  bool ok = true;
+
+  template <typename T>
+  double get()
+  {
+    T value;
+    std::memcpy(&value, cursor, sizeof(T));
+    cursor += sizeof(T);
+    return double(value);
+  }
+
+  double read(PlyType _type)
+  {
+    if (!binary)
+    {
+      char *next;
+      double value = std::strtod(cursor, &next);
+      ok &= next != cursor;
+      cursor = next;
+      return value;
+    }
+    static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+    if (_type == PlyType::None || size_t(end - cursor) < sizes[int(_type)])
+    {
+      ok = false;
+      return 0.0;
+    }
+    switch (_type)
+    {
+    case PlyType::Int8:
+      return get<int8_t>();
+    case PlyType::UInt8:
+      return get<uint8_t>();
+    case PlyType::Int16:
+      return get<int16_t>();
+    case PlyType::UInt16:
+      return get<uint16_t>();
+    case PlyType::Int32:
+      return get<int32_t>();
+    case PlyType::UInt32:
+      return get<uint32_t>();
+    case PlyType::Float32:
+      return get<float>();
+    default:
+      return get<double>();
+    }
+  }
+};
+} // end namespace detail
+
+// merge vertices whose attributes are identical, returns the vertex count
+inline size_t weld(MeshData &_mesh)
+{
+  size_t count = _mesh.vertexCount();
+  bool hasNormals = !_mesh.normals.empty();
+  bool hasUVs = !_mesh.uvs.empty();
+  std::unordered_map<detail::VertexKey, uint32_t, detail::VertexKeyHash, detail::VertexKeyEqual> unique;
+  unique.reserve(count);
+  std::vector<uint32_t> remap(count);
+  MeshData welded;
+  for (size_t v = 0; v < count; ++v)
+  {
+    detail::VertexKey key = {};
+    std::copy_n(&_mesh.positions[v * 3], 3, &key.values[0]);
+    if (hasNormals)
+      std::copy_n(&_mesh.normals[v * 3], 3, &key.values[3]);
+    if (hasUVs)
+      std::copy_n(&_mesh.uvs[v * 2], 2, &key.values[6]);
+    auto inserted = unique.emplace(key, uint32_t(welded.vertexCount()));
+    remap[v] = inserted.first->second;
+    if (!inserted.second)
+      continue;
+    welded.positions.insert(welded.positions.end(), &key.values[0], &key.values[3]);
+    if (hasNormals)
+      welded.normals.insert(welded.normals.end(), &key.values[3], &key.values[6]);
+    if (hasUVs)
+      welded.uvs.insert(welded.uvs.end(), &key.values[6], &key.values[8]);
+  }
+  for (auto &i : _mesh.indices)
+    i = remap[i];
+  _mesh.positions = std::move(welded.positions);
+  _mesh.normals = std::move(welded.normals);
+  _mesh.uvs = std::move(welded.uvs);
+  return _mesh.vertexCount();
+}
+
+// area weighted vertex normals, for meshes that come without them
+inline void computeNormals(MeshData &_mesh)
+{
+  _mesh.normals.assign(_mesh.positions.size(), 0.0f);
+  const float *p = _mesh.positions.data();
+  for (size_t t = 0; t < _mesh.indices.size(); t += 3)
+  {
+    const uint32_t *tri = &_mesh.indices[t];
+    float e1[3], e2[3];
+    for (int c = 0; c < 3; ++c)
+    {
+      e1[c] = p[tri[1] * 3 + c] - p[tri[0] * 3 + c];
+      e2[c] = p[tri[2] * 3 + c] - p[tri[0] * 3 + c];
+    }
+    float n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+    for (int k = 0; k < 3; ++k)
+      for (int c = 0; c < 3; ++c)
+        _mesh.normals[tri[k] * 3 + c] += n[c];
+  }
+  for (size_t v = 0; v < _mesh.normals.size(); v += 3)
+  {
+    float *n = &_mesh.normals[v];
+    float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    for (int c = 0; c < 3; ++c)
+      n[c] = length > 0.0f ? n[c] / length : (c == 2 ? 1.0f : 0.0f);
+  }
+}
+
+// Wavefront OBJ, v, vt, vn and f lines, polygons are split into fans. Each
+// distinct v/vt/vn corner becomes a vertex, normals and uvs are kept only if
+// every corner has them.
+inline bool loadOBJ(const std::string &_path, MeshData *o_mesh)
+{
+  std::ifstream file(_path);
+  if (!file)
+  {
+    std::cerr << "Unable to open " << _path << '\n';
+    return false;
+  }
+  std::vector<float> v, vt, vn;
+  std::vector<std::array<int, 3>> corners;
+  std::vector<std::array<int, 3>> polygon;
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(file, line))
+  {
+    ++lineNumber;
+    const char *s = line.c_str();
+    while (*s == ' ' || *s == '\t')
+      ++s;
+    char *end;
+    if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t'))
+    {
+      s += 2;
+      for (int c = 0; c < 3; ++c, s = end)
+        v.push_back(std::strtof(s, &end));
+    }
+    else if (s[0] == 'v' && s[1] == 'n')
+    {
+      s += 2;
+      for (int c = 0; c < 3; ++c, s = end)
+        vn.push_back(std::strtof(s, &end));
+    }
+    else if (s[0] == 'v' && s[1] == 't')
+    {
+      s += 2;
+      for (int c = 0; c < 2; ++c, s = end)
+        vt.push_back(std::strtof(s, &end));
+    }
+    else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t'))
+    {
+      s += 2;
+      polygon.clear();
+      for (;;)
+      {
+        // v, v/vt, v//vn or v/vt/vn, negative indices count back from the end
+        long index = std::strtol(s, &end, 10);
+        if (end == s)
+          break;
+        s = end;
+        std::array<int, 3> corner = {int(index < 0 ? long(v.size() / 3) + index : index - 1), -1, -1};
+        for (int a = 1; a < 3 && *s == '/'; ++a)
+        {
+          ++s;
+          index = std::strtol(s, &end, 10);
+          if (end != s)
+          {
+            long count = long((a == 1 ? vt.size() / 2 : vn.size() / 3));
+            corner[a] = int(index < 0 ? count + index : index - 1);
+          }
+          s = end;
+        }
+        if (corner[0] < 0 || size_t(corner[0]) >= v.size() / 3)
+        {
+          std::cerr << _path << ':' << lineNumber << " vertex index out of range\n";
+          return false;
+        }
+        polygon.push_back(corner);
+      }
+      for (size_t i = 2; i < polygon.size(); ++i)
+      {
+        corners.push_back(polygon[0]);
+        corners.push_back(polygon[i - 1]);
+        corners.push_back(polygon[i]);
+      }
+    }
+  }
+  bool hasUVs = !corners.empty();
+  bool hasNormals = !corners.empty();
+  for (const auto &c : corners)
+  {
+    hasUVs &= c[1] >= 0 && size_t(c[1]) < vt.size() / 2;
+    hasNormals &= c[2] >= 0 && size_t(c[2]) < vn.size() / 3;
+  }
+
+  MeshData mesh;
+  std::unordered_map<std::array<int, 3>, uint32_t, detail::CornerHash> unique;
+  for (const auto &c : corners)
+  {
+    std::array<int, 3> key = {c[0], hasUVs ? c[1] : -1, hasNormals ? c[2] : -1};
+    auto inserted = unique.emplace(key, uint32_t(mesh.vertexCount()));
+    if (inserted.second)
+    {
+      mesh.positions.insert(mesh.positions.end(), &v[c[0] * 3], &v[c[0] * 3 + 3]);
+      if (hasUVs)
+        mesh.uvs.insert(mesh.uvs.end(), &vt[c[1] * 2], &vt[c[1] * 2 + 2]);
+      if (hasNormals)
+        mesh.normals.insert(mesh.normals.end(), &vn[c[2] * 3], &vn[c[2] * 3 + 3]);
+    }
+    mesh.indices.push_back(inserted.first->second);
+  }
+  // corners with different indices can still be the same vertex when the
+  // file repeats values
+  weld(mesh);
+  *o_mesh = std::move(mesh);
+  return true;
+}
+
+// Stanford PLY, ascii or binary little endian, x y z and optionally
+// nx ny nz and u v (or s t) per vertex, faces as a list of vertex indices
+// split into fans. Other elements are skipped.
+inline bool loadPLY(const std::string &_path, MeshData *o_mesh)
+{
+  std::ifstream file(_path, std::ios::binary);
+  if (!file)
+  {
+    std::cerr << "Unable to open " << _path << '\n';
+    return false;
+  }
+  std::string line;
+  std::getline(file, line);
+  if (line.compare(0, 3, "ply") != 0)
+  {
+    std::cerr << _path << " is not a PLY file\n";
+    return false;
+  }
+  bool binary = false;
+  std::vector<detail::PlyElement> elements;
+  while (std::getline(file, line))
+  {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    std::istringstream words(line);
+    std::string word;
+    words >> word;
+    if (word == "format")
+    {
+      words >> word;
+      if (word == "binary_little_endian")
+        binary = true;
+      else if (word != "ascii")
+      {
+        std::cerr << _path << " is " << word << ", only ascii and binary_little_endian are supported\n";
+        return false;
+      }
+    }
+    else if (word == "element")
+    {
+      elements.emplace_back();
+      words >> elements.back().name >> elements.back().count;
+    }
+    else if (word == "property" && !elements.empty())
+    {
+      detail::PlyProperty property;
+      words >> word;
+      if (word == "list")
+      {
+        words >> word;
+        property.countType = detail::plyType(word);
+        words >> word;
+      }
+      property.type = detail::plyType(word);
+      words >> property.name;
+      if (property.type == detail::PlyType::None)
+      {
+        std::cerr << _path << " has a property " << property.name << " of unknown type " << word << '\n';
+        return false;
+      }
+      elements.back().properties.push_back(property);
+    }
+    else if (word == "end_header")
+      break;
+  }
+  std::string body((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  detail::PlyReader reader = {body.data(), body.data() + body.size(), binary};
+
+  MeshData mesh;
+  std::vector<uint32_t> polygon;
+  for (const auto &element : elements)
+  {
+    bool isVertex = element.name == "vertex";
+    bool isFace = element.name == "face";
+    std::vector<int> slots;
+    bool hasNormals = false;
+    bool hasUVs = false;
+    for (const auto &p : element.properties)
+    {
+      slots.push_back(isVertex ? detail::plySlot(p.name) : -1);
+      hasNormals |= slots.back() == 3;
+      hasUVs |= slots.back() == 6;
+    }
+    for (size_t e = 0; e < element.count && reader.ok; ++e)
+    {
+      float values[8] = {};
+      for (size_t i = 0; i < element.properties.size(); ++i)
+      {
+        const auto &p = element.properties[i];
+        if (p.countType != detail::PlyType::None)
+        {
+          auto count = size_t(reader.read(p.countType));
+          polygon.clear();
+          for (size_t j = 0; j < count && reader.ok; ++j)
+            polygon.push_back(uint32_t(reader.read(p.type)));
+          if (isFace && (p.name == "vertex_indices" || p.name == "vertex_index"))
+            for (size_t j = 2; j < polygon.size(); ++j)
+              mesh.indices.insert(mesh.indices.end(), {polygon[0], polygon[j - 1], polygon[j]});
+          continue;
+        }
+        auto value = float(reader.read(p.type));
+        if (slots[i] >= 0)
+          values[slots[i]] = value;
+      }
+      if (isVertex)
+      {
+        mesh.positions.insert(mesh.positions.end(), values, values + 3);
+        if (hasNormals)
+          mesh.normals.insert(mesh.normals.end(), values + 3, values + 6);
+        if (hasUVs)
+          mesh.uvs.insert(mesh.uvs.end(), values + 6, values + 8);
+      }
+    }
+  }
+  if (!reader.ok)
+  {
+    std::cerr << _path << " ended early or has a bad value\n";
+    return false;
+  }
+  for (uint32_t i : mesh.indices)
+    if (i >= mesh.vertexCount())
+    {
+      std::cerr << _path << " face index out of range\n";
+      return false;
+    }
+  weld(mesh);
+  *o_mesh = std::move(mesh);
+  return true;
+}
+
+// by extension, normals are computed if the file has none
+inline bool load(const std::string &_path, MeshData *o_mesh)
+{
+  std::string extension = _path.substr(_path.find_last_of('.') + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char _c) { return char(std::tolower(_c)); });
+  bool loaded;
+  if (extension == "obj")
+    loaded = loadOBJ(_path, o_mesh);
+  else if (extension == "ply")
+    loaded = loadPLY(_path, o_mesh);
+  else
+  {
+    std::cerr << "Unknown mesh format " << _path << '\n';
+    return false;
+  }
+  if (loaded && o_mesh->normals.empty())
+    computeNormals(*o_mesh);
+  return loaded;
+}
+
+// average cache miss ratio, vertices transformed per triangle with a FIFO
+// post transform cache of _cacheSize entries, 0.5 is the best a regular grid
+// can do and 3 means no reuse at all
+inline double acmr(const std::vector<uint32_t> &_indices, size_t _vertexCount, unsigned _cacheSize = 16)
+{
+  if (_indices.empty())
+    return 0.0;
+  // a vertex is in the cache if fewer than _cacheSize misses happened since
+  // it was last loaded
+  std::vector<size_t> loadedAt(_vertexCount, 0);
+  size_t misses = 0;
+  size_t time = _cacheSize + 1;
+  for (uint32_t i : _indices)
+    if (time - loadedAt[i] > _cacheSize)
+    {
+      loadedAt[i] = time++;
+      ++misses;
+    }
+  return double(misses) / double(_indices.size() / 3);
+}
+
+// Reorders triangles so vertices are reused while still in the post
+// transform cache, Tom Forsyth's linear speed vertex cache optimisation.
+// Vertices score higher the more recently they were used and the fewer
+// triangles they have left, and the best scoring triangle using a vertex in
+// the (simulated LRU) cache goes next.
+inline void optimiseVertexCache(std::vector<uint32_t> &_indices, size_t _vertexCount)
+{
+  constexpr int CacheSize = 32;
+  size_t triangles = _indices.size() / 3;
+  if (!triangles)
+    return;
+  auto score = [](int _cachePosition, uint32_t _remaining) {
+    if (!_remaining)
+      return -1.0f;
+    float s = 0.0f;
+    if (_cachePosition >= 0)
+      // the last triangle's vertices get a fixed score so the next triangle
+      // doesn't just strip along
+      s = _cachePosition < 3 ? 0.75f : std::pow(1.0f - float(_cachePosition - 3) / float(CacheSize - 3), 1.5f);
+    return s + 2.0f / std::sqrt(float(_remaining));
+  };
+
+  // triangles using each vertex, the live ones at the front of each range
+  std::vector<uint32_t> remaining(_vertexCount, 0);
+  for (uint32_t i : _indices)
+    ++remaining[i];
+  std::vector<uint32_t> first(_vertexCount + 1, 0);
+  for (size_t v = 0; v < _vertexCount; ++v)
+    first[v + 1] = first[v] + remaining[v];
+  std::vector<uint32_t> adjacency(_indices.size());
+  {
+    std::vector<uint32_t> filled(first.begin(), first.end() - 1);
+    for (size_t t = 0; t < triangles; ++t)
+      for (int k = 0; k < 3; ++k)
+        adjacency[filled[_indices[t * 3 + k]]++] = uint32_t(t);
+  }
+  std::vector<int> cachePosition(_vertexCount, -1);
+  std::vector<float> vertexScore(_vertexCount);
+  for (size_t v = 0; v < _vertexCount; ++v)
+    vertexScore[v] = score(-1, remaining[v]);
+  std::vector<float> triangleScore(triangles);
+  std::vector<bool> emitted(triangles, false);
+  size_t best = 0;
+  for (size_t t = 0; t < triangles; ++t)
+  {
+    triangleScore[t] = vertexScore[_indices[t * 3]] + vertexScore[_indices[t * 3 + 1]] + vertexScore[_indices[t * 3 + 2]];
+    if (triangleScore[t] > triangleScore[best])
+      best = t;
+  }
+
+  std::vector<uint32_t> output;
+  output.reserve(_indices.size());
+  std::vector<uint32_t> cache, nextCache;
+  size_t nextUnemitted = 0;
+  while (output.size() < _indices.size())
+  {
+    const uint32_t *tri = &_indices[best * 3];
+    output.insert(output.end(), tri, tri + 3);
+    emitted[best] = true;
+    for (int k = 0; k < 3; ++k)
+    {
+      uint32_t v = tri[k];
+      auto *begin = &adjacency[first[v]];
+      auto *end = begin + remaining[v];
+      std::iter_swap(std::find(begin, end, uint32_t(best)), end - 1);
+      --remaining[v];
+    }
+    // the triangle's vertices move to the front
+    nextCache.assign(tri, tri + 3);
+    for (uint32_t v : cache)
+      if (v != tri[0] && v != tri[1] && v != tri[2])
+        nextCache.push_back(v);
+    for (size_t i = 0; i < nextCache.size(); ++i)
+    {
+      uint32_t v = nextCache[i];
+      cachePosition[v] = i < size_t(CacheSize) ? int(i) : -1;
+      vertexScore[v] = score(cachePosition[v], remaining[v]);
+    }
+    if (nextCache.size() > size_t(CacheSize))
+      nextCache.resize(CacheSize);
+    cache.swap(nextCache);
+
+    // rescore the triangles touching anything whose score changed, the best
+    // of them goes next
+    float bestScore = -1.0f;
+    best = triangles;
+    for (uint32_t v : cache)
+      for (uint32_t a = first[v]; a < first[v] + remaining[v]; ++a)
+      {
+        uint32_t t = adjacency[a];
+        const uint32_t *o = &_indices[size_t(t) * 3];
+        triangleScore[t] = vertexScore[o[0]] + vertexScore[o[1]] + vertexScore[o[2]];
+        if (triangleScore[t] > bestScore)
+        {
+          bestScore = triangleScore[t];
+          best = t;
+        }
+      }
+    if (best == triangles)
+    {
+      // nothing left touches the cache, carry on from the next triangle not
+      // yet drawn
+      while (nextUnemitted < triangles && emitted[nextUnemitted])
+        ++nextUnemitted;
+      best = nextUnemitted;
+      if (best == triangles)
+        break;
+    }
+  }
+  _indices.swap(output);
+}
+
+// Reorders clusters of triangles so ones likely to be in front are drawn
+// first and more is rejected by the depth test, after Sander, Nehab and
+// Barczak's "Fast triangle reordering". Run it after optimiseVertexCache. The
+// triangles are cut into clusters where the cache would be cold anyway, a
+// triangle whose three vertices all miss, and those are cut again as soon as
+// a cluster, started with a cold cache, gets its ACMR down to _threshold
+// times what the whole run had. So moving clusters around costs at most that
+// much ACMR. Clusters facing away from the mesh's centre go first.
+inline void optimiseOverdraw(std::vector<uint32_t> &_indices, const std::vector<float> &_positions, float _threshold = 1.05f,
+                             unsigned _cacheSize = 16)
+{
+  size_t triangles = _indices.size() / 3;
+  size_t vertexCount = _positions.size() / 3;
+  if (!triangles)
+    return;
+  std::vector<size_t> loadedAt(vertexCount, 0);
+  size_t time = _cacheSize + 1;
+  auto misses = [&](size_t _t) {
+    int count = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+      uint32_t v = _indices[_t * 3 + k];
+      if (time - loadedAt[v] > _cacheSize)
+      {
+        loadedAt[v] = time++;
+        ++count;
+      }
+    }
+    return count;
+  };
+  // emptying the cache is just moving time on past everything in it
+  auto flush = [&]() { time += _cacheSize + 1; };
+
+  std::vector<size_t> hardStart;
+  for (size_t t = 0; t < triangles; ++t)
+    if (misses(t) == 3 || t == 0)
+      hardStart.push_back(t);
+  hardStart.push_back(triangles);
+  std::vector<size_t> clusterStart;
+  for (size_t h = 0; h + 1 < hardStart.size(); ++h)
+  {
+    size_t start = hardStart[h];
+    size_t end = hardStart[h + 1];
+    flush();
+    size_t runMisses = 0;
+    for (size_t t = start; t < end; ++t)
+      runMisses += size_t(misses(t));
+    double limit = _threshold * double(runMisses) / double(end - start);
+    flush();
+    clusterStart.push_back(start);
+    size_t clusterMisses = 0;
+    for (size_t t = start; t < end; ++t)
+    {
+      clusterMisses += size_t(misses(t));
+      if (t + 1 < end && double(clusterMisses) <= limit * double(t + 1 - clusterStart.back()))
+      {
+        clusterStart.push_back(t + 1);
+        clusterMisses = 0;
+        flush();
+      }
+    }
+  }
+  clusterStart.push_back(triangles);
+
+  // area weighted centroid and normal per cluster, and of the whole mesh
+  size_t clusters = clusterStart.size() - 1;
+  std::vector<std::array<double, 7>> sums(clusters, std::array<double, 7>{});
+  double meshCentroid[3] = {0.0, 0.0, 0.0};
+  double meshArea = 0.0;
+  for (size_t c = 0; c < clusters; ++c)
+    for (size_t t = clusterStart[c]; t < clusterStart[c + 1]; ++t)
+    {
+      const float *p[3];
+      for (int k = 0; k < 3; ++k)
+        p[k] = &_positions[_indices[t * 3 + k] * 3];
+      double e1[3], e2[3];
+      for (int i = 0; i < 3; ++i)
+      {
+        e1[i] = p[1][i] - p[0][i];
+        e2[i] = p[2][i] - p[0][i];
+      }
+      double n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+      double area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      auto &s = sums[c];
+      for (int i = 0; i < 3; ++i)
+      {
+        double centre = (p[0][i] + p[1][i] + p[2][i]) / 3.0;
+        s[i] += centre * area;
+        s[3 + i] += n[i];
+        meshCentroid[i] += centre * area;
+      }
+      s[6] += area;
+      meshArea += area;
+    }
+  for (double &m : meshCentroid)
+    m = meshArea > 0.0 ? m / meshArea : 0.0;
+  std::vector<double> key(clusters);
+  for (size_t c = 0; c < clusters; ++c)
+  {
+    const auto &s = sums[c];
+    double length = std::sqrt(s[3] * s[3] + s[4] * s[4] + s[5] * s[5]);
+    key[c] = 0.0;
+    if (s[6] > 0.0 && length > 0.0)
+      for (int i = 0; i < 3; ++i)
+        key[c] += (s[i] / s[6] - meshCentroid[i]) * s[3 + i] / length;
+  }
+  std::vector<size_t> order(clusters);
+  for (size_t c = 0; c < clusters; ++c)
+    order[c] = c;
+  std::stable_sort(order.begin(), order.end(), [&key](size_t _a, size_t _b) { return key[_a] > key[_b]; });
+  std::vector<uint32_t> output;
+  output.reserve(_indices.size());
+  for (size_t c : order)
+    output.insert(output.end(), _indices.begin() + long(clusterStart[c] * 3), _indices.begin() + long(clusterStart[c + 1] * 3));
+  _indices.swap(output);
+}
+
+// Renumbers vertices in the order the index buffer first uses them so the
+// vertex fetch walks memory forwards, vertices nothing uses are dropped.
+// Returns the vertex count.
+inline size_t optimiseVertexFetch(MeshData &_mesh)
+{
+  constexpr uint32_t Unused = ~0u;
+  std::vector<uint32_t> remap(_mesh.vertexCount(), Unused);
+  MeshData reordered;
+  bool hasNormals = !_mesh.normals.empty();
+  bool hasUVs = !_mesh.uvs.empty();
+  for (auto &i : _mesh.indices)
+  {
+    if (remap[i] == Unused)
+    {
+      remap[i] = uint32_t(reordered.vertexCount());
+      reordered.positions.insert(reordered.positions.end(), &_mesh.positions[i * 3], &_mesh.positions[i * 3 + 3]);
+      if (hasNormals)
+        reordered.normals.insert(reordered.normals.end(), &_mesh.normals[i * 3], &_mesh.normals[i * 3 + 3]);
+      if (hasUVs)
+        reordered.uvs.insert(reordered.uvs.end(), &_mesh.uvs[i * 2], &_mesh.uvs[i * 2 + 2]);
+    }
+    i = remap[i];
+  }
+  _mesh.positions = std::move(reordered.positions);
+  _mesh.normals = std::move(reordered.normals);
+  _mesh.uvs = std::move(reordered.uvs);
+  return _mesh.vertexCount();
+}
+
+// everything above in the order it should run
+inline void optimise(MeshData &_mesh)
+{
+  optimiseVertexCache(_mesh.indices, _mesh.vertexCount());
+  optimiseOverdraw(_mesh.indices, _mesh.positions);
+  optimiseVertexFetch(_mesh);
+}
+
+// a shared buffer holding _bytes copied from _data, at least 4 bytes long so
+// an empty one can still be created and bound, caller owns the buffer
+inline MTL::Buffer *newBuffer(MTL::Device *_device, const void *_data, size_t _bytes)
+{
+  auto *buffer = _device->newBuffer(std::max<NS::UInteger>(_bytes, 4), MTL::ResourceStorageModeShared);
+  if (_bytes)
+    std::memcpy(buffer->contents(), _data, _bytes);
+  return buffer;
+}
+} // end namespace meshtools
+
+// A MeshData in Metal buffers. The vertices are packed into _layout, whose
+// attributes are the position, then the normal and the uv if the layout has
+// them. Indices are 16 bit when every vertex can be addressed with them and
+// 32 bit otherwise.
+class IndexedMesh
+{
+public:
+  IndexedMesh(MTL::Device *_device, const MeshData &_mesh, const VertexLayout &_layout)
+      : m_indexCount(_mesh.indices.size()), m_indexType(_mesh.vertexCount() <= 65536 ? MTL::IndexTypeUInt16 : MTL::IndexTypeUInt32)
+  {
+    std::vector<const float *> streams = {_mesh.positions.data(), _mesh.normals.data(), _mesh.uvs.data()};
+    assert(_layout.attributes() <= streams.size());
+    assert(_layout.attributes() < 2 || !_mesh.normals.empty());
+    assert(_layout.attributes() < 3 || !_mesh.uvs.empty());
+    streams.resize(_layout.attributes());
+    m_vertices = _device->newBuffer(std::max<NS::UInteger>(_layout.stride() * _mesh.vertexCount(), 1), MTL::ResourceStorageModeShared);
+    _layout.pack(streams, _mesh.vertexCount(), m_vertices->contents());
+    if (m_indexType == MTL::IndexTypeUInt16)
+    {
+      std::vector<uint16_t> narrow(_mesh.indices.begin(), _mesh.indices.end());
+      m_indices = meshtools::newBuffer(_device, narrow.data(), narrow.size() * 2);
+    }
+    else
+      m_indices = meshtools::newBuffer(_device, _mesh.indices.data(), m_indexCount * 4);
+  }
+
+  ~IndexedMesh()
+  {
+    m_indices->release();
+    m_vertices->release();
+  }
+
+  IndexedMesh(const IndexedMesh &) = delete;
+  IndexedMesh &operator=(const IndexedMesh &) = delete;
+
+  // binds the vertices and draws every triangle
+  void draw(MTL::RenderCommandEncoder *_encoder, NS::UInteger _vertexBufferIndex = 0, NS::UInteger _instances = 1) const
+  {
+    _encoder->setVertexBuffer(m_vertices, 0, _vertexBufferIndex);
+    _encoder->drawIndexedPrimitives(MTL::PrimitiveTypeTriangle, m_indexCount, m_indexType, m_indices, 0, _instances);
+  }
+
+  MTL::Buffer *vertices() const { return m_vertices; }
+  MTL::Buffer *indices() const { return m_indices; }
+  MTL::IndexType indexType() const { return m_indexType; }
+  NS::UInteger indexCount() const { return m_indexCount; }
+
+private:
+  MTL::Buffer *m_vertices;
+  MTL::Buffer *m_indices;
+  NS::UInteger m_indexCount;
+  MTL::IndexType m_indexType;
+};
@@ -0,0 +1,523 @@
+#pragma once
+#include "Metal.hpp"
+#include "MeshLoader.h"
+#include "VertexLayout.h"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// A cluster of a mesh's triangles, laid out as the cull kernel reads it.
+// Every triangle in it faces away from a camera at p when
+// dot(centre - p, axis) >= cutoff * length(centre - p) + radius, a cutoff of
+// 1 with a zero axis is a cone that never culls.
+struct Meshlet
+{
+  float centreRadius[4];
+  float coneAxisCutoff[4];
+  // into MeshletData::vertices
+  uint32_t vertexOffset;
+  uint32_t vertexCount;
+  // in triangles into MeshletData::triangles
+  uint32_t triangleOffset;
+  uint32_t triangleCount;
+};
+
+struct MeshletData
+{
+  std::vector<Meshlet> meshlets;
+  // the mesh vertex for each meshlet vertex
+  std::vector<uint32_t> vertices;
+  // three meshlet vertices a triangle
+  std::vector<uint8_t> triangles;
+
+  size_t triangleCount() const { return triangles.size() / 3; }
+};
+
+namespace meshtools
+{
+// Splits _mesh into meshlets of at most _maxVertices vertices and
+// _maxTriangles triangles, each with a bounding sphere and normal cone. The
+// meshlet vertices and triangles come out in the order they were added, so
+// after optimiseVertexCache the indices the cull pass writes keep most of
+// its cache order. 64 and 124 are the sizes that suit mesh shaders and a 128
+// thread cull threadgroup.
+inline MeshletData buildMeshlets(const MeshData &_mesh, size_t _maxVertices = 64, size_t _maxTriangles = 124)
+{
+  assert(_maxVertices >= 3 && _maxVertices <= 256 && _maxTriangles >= 1);
+  MeshletData data;
+  // where each mesh vertex is in the current meshlet, or -1
+  std::vector<int> local(_mesh.vertexCount(), -1);
+  Meshlet current = {};
+
+  auto position = [&](uint32_t _v) { return &_mesh.positions[size_t(_v) * 3]; };
+  auto finish = [&]() {
+    if (!current.triangleCount)
+      return;
+    // the centroid of the vertices and the furthest of them
+    double centre[3] = {0.0, 0.0, 0.0};
+    for (uint32_t i = 0; i < current.vertexCount; ++i)
+      for (int k = 0; k < 3; ++k)
+        centre[k] += position(data.vertices[current.vertexOffset + i])[k];
+    for (auto &c : centre)
+      c /= current.vertexCount;
+    double radius = 0.0;
+    for (uint32_t i = 0; i < current.vertexCount; ++i)
+    {
+      const float *p = position(data.vertices[current.vertexOffset + i]);
+      double d[3] = {p[0] - centre[0], p[1] - centre[1], p[2] - centre[2]};
+      radius = std::max(radius, std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]));
+    }
+
+    // the cone axis is the average face normal, the cutoff the sine of the
+    // widest angle between it and any face
+    std::vector<std::array<double, 3>> normals;
+    double axis[3] = {0.0, 0.0, 0.0};
+    for (uint32_t t = 0; t < current.triangleCount; ++t)
+    {
+      const uint8_t *corner = &data.triangles[(size_t(current.triangleOffset) + t) * 3];
+      const float *p0 = position(data.vertices[current.vertexOffset + corner[0]]);
+      const float *p1 = position(data.vertices[current.vertexOffset + corner[1]]);
+      const float *p2 = position(data.vertices[current.vertexOffset + corner[2]]);
+      double e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+      double e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+      std::array<double, 3> n = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+      double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      // degenerate triangles can't be seen from anywhere
+      if (length == 0.0)
+        continue;
+      for (int k = 0; k < 3; ++k)
+      {
+        n[k] /= length;
+        axis[k] += n[k];
+      }
+      normals.push_back(n);
+    }
+    double axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    double minDot = 1.0;
+    if (axisLength > 0.0)
+      for (const auto &n : normals)
+        minDot = std::min(minDot, (n[0] * axis[0] + n[1] * axis[1] + n[2] * axis[2]) / axisLength);
+    else
+      minDot = -1.0;
+
+    for (int k = 0; k < 3; ++k)
+      current.centreRadius[k] = float(centre[k]);
+    current.centreRadius[3] = float(radius);
+    // past about 85 degrees the cone would cull so rarely it isn't worth it
+    if (minDot <= 0.1)
+    {
+      current.coneAxisCutoff[0] = current.coneAxisCutoff[1] = current.coneAxisCutoff[2] = 0.0f;
+      current.coneAxisCutoff[3] = 1.0f;
+    }
+    else
+    {
+      for (int k = 0; k < 3; ++k)
+        current.coneAxisCutoff[k] = float(axis[k] / axisLength);
+      current.coneAxisCutoff[3] = float(std::sqrt(1.0 - minDot * minDot));
+    }
+    data.meshlets.push_back(current);
+
+    for (uint32_t i = 0; i < current.vertexCount; ++i)
+      local[data.vertices[current.vertexOffset + i]] = -1;
+    current = {};
+    current.vertexOffset = uint32_t(data.vertices.size());
+    current.triangleOffset = uint32_t(data.triangles.size() / 3);
+  };
+
+  // the triangles around each vertex and each triangle's unit normal
+  size_t triangles = _mesh.triangleCount();
+  std::vector<uint32_t> aroundStart(_mesh.vertexCount() + 1, 0);
+  for (uint32_t v : _mesh.indices)
+    ++aroundStart[v + 1];
+  for (size_t v = 0; v < _mesh.vertexCount(); ++v)
+    aroundStart[v + 1] += aroundStart[v];
+  std::vector<uint32_t> around(_mesh.indices.size());
+  std::vector<uint32_t> filled(aroundStart.begin(), aroundStart.end() - 1);
+  std::vector<float> faceNormals(triangles * 3, 0.0f);
+  double area = 0.0;
+  for (size_t t = 0; t < triangles; ++t)
+  {
+    const uint32_t *corner = &_mesh.indices[t * 3];
+    for (int k = 0; k < 3; ++k)
+      around[filled[corner[k]]++] = uint32_t(t);
+    const float *p0 = position(corner[0]);
+    const float *p1 = position(corner[1]);
+    const float *p2 = position(corner[2]);
+    float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+    float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+    float n[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+    float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    area += 0.5 * length;
+    if (length > 0.0f)
+      for (int k = 0; k < 3; ++k)
+        faceNormals[t * 3 + k] = n[k] / length;
+  }
+  // about the radius of a full meshlet, to measure how far out a triangle is
+  float reach = triangles ? float(std::sqrt(area / double(triangles) * double(_maxTriangles) / M_PI)) : 1.0f;
+  if (reach <= 0.0f)
+    reach = 1.0f;
+
+  // Grow each meshlet from the triangles next to it, preferring the one that
+  // adds the fewest vertices, then the ones nearest its centre and facing
+  // the same way as the meshlet so far, which keeps the spheres small and
+  // the normal cones narrow. When nothing touches it the next triangle in
+  // index order starts the next one.
+  std::vector<bool> emitted(triangles, false);
+  std::vector<uint32_t> candidates;
+  float axis[3] = {0.0f, 0.0f, 0.0f};
+  float sum[3] = {0.0f, 0.0f, 0.0f};
+  size_t next = 0;
+  auto newVertices = [&](size_t _t) {
+    const uint32_t *corner = &_mesh.indices[_t * 3];
+    return size_t(local[corner[0]] < 0) + (local[corner[1]] < 0 && corner[1] != corner[0]) +
+           (local[corner[2]] < 0 && corner[2] != corner[0] && corner[2] != corner[1]);
+  };
+  for (size_t done = 0; done < triangles; ++done)
+  {
+    float axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    float scale = axisLength > 0.0f ? 1.0f / axisLength : 0.0f;
+    float middle[3] = {0.0f, 0.0f, 0.0f};
+    if (current.vertexCount)
+      for (int k = 0; k < 3; ++k)
+        middle[k] = sum[k] / float(current.vertexCount);
+    size_t best = triangles;
+    float bestScore = 0.0f;
+    size_t live = 0;
+    for (uint32_t t : candidates)
+    {
+      if (emitted[t])
+        continue;
+      candidates[live++] = t;
+      const float *n = &faceNormals[size_t(t) * 3];
+      const uint32_t *corner = &_mesh.indices[size_t(t) * 3];
+      float d[3];
+      for (int k = 0; k < 3; ++k)
+        d[k] = (position(corner[0])[k] + position(corner[1])[k] + position(corner[2])[k]) / 3.0f - middle[k];
+      float score = float(newVertices(t)) + 0.5f * (1.0f - (n[0] * axis[0] + n[1] * axis[1] + n[2] * axis[2]) * scale) +
+                    0.5f * std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) / reach;
+      if (best == triangles || score < bestScore)
+      {
+        best = t;
+        bestScore = score;
+      }
+    }
+    candidates.resize(live);
+    if (best == triangles)
+    {
+      while (emitted[next])
+        ++next;
+      best = next;
+    }
+    // a triangle from elsewhere would spread the meshlet out, start another
+    if (best == next || current.vertexCount + newVertices(best) > _maxVertices || current.triangleCount + 1 > _maxTriangles)
+    {
+      finish();
+      candidates.clear();
+      axis[0] = axis[1] = axis[2] = 0.0f;
+      sum[0] = sum[1] = sum[2] = 0.0f;
+    }
+    emitted[best] = true;
+    for (int k = 0; k < 3; ++k)
+    {
+      uint32_t v = _mesh.indices[best * 3 + k];
+      int &slot = local[v];
+      if (slot < 0)
+      {
+        slot = int(current.vertexCount++);
+        data.vertices.push_back(v);
+        for (int c = 0; c < 3; ++c)
+          sum[c] += position(v)[c];
+        for (uint32_t i = aroundStart[v]; i < aroundStart[v + 1]; ++i)
+          if (!emitted[around[i]])
+            candidates.push_back(around[i]);
+      }
+      data.triangles.push_back(uint8_t(slot));
+      axis[k] += faceNormals[best * 3 + k];
+    }
+    ++current.triangleCount;
+  }
+  finish();
+  return data;
+}
+} // end namespace meshtools
+
+// A mesh drawn as meshlets, culled on the GPU every frame. cull() encodes a
+// compute pass with a threadgroup per meshlet that tests it against the
+// view frustum and its normal cone, and copies the triangles of the ones
+// that survive into an index buffer, packed from the start with the count
+// written into the indirect arguments draw() draws with. The CPU never
+// learns how many triangles are drawn, so culling costs no round trip.
+//
+// The vertices are packed into _layout as IndexedMesh does. There is an index
+// buffer and arguments buffer per frame in flight, cull() and draw() take the
+// slot from a FramePacer or 0 when frames aren't overlapped, and stats()
+// reads what was drawn in a slot once the GPU is done with it, in a paced
+// loop just after beginFrame() returns it and before cull() reuses it.
+class MeshletMesh
+{
+public:
+  struct Stats
+  {
+    size_t meshlets = 0;
+    size_t visibleMeshlets = 0;
+    size_t triangles = 0;
+    size_t visibleTriangles = 0;
+  };
+
+  MeshletMesh(MTL::Device *_device, const MeshData &_mesh, const MeshletData &_meshlets, const VertexLayout &_layout,
+              unsigned _framesInFlight = 1)
+      : m_meshletCount(_meshlets.meshlets.size()), m_triangleCount(_meshlets.triangleCount())
+  {
+    std::vector<const float *> streams = {_mesh.positions.data(), _mesh.normals.data(), _mesh.uvs.data()};
+    assert(_layout.attributes() <= streams.size());
+    assert(_layout.attributes() < 2 || !_mesh.normals.empty());
+    assert(_layout.attributes() < 3 || !_mesh.uvs.empty());
+    streams.resize(_layout.attributes());
+    m_vertices = _device->newBuffer(std::max<NS::UInteger>(_layout.stride() * _mesh.vertexCount(), 1), MTL::ResourceStorageModeShared);
+    _layout.pack(streams, _mesh.vertexCount(), m_vertices->contents());
+
+    m_meshlets = meshtools::newBuffer(_device, _meshlets.meshlets.data(), _meshlets.meshlets.size() * sizeof(Meshlet));
+    m_meshletVertices = meshtools::newBuffer(_device, _meshlets.vertices.data(), _meshlets.vertices.size() * sizeof(uint32_t));
+    m_meshletTriangles = meshtools::newBuffer(_device, _meshlets.triangles.data(), _meshlets.triangles.size());
+    // every triangle in meshlet order, for drawing without culling
+    std::vector<uint32_t> all;
+    all.reserve(m_triangleCount * 3);
+    for (const auto &m : _meshlets.meshlets)
+      for (uint32_t i = 0; i < m.triangleCount * 3; ++i)
+        all.push_back(_meshlets.vertices[m.vertexOffset + _meshlets.triangles[m.triangleOffset * 3 + i]]);
+    m_allIndices = meshtools::newBuffer(_device, all.data(), all.size() * sizeof(uint32_t));
+    for (unsigned i = 0; i < std::max(1u, _framesInFlight); ++i)
+    {
+      m_indices.push_back(_device->newBuffer(std::max<NS::UInteger>(m_triangleCount * 3 * sizeof(uint32_t), 4), MTL::ResourceStorageModePrivate));
+      m_arguments.push_back(_device->newBuffer(sizeof(Arguments), MTL::ResourceStorageModeShared));
+      *static_cast<Arguments *>(m_arguments.back()->contents()) = Arguments();
+    }
+
+    NS::Error *error = nullptr;
+    auto *library = _device->newLibrary(NS::String::string(cullSource(), NS::UTF8StringEncoding), nullptr, &error);
+    if (!library)
+    {
+      std::cerr << "Failed to compile the meshlet cull kernel " << error->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+    auto *function = library->newFunction(NS::String::string("cullMeshlets", NS::ASCIIStringEncoding));
+    m_cull = _device->newComputePipelineState(function, &error);
+    function->release();
+    library->release();
+    if (!m_cull)
+    {
+      std::cerr << "Failed to create the meshlet cull pipeline " << error->localizedDescription()->utf8String() << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ~MeshletMesh()
+  {
+    m_cull->release();
+    for (auto *b : m_arguments)
+      b->release();
+    for (auto *b : m_indices)
+      b->release();
+    m_allIndices->release();
+    m_meshletTriangles->release();
+    m_meshletVertices->release();
+    m_meshlets->release();
+    m_vertices->release();
+  }
+
+  MeshletMesh(const MeshletMesh &) = delete;
+  MeshletMesh &operator=(const MeshletMesh &) = delete;
+
+  // _viewProjection is column major, the float4x4 the vertex shader uses, and
+  // _camera the eye position in the same space as the mesh. Without
+  // _coneCulling only the frustum test is done.
+  void cull(MTL::CommandBuffer *_commandBuffer, unsigned _slot, const float *_viewProjection, const float *_camera, bool _coneCulling = true)
+  {
+    CullUniforms uniforms;
+    planes(_viewProjection, uniforms.planes);
+    for (int k = 0; k < 3; ++k)
+      uniforms.camera[k] = _camera[k];
+    uniforms.camera[3] = 1.0f;
+    uniforms.meshletCount = uint32_t(m_meshletCount);
+    uniforms.coneCulling = _coneCulling;
+    // the slot's last frame is complete so the CPU can reset it
+    *static_cast<Arguments *>(m_arguments[_slot]->contents()) = Arguments();
+    if (!m_meshletCount)
+      return;
+    auto *compute = _commandBuffer->computeCommandEncoder();
+    compute->setComputePipelineState(m_cull);
+    compute->setBytes(&uniforms, sizeof(CullUniforms), 0);
+    compute->setBuffer(m_meshlets, 0, 1);
+    compute->setBuffer(m_meshletVertices, 0, 2);
+    compute->setBuffer(m_meshletTriangles, 0, 3);
+    compute->setBuffer(m_indices[_slot], 0, 4);
+    compute->setBuffer(m_arguments[_slot], 0, 5);
+    compute->dispatchThreadgroups(MTL::Size(m_meshletCount, 1, 1), MTL::Size(ThreadsPerMeshlet, 1, 1));
+    compute->endEncoding();
+  }
+
+  // binds the vertices and draws what cull() left in _slot
+  void draw(MTL::RenderCommandEncoder *_encoder, unsigned _slot, NS::UInteger _vertexBufferIndex = 0) const
+  {
+    _encoder->setVertexBuffer(m_vertices, 0, _vertexBufferIndex);
+    _encoder->drawIndexedPrimitives(MTL::PrimitiveTypeTriangle, MTL::IndexTypeUInt32, m_indices[_slot], 0, m_arguments[_slot], 0);
+  }
+
+  // binds the vertices and draws every triangle
+  void drawAll(MTL::RenderCommandEncoder *_encoder, NS::UInteger _vertexBufferIndex = 0) const
+  {
+    _encoder->setVertexBuffer(m_vertices, 0, _vertexBufferIndex);
+    _encoder->drawIndexedPrimitives(MTL::PrimitiveTypeTriangle, m_triangleCount * 3, MTL::IndexTypeUInt32, m_allIndices, 0);
+  }
+
+  Stats stats(unsigned _slot) const
+  {
+    const auto *arguments = static_cast<const Arguments *>(m_arguments[_slot]->contents());
+    Stats stats;
+    stats.meshlets = m_meshletCount;
+    stats.visibleMeshlets = arguments->visibleMeshlets;
+    stats.triangles = m_triangleCount;
+    stats.visibleTriangles = arguments->draw.indexCount / 3;
+    return stats;
+  }
+
+  size_t meshletCount() const { return m_meshletCount; }
+  size_t triangleCount() const { return m_triangleCount; }
+  MTL::Buffer *vertices() const { return m_vertices; }
+
+private:
+  static constexpr NS::UInteger ThreadsPerMeshlet = 128;
+
+  // the indirect draw arguments and a count of the meshlets drawn
+  struct Arguments
+  {
+    MTL::DrawIndexedPrimitivesIndirectArguments draw = {0, 1, 0, 0, 0};
+    uint32_t visibleMeshlets = 0;
+  };
+
+  // matches the kernel's
+  struct CullUniforms
+  {
+    float planes[6][4];
+    float camera[4];
+    uint32_t meshletCount;
+    uint32_t coneCulling;
+    uint32_t pad[2];
+  };
+
+  // the six frustum planes of a column major matrix with a 0 to 1 depth
+  // range, normalised so a sphere test is a distance
+  static void planes(const float *_m, float o_planes[6][4])
+  {
+    auto row = [_m](int _r, int _i) { return _m[_i * 4 + _r]; };
+    for (int i = 0; i < 4; ++i)
+    {
+      o_planes[0][i] = row(3, i) + row(0, i);
+      o_planes[1][i] = row(3, i) - row(0, i);
+      o_planes[2][i] = row(3, i) + row(1, i);
+      o_planes[3][i] = row(3, i) - row(1, i);
+      o_planes[4][i] = row(2, i);
+      o_planes[5][i] = row(3, i) - row(2, i);
+    }
+    for (int p = 0; p < 6; ++p)
+    {
+      float length = std::sqrt(o_planes[p][0] * o_planes[p][0] + o_planes[p][1] * o_planes[p][1] + o_planes[p][2] * o_planes[p][2]);
+      for (int i = 0; i < 4; ++i)
+        o_planes[p][i] /= length;
+    }
+  }
+
+  static const char *cullSource()
+  {
+    return R"""(
+      #include <metal_stdlib>
+      using namespace metal;
+
+      struct Meshlet
+      {
+        float4 centreRadius;
+        float4 coneAxisCutoff;
+        uint vertexOffset;
+        uint vertexCount;
+        uint triangleOffset;
+        uint triangleCount;
+      };
+
+      struct CullUniforms
+      {
+        float4 planes[6];
+        float4 camera;
+        uint meshletCount;
+        uint coneCulling;
+      };
+
+      struct Arguments
+      {
+        atomic_uint indexCount;
+        uint instanceCount;
+        uint indexStart;
+        int baseVertex;
+        uint baseInstance;
+        atomic_uint visibleMeshlets;
+      };
+
+      bool visible(Meshlet m, constant CullUniforms &u)
+      {
+        for (int p = 0; p < 6; ++p)
+          if (dot(u.planes[p].xyz, m.centreRadius.xyz) + u.planes[p].w < -m.centreRadius.w)
+            return false;
+        float3 toCentre = m.centreRadius.xyz - u.camera.xyz;
+        return !u.coneCulling || dot(toCentre, m.coneAxisCutoff.xyz) < m.coneAxisCutoff.w * length(toCentre) + m.centreRadius.w;
+      }
+
+      kernel void cullMeshlets(uint meshlet [[threadgroup_position_in_grid]],
+                               uint lane [[thread_index_in_threadgroup]],
+                               uint lanes [[threads_per_threadgroup]],
+                               constant CullUniforms &u [[buffer(0)]],
+                               const device Meshlet *meshlets [[buffer(1)]],
+                               const device uint *meshletVertices [[buffer(2)]],
+                               const device uchar *meshletTriangles [[buffer(3)]],
+                               device uint *indices [[buffer(4)]],
+                               device Arguments &arguments [[buffer(5)]])
+      {
+        // one lane tests the meshlet and claims room for its indices, the
+        // whole threadgroup copies them
+        if (meshlet >= u.meshletCount)
+          return;
+        threadgroup uint start;
+        Meshlet m = meshlets[meshlet];
+        if (lane == 0)
+        {
+          start = ~0u;
+          if (visible(m, u))
+          {
+            start = atomic_fetch_add_explicit(&arguments.indexCount, m.triangleCount * 3, memory_order_relaxed);
+            atomic_fetch_add_explicit(&arguments.visibleMeshlets, 1, memory_order_relaxed);
+          }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        if (start == ~0u)
+          return;
+        for (uint i = lane; i < m.triangleCount * 3; i += lanes)
+          indices[start + i] = meshletVertices[m.vertexOffset + meshletTriangles[m.triangleOffset * 3 + i]];
+      }
+    )""";
+  }
+
+  MTL::Buffer *m_vertices;
+  MTL::Buffer *m_meshlets;
+  MTL::Buffer *m_meshletVertices;
+  MTL::Buffer *m_meshletTriangles;
+  MTL::Buffer *m_allIndices;
+  std::vector<MTL::Buffer *> m_indices;
+  std::vector<MTL::Buffer *> m_arguments;
+  MTL::ComputePipelineState *m_cull = nullptr;
+  size_t m_meshletCount;
+  size_t m_triangleCount;
+};
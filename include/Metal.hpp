@@ -5577,6 +5577,7 @@ _MTL_INLINE MTL::Texture* MTL::Texture::newTextureView(MTL::PixelFormat pixelFor
 #define _CA_VALIDATE_SIZE(ns, name) _NS_VALIDATE_SIZE(ns, name)
 #define _CA_VALIDATE_ENUM(ns, name) _NS_VALIDATE_ENUM(ns, name)
 
+#include <CoreGraphics/CGGeometry.h>
 #include <objc/runtime.h>
 
 #define _CA_PRIVATE_CLS(symbol) (Private::Class::s_k##symbol)
@@ -5616,6 +5617,8 @@ namespace Private
     namespace Class
     {
 
+        _CA_PRIVATE_DEF_CLS(CAMetalLayer);
+
     } // Class
 } // Private
 } // CA
@@ -5640,8 +5643,38 @@ namespace Private
     namespace Selector
     {
 
+        _CA_PRIVATE_DEF_SEL(allowsNextDrawableTimeout,
+            "allowsNextDrawableTimeout");
+        _CA_PRIVATE_DEF_SEL(device,
+            "device");
+        _CA_PRIVATE_DEF_SEL(displaySyncEnabled,
+            "displaySyncEnabled");
+        _CA_PRIVATE_DEF_SEL(drawableSize,
+            "drawableSize");
+        _CA_PRIVATE_DEF_SEL(framebufferOnly,
+            "framebufferOnly");
         _CA_PRIVATE_DEF_SEL(layer,
             "layer");
+        _CA_PRIVATE_DEF_SEL(maximumDrawableCount,
+            "maximumDrawableCount");
+        _CA_PRIVATE_DEF_SEL(nextDrawable,
+            "nextDrawable");
+        _CA_PRIVATE_DEF_SEL(pixelFormat,
+            "pixelFormat");
+        _CA_PRIVATE_DEF_SEL(setAllowsNextDrawableTimeout_,
+            "setAllowsNextDrawableTimeout:");
+        _CA_PRIVATE_DEF_SEL(setDevice_,
+            "setDevice:");
+        _CA_PRIVATE_DEF_SEL(setDisplaySyncEnabled_,
+            "setDisplaySyncEnabled:");
+        _CA_PRIVATE_DEF_SEL(setDrawableSize_,
+            "setDrawableSize:");
+        _CA_PRIVATE_DEF_SEL(setFramebufferOnly_,
+            "setFramebufferOnly:");
+        _CA_PRIVATE_DEF_SEL(setMaximumDrawableCount_,
+            "setMaximumDrawableCount:");
+        _CA_PRIVATE_DEF_SEL(setPixelFormat_,
+            "setPixelFormat:");
         _CA_PRIVATE_DEF_SEL(texture,
             "texture");
 
@@ -5661,12 +5694,124 @@ public:
 
 _CA_INLINE CA::MetalLayer* CA::MetalDrawable::layer() const
 {
-    return Object::sendMessage<MetalLayer*>(this, _MTL_PRIVATE_SEL(layer));
+    return Object::sendMessage<MetalLayer*>(this, _CA_PRIVATE_SEL(layer));
 }
 
 _CA_INLINE MTL::Texture* CA::MetalDrawable::texture() const
 {
-    return Object::sendMessage<MTL::Texture*>(this, _MTL_PRIVATE_SEL(texture));
+    return Object::sendMessage<MTL::Texture*>(this, _CA_PRIVATE_SEL(texture));
+}
+
+namespace CA
+{
+class MetalLayer : public NS::Referencing<MetalLayer>
+{
+public:
+    static class MetalLayer* layer();
+
+    MTL::Device*             device() const;
+    void                     setDevice(MTL::Device* device);
+
+    MTL::PixelFormat         pixelFormat() const;
+    void                     setPixelFormat(MTL::PixelFormat pixelFormat);
+
+    bool                     framebufferOnly() const;
+    void                     setFramebufferOnly(bool framebufferOnly);
+
+    CGSize                   drawableSize() const;
+    void                     setDrawableSize(CGSize drawableSize);
+
+    NS::UInteger             maximumDrawableCount() const;
+    void                     setMaximumDrawableCount(NS::UInteger maximumDrawableCount);
+
+    bool                     displaySyncEnabled() const;
+    void                     setDisplaySyncEnabled(bool displaySyncEnabled);
+
+    bool                     allowsNextDrawableTimeout() const;
+    void                     setAllowsNextDrawableTimeout(bool allowsNextDrawableTimeout);
+
+    class MetalDrawable*     nextDrawable();
+};
+}
+
+_CA_INLINE CA::MetalLayer* CA::MetalLayer::layer()
+{
+    return Object::sendMessage<CA::MetalLayer*>(_CA_PRIVATE_CLS(CAMetalLayer), _CA_PRIVATE_SEL(layer));
+}
+
+_CA_INLINE MTL::Device* CA::MetalLayer::device() const
+{
+    return Object::sendMessage<MTL::Device*>(this, _CA_PRIVATE_SEL(device));
+}
+
+_CA_INLINE void CA::MetalLayer::setDevice(MTL::Device* device)
+{
+    Object::sendMessage<void>(this, _CA_PRIVATE_SEL(setDevice_), device);
+}
+
+_CA_INLINE MTL::PixelFormat CA::MetalLayer::pixelFormat() const
+{
+    return Object::sendMessage<MTL::PixelFormat>(this, _CA_PRIVATE_SEL(pixelFormat));
+}
+
+_CA_INLINE void CA::MetalLayer::setPixelFormat(MTL::PixelFormat pixelFormat)
+{
+    Object::sendMessage<void>(this, _CA_PRIVATE_SEL(setPixelFormat_), pixelFormat);
+}
+
+_CA_INLINE bool CA::MetalLayer::framebufferOnly() const
+{
+    return Object::sendMessage<bool>(this, _CA_PRIVATE_SEL(framebufferOnly));
+}
+
+_CA_INLINE void CA::MetalLayer::setFramebufferOnly(bool framebufferOnly)
+{
+    Object::sendMessage<void>(this, _CA_PRIVATE_SEL(setFramebufferOnly_), framebufferOnly);
+}
+
+_CA_INLINE CGSize CA::MetalLayer::drawableSize() const
+{
+    return Object::sendMessage<CGSize>(this, _CA_PRIVATE_SEL(drawableSize));
+}
+
+_CA_INLINE void CA::MetalLayer::setDrawableSize(CGSize drawableSize)
+{
+    Object::sendMessage<void>(this, _CA_PRIVATE_SEL(setDrawableSize_), drawableSize);
+}
+
+_CA_INLINE NS::UInteger CA::MetalLayer::maximumDrawableCount() const
+{
+    return Object::sendMessage<NS::UInteger>(this, _CA_PRIVATE_SEL(maximumDrawableCount));
+}
+
+_CA_INLINE void CA::MetalLayer::setMaximumDrawableCount(NS::UInteger maximumDrawableCount)
+{
+    Object::sendMessage<void>(this, _CA_PRIVATE_SEL(setMaximumDrawableCount_), maximumDrawableCount);
+}
+
+_CA_INLINE bool CA::MetalLayer::displaySyncEnabled() const
+{
+    return Object::sendMessage<bool>(this, _CA_PRIVATE_SEL(displaySyncEnabled));
+}
+
+_CA_INLINE void CA::MetalLayer::setDisplaySyncEnabled(bool displaySyncEnabled)
+{
+    Object::sendMessage<void>(this, _CA_PRIVATE_SEL(setDisplaySyncEnabled_), displaySyncEnabled);
+}
+
+_CA_INLINE bool CA::MetalLayer::allowsNextDrawableTimeout() const
+{
+    return Object::sendMessage<bool>(this, _CA_PRIVATE_SEL(allowsNextDrawableTimeout));
+}
+
+_CA_INLINE void CA::MetalLayer::setAllowsNextDrawableTimeout(bool allowsNextDrawableTimeout)
+{
+    Object::sendMessage<void>(this, _CA_PRIVATE_SEL(setAllowsNextDrawableTimeout_), allowsNextDrawableTimeout);
+}
+
+_CA_INLINE CA::MetalDrawable* CA::MetalLayer::nextDrawable()
+{
+    return Object::sendMessage<MetalDrawable*>(this, _CA_PRIVATE_SEL(nextDrawable));
 }
 
 #pragma once
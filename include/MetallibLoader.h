@@ -0,0 +1,106 @@
+#pragma once
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include <dispatch/dispatch.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Loads a library from a .metallib packaged beside the executable, falling
+// back to compiling the MSL source built into the program if the metallib is
+// missing, can't be loaded or is stale. The build copies the source it made
+// the metallib from to <metallib>.src, which is compared with the built in
+// source so an old metallib is never used with newer code.
+//
+// The metallib is mapped rather than read, and given to Metal as dispatch
+// data that unmaps it when Metal is finished with it, so there is no copy.
+class MetallibLoader
+{
+public:
+  enum class Path
+  {
+    Mapped,
+    URL,
+    Compiled
+  };
+
+  static const char *name(Path _path)
+  {
+    switch (_path)
+    {
+    case Path::Mapped:
+      return "mapped metallib";
+    case Path::URL:
+      return "metallib url";
+    case Path::Compiled:
+      return "compiled source";
+    }
+    return "";
+  }
+
+  // _prefer picks how a metallib is loaded, Mapped or URL. Passing Compiled
+  // skips the metallib altogether. The path taken is returned in o_path.
+  static MTL::Library *newLibrary(MTL::Device *_device, const std::string &_metallib, const std::string &_source, const ShaderOptions &_options,
+                                  Path _prefer, Path *o_path, NS::Error **_error)
+  {
+    if (_prefer != Path::Compiled && upToDate(_metallib, _source))
+    {
+      auto *library = _prefer == Path::Mapped ? loadMapped(_device, _metallib, _error) : loadURL(_device, _metallib, _error);
+      if (library)
+      {
+        if (o_path)
+          *o_path = _prefer;
+        return library;
+      }
+      std::cerr << "Unable to load " << _metallib << ", compiling from source\n";
+    }
+    if (o_path)
+      *o_path = Path::Compiled;
+    auto *options = _options.newCompileOptions();
+    auto *library = _device->newLibrary(NS::String::string(_source.c_str(), NS::UTF8StringEncoding), options, _error);
+    options->release();
+    return library;
+  }
+
+  // the metallib exists and was built from _source
+  static bool upToDate(const std::string &_metallib, const std::string &_source)
+  {
+    std::ifstream built(_metallib + ".src", std::ios::binary);
+    if (!built.is_open() || access(_metallib.c_str(), R_OK) != 0)
+      return false;
+    auto builtSource = std::string((std::istreambuf_iterator<char>(built)), std::istreambuf_iterator<char>());
+    return builtSource == _source;
+  }
+
+  static MTL::Library *loadMapped(MTL::Device *_device, const std::string &_metallib, NS::Error **_error)
+  {
+    int fd = open(_metallib.c_str(), O_RDONLY);
+    if (fd < 0)
+      return nullptr;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+      close(fd);
+      return nullptr;
+    }
+    void *bytes = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid once the file is closed
+    close(fd);
+    if (bytes == MAP_FAILED)
+      return nullptr;
+    auto data = dispatch_data_create(bytes, size_t(info.st_size), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                                     DISPATCH_DATA_DESTRUCTOR_MUNMAP);
+    auto *library = _device->newLibrary(data, _error);
+    dispatch_release(data);
+    return library;
+  }
+
+  static MTL::Library *loadURL(MTL::Device *_device, const std::string &_metallib, NS::Error **_error)
+  {
+    return _device->newLibrary(NS::URL::fileURLWithPath(NS::String::string(_metallib.c_str(), NS::UTF8StringEncoding)), _error);
+  }
+};
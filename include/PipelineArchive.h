@@ -0,0 +1,145 @@
+#pragma once
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include <cassert>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Persistent pipeline cache built on MTL::BinaryArchive. On the first run every
+// pipeline is built as normal and its functions recorded into the archive,
+// which is written out with save(). Later runs hand the archive to the
+// pipeline descriptors so the compiled GPU binaries are reused instead of
+// compiled again. The archive is thrown away when the shader version string
+// given by the caller, the device or the OS (and so the driver) changes.
+class PipelineArchive
+{
+public:
+  PipelineArchive(MTL::Device *_device, const std::string &_path, const std::string &_shaderVersion)
+      : m_device(_device), m_path(_path)
+  {
+    std::string stamp = _shaderVersion;
+    stamp += '\n' + std::string(_device->name()->utf8String());
+    stamp += '\n' + std::string(NS::ProcessInfo::processInfo()->operatingSystemVersionString()->utf8String());
+    char hash[32];
+    std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(fnv1a(stamp)));
+    m_stamp = hash;
+
+    auto *descriptor = MTL::BinaryArchiveDescriptor::alloc()->init();
+    if (std::filesystem::exists(m_path) && readStamp() == m_stamp)
+    {
+      descriptor->setUrl(url(m_path));
+      NS::Error *error = nullptr;
+      m_archive = m_device->newBinaryArchive(descriptor, &error);
+      m_loaded = m_archive != nullptr;
+    }
+    if (!m_archive)
+    {
+      // stale or missing, start again with an empty archive
+      std::error_code ec;
+      std::filesystem::remove(m_path, ec);
+      descriptor->setUrl(nullptr);
+      NS::Error *error = nullptr;
+      m_archive = m_device->newBinaryArchive(descriptor, &error);
+      assert(m_archive);
+    }
+    descriptor->release();
+    m_archives = NS::Array::array(m_archive)->retain();
+  }
+
+  ~PipelineArchive()
+  {
+    m_archives->release();
+    m_archive->release();
+  }
+
+  MTL::RenderPipelineState *newRenderPipelineState(MTL::RenderPipelineDescriptor *_desc, NS::Error **_error)
+  {
+    _desc->setBinaryArchives(m_archives);
+    if (m_loaded)
+    {
+      // only accept a binary from the archive so a hit can be told from a miss
+      auto *pipeline = m_device->newRenderPipelineState(_desc, MTL::PipelineOptionFailOnBinaryArchiveMiss, nullptr, _error);
+      if (pipeline)
+      {
+        ++m_hits;
+        return pipeline;
+      }
+    }
+    ++m_misses;
+    auto *pipeline = m_device->newRenderPipelineState(_desc, _error);
+    if (pipeline && m_archive->addRenderPipelineFunctions(_desc, _error))
+      m_dirty = true;
+    return pipeline;
+  }
+
+  MTL::ComputePipelineState *newComputePipelineState(MTL::ComputePipelineDescriptor *_desc, NS::Error **_error)
+  {
+    _desc->setBinaryArchives(m_archives);
+    if (m_loaded)
+    {
+      auto *pipeline = m_device->newComputePipelineState(_desc, MTL::PipelineOptionFailOnBinaryArchiveMiss, nullptr, _error);
+      if (pipeline)
+      {
+        ++m_hits;
+        return pipeline;
+      }
+    }
+    ++m_misses;
+    auto *pipeline = m_device->newComputePipelineState(_desc, MTL::PipelineOptionNone, nullptr, _error);
+    if (pipeline && m_archive->addComputePipelineFunctions(_desc, _error))
+      m_dirty = true;
+    return pipeline;
+  }
+
+  // write the archive if anything new was recorded, via a temporary file as
+  // the archive may be backed by the file it was loaded from
+  bool save()
+  {
+    if (!m_dirty)
+      return true;
+    auto tmpPath = m_path + ".tmp";
+    NS::Error *error = nullptr;
+    if (!m_archive->serializeToURL(url(tmpPath), &error))
+    {
+      std::cerr << "Unable to save pipeline archive " << m_path << ' ' << error->localizedDescription()->utf8String() << '\n';
+      return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, m_path, ec);
+    if (ec)
+      return false;
+    std::ofstream(m_path + ".stamp") << m_stamp;
+    m_dirty = false;
+    return true;
+  }
+
+  bool loadedFromDisk() const { return m_loaded; }
+  size_t hits() const { return m_hits; }
+  size_t misses() const { return m_misses; }
+
+private:
+  static NS::URL *url(const std::string &_path)
+  {
+    return NS::URL::fileURLWithPath(NS::String::string(_path.c_str(), NS::UTF8StringEncoding));
+  }
+
+  std::string readStamp() const
+  {
+    std::string stamp;
+    std::ifstream(m_path + ".stamp") >> stamp;
+    return stamp;
+  }
+
+  MTL::Device *m_device;
+  std::string m_path;
+  std::string m_stamp;
+  MTL::BinaryArchive *m_archive = nullptr;
+  NS::Array *m_archives = nullptr;
+  bool m_loaded = false;
+  bool m_dirty = false;
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+};
@@ -0,0 +1,246 @@
+#pragma once
+#include "Metal.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One pipeline an app will need. build() makes it and is called on a worker
+// thread, or on the render thread if the pipeline is needed before the warm-up
+// got to it. The result is owned by the scheduler.
+struct WarmupEntry
+{
+  std::string name;
+  // higher goes first among pipelines expected on the same frame
+  int priority = 0;
+  // the frame the pipeline is expected to be first used on
+  int expectedFrame = 0;
+  std::function<NS::Object *()> build;
+};
+
+// Builds the pipelines of a manifest on background threads before they are
+// needed, soonest first. The frame each pipeline is actually first used on is
+// recorded and can be saved, and a later run orders the work by that instead
+// of the manifest's guess, whether the guess was too late or too early. A
+// pipeline that is asked for before it is ready is built (or waited for) on
+// the calling thread, which is the hitch the warm-up is there to avoid, and is
+// counted.
+//
+// The history is a text file of one pipeline per line, the frame then a tab
+// then the name, so names may hold spaces but not tabs or newlines.
+class PipelineWarmup
+{
+public:
+  PipelineWarmup(std::vector<WarmupEntry> _manifest, const std::string &_historyPath,
+                 unsigned _threads = 2)
+      : m_historyPath(_historyPath)
+  {
+    loadHistory();
+    for (auto &e : _manifest)
+    {
+      auto item = std::make_unique<Item>();
+      item->entry = std::move(e);
+      auto seen = m_history.find(item->entry.name);
+      item->order = seen != m_history.end() ? seen->second : item->entry.expectedFrame;
+      m_items[item->entry.name] = item.get();
+      m_queue.push_back(std::move(item));
+    }
+    // soonest first, then by priority; the back of the queue is taken first
+    std::stable_sort(m_queue.begin(), m_queue.end(), [](const std::unique_ptr<Item> &_a, const std::unique_ptr<Item> &_b) {
+      if (_a->order != _b->order)
+        return _a->order > _b->order;
+      return _a->entry.priority < _b->entry.priority;
+    });
+    for (auto &i : m_queue)
+      m_order.push_back(i->entry.name);
+    std::reverse(m_order.begin(), m_order.end());
+    for (unsigned t = 0; t < _threads; ++t)
+      m_workers.emplace_back([this] { work(); });
+  }
+
+  ~PipelineWarmup()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_quit = true;
+    }
+    m_cv.notify_all();
+    for (auto &w : m_workers)
+      w.join();
+    for (auto &i : m_queue)
+      if (i->object)
+        i->object->release();
+    for (auto &i : m_taken)
+      if (i->object)
+        i->object->release();
+  }
+
+  PipelineWarmup(const PipelineWarmup &) = delete;
+  PipelineWarmup &operator=(const PipelineWarmup &) = delete;
+
+  // The pipeline called _name for use on _frame, borrowed. Never fails to
+  // return one that could be built, but may block.
+  template <typename T>
+  T *acquire(const std::string &_name, int _frame)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = m_items.find(_name);
+    if (it == m_items.end())
+      return nullptr;
+    Item *item = it->second;
+    if (item->firstUse < 0)
+      item->firstUse = _frame;
+    if (item->state == State::Ready)
+      return static_cast<T *>(item->object);
+
+    auto start = std::chrono::steady_clock::now();
+    if (item->state == State::Queued)
+    {
+      // not started, build it here rather than wait behind the queue
+      take(item);
+      item->state = State::Building;
+      lock.unlock();
+      auto *object = item->entry.build();
+      lock.lock();
+      item->object = object;
+      item->state = State::Ready;
+      m_cv.notify_all();
+    }
+    else
+      m_cv.wait(lock, [item] { return item->state == State::Ready; });
+    ++m_stalls;
+    m_stallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<T *>(item->object);
+  }
+
+  bool ready(const std::string &_name) const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_items.find(_name);
+    return it != m_items.end() && it->second->state == State::Ready;
+  }
+
+  // blocks until every pipeline is built
+  void waitAll()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this] {
+      for (auto &i : m_items)
+        if (i.second->state != State::Ready)
+          return false;
+      return true;
+    });
+  }
+
+  // write the first use frames seen this run, merged with what was known
+  bool saveHistory()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto &i : m_items)
+      if (i.second->firstUse >= 0)
+        m_history[i.first] = i.second->firstUse;
+    std::ofstream out(m_historyPath);
+    if (!out.is_open())
+      return false;
+    for (auto &h : m_history)
+      out << h.second << '\t' << h.first << '\n';
+    return true;
+  }
+
+  // the names in the order they are warmed up
+  const std::vector<std::string> &order() const { return m_order; }
+  size_t stalls() const { return m_stalls; }
+  double stallMs() const { return m_stallMs; }
+  bool hadHistory() const { return !m_history.empty(); }
+
+private:
+  enum class State
+  {
+    Queued,
+    Building,
+    Ready
+  };
+
+  struct Item
+  {
+    WarmupEntry entry;
+    int order = 0;
+    int firstUse = -1;
+    State state = State::Queued;
+    NS::Object *object = nullptr;
+  };
+
+  // move a queued item out of the queue, called with the lock held
+  void take(Item *_item)
+  {
+    auto it = std::find_if(m_queue.begin(), m_queue.end(), [_item](const std::unique_ptr<Item> &_i) { return _i.get() == _item; });
+    m_taken.push_back(std::move(*it));
+    m_queue.erase(it);
+  }
+
+  void work()
+  {
+    for (;;)
+    {
+      Item *item = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+        if (m_quit)
+          return;
+        item = m_queue.back().get();
+        take(item);
+        item->state = State::Building;
+      }
+      // the worker threads have no autorelease pool of their own
+      auto *pool = NS::AutoreleasePool::alloc()->init();
+      auto *object = item->entry.build();
+      pool->release();
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        item->object = object;
+        item->state = State::Ready;
+      }
+      m_cv.notify_all();
+    }
+  }
+
+  void loadHistory()
+  {
+    std::ifstream in(m_historyPath);
+    std::string line;
+    while (std::getline(in, line))
+    {
+      auto tab = line.find('\t');
+      if (tab == std::string::npos || tab + 1 == line.size())
+        continue;
+      char *end = nullptr;
+      long frame = std::strtol(line.c_str(), &end, 10);
+      if (end != line.c_str() + tab)
+        continue;
+      m_history[line.substr(tab + 1)] = static_cast<int>(frame);
+    }
+  }
+
+  std::string m_historyPath;
+  std::map<std::string, int> m_history;
+  std::map<std::string, Item *> m_items;
+  // queued work, soonest needed at the back, and work that has been started
+  std::vector<std::unique_ptr<Item>> m_queue;
+  std::vector<std::unique_ptr<Item>> m_taken;
+  std::vector<std::string> m_order;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::vector<std::thread> m_workers;
+  bool m_quit = false;
+  size_t m_stalls = 0;
+  double m_stallMs = 0.0;
+};
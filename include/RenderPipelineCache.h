@@ -0,0 +1,200 @@
+#pragma once
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Hands out one MTL::RenderPipelineState per distinct pipeline state. The
+// descriptor is reduced to a key covering the vertex and fragment functions,
+// colour attachment formats and blend state, vertex descriptor, sample counts
+// and depth / stencil formats, so code that builds the same descriptor in
+// several places shares a single pipeline instead of compiling it again.
+//
+// Functions are keyed by object, as MTL::Function has no link back to its
+// library. Get them through function() so asking for the same name from the
+// same library always gives the same object and so the same key.
+class RenderPipelineCache
+{
+public:
+  explicit RenderPipelineCache(MTL::Device *_device) : m_device(_device) {}
+
+  ~RenderPipelineCache()
+  {
+    for (auto &f : m_functions)
+      f.second->release();
+    for (auto &p : m_pipelines)
+      p.second.pipeline->release();
+    for (auto *f : m_retained)
+      f->release();
+  }
+
+  RenderPipelineCache(const RenderPipelineCache &) = delete;
+  RenderPipelineCache &operator=(const RenderPipelineCache &) = delete;
+
+  // borrowed, owned by the cache
+  MTL::Function *function(MTL::Library *_library, const std::string &_name)
+  {
+    auto key = std::make_pair(_library, _name);
+    auto it = m_functions.find(key);
+    if (it != m_functions.end())
+      return it->second;
+    auto *func = _library->newFunction(NS::String::string(_name.c_str(), NS::UTF8StringEncoding));
+    if (func)
+      m_functions.emplace(key, func);
+    return func;
+  }
+
+  // borrowed, owned by the cache. _desc is only read so the caller can keep
+  // reusing it.
+  MTL::RenderPipelineState *renderPipelineState(const MTL::RenderPipelineDescriptor *_desc, NS::Error **_error)
+  {
+    auto key = makeKey(_desc);
+    auto it = m_pipelines.find(key);
+    if (it != m_pipelines.end())
+    {
+      ++m_hits;
+      m_savedMs += it->second.createMs;
+      return it->second.pipeline;
+    }
+    ++m_misses;
+    auto start = std::chrono::steady_clock::now();
+    auto *pipeline = m_device->newRenderPipelineState(_desc, _error);
+    double createMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (!pipeline)
+      return nullptr;
+    // keep the functions alive so their addresses can't be reused by another
+    // function and give a false hit
+    if (auto *f = _desc->vertexFunction())
+      retainFunction(f);
+    if (auto *f = _desc->fragmentFunction())
+      retainFunction(f);
+    m_createMs += createMs;
+    m_pipelines.emplace(std::move(key), Entry{pipeline, createMs});
+    return pipeline;
+  }
+
+  // stable for the life of the process, useful for logging which pipelines an
+  // app ends up with
+  uint64_t hash(const MTL::RenderPipelineDescriptor *_desc) const { return fnv1a(makeKey(_desc)); }
+
+  size_t size() const { return m_pipelines.size(); }
+  size_t hits() const { return m_hits; }
+  size_t misses() const { return m_misses; }
+  double hitRate() const { return m_hits + m_misses ? double(m_hits) / double(m_hits + m_misses) : 0.0; }
+  // time spent creating pipelines and the creation time hits avoided, taking
+  // each hit as costing what its pipeline took to build
+  double createMs() const { return m_createMs; }
+  double savedMs() const { return m_savedMs; }
+
+private:
+  struct Entry
+  {
+    MTL::RenderPipelineState *pipeline;
+    double createMs;
+  };
+
+  struct FunctionKeyHash
+  {
+    size_t operator()(const std::pair<MTL::Library *, std::string> &_k) const
+    {
+      return std::hash<std::string>()(_k.second) ^ std::hash<const void *>()(_k.first);
+    }
+  };
+
+  template <typename T>
+  static void append(std::string &_key, T _value)
+  {
+    _key.append(reinterpret_cast<const char *>(&_value), sizeof(T));
+  }
+
+  // every field that changes the compiled pipeline, packed into bytes
+  static std::string makeKey(const MTL::RenderPipelineDescriptor *_desc)
+  {
+    std::string key;
+    key.reserve(256);
+    append(key, static_cast<const void *>(_desc->vertexFunction()));
+    append(key, static_cast<const void *>(_desc->fragmentFunction()));
+    append(key, _desc->sampleCount());
+    append(key, _desc->rasterSampleCount());
+    append(key, _desc->alphaToCoverageEnabled());
+    append(key, _desc->alphaToOneEnabled());
+    append(key, _desc->rasterizationEnabled());
+    append(key, _desc->inputPrimitiveTopology());
+    append(key, _desc->supportIndirectCommandBuffers());
+    append(key, _desc->depthAttachmentPixelFormat());
+    append(key, _desc->stencilAttachmentPixelFormat());
+
+    auto *colour = _desc->colorAttachments();
+    for (NS::UInteger i = 0; i < MaxColourAttachments; ++i)
+    {
+      auto *attachment = colour->object(i);
+      if (attachment->pixelFormat() == MTL::PixelFormatInvalid)
+        continue;
+      append(key, i);
+      append(key, attachment->pixelFormat());
+      append(key, attachment->writeMask());
+      append(key, attachment->blendingEnabled());
+      if (!attachment->blendingEnabled())
+        continue;
+      append(key, attachment->sourceRGBBlendFactor());
+      append(key, attachment->destinationRGBBlendFactor());
+      append(key, attachment->rgbBlendOperation());
+      append(key, attachment->sourceAlphaBlendFactor());
+      append(key, attachment->destinationAlphaBlendFactor());
+      append(key, attachment->alphaBlendOperation());
+    }
+
+    if (auto *vertex = _desc->vertexDescriptor())
+    {
+      // only the layouts of buffers an attribute reads from matter
+      uint64_t buffersUsed = 0;
+      for (NS::UInteger i = 0; i < MaxVertexAttributes; ++i)
+      {
+        auto *attribute = vertex->attributes()->object(i);
+        if (attribute->format() == MTL::VertexFormatInvalid)
+          continue;
+        append(key, i);
+        append(key, attribute->format());
+        append(key, attribute->offset());
+        append(key, attribute->bufferIndex());
+        buffersUsed |= uint64_t(1) << attribute->bufferIndex();
+      }
+      for (NS::UInteger i = 0; i < MaxVertexBuffers; ++i)
+      {
+        if (!(buffersUsed & (uint64_t(1) << i)))
+          continue;
+        auto *layout = vertex->layouts()->object(i);
+        append(key, i);
+        append(key, layout->stride());
+        append(key, layout->stepFunction());
+        append(key, layout->stepRate());
+      }
+    }
+    return key;
+  }
+
+  void retainFunction(MTL::Function *_function)
+  {
+    for (auto *f : m_retained)
+      if (f == _function)
+        return;
+    m_retained.push_back(_function->retain());
+  }
+
+  static constexpr NS::UInteger MaxColourAttachments = 8;
+  static constexpr NS::UInteger MaxVertexAttributes = 31;
+  static constexpr NS::UInteger MaxVertexBuffers = 31;
+
+  MTL::Device *m_device;
+  std::unordered_map<std::string, Entry> m_pipelines;
+  std::unordered_map<std::pair<MTL::Library *, std::string>, MTL::Function *, FunctionKeyHash> m_functions;
+  std::vector<MTL::Function *> m_retained;
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+  double m_createMs = 0.0;
+  double m_savedMs = 0.0;
+};
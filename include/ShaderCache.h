@@ -0,0 +1,271 @@
+#pragma once
+#include "Metal.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+// Compile options for MSL source in a form which can be hashed and turned into
+// both an MTL::CompileOptions and metal compiler command line arguments.
+struct ShaderOptions
+{
+  // 0 means use the compiler default
+  MTL::LanguageVersion languageVersion = static_cast<MTL::LanguageVersion>(0);
+  bool fastMath = true;
+  std::map<std::string, std::string> macros;
+
+  // caller owns the returned object
+  MTL::CompileOptions *newCompileOptions() const
+  {
+    auto *options = MTL::CompileOptions::alloc()->init();
+    options->setFastMathEnabled(fastMath);
+    if (languageVersion != 0)
+      options->setLanguageVersion(languageVersion);
+    if (!macros.empty())
+    {
+      std::vector<const NS::Object *> keys;
+      std::vector<const NS::Object *> values;
+      for (auto &m : macros)
+      {
+        keys.push_back(NS::String::string(m.first.c_str(), NS::UTF8StringEncoding));
+        values.push_back(NS::String::string(m.second.c_str(), NS::UTF8StringEncoding));
+      }
+      options->setPreprocessorMacros(NS::Dictionary::dictionary(values.data(), keys.data(), keys.size()));
+    }
+    return options;
+  }
+
+  // the same options as arguments for the offline metal compiler, one string
+  // each and passed as they are rather than through a shell
+  std::vector<std::string> compilerArguments() const
+  {
+    std::vector<std::string> arguments = {fastMath ? "-ffast-math" : "-fno-fast-math"};
+    if (languageVersion != 0)
+    {
+      auto major = static_cast<unsigned>(languageVersion) >> 16;
+      auto minor = static_cast<unsigned>(languageVersion) & 0xffff;
+      // Metal 3 dropped the platform, -std=metal3.0 follows -std=macos-metal2.4
+      std::string standard = major >= 3 ? "-std=metal" : "-std=macos-metal";
+      arguments.push_back(standard + std::to_string(major) + "." + std::to_string(minor));
+    }
+    for (auto &m : macros)
+      arguments.push_back("-D" + m.first + "=" + m.second);
+    return arguments;
+  }
+
+  // every option, for cache keys
+  std::string key() const
+  {
+    std::string key;
+    for (auto &a : compilerArguments())
+      key += a + '\0';
+    return key;
+  }
+};
+
+// 64 bit FNV-1a, only used to name cache entries
+inline uint64_t fnv1a(const std::string &_data, uint64_t _hash = 14695981039346656037ull)
+{
+  for (unsigned char c : _data)
+  {
+    _hash ^= c;
+    _hash *= 1099511628211ull;
+  }
+  return _hash;
+}
+
+// On disk cache of compiled shader libraries. Entries are keyed by a hash of
+// the MSL source, the compile options, the device name and the OS version, and
+// stored as .metallib files built with the offline compiler (xcrun metal) so
+// later runs load the binary instead of compiling source at startup. If the
+// offline compiler is not installed the source is compiled in process as before.
+// It can be shared between threads, such as the watcher threads of several
+// HotReloadPipelines: one library is looked up or built at a time, so a second
+// thread asking for the same source finds the entry the first one wrote.
+class ShaderCache
+{
+public:
+  explicit ShaderCache(MTL::Device *_device, const std::string &_directory = defaultDirectory())
+      : m_device(_device), m_directory(_directory)
+  {
+    std::error_code ec;
+    std::filesystem::create_directories(m_directory, ec);
+    if (ec)
+      std::cerr << "Unable to create shader cache directory " << m_directory << '\n';
+  }
+
+  // $METAL_SHADER_CACHE if set else ~/Library/Caches/MetalExamples
+  static std::string defaultDirectory()
+  {
+    if (const char *dir = std::getenv("METAL_SHADER_CACHE"))
+      return dir;
+    if (const char *home = std::getenv("HOME"))
+      return std::string(home) + "/Library/Caches/MetalExamples";
+    return "shadercache";
+  }
+
+  std::string entryPath(const std::string &_source, const ShaderOptions &_options) const
+  {
+    std::string key = _source;
+    key += '\0' + _options.key();
+    key += '\0' + std::string(m_device->name()->utf8String());
+    key += '\0' + std::string(NS::ProcessInfo::processInfo()->operatingSystemVersionString()->utf8String());
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(fnv1a(key)));
+    return m_directory + "/" + name + ".metallib";
+  }
+
+  MTL::Library *newLibrary(const NS::String *_source, const ShaderOptions &_options, NS::Error **_error)
+  {
+    return newLibrary(std::string(_source->utf8String()), _options, _error);
+  }
+
+  MTL::Library *newLibrary(const std::string &_source, const ShaderOptions &_options, NS::Error **_error)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto path = entryPath(_source, _options);
+    m_lastWasHit = false;
+    if (std::filesystem::exists(path))
+    {
+      if (auto *library = loadLibrary(path, _error))
+      {
+        m_lastWasHit = true;
+        ++m_hits;
+        return library;
+      }
+      // unreadable or stale entry, rebuild it
+      std::error_code ec;
+      std::filesystem::remove(path, ec);
+    }
+    ++m_misses;
+    if (compileToDisk(_source, _options, path))
+    {
+      if (auto *library = loadLibrary(path, _error))
+        return library;
+    }
+    auto *options = _options.newCompileOptions();
+    auto *library = m_device->newLibrary(NS::String::string(_source.c_str(), NS::UTF8StringEncoding), options, _error);
+    options->release();
+    return library;
+  }
+
+  // delete one entry, as returned by entryPath()
+  void remove(const std::string &_entryPath)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::error_code ec;
+    std::filesystem::remove(_entryPath, ec);
+  }
+
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::error_code ec;
+    for (auto &entry : std::filesystem::directory_iterator(m_directory, ec))
+      if (entry.path().extension() == ".metallib")
+        std::filesystem::remove(entry.path(), ec);
+  }
+
+  // whether the last newLibrary call, on any thread, was a hit
+  bool lastWasHit() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lastWasHit;
+  }
+
+  size_t hits() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hits;
+  }
+
+  size_t misses() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_misses;
+  }
+
+private:
+  MTL::Library *loadLibrary(const std::string &_path, NS::Error **_error)
+  {
+    auto *url = NS::URL::fileURLWithPath(NS::String::string(_path.c_str(), NS::UTF8StringEncoding));
+    return m_device->newLibrary(url, _error);
+  }
+
+  // build the metallib with the offline compiler, written to a temporary name
+  // first so a concurrent reader never sees a partial file. The temporary
+  // names carry the process id so other processes sharing the directory
+  // don't write over them, threads of this one are kept apart by m_mutex.
+  bool compileToDisk(const std::string &_source, const ShaderOptions &_options, const std::string &_path)
+  {
+    if (!hasOfflineCompiler())
+      return false;
+    auto unique = _path + "." + std::to_string(getpid());
+    auto sourcePath = unique + ".metal";
+    auto tmpPath = unique + ".tmp";
+    if (std::FILE *f = std::fopen(sourcePath.c_str(), "wb"))
+    {
+      std::fwrite(_source.data(), 1, _source.size(), f);
+      std::fclose(f);
+    }
+    else
+      return false;
+    std::vector<std::string> command = {"xcrun", "-sdk", "macosx", "metal"};
+    for (auto &a : _options.compilerArguments())
+      command.push_back(a);
+    command.insert(command.end(), {"-o", tmpPath, sourcePath});
+    bool ok = run(command);
+    std::error_code ec;
+    if (ok)
+      std::filesystem::rename(tmpPath, _path, ec);
+    std::filesystem::remove(sourcePath, ec);
+    std::filesystem::remove(tmpPath, ec);
+    return ok && std::filesystem::exists(_path);
+  }
+
+  // the metal compiler only ships with the full Xcode, check for it once
+  static bool hasOfflineCompiler()
+  {
+    static const bool found = run({"xcrun", "-sdk", "macosx", "-f", "metal"});
+    return found;
+  }
+
+  // runs a program found on the PATH with _arguments as its argv, without a
+  // shell so nothing in them is interpreted, and its output discarded. True
+  // if it ran and exited with 0.
+  static bool run(const std::vector<std::string> &_arguments)
+  {
+    std::vector<char *> argv;
+    for (auto &a : _arguments)
+      argv.push_back(const_cast<char *>(a.c_str()));
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int status = 0;
+    bool ok = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ) == 0 && waitpid(pid, &status, 0) == pid &&
+              WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    return ok;
+  }
+
+  MTL::Device *m_device;
+  std::string m_directory;
+  mutable std::mutex m_mutex;
+  bool m_lastWasHit = false;
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+};
@@ -0,0 +1,153 @@
+#pragma once
+#include "Metal.hpp"
+#include "FileWatcher.h"
+#include "ShaderCache.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+// A render pipeline built from a shader file that is rebuilt whenever the file
+// changes. The library and pipeline are compiled on the watcher thread and the
+// new pipeline handed over through an atomic, so the render loop only ever
+// pays for an exchange. Call acquire() once per frame, before encoding, to get
+// the pipeline to draw with. If an edit fails to compile the errors are
+// printed and the last good pipeline stays in use. Each edit that builds
+// deletes the cache entry of the version it replaced, so saving the file over
+// and over doesn't fill the cache with .metallibs nothing will ask for again.
+class HotReloadPipeline
+{
+public:
+  // _desc is copied, its vertex and fragment functions are replaced with
+  // _vertex and _fragment from each build of the library
+  HotReloadPipeline(MTL::Device *_device, ShaderCache &_cache, const std::string &_path, const MTL::RenderPipelineDescriptor *_desc,
+                    const std::string &_vertex, const std::string &_fragment, const ShaderOptions &_options = ShaderOptions())
+      : m_device(_device), m_cache(_cache), m_path(_path), m_desc(_desc->copy()), m_vertex(_vertex), m_fragment(_fragment), m_options(_options)
+  {
+    // the first build is synchronous as there is nothing to draw with yet
+    m_current = build();
+    if (!m_current)
+      exit(EXIT_FAILURE);
+    m_watcher = std::make_unique<FileWatcher>(m_path, [this](const std::string &) { rebuild(); });
+  }
+
+  ~HotReloadPipeline()
+  {
+    // stop the watcher first so nothing is built while tearing down
+    m_watcher.reset();
+    if (auto *pending = m_pending.exchange(nullptr))
+      pending->release();
+    m_current->release();
+    m_desc->release();
+  }
+
+  HotReloadPipeline(const HotReloadPipeline &) = delete;
+  HotReloadPipeline &operator=(const HotReloadPipeline &) = delete;
+
+  // the pipeline for this frame, swapping in a rebuilt one if there is one.
+  // _swapped is set when that happened. The old pipeline is released here,
+  // which is safe as the encoder that used it retained it.
+  MTL::RenderPipelineState *acquire(bool *_swapped = nullptr)
+  {
+    auto *pending = m_pending.exchange(nullptr, std::memory_order_acquire);
+    if (pending)
+    {
+      m_current->release();
+      m_current = pending;
+    }
+    if (_swapped)
+      *_swapped = pending != nullptr;
+    return m_current;
+  }
+
+  size_t reloads() const { return m_reloads.load(); }
+  size_t failures() const { return m_failures.load(); }
+  double lastBuildMs() const { return m_lastBuildMs.load(); }
+  bool watchingWithInotify() const { return m_watcher->usingInotify(); }
+
+private:
+  void rebuild()
+  {
+    auto *pipeline = build();
+    if (!pipeline)
+    {
+      ++m_failures;
+      return;
+    }
+    ++m_reloads;
+    // a build the render loop hasn't picked up yet is simply replaced
+    if (auto *stale = m_pending.exchange(pipeline, std::memory_order_release))
+      stale->release();
+  }
+
+  MTL::RenderPipelineState *build()
+  {
+    // the watcher thread has no autorelease pool of its own
+    auto *pool = NS::AutoreleasePool::alloc()->init();
+    auto start = std::chrono::steady_clock::now();
+    MTL::RenderPipelineState *pipeline = nullptr;
+    std::ifstream file(m_path);
+    if (!file.is_open())
+    {
+      std::cerr << "Unable to open shader file " << m_path << '\n';
+      pool->release();
+      return nullptr;
+    }
+    auto source = std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    NS::Error *error = nullptr;
+    auto *library = m_cache.newLibrary(source, m_options, &error);
+    if (!library)
+    {
+      std::cerr << "Shader " << m_path << " failed to compile\n" << (error ? error->localizedDescription()->utf8String() : "") << '\n';
+      pool->release();
+      return nullptr;
+    }
+    auto *vertFunc = library->newFunction(NS::String::string(m_vertex.c_str(), NS::UTF8StringEncoding));
+    auto *fragFunc = library->newFunction(NS::String::string(m_fragment.c_str(), NS::UTF8StringEncoding));
+    if (vertFunc && fragFunc)
+    {
+      // only ever touched by one build at a time
+      m_desc->setVertexFunction(vertFunc);
+      m_desc->setFragmentFunction(fragFunc);
+      pipeline = m_device->newRenderPipelineState(m_desc, &error);
+      if (pipeline)
+      {
+        auto entry = m_cache.entryPath(source, m_options);
+        if (!m_entry.empty() && m_entry != entry)
+          m_cache.remove(m_entry);
+        m_entry = entry;
+      }
+      else
+        std::cerr << "Pipeline for " << m_path << " failed\n" << (error ? error->localizedDescription()->utf8String() : "") << '\n';
+    }
+    else
+      std::cerr << "Shader " << m_path << " is missing " << m_vertex << " or " << m_fragment << '\n';
+    if (vertFunc)
+      vertFunc->release();
+    if (fragFunc)
+      fragFunc->release();
+    library->release();
+    m_lastBuildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    pool->release();
+    return pipeline;
+  }
+
+  MTL::Device *m_device;
+  ShaderCache &m_cache;
+  std::string m_path;
+  MTL::RenderPipelineDescriptor *m_desc;
+  std::string m_vertex;
+  std::string m_fragment;
+  ShaderOptions m_options;
+  // cache entry of the pipeline last built, only touched by build()
+  std::string m_entry;
+  MTL::RenderPipelineState *m_current = nullptr;
+  std::atomic<MTL::RenderPipelineState *> m_pending{nullptr};
+  std::atomic<size_t> m_reloads{0};
+  std::atomic<size_t> m_failures{0};
+  std::atomic<double> m_lastBuildMs{0.0};
+  std::unique_ptr<FileWatcher> m_watcher;
+};
@@ -0,0 +1,636 @@
+#pragma once
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include <cctype>
+#include <cstring>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One value for every permutation macro declared on a ShaderPreprocessor.
+struct Permutation
+{
+  std::map<std::string, std::string> values;
+
+  // "A=1 B=0", handy as a key and for printing
+  std::string name() const
+  {
+    std::string n;
+    for (auto &v : values)
+      n += (n.empty() ? "" : " ") + v.first + "=" + v.second;
+    return n;
+  }
+};
+
+// Expands MSL source files before they are compiled. Quoted includes are
+// inlined from the including file's directory or the search path (system
+// includes such as <metal_stdlib> are left to the compiler) and #line
+// directives keep error messages pointing at the original files.
+//
+// Macros declared with addPermutation() are applied here rather than by the
+// compiler. #if / #ifdef blocks that only depend on them are resolved and the
+// dead branches removed, and a #define is only emitted for macros the code
+// still refers to. Permutations that differ only in code that was removed
+// come out as identical source, which ShaderVariants uses to compile each
+// distinct source once.
+class ShaderPreprocessor
+{
+public:
+  explicit ShaderPreprocessor(std::vector<std::string> _searchPath = {}) : m_searchPath(std::move(_searchPath)) {}
+
+  void addSearchPath(const std::string &_path) { m_searchPath.push_back(_path); }
+
+  // declare a macro and the values it takes, every combination of values
+  // across the declared macros is a permutation
+  void addPermutation(const std::string &_macro, const std::vector<std::string> &_values) { m_axes.emplace_back(_macro, _values); }
+
+  std::vector<Permutation> permutations() const
+  {
+    std::vector<Permutation> result(1);
+    for (auto &axis : m_axes)
+    {
+      std::vector<Permutation> next;
+      for (auto &p : result)
+        for (auto &v : axis.second)
+        {
+          next.push_back(p);
+          next.back().values[axis.first] = v;
+        }
+      result.swap(next);
+    }
+    return result;
+  }
+
+  // the file at _path expanded for _permutation, false with a message in
+  // o_error if a file can't be found, includes itself or has unbalanced #ifs
+  bool preprocess(const std::string &_path, const Permutation &_permutation, std::string &o_source, std::string &o_error) const
+  {
+    Context ctx{_permutation, {}, {}};
+    std::string body;
+    if (!expandFile(std::filesystem::path(_path), ctx, body, o_error))
+      return false;
+    // only define the macros that survived in the code
+    o_source.clear();
+    auto used = identifiers(body);
+    for (auto &v : _permutation.values)
+      if (used.count(v.first))
+        o_source += "#define " + v.first + " " + v.second + "\n";
+    o_source += body;
+    return true;
+  }
+
+private:
+  struct Context
+  {
+    const Permutation &permutation;
+    std::vector<std::filesystem::path> stack;
+    std::set<std::filesystem::path> once;
+  };
+
+  // a conditional block, known when its condition only used permutation
+  // macros and so was resolved here, otherwise passed on to the compiler
+  struct Conditional
+  {
+    bool known;
+    bool active;
+    bool taken;
+  };
+
+  std::optional<std::filesystem::path> find(const std::string &_name, const std::filesystem::path &_from) const
+  {
+    std::error_code ec;
+    auto local = _from.parent_path() / _name;
+    if (std::filesystem::exists(local, ec))
+      return std::filesystem::weakly_canonical(local, ec);
+    for (auto &dir : m_searchPath)
+    {
+      auto candidate = std::filesystem::path(dir) / _name;
+      if (std::filesystem::exists(candidate, ec))
+        return std::filesystem::weakly_canonical(candidate, ec);
+    }
+    return std::nullopt;
+  }
+
+  static std::string trim(const std::string &_s)
+  {
+    auto b = _s.find_first_not_of(" \t\r");
+    if (b == std::string::npos)
+      return "";
+    auto e = _s.find_last_not_of(" \t\r");
+    return _s.substr(b, e - b + 1);
+  }
+
+  static std::string lineDirective(size_t _line, const std::filesystem::path &_file)
+  {
+    return "#line " + std::to_string(_line) + " \"" + _file.generic_string() + "\"\n";
+  }
+
+  bool expandFile(const std::filesystem::path &_path, Context &_ctx, std::string &o_out, std::string &o_error) const
+  {
+    std::error_code ec;
+    auto path = std::filesystem::weakly_canonical(_path, ec);
+    if (_ctx.once.count(path))
+      return true;
+    for (auto &p : _ctx.stack)
+      if (p == path)
+      {
+        o_error = "recursive include of " + path.string();
+        return false;
+      }
+    std::ifstream file(path);
+    if (!file.is_open())
+    {
+      o_error = "unable to open " + path.string();
+      return false;
+    }
+    _ctx.stack.push_back(path);
+
+    std::vector<Conditional> conditionals;
+    auto active = [&conditionals] {
+      for (auto &c : conditionals)
+        if (c.known && !c.active)
+          return false;
+      return true;
+    };
+    // whether the last line written was dropped, so a #line is needed to put
+    // the compiler's line count back in step
+    bool skipped = false;
+    size_t lineNumber = 0;
+    std::string line;
+    o_out += lineDirective(1, path);
+    while (std::getline(file, line))
+    {
+      size_t firstLine = ++lineNumber;
+      auto text = trim(line);
+      if (text.empty() || text[0] != '#')
+      {
+        if (active())
+        {
+          if (skipped)
+            o_out += lineDirective(firstLine, path);
+          o_out += line + '\n';
+          skipped = false;
+        }
+        else
+          skipped = true;
+        continue;
+      }
+
+      // a directive, pull in any continuation lines
+      std::string directive = line;
+      while (!directive.empty() && directive.back() == '\\' && std::getline(file, line))
+      {
+        directive.back() = ' ';
+        directive += line;
+        ++lineNumber;
+      }
+      text = trim(trim(directive).substr(1));
+      auto split = text.find_first_of(" \t(\"<");
+      auto keyword = text.substr(0, split);
+      auto rest = split == std::string::npos ? std::string() : trim(stripComments(text.substr(split)));
+
+      bool keep = false;
+      if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef")
+      {
+        std::optional<long long> value;
+        if (keyword == "if")
+          value = evaluate(rest, _ctx.permutation);
+        else if (_ctx.permutation.values.count(rest))
+          value = keyword == "ifdef" ? 1 : 0;
+        // an unresolved #if is written out if the code around it is
+        keep = !value && active();
+        conditionals.push_back({bool(value), !value || *value != 0, value && *value != 0});
+      }
+      else if (keyword == "elif" || keyword == "else")
+      {
+        if (conditionals.empty())
+          return fail(o_error, path, firstLine, "#" + keyword + " without #if", _ctx);
+        auto &c = conditionals.back();
+        if (!c.known)
+          keep = active();
+        else if (c.taken)
+          c.active = false;
+        else
+        {
+          auto value = keyword == "else" ? std::optional<long long>(1) : evaluate(rest, _ctx.permutation);
+          if (value)
+            c.active = c.taken = *value != 0;
+          else
+          {
+            // can't be decided here, the earlier branches were all dead so
+            // the rest of the chain goes to the compiler as a new #if
+            c = {false, true, false};
+            if (active())
+            {
+              if (skipped)
+                o_out += lineDirective(firstLine, path);
+              o_out += "#if " + rest + '\n';
+              skipped = false;
+            }
+            continue;
+          }
+        }
+      }
+      else if (keyword == "endif")
+      {
+        if (conditionals.empty())
+          return fail(o_error, path, firstLine, "#endif without #if", _ctx);
+        bool known = conditionals.back().known;
+        conditionals.pop_back();
+        keep = !known && active();
+      }
+      else if (!active())
+      {
+        skipped = true;
+        continue;
+      }
+      else if (keyword == "include" && !rest.empty() && rest[0] == '"')
+      {
+        auto name = rest.substr(1, rest.find('"', 1) - 1);
+        auto found = find(name, path);
+        if (!found)
+          return fail(o_error, path, firstLine, "can't find include \"" + name + "\"", _ctx);
+        if (!expandFile(*found, _ctx, o_out, o_error))
+        {
+          _ctx.stack.pop_back();
+          return false;
+        }
+        skipped = true;
+        continue;
+      }
+      else if (keyword == "pragma" && rest == "once")
+      {
+        _ctx.once.insert(path);
+        skipped = true;
+        continue;
+      }
+      else
+        keep = true;
+
+      if (keep)
+      {
+        if (skipped)
+          o_out += lineDirective(firstLine, path);
+        o_out += directive + '\n';
+        skipped = false;
+      }
+      else
+        skipped = true;
+    }
+    if (!conditionals.empty())
+      return fail(o_error, path, lineNumber, "unterminated #if", _ctx);
+    _ctx.stack.pop_back();
+    return true;
+  }
+
+  static bool fail(std::string &o_error, const std::filesystem::path &_path, size_t _line, const std::string &_message, Context &_ctx)
+  {
+    o_error = _path.string() + ":" + std::to_string(_line) + ": " + _message;
+    _ctx.stack.pop_back();
+    return false;
+  }
+
+  static std::string stripComments(const std::string &_s)
+  {
+    std::string out;
+    for (size_t i = 0; i < _s.size(); ++i)
+    {
+      if (_s.compare(i, 2, "//") == 0)
+        break;
+      if (_s.compare(i, 2, "/*") == 0)
+      {
+        auto end = _s.find("*/", i + 2);
+        if (end == std::string::npos)
+          break;
+        i = end + 1;
+        out += ' ';
+        continue;
+      }
+      out += _s[i];
+    }
+    return out;
+  }
+
+  // identifiers used in code, skipping comments, strings and #line paths
+  static std::set<std::string> identifiers(const std::string &_s)
+  {
+    std::set<std::string> ids;
+    for (size_t i = 0; i < _s.size();)
+    {
+      if (_s.compare(i, 2, "//") == 0)
+        i = _s.find('\n', i);
+      else if (_s.compare(i, 2, "/*") == 0)
+      {
+        i = _s.find("*/", i + 2);
+        i = i == std::string::npos ? i : i + 2;
+      }
+      else if (_s[i] == '"')
+      {
+        for (++i; i < _s.size() && _s[i] != '"' && _s[i] != '\n'; ++i)
+          if (_s[i] == '\\')
+            ++i;
+        ++i;
+      }
+      else if (std::isalpha(static_cast<unsigned char>(_s[i])) || _s[i] == '_')
+      {
+        size_t start = i;
+        while (i < _s.size() && (std::isalnum(static_cast<unsigned char>(_s[i])) || _s[i] == '_'))
+          ++i;
+        ids.insert(_s.substr(start, i - start));
+      }
+      else
+        ++i;
+      if (i == std::string::npos)
+        break;
+    }
+    return ids;
+  }
+
+  // Evaluates an #if expression over the permutation macros. Anything it
+  // can't decide, such as a macro that isn't a permutation macro, gives
+  // nullopt unless the other side of an && or || settles it.
+  class Expression
+  {
+  public:
+    Expression(const std::string &_text, const Permutation &_permutation) : m_text(_text), m_permutation(_permutation) {}
+
+    std::optional<long long> parse()
+    {
+      auto v = logicalOr();
+      skipSpace();
+      if (m_pos != m_text.size())
+        return std::nullopt;
+      return v;
+    }
+
+  private:
+    using Value = std::optional<long long>;
+
+    void skipSpace()
+    {
+      while (m_pos < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_pos])))
+        ++m_pos;
+    }
+
+    bool accept(const char *_op)
+    {
+      skipSpace();
+      auto len = std::char_traits<char>::length(_op);
+      if (m_text.compare(m_pos, len, _op) != 0)
+        return false;
+      // don't take the first half of a longer operator
+      if (len == 1 && m_pos + 1 < m_text.size() && (_op[0] == '<' || _op[0] == '>' || _op[0] == '!') && m_text[m_pos + 1] == '=')
+        return false;
+      if (len == 1 && (_op[0] == '&' || _op[0] == '|') && m_pos + 1 < m_text.size() && m_text[m_pos + 1] == _op[0])
+        return false;
+      m_pos += len;
+      return true;
+    }
+
+    Value logicalOr()
+    {
+      auto lhs = logicalAnd();
+      while (accept("||"))
+      {
+        auto rhs = logicalAnd();
+        if ((lhs && *lhs) || (rhs && *rhs))
+          lhs = 1;
+        else if (lhs && rhs)
+          lhs = 0;
+        else
+          lhs = std::nullopt;
+      }
+      return lhs;
+    }
+
+    Value logicalAnd()
+    {
+      auto lhs = equality();
+      while (accept("&&"))
+      {
+        auto rhs = equality();
+        if ((lhs && !*lhs) || (rhs && !*rhs))
+          lhs = 0;
+        else if (lhs && rhs)
+          lhs = 1;
+        else
+          lhs = std::nullopt;
+      }
+      return lhs;
+    }
+
+    Value equality()
+    {
+      auto lhs = relational();
+      for (;;)
+      {
+        bool eq = accept("==");
+        if (!eq && !accept("!="))
+          return lhs;
+        auto rhs = relational();
+        lhs = lhs && rhs ? Value((*lhs == *rhs) == eq) : std::nullopt;
+      }
+    }
+
+    Value relational()
+    {
+      auto lhs = additive();
+      for (;;)
+      {
+        int op = accept("<=") ? 0 : accept(">=") ? 1 : accept("<") ? 2 : accept(">") ? 3 : -1;
+        if (op < 0)
+          return lhs;
+        auto rhs = additive();
+        if (!lhs || !rhs)
+          lhs = std::nullopt;
+        else
+          lhs = op == 0 ? *lhs <= *rhs : op == 1 ? *lhs >= *rhs : op == 2 ? *lhs < *rhs : *lhs > *rhs;
+      }
+    }
+
+    Value additive()
+    {
+      auto lhs = unary();
+      for (;;)
+      {
+        bool add = accept("+");
+        if (!add && !accept("-"))
+          return lhs;
+        auto rhs = unary();
+        lhs = lhs && rhs ? Value(add ? *lhs + *rhs : *lhs - *rhs) : std::nullopt;
+      }
+    }
+
+    Value unary()
+    {
+      if (accept("!"))
+      {
+        auto v = unary();
+        return v ? Value(!*v) : std::nullopt;
+      }
+      if (accept("-"))
+      {
+        auto v = unary();
+        return v ? Value(-*v) : std::nullopt;
+      }
+      return primary();
+    }
+
+    Value primary()
+    {
+      skipSpace();
+      if (accept("("))
+      {
+        auto v = logicalOr();
+        return accept(")") ? v : std::nullopt;
+      }
+      if (m_pos < m_text.size() && std::isdigit(static_cast<unsigned char>(m_text[m_pos])))
+      {
+        size_t used = 0;
+        long long v = std::stoll(m_text.substr(m_pos), &used, 0);
+        m_pos += used;
+        // integer suffixes
+        while (m_pos < m_text.size() && std::strchr("uUlL", m_text[m_pos]))
+          ++m_pos;
+        return v;
+      }
+      auto id = identifier();
+      if (id.empty())
+        return std::nullopt;
+      if (id == "defined")
+      {
+        bool paren = accept("(");
+        auto name = identifier();
+        if (paren && !accept(")"))
+          return std::nullopt;
+        if (m_permutation.values.count(name))
+          return 1;
+        return std::nullopt;
+      }
+      auto it = m_permutation.values.find(id);
+      if (it == m_permutation.values.end())
+        return std::nullopt;
+      try
+      {
+        size_t used = 0;
+        long long v = std::stoll(it->second, &used, 0);
+        if (used == it->second.size())
+          return v;
+      }
+      catch (const std::exception &)
+      {
+      }
+      return std::nullopt;
+    }
+
+    std::string identifier()
+    {
+      skipSpace();
+      size_t start = m_pos;
+      while (m_pos < m_text.size() && (std::isalnum(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == '_'))
+        ++m_pos;
+      return m_text.substr(start, m_pos - start);
+    }
+
+    const std::string &m_text;
+    const Permutation &m_permutation;
+    size_t m_pos = 0;
+  };
+
+  static std::optional<long long> evaluate(const std::string &_text, const Permutation &_permutation)
+  {
+    return Expression(_text, _permutation).parse();
+  }
+
+  std::vector<std::string> m_searchPath;
+  std::vector<std::pair<std::string, std::vector<std::string>>> m_axes;
+};
+
+// Every permutation of a shader file, expanded by a ShaderPreprocessor and
+// compiled with each distinct source compiled once. Permutations whose source
+// came out the same share a library.
+class ShaderVariants
+{
+public:
+  ShaderVariants() = default;
+  ~ShaderVariants()
+  {
+    for (auto *l : m_libraries)
+      if (l)
+        l->release();
+  }
+  ShaderVariants(const ShaderVariants &) = delete;
+  ShaderVariants &operator=(const ShaderVariants &) = delete;
+
+  bool expand(const ShaderPreprocessor &_preprocessor, const std::string &_path, std::string &o_error)
+  {
+    m_permutations = _preprocessor.permutations();
+    m_sourceIndex.clear();
+    m_sources.clear();
+    std::unordered_map<uint64_t, std::vector<size_t>> byHash;
+    for (auto &p : m_permutations)
+    {
+      std::string source;
+      if (!_preprocessor.preprocess(_path, p, source, o_error))
+        return false;
+      auto &bucket = byHash[fnv1a(source)];
+      size_t index = m_sources.size();
+      // compare too, two sources sharing a hash must not share a library
+      for (auto i : bucket)
+        if (m_sources[i] == source)
+          index = i;
+      if (index == m_sources.size())
+      {
+        bucket.push_back(index);
+        m_sources.push_back(std::move(source));
+      }
+      m_sourceIndex[p.name()] = index;
+    }
+    return true;
+  }
+
+  // compile every unique source through the cache
+  bool compile(ShaderCache &_cache, const ShaderOptions &_options, NS::Error **_error)
+  {
+    m_libraries.assign(m_sources.size(), nullptr);
+    for (size_t i = 0; i < m_sources.size(); ++i)
+    {
+      m_libraries[i] = _cache.newLibrary(m_sources[i], _options, _error);
+      if (!m_libraries[i])
+        return false;
+    }
+    return true;
+  }
+
+  // borrowed, nullptr if the permutation wasn't expanded or compiled
+  MTL::Library *library(const Permutation &_permutation) const
+  {
+    auto it = m_sourceIndex.find(_permutation.name());
+    if (it == m_sourceIndex.end() || it->second >= m_libraries.size())
+      return nullptr;
+    return m_libraries[it->second];
+  }
+
+  const std::string &source(const Permutation &_permutation) const { return m_sources[m_sourceIndex.at(_permutation.name())]; }
+  const std::vector<Permutation> &permutations() const { return m_permutations; }
+  size_t uniqueSources() const { return m_sources.size(); }
+  size_t sourceBytes() const
+  {
+    size_t total = 0;
+    for (auto &s : m_sources)
+      total += s.size();
+    return total;
+  }
+
+private:
+  std::vector<Permutation> m_permutations;
+  std::map<std::string, size_t> m_sourceIndex;
+  std::vector<std::string> m_sources;
+  std::vector<MTL::Library *> m_libraries;
+};
@@ -0,0 +1,138 @@
+#pragma once
+#include "Metal.hpp"
+#include "ShaderCache.h"
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Helper code compiled once as an MTL::DynamicLibrary and linked into the
+// libraries of many pipelines, rather than pasted into every one of them and
+// compiled again each time. Sources that use it declare the helpers extern
+// and are compiled with newLinkedLibrary(), which adds the dynamic library to
+// the compile options. Pipelines then load it through their preloaded
+// libraries, set up by configure().
+//
+// The dynamic library is serialized to the shader cache directory, keyed on
+// its source, options, device and OS, and loaded from there on later runs.
+class SharedShaderLibrary
+{
+public:
+  SharedShaderLibrary(MTL::Device *_device, const std::string &_source, const std::string &_installName,
+                      const ShaderOptions &_options = ShaderOptions(), const std::string &_directory = ShaderCache::defaultDirectory())
+      : m_device(_device), m_options(_options)
+  {
+    std::string key = _source + '\0' + _installName + '\0' + _options.key();
+    key += '\0' + std::string(_device->name()->utf8String());
+    key += '\0' + std::string(NS::ProcessInfo::processInfo()->operatingSystemVersionString()->utf8String());
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(fnv1a(key)));
+    m_path = _directory + "/" + name + ".metallib";
+
+    NS::Error *error = nullptr;
+    if (std::filesystem::exists(m_path))
+    {
+      m_dylib = m_device->newDynamicLibrary(url(m_path), &error);
+      m_loaded = m_dylib != nullptr;
+    }
+    if (!m_dylib)
+    {
+      auto *options = _options.newCompileOptions();
+      options->setLibraryType(MTL::LibraryTypeDynamic);
+      options->setInstallName(NS::String::string(_installName.c_str(), NS::UTF8StringEncoding));
+      auto *library = m_device->newLibrary(NS::String::string(_source.c_str(), NS::UTF8StringEncoding), options, &error);
+      options->release();
+      if (library)
+      {
+        m_dylib = m_device->newDynamicLibrary(library, &error);
+        library->release();
+      }
+      if (m_dylib)
+      {
+        std::error_code ec;
+        std::filesystem::create_directories(_directory, ec);
+        if (!m_dylib->serializeToURL(url(m_path), &error))
+          std::cerr << "Unable to save dynamic library " << m_path << '\n';
+      }
+    }
+    if (!m_dylib)
+    {
+      m_error = error ? error->localizedDescription()->utf8String() : "unknown error";
+      return;
+    }
+    m_array = NS::Array::array(m_dylib)->retain();
+  }
+
+  ~SharedShaderLibrary()
+  {
+    if (m_array)
+      m_array->release();
+    if (m_dylib)
+      m_dylib->release();
+  }
+
+  SharedShaderLibrary(const SharedShaderLibrary &) = delete;
+  SharedShaderLibrary &operator=(const SharedShaderLibrary &) = delete;
+
+  bool valid() const { return m_dylib != nullptr; }
+  const std::string &error() const { return m_error; }
+  bool loadedFromDisk() const { return m_loaded; }
+  MTL::DynamicLibrary *dynamicLibrary() const { return m_dylib; }
+  const std::string &path() const { return m_path; }
+
+  // size of the serialized dynamic library, what the shared code costs on disk
+  size_t binarySize() const
+  {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(m_path, ec);
+    return ec ? 0 : size_t(size);
+  }
+
+  // compile _source against the shared code, caller owns the library
+  MTL::Library *newLinkedLibrary(const std::string &_source, NS::Error **_error) const
+  {
+    auto *options = m_options.newCompileOptions();
+    options->setLibraries(m_array);
+    auto *library = m_device->newLibrary(NS::String::string(_source.c_str(), NS::UTF8StringEncoding), options, _error);
+    options->release();
+    return library;
+  }
+
+  void configure(MTL::ComputePipelineDescriptor *_desc) const { _desc->setPreloadedLibraries(m_array); }
+
+  void configure(MTL::RenderPipelineDescriptor *_desc) const
+  {
+    _desc->setVertexPreloadedLibraries(m_array);
+    _desc->setFragmentPreloadedLibraries(m_array);
+  }
+
+  // [[ visible ]] functions from _library for a compute pipeline's
+  // setLinkedFunctions(), so kernels can call them through extern
+  // declarations or function pointers, caller owns the result
+  static MTL::LinkedFunctions *newLinkedFunctions(MTL::Library *_library, const std::vector<std::string> &_names)
+  {
+    std::vector<NS::Object *> functions;
+    for (auto &n : _names)
+      if (auto *f = _library->newFunction(NS::String::string(n.c_str(), NS::UTF8StringEncoding)))
+        functions.push_back(f);
+    auto *linked = MTL::LinkedFunctions::alloc()->init();
+    linked->setFunctions(NS::Array::array(functions.data(), functions.size()));
+    for (auto *f : functions)
+      f->release();
+    return linked;
+  }
+
+private:
+  static NS::URL *url(const std::string &_path)
+  {
+    return NS::URL::fileURLWithPath(NS::String::string(_path.c_str(), NS::UTF8StringEncoding));
+  }
+
+  MTL::Device *m_device;
+  ShaderOptions m_options;
+  std::string m_path;
+  std::string m_error;
+  MTL::DynamicLibrary *m_dylib = nullptr;
+  NS::Array *m_array = nullptr;
+  bool m_loaded = false;
+};
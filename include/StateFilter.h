@@ -0,0 +1,380 @@
+#pragma once
+#include "Metal.hpp"
+#include <array>
+#include <cstring>
+
+// Counts of the state setting calls made through a filtered encoder. Draws and
+// dispatches are passed straight through and not counted.
+struct StateFilterCounters
+{
+  // calls passed on to the encoder
+  size_t issued = 0;
+  // calls dropped because the state was already set
+  size_t filtered = 0;
+  // buffer bindings passed on as an offset change only, part of issued
+  size_t offsetOnly = 0;
+
+  size_t calls() const { return issued + filtered; }
+  void reset() { *this = StateFilterCounters(); }
+};
+
+namespace statefilter
+{
+// what one shader stage has bound, Metal allows 31 buffers, 128 textures and
+// 16 samplers per stage
+struct StageState
+{
+  static constexpr NS::UInteger MaxBuffers = 31;
+  static constexpr NS::UInteger MaxTextures = 128;
+  static constexpr NS::UInteger MaxSamplers = 16;
+
+  struct BufferBinding
+  {
+    const MTL::Buffer *buffer = nullptr;
+    NS::UInteger offset = 0;
+    bool valid = false;
+  };
+
+  std::array<BufferBinding, MaxBuffers> buffers;
+  std::array<const MTL::Texture *, MaxTextures> textures;
+  std::array<const MTL::SamplerState *, MaxSamplers> samplers;
+  std::array<bool, MaxTextures> texturesValid;
+  std::array<bool, MaxSamplers> samplersValid;
+
+  StageState() { reset(); }
+
+  void reset()
+  {
+    buffers.fill(BufferBinding());
+    textures.fill(nullptr);
+    samplers.fill(nullptr);
+    texturesValid.fill(false);
+    samplersValid.fill(false);
+  }
+
+  enum class BufferChange
+  {
+    None,
+    Offset,
+    Buffer
+  };
+
+  // record a buffer binding and say what has to be sent to the encoder
+  BufferChange setBuffer(const MTL::Buffer *_buffer, NS::UInteger _offset, NS::UInteger _index)
+  {
+    if (_index >= MaxBuffers)
+      return BufferChange::Buffer;
+    auto &b = buffers[_index];
+    BufferChange change = BufferChange::Buffer;
+    if (b.valid && b.buffer == _buffer)
+      change = b.offset == _offset ? BufferChange::None : BufferChange::Offset;
+    b = {_buffer, _offset, true};
+    return change;
+  }
+
+  // setBytes replaces whatever buffer was bound, the next setBuffer must be sent
+  void forgetBuffer(NS::UInteger _index)
+  {
+    if (_index < MaxBuffers)
+      buffers[_index].valid = false;
+  }
+
+  bool setTexture(const MTL::Texture *_texture, NS::UInteger _index)
+  {
+    if (_index >= MaxTextures)
+      return true;
+    bool changed = !texturesValid[_index] || textures[_index] != _texture;
+    textures[_index] = _texture;
+    texturesValid[_index] = true;
+    return changed;
+  }
+
+  bool setSampler(const MTL::SamplerState *_sampler, NS::UInteger _index)
+  {
+    if (_index >= MaxSamplers)
+      return true;
+    bool changed = !samplersValid[_index] || samplers[_index] != _sampler;
+    samplers[_index] = _sampler;
+    samplersValid[_index] = true;
+    return changed;
+  }
+};
+
+template <typename T>
+struct Shadow
+{
+  T value;
+  bool valid = false;
+
+  // true if _value differs from what is set, compared bytewise so it works for
+  // the plain Metal structs
+  bool set(const T &_value)
+  {
+    bool changed = !valid || std::memcmp(&value, &_value, sizeof(T)) != 0;
+    value = _value;
+    valid = true;
+    return changed;
+  }
+};
+} // namespace statefilter
+
+// Wraps a render command encoder and keeps a shadow of the state it has set,
+// so setting the same pipeline, depth stencil state, viewport, buffer, texture
+// or sampler again is dropped rather than sent to Metal. Rebinding the buffer
+// already in a slot at a new offset goes through setVertexBufferOffset or
+// setFragmentBufferOffset, which is cheaper than a full bind. State set on the
+// underlying encoder directly isn't seen, call invalidate() after doing so.
+class FilteredRenderEncoder
+{
+public:
+  explicit FilteredRenderEncoder(MTL::RenderCommandEncoder *_encoder) : m_encoder(_encoder) {}
+
+  MTL::RenderCommandEncoder *encoder() const { return m_encoder; }
+  const StateFilterCounters &counters() const { return m_counters; }
+
+  // forget the shadow state so everything is sent again
+  void invalidate()
+  {
+    m_pipeline.valid = m_depthStencil.valid = false;
+    m_viewport.valid = m_scissor.valid = m_cullMode.valid = m_winding.valid = m_fillMode.valid = false;
+    m_vertex.reset();
+    m_fragment.reset();
+  }
+
+  void setRenderPipelineState(const MTL::RenderPipelineState *_pipeline)
+  {
+    if (count(m_pipeline.set(_pipeline)))
+      m_encoder->setRenderPipelineState(_pipeline);
+  }
+
+  void setDepthStencilState(const MTL::DepthStencilState *_state)
+  {
+    if (count(m_depthStencil.set(_state)))
+      m_encoder->setDepthStencilState(_state);
+  }
+
+  void setViewport(const MTL::Viewport &_viewport)
+  {
+    if (count(m_viewport.set(_viewport)))
+      m_encoder->setViewport(_viewport);
+  }
+
+  void setScissorRect(const MTL::ScissorRect &_rect)
+  {
+    if (count(m_scissor.set(_rect)))
+      m_encoder->setScissorRect(_rect);
+  }
+
+  void setCullMode(MTL::CullMode _mode)
+  {
+    if (count(m_cullMode.set(_mode)))
+      m_encoder->setCullMode(_mode);
+  }
+
+  void setFrontFacingWinding(MTL::Winding _winding)
+  {
+    if (count(m_winding.set(_winding)))
+      m_encoder->setFrontFacingWinding(_winding);
+  }
+
+  void setTriangleFillMode(MTL::TriangleFillMode _mode)
+  {
+    if (count(m_fillMode.set(_mode)))
+      m_encoder->setTriangleFillMode(_mode);
+  }
+
+  void setVertexBuffer(const MTL::Buffer *_buffer, NS::UInteger _offset, NS::UInteger _index)
+  {
+    switch (countBuffer(m_vertex.setBuffer(_buffer, _offset, _index)))
+    {
+    case statefilter::StageState::BufferChange::Buffer:
+      m_encoder->setVertexBuffer(_buffer, _offset, _index);
+      break;
+    case statefilter::StageState::BufferChange::Offset:
+      m_encoder->setVertexBufferOffset(_offset, _index);
+      break;
+    case statefilter::StageState::BufferChange::None:
+      break;
+    }
+  }
+
+  void setFragmentBuffer(const MTL::Buffer *_buffer, NS::UInteger _offset, NS::UInteger _index)
+  {
+    switch (countBuffer(m_fragment.setBuffer(_buffer, _offset, _index)))
+    {
+    case statefilter::StageState::BufferChange::Buffer:
+      m_encoder->setFragmentBuffer(_buffer, _offset, _index);
+      break;
+    case statefilter::StageState::BufferChange::Offset:
+      m_encoder->setFragmentBufferOffset(_offset, _index);
+      break;
+    case statefilter::StageState::BufferChange::None:
+      break;
+    }
+  }
+
+  // bytes are always sent, there is nothing cheap to compare them with
+  void setVertexBytes(const void *_bytes, NS::UInteger _length, NS::UInteger _index)
+  {
+    m_vertex.forgetBuffer(_index);
+    count(true);
+    m_encoder->setVertexBytes(_bytes, _length, _index);
+  }
+
+  void setFragmentBytes(const void *_bytes, NS::UInteger _length, NS::UInteger _index)
+  {
+    m_fragment.forgetBuffer(_index);
+    count(true);
+    m_encoder->setFragmentBytes(_bytes, _length, _index);
+  }
+
+  void setVertexTexture(const MTL::Texture *_texture, NS::UInteger _index)
+  {
+    if (count(m_vertex.setTexture(_texture, _index)))
+      m_encoder->setVertexTexture(_texture, _index);
+  }
+
+  void setFragmentTexture(const MTL::Texture *_texture, NS::UInteger _index)
+  {
+    if (count(m_fragment.setTexture(_texture, _index)))
+      m_encoder->setFragmentTexture(_texture, _index);
+  }
+
+  void setVertexSamplerState(const MTL::SamplerState *_sampler, NS::UInteger _index)
+  {
+    if (count(m_vertex.setSampler(_sampler, _index)))
+      m_encoder->setVertexSamplerState(_sampler, _index);
+  }
+
+  void setFragmentSamplerState(const MTL::SamplerState *_sampler, NS::UInteger _index)
+  {
+    if (count(m_fragment.setSampler(_sampler, _index)))
+      m_encoder->setFragmentSamplerState(_sampler, _index);
+  }
+
+  void drawPrimitives(MTL::PrimitiveType _type, NS::UInteger _start, NS::UInteger _count, NS::UInteger _instances = 1)
+  {
+    m_encoder->drawPrimitives(_type, _start, _count, _instances);
+  }
+
+  void drawIndexedPrimitives(MTL::PrimitiveType _type, NS::UInteger _count, MTL::IndexType _indexType, const MTL::Buffer *_indices,
+                             NS::UInteger _indexOffset, NS::UInteger _instances = 1)
+  {
+    m_encoder->drawIndexedPrimitives(_type, _count, _indexType, _indices, _indexOffset, _instances);
+  }
+
+  void endEncoding() { m_encoder->endEncoding(); }
+
+private:
+  bool count(bool _changed)
+  {
+    ++(_changed ? m_counters.issued : m_counters.filtered);
+    return _changed;
+  }
+
+  statefilter::StageState::BufferChange countBuffer(statefilter::StageState::BufferChange _change)
+  {
+    count(_change != statefilter::StageState::BufferChange::None);
+    if (_change == statefilter::StageState::BufferChange::Offset)
+      ++m_counters.offsetOnly;
+    return _change;
+  }
+
+  MTL::RenderCommandEncoder *m_encoder;
+  StateFilterCounters m_counters;
+  statefilter::Shadow<const MTL::RenderPipelineState *> m_pipeline;
+  statefilter::Shadow<const MTL::DepthStencilState *> m_depthStencil;
+  statefilter::Shadow<MTL::Viewport> m_viewport;
+  statefilter::Shadow<MTL::ScissorRect> m_scissor;
+  statefilter::Shadow<MTL::CullMode> m_cullMode;
+  statefilter::Shadow<MTL::Winding> m_winding;
+  statefilter::Shadow<MTL::TriangleFillMode> m_fillMode;
+  statefilter::StageState m_vertex;
+  statefilter::StageState m_fragment;
+};
+
+// The same for a compute command encoder, rebinding the buffer already in a
+// slot at a new offset goes through setBufferOffset.
+class FilteredComputeEncoder
+{
+public:
+  explicit FilteredComputeEncoder(MTL::ComputeCommandEncoder *_encoder) : m_encoder(_encoder) {}
+
+  MTL::ComputeCommandEncoder *encoder() const { return m_encoder; }
+  const StateFilterCounters &counters() const { return m_counters; }
+
+  void invalidate()
+  {
+    m_pipeline.valid = false;
+    m_stage.reset();
+  }
+
+  void setComputePipelineState(const MTL::ComputePipelineState *_pipeline)
+  {
+    if (count(m_pipeline.set(_pipeline)))
+      m_encoder->setComputePipelineState(_pipeline);
+  }
+
+  void setBuffer(const MTL::Buffer *_buffer, NS::UInteger _offset, NS::UInteger _index)
+  {
+    switch (countBuffer(m_stage.setBuffer(_buffer, _offset, _index)))
+    {
+    case statefilter::StageState::BufferChange::Buffer:
+      m_encoder->setBuffer(_buffer, _offset, _index);
+      break;
+    case statefilter::StageState::BufferChange::Offset:
+      m_encoder->setBufferOffset(_offset, _index);
+      break;
+    case statefilter::StageState::BufferChange::None:
+      break;
+    }
+  }
+
+  void setBytes(const void *_bytes, NS::UInteger _length, NS::UInteger _index)
+  {
+    m_stage.forgetBuffer(_index);
+    count(true);
+    m_encoder->setBytes(_bytes, _length, _index);
+  }
+
+  void setTexture(const MTL::Texture *_texture, NS::UInteger _index)
+  {
+    if (count(m_stage.setTexture(_texture, _index)))
+      m_encoder->setTexture(_texture, _index);
+  }
+
+  void setSamplerState(const MTL::SamplerState *_sampler, NS::UInteger _index)
+  {
+    if (count(m_stage.setSampler(_sampler, _index)))
+      m_encoder->setSamplerState(_sampler, _index);
+  }
+
+  void dispatchThreads(MTL::Size _threads, MTL::Size _threadsPerThreadgroup) { m_encoder->dispatchThreads(_threads, _threadsPerThreadgroup); }
+
+  void dispatchThreadgroups(MTL::Size _threadgroups, MTL::Size _threadsPerThreadgroup)
+  {
+    m_encoder->dispatchThreadgroups(_threadgroups, _threadsPerThreadgroup);
+  }
+
+  void endEncoding() { m_encoder->endEncoding(); }
+
+private:
+  bool count(bool _changed)
+  {
+    ++(_changed ? m_counters.issued : m_counters.filtered);
+    return _changed;
+  }
+
+  statefilter::StageState::BufferChange countBuffer(statefilter::StageState::BufferChange _change)
+  {
+    count(_change != statefilter::StageState::BufferChange::None);
+    if (_change == statefilter::StageState::BufferChange::Offset)
+      ++m_counters.offsetOnly;
+    return _change;
+  }
+
+  MTL::ComputeCommandEncoder *m_encoder;
+  StateFilterCounters m_counters;
+  statefilter::Shadow<const MTL::ComputePipelineState *> m_pipeline;
+  statefilter::StageState m_stage;
+};
@@ -0,0 +1,354 @@
+#pragma once
+#include "Metal.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace vertexpack
+{
+// float to IEEE half, rounding to nearest even, too large becomes infinity
+inline uint16_t toHalf(float _f)
+{
+  uint32_t x;
+  std::memcpy(&x, &_f, 4);
+  uint32_t sign = (x >> 16) & 0x8000u;
+  uint32_t bits = x & 0x7fffffffu;
+  if (bits >= 0x7f800000u)
+    return uint16_t(sign | 0x7c00u | (bits > 0x7f800000u ? 0x200u : 0u));
+  // 65520 and up round past the largest half
+  if (bits >= 0x477ff000u)
+    return uint16_t(sign | 0x7c00u);
+  if (bits < 0x38800000u)
+  {
+    // a half denormal, or zero below half the smallest one
+    if (bits < 0x33000000u)
+      return uint16_t(sign);
+    uint32_t shift = 126u - (bits >> 23);
+    uint32_t mantissa = (bits & 0x7fffffu) | 0x800000u;
+    uint32_t h = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1u);
+    uint32_t halfway = 1u << (shift - 1u);
+    if (rest > halfway || (rest == halfway && (h & 1u)))
+      ++h;
+    return uint16_t(sign | h);
+  }
+  uint32_t h = (bits >> 13) - ((127u - 15u) << 10);
+  uint32_t rest = bits & 0x1fffu;
+  // a carry out of the mantissa correctly bumps the exponent
+  if (rest > 0x1000u || (rest == 0x1000u && (h & 1u)))
+    ++h;
+  return uint16_t(sign | h);
+}
+
+inline float fromHalf(uint16_t _h)
+{
+  uint32_t sign = uint32_t(_h & 0x8000u) << 16;
+  uint32_t exponent = (_h >> 10) & 0x1fu;
+  uint32_t mantissa = _h & 0x3ffu;
+  if (exponent == 0)
+  {
+    float f = std::ldexp(float(mantissa), -24);
+    return sign ? -f : f;
+  }
+  uint32_t x = sign | (exponent == 31 ? 0x7f800000u | (mantissa << 13) : ((exponent + 112u) << 23) | (mantissa << 13));
+  float f;
+  std::memcpy(&f, &x, 4);
+  return f;
+}
+
+// the GPU decodes snorm as max(c / max, -1) and unorm as c / max
+inline int32_t toSnorm(float _f, int32_t _max)
+{
+  return int32_t(std::lround(std::clamp(_f, -1.0f, 1.0f) * float(_max)));
+}
+
+inline uint32_t toUnorm(float _f, uint32_t _max)
+{
+  return uint32_t(std::lround(std::clamp(_f, 0.0f, 1.0f) * float(_max)));
+}
+
+inline float fromSnorm(int32_t _c, int32_t _max)
+{
+  return std::max(float(_c) / float(_max), -1.0f);
+}
+
+// floats in a vertex of the format, what a [[stage_in]] attribute gets.
+// Int1010102Normalized is packed from three, w is 0, as it is for normals.
+inline NS::UInteger components(MTL::VertexFormat _format)
+{
+  switch (_format)
+  {
+  case MTL::VertexFormatFloat:
+  case MTL::VertexFormatHalf:
+    return 1;
+  case MTL::VertexFormatFloat2:
+  case MTL::VertexFormatHalf2:
+  case MTL::VertexFormatChar2Normalized:
+  case MTL::VertexFormatUChar2Normalized:
+  case MTL::VertexFormatShort2Normalized:
+  case MTL::VertexFormatUShort2Normalized:
+    return 2;
+  case MTL::VertexFormatFloat3:
+  case MTL::VertexFormatHalf3:
+  case MTL::VertexFormatInt1010102Normalized:
+    return 3;
+  case MTL::VertexFormatFloat4:
+  case MTL::VertexFormatHalf4:
+  case MTL::VertexFormatChar4Normalized:
+  case MTL::VertexFormatUChar4Normalized:
+  case MTL::VertexFormatShort4Normalized:
+  case MTL::VertexFormatUShort4Normalized:
+    return 4;
+  default:
+    assert(false && "vertex format not supported by the packer");
+    return 0;
+  }
+}
+
+// bytes a vertex of the format takes
+inline NS::UInteger size(MTL::VertexFormat _format)
+{
+  switch (_format)
+  {
+  case MTL::VertexFormatChar2Normalized:
+  case MTL::VertexFormatUChar2Normalized:
+  case MTL::VertexFormatHalf:
+    return 2;
+  case MTL::VertexFormatFloat:
+  case MTL::VertexFormatHalf2:
+  case MTL::VertexFormatChar4Normalized:
+  case MTL::VertexFormatUChar4Normalized:
+  case MTL::VertexFormatShort2Normalized:
+  case MTL::VertexFormatUShort2Normalized:
+  case MTL::VertexFormatInt1010102Normalized:
+    return 4;
+  case MTL::VertexFormatHalf3:
+    return 6;
+  case MTL::VertexFormatFloat2:
+  case MTL::VertexFormatHalf4:
+  case MTL::VertexFormatShort4Normalized:
+  case MTL::VertexFormatUShort4Normalized:
+    return 8;
+  case MTL::VertexFormatFloat3:
+    return 12;
+  case MTL::VertexFormatFloat4:
+    return 16;
+  default:
+    assert(false && "vertex format not supported by the packer");
+    return 0;
+  }
+}
+
+// one vertex's worth of floats into the format
+inline void pack(MTL::VertexFormat _format, const float *_src, void *_dst)
+{
+  NS::UInteger n = components(_format);
+  switch (_format)
+  {
+  case MTL::VertexFormatFloat:
+  case MTL::VertexFormatFloat2:
+  case MTL::VertexFormatFloat3:
+  case MTL::VertexFormatFloat4:
+    std::memcpy(_dst, _src, n * sizeof(float));
+    break;
+  case MTL::VertexFormatHalf:
+  case MTL::VertexFormatHalf2:
+  case MTL::VertexFormatHalf3:
+  case MTL::VertexFormatHalf4:
+    for (NS::UInteger c = 0; c < n; ++c)
+      static_cast<uint16_t *>(_dst)[c] = toHalf(_src[c]);
+    break;
+  case MTL::VertexFormatChar2Normalized:
+  case MTL::VertexFormatChar4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      static_cast<int8_t *>(_dst)[c] = int8_t(toSnorm(_src[c], 127));
+    break;
+  case MTL::VertexFormatUChar2Normalized:
+  case MTL::VertexFormatUChar4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      static_cast<uint8_t *>(_dst)[c] = uint8_t(toUnorm(_src[c], 255));
+    break;
+  case MTL::VertexFormatShort2Normalized:
+  case MTL::VertexFormatShort4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      static_cast<int16_t *>(_dst)[c] = int16_t(toSnorm(_src[c], 32767));
+    break;
+  case MTL::VertexFormatUShort2Normalized:
+  case MTL::VertexFormatUShort4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      static_cast<uint16_t *>(_dst)[c] = uint16_t(toUnorm(_src[c], 65535));
+    break;
+  case MTL::VertexFormatInt1010102Normalized:
+  {
+    // x in the low bits
+    uint32_t packed = 0;
+    for (NS::UInteger c = 0; c < 3; ++c)
+      packed |= (uint32_t(toSnorm(_src[c], 511)) & 0x3ffu) << (10 * c);
+    std::memcpy(_dst, &packed, 4);
+    break;
+  }
+  default:
+    assert(false && "vertex format not supported by the packer");
+  }
+}
+
+// what the GPU will read back, to measure the error packing introduces
+inline void unpack(MTL::VertexFormat _format, const void *_src, float *_dst)
+{
+  NS::UInteger n = components(_format);
+  switch (_format)
+  {
+  case MTL::VertexFormatFloat:
+  case MTL::VertexFormatFloat2:
+  case MTL::VertexFormatFloat3:
+  case MTL::VertexFormatFloat4:
+    std::memcpy(_dst, _src, n * sizeof(float));
+    break;
+  case MTL::VertexFormatHalf:
+  case MTL::VertexFormatHalf2:
+  case MTL::VertexFormatHalf3:
+  case MTL::VertexFormatHalf4:
+    for (NS::UInteger c = 0; c < n; ++c)
+      _dst[c] = fromHalf(static_cast<const uint16_t *>(_src)[c]);
+    break;
+  case MTL::VertexFormatChar2Normalized:
+  case MTL::VertexFormatChar4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      _dst[c] = fromSnorm(static_cast<const int8_t *>(_src)[c], 127);
+    break;
+  case MTL::VertexFormatUChar2Normalized:
+  case MTL::VertexFormatUChar4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      _dst[c] = static_cast<const uint8_t *>(_src)[c] / 255.0f;
+    break;
+  case MTL::VertexFormatShort2Normalized:
+  case MTL::VertexFormatShort4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      _dst[c] = fromSnorm(static_cast<const int16_t *>(_src)[c], 32767);
+    break;
+  case MTL::VertexFormatUShort2Normalized:
+  case MTL::VertexFormatUShort4Normalized:
+    for (NS::UInteger c = 0; c < n; ++c)
+      _dst[c] = static_cast<const uint16_t *>(_src)[c] / 65535.0f;
+    break;
+  case MTL::VertexFormatInt1010102Normalized:
+  {
+    uint32_t packed;
+    std::memcpy(&packed, _src, 4);
+    for (NS::UInteger c = 0; c < 3; ++c)
+      _dst[c] = fromSnorm(int32_t(packed << (22 - 10 * c)) >> 22, 511);
+    break;
+  }
+  default:
+    assert(false && "vertex format not supported by the packer");
+  }
+}
+} // end namespace vertexpack
+
+// An interleaved vertex layout in one buffer, attribute i is [[attribute(i)]]
+// in the order they were added. newDescriptor() gives the MTL::VertexDescriptor
+// for a render pipeline so the vertex shader takes its input with [[stage_in]]
+// and the fetch converts half, snorm and unorm data to float for free, the
+// same shader works whatever the formats are. pack() fills a buffer from float
+// data.
+//
+// Attributes are placed at 4 byte aligned offsets and the stride rounded up to
+// 4, as Metal requires.
+class VertexLayout
+{
+public:
+  VertexLayout &add(MTL::VertexFormat _format)
+  {
+    m_attributes.push_back({_format, m_stride});
+    m_stride = (m_stride + vertexpack::size(_format) + 3) & ~NS::UInteger(3);
+    return *this;
+  }
+
+  NS::UInteger stride() const
+  {
+    return m_stride;
+  }
+
+  size_t attributes() const
+  {
+    return m_attributes.size();
+  }
+
+  MTL::VertexFormat format(size_t _attribute) const
+  {
+    return m_attributes[_attribute].format;
+  }
+
+  NS::UInteger offset(size_t _attribute) const
+  {
+    return m_attributes[_attribute].offset;
+  }
+
+  // floats a vertex of the attribute is packed from
+  NS::UInteger components(size_t _attribute) const
+  {
+    return vertexpack::components(m_attributes[_attribute].format);
+  }
+
+  // the vertices are read from _bufferIndex, the caller releases it
+  MTL::VertexDescriptor *newDescriptor(NS::UInteger _bufferIndex = 0) const
+  {
+    auto *desc = MTL::VertexDescriptor::alloc()->init();
+    for (size_t i = 0; i < m_attributes.size(); ++i)
+    {
+      auto *attribute = desc->attributes()->object(i);
+      attribute->setFormat(m_attributes[i].format);
+      attribute->setOffset(m_attributes[i].offset);
+      attribute->setBufferIndex(_bufferIndex);
+    }
+    auto *layout = desc->layouts()->object(_bufferIndex);
+    layout->setStride(m_stride);
+    layout->setStepFunction(MTL::VertexStepFunctionPerVertex);
+    layout->setStepRate(1);
+    return desc;
+  }
+
+  // write one attribute of _count vertices into _dst, which holds whole
+  // vertices of this layout. _src has components(_attribute) floats a vertex,
+  // every _srcStride floats, 0 if they are tightly packed.
+  void pack(size_t _attribute, const float *_src, size_t _srcStride, size_t _count, void *_dst) const
+  {
+    const auto &a = m_attributes[_attribute];
+    if (!_srcStride)
+      _srcStride = vertexpack::components(a.format);
+    auto *dst = static_cast<uint8_t *>(_dst) + a.offset;
+    for (size_t v = 0; v < _count; ++v)
+      vertexpack::pack(a.format, _src + v * _srcStride, dst + v * m_stride);
+  }
+
+  // every attribute, one tightly packed float stream each
+  void pack(const std::vector<const float *> &_streams, size_t _count, void *_dst) const
+  {
+    assert(_streams.size() == m_attributes.size());
+    for (size_t i = 0; i < m_attributes.size(); ++i)
+      pack(i, _streams[i], 0, _count, _dst);
+  }
+
+  // the floats the GPU will see for one attribute, tightly packed
+  void unpack(size_t _attribute, const void *_src, size_t _count, float *_dst) const
+  {
+    const auto &a = m_attributes[_attribute];
+    NS::UInteger n = vertexpack::components(a.format);
+    auto *src = static_cast<const uint8_t *>(_src) + a.offset;
+    for (size_t v = 0; v < _count; ++v)
+      vertexpack::unpack(a.format, src + v * m_stride, _dst + v * n);
+  }
+
+private:
+  struct Attribute
+  {
+    MTL::VertexFormat format;
+    NS::UInteger offset;
+  };
+
+  std::vector<Attribute> m_attributes;
+  NS::UInteger m_stride = 0;
+};